@@ -0,0 +1,116 @@
+# Packs the user programs into the archive the kernel embeds, see
+# src/progs/mod.rs for the layout.
+#
+#   python3 pack_progs.py target/user_prog/progs.pack target/user_prog/exec ...
+#
+# Each program is named after its file. Programs with the same content are
+# stored once, and each stored program is compressed with the LZ4 block
+# format, or kept as is if that does not make it smaller.
+
+import hashlib
+import os
+import struct
+import sys
+
+MAGIC = b'TPAK'
+VERSION = 1
+NAME_LEN = 32
+HEADER = struct.Struct('<4sIII')
+PROGRAM_ENTRY = struct.Struct('<%dsII' % NAME_LEN)
+BLOB_ENTRY = struct.Struct('<IIII')
+
+MIN_MATCH = 4
+MAX_OFFSET = 0xffff
+# LZ4 ends a block with literals: the last match starts at least 12 bytes
+# before the end, and ends at least 5 bytes before it.
+LAST_LITERALS = 5
+MF_LIMIT = 12
+
+
+def write_length(out, length):
+    while length >= 255:
+        out.append(255)
+        length -= 255
+    out.append(length)
+
+
+def write_sequence(out, literals, offset=None, match_len=0):
+    lit_nibble = min(len(literals), 15)
+    match_nibble = min(match_len - MIN_MATCH, 15) if offset is not None else 0
+    out.append(lit_nibble << 4 | match_nibble)
+    if lit_nibble == 15:
+        write_length(out, len(literals) - 15)
+    out += literals
+    if offset is None:
+        return
+    out += struct.pack('<H', offset)
+    if match_nibble == 15:
+        write_length(out, match_len - MIN_MATCH - 15)
+
+
+def lz4_compress(data):
+    out = bytearray()
+    table = {}
+    anchor = 0
+    pos = 0
+    limit = len(data) - MF_LIMIT
+    while pos < limit:
+        key = data[pos:pos + MIN_MATCH]
+        candidate = table.get(key)
+        table[key] = pos
+        if candidate is None or pos - candidate > MAX_OFFSET:
+            pos += 1
+            continue
+        match_len = MIN_MATCH
+        match_end = len(data) - LAST_LITERALS
+        while pos + match_len < match_end and data[candidate + match_len] == data[pos + match_len]:
+            match_len += 1
+        write_sequence(out, data[anchor:pos], pos - candidate, match_len)
+        pos += match_len
+        anchor = pos
+    write_sequence(out, data[anchor:])
+    return bytes(out)
+
+
+def pack(paths):
+    names = []
+    blobs = []
+    blob_indices = {}
+    total = 0
+    for path in sorted(paths):
+        name = os.path.basename(path).encode()
+        if len(name) >= NAME_LEN:
+            sys.exit('Program name too long: ' + path)
+        with open(path, 'rb') as file:
+            data = file.read()
+        total += len(data)
+        digest = hashlib.sha256(data).digest()
+        if digest not in blob_indices:
+            blob_indices[digest] = len(blobs)
+            packed = lz4_compress(data)
+            blobs.append((packed if len(packed) < len(data) else data, len(data)))
+        names.append((name, blob_indices[digest]))
+
+    offset = HEADER.size + len(names) * PROGRAM_ENTRY.size + len(blobs) * BLOB_ENTRY.size
+    out = bytearray(HEADER.pack(MAGIC, VERSION, len(names), len(blobs)))
+    for name, blob in names:
+        out += PROGRAM_ENTRY.pack(name, blob, 0)
+    for packed, length in blobs:
+        out += BLOB_ENTRY.pack(offset, len(packed), length, 0)
+        offset += len(packed)
+    for packed, _ in blobs:
+        out += packed
+    return bytes(out), total
+
+
+def main():
+    if len(sys.argv) < 2:
+        sys.exit('Usage: pack_progs.py ARCHIVE [PROGRAM]...')
+    archive, total = pack(sys.argv[2:])
+    with open(sys.argv[1], 'wb') as file:
+        file.write(archive)
+    print('Packed %d programs, %d bytes, into %d bytes' % (len(sys.argv) - 2, total, len(archive)))
+
+
+if __name__ == '__main__':
+    main()
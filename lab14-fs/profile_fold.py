@@ -0,0 +1,70 @@
+# Symbolizes the folded stacks of the in-kernel profiler for FlameGraph.
+#
+# Build and run with `make run FEATURES=profiler`, reboot from the shell to
+# print the profile into qemu.log, then:
+#
+#   python profile_fold.py [kernel-elf] [user-elf]
+#   ./FlameGraph/flamegraph.pl ./out.folded > kernel.svg
+#
+# Kernel addresses are looked up in kernel-elf. User addresses are looked up
+# in user-elf if one is given, which only makes sense when profiling a single
+# program.
+
+import re
+import subprocess
+import sys
+
+KERNEL_ELF = 'target/osdk/lab14-fs/lab14-fs-osdk-bin'
+KERNEL_BASE = 0xffff_0000_0000_0000
+
+
+def read_profile(log_path):
+    with open(log_path, 'r', errors='replace') as file:
+        log = file.read()
+    match = re.findall(r'==== profile begin ====\n(.*?)==== profile end ====', log, re.S)
+    if not match:
+        sys.exit('No profile found in ' + log_path)
+    return match[-1].splitlines()
+
+
+def symbolize(elf, addrs):
+    if not elf or not addrs:
+        return {}
+    # Return addresses point past the call, so look up the byte before.
+    out = subprocess.run(
+        ['addr2line', '-f', '-C', '-e', elf] + [hex(addr - 1) for addr in addrs],
+        capture_output=True, text=True, check=True).stdout.splitlines()
+    names = {}
+    for addr, name in zip(addrs, out[0::2]):
+        # Leave out generics, as gdb_perf.py does.
+        name = re.sub(r'<.*>', '', name)
+        if name != '??':
+            names[addr] = name
+    return names
+
+
+def main():
+    kernel_elf = sys.argv[1] if len(sys.argv) > 1 else KERNEL_ELF
+    user_elf = sys.argv[2] if len(sys.argv) > 2 else None
+
+    stacks = []
+    for line in read_profile('qemu.log'):
+        stack, count = line.rsplit(' ', 1)
+        stacks.append((stack.split(';'), int(count)))
+
+    addrs = {int(frame, 16) for frames, _ in stacks for frame in frames if frame.startswith('0x')}
+    names = symbolize(kernel_elf, sorted(a for a in addrs if a >= KERNEL_BASE))
+    names.update(symbolize(user_elf, sorted(a for a in addrs if a < KERNEL_BASE)))
+
+    folded = {}
+    for frames, count in stacks:
+        key = ';'.join(names.get(int(f, 16), f) if f.startswith('0x') else f for f in frames)
+        folded[key] = folded.get(key, 0) + count
+
+    with open('out.folded', 'w') as out_file:
+        for key, v in folded.items():
+            out_file.write(f"{key} {v}\n")
+
+
+if __name__ == "__main__":
+    main()
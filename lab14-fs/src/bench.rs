@@ -0,0 +1,82 @@
+//! The performance regression tests of the hot paths.
+//!
+//! Each hot path has a `#[ktest]` benchmark next to its code, which times it
+//! with [`run`]. `make test` runs them with the other kernel tests, and
+//! `make test TESTS=bench_` runs only them.
+//!
+//! A benchmark runs its operation over a few samples and takes the median
+//! time per operation, so that a timer interrupt or a preemption in one sample
+//! does not count. It prints the result and fails if it is over the
+//! benchmark's entry in [`BASELINES`].
+//!
+//! The times come from the `time` counter, which is the one counter S-mode
+//! can always read on RISC-V, see [`read_tsc`]. They are in its ticks, 100 ns
+//! each on QEMU's `virt` machine, and in thousandths of a tick per operation
+//! for the operations shorter than a tick.
+
+use alloc::{sync::Arc, vec::Vec};
+use ostd::{arch::read_tsc, early_println};
+use spin::Once;
+
+use crate::drivers::{self, blk::BlockDevice};
+
+/// The most each benchmark may take per operation, in thousandths of a tick.
+///
+/// They leave room for the noise of running under an emulator, so a failure
+/// means a regression rather than a slow host. Tighten them as the numbers the
+/// benchmarks print show what a change costs.
+const BASELINES: &[(&str, u64)] = &[
+    ("dma_buf_alloc", 20_000),
+    ("virtqueue_round_trip", 2_000_000),
+    ("ext2_lookup_inode", 30_000),
+    ("path_lookup", 150_000),
+    ("memory_space_duplicate", 5_000_000),
+    ("pipe_transfer", 200_000),
+];
+
+/// The samples each benchmark takes, of which the median counts.
+const NUM_SAMPLES: usize = 5;
+
+/// Runs `op` `iters` times per sample, and fails if the median time it takes
+/// is over the baseline of `name`.
+pub fn run(name: &str, iters: usize, mut op: impl FnMut()) {
+    let baseline = BASELINES
+        .iter()
+        .find(|(baseline_name, _)| *baseline_name == name)
+        .map(|&(_, baseline)| baseline)
+        .expect("benchmark without a baseline");
+
+    // Warm the caches and the allocators up first.
+    for _ in 0..iters.div_ceil(10) {
+        op();
+    }
+    let mut samples: Vec<u64> = (0..NUM_SAMPLES)
+        .map(|_| {
+            let start = read_tsc();
+            for _ in 0..iters {
+                op();
+            }
+            (read_tsc() - start) * 1000 / iters as u64
+        })
+        .collect();
+    samples.sort_unstable();
+    let median = samples[NUM_SAMPLES / 2];
+
+    early_println!(
+        "[bench] {:<24} {:>6}.{:03} ticks/op (baseline {}.{:03})",
+        name,
+        median / 1000,
+        median % 1000,
+        baseline / 1000,
+        baseline % 1000
+    );
+    assert!(median <= baseline, "{} regressed", name);
+}
+
+/// Returns the block devices, probing them on the first call, as the tests run
+/// without the boot that would.
+pub fn block_devices() -> Vec<Arc<dyn BlockDevice>> {
+    static PROBED: Once<()> = Once::new();
+    PROBED.call_once(|| drivers::init().wait());
+    drivers::BLOCK_DEVICES.get().unwrap().read().clone()
+}
@@ -0,0 +1,123 @@
+//! The boot profile, and the kernel tasks that run init phases in parallel.
+//!
+//! Each init phase runs through [`phase`], which records when it started and
+//! how long it took. `/proc/boot` lists the phases, and the log gets the
+//! total once `init_proc` is about to start.
+//!
+//! Phases that mostly wait on devices, as probing them, run in boot tasks of
+//! their own, see [`spawn`], so that the waits overlap with each other and
+//! with the phases that need no device.
+
+use core::{fmt::Write, time::Duration};
+
+use alloc::{string::String, sync::Arc, vec::Vec};
+use log::info;
+use ostd::{
+    sync::{SpinLock, WaitQueue},
+    task::TaskOptions,
+};
+use spin::Once;
+
+use crate::clock::monotonic_time;
+
+/// The phases run so far, in the order they finished.
+static PHASES: SpinLock<Vec<Phase>> = SpinLock::new(Vec::new());
+/// From the start of the first phase to [`finish`].
+static BOOT_TIME: Once<Duration> = Once::new();
+
+struct Phase {
+    name: &'static str,
+    start: Duration,
+    duration: Duration,
+}
+
+/// Runs the init phase `name`, timing it.
+pub fn phase<T>(name: &'static str, init: impl FnOnce() -> T) -> T {
+    let start = monotonic_time();
+    let ret = init();
+    let duration = monotonic_time() - start;
+    PHASES.lock().push(Phase {
+        name,
+        start,
+        duration,
+    });
+    ret
+}
+
+/// A phase running in a boot task, which [`BootTask::join`] waits for.
+pub struct BootTask<T> {
+    result: Arc<BootResult<T>>,
+}
+
+struct BootResult<T> {
+    value: SpinLock<Option<T>>,
+    done: WaitQueue,
+}
+
+/// Runs the init phase `name` in a kernel task of its own.
+pub fn spawn<T: Send + 'static>(
+    name: &'static str,
+    init: impl FnOnce() -> T + Send + 'static,
+) -> BootTask<T> {
+    let result = Arc::new(BootResult {
+        value: SpinLock::new(None),
+        done: WaitQueue::new(),
+    });
+    let task_result = result.clone();
+    TaskOptions::new(move || {
+        let value = phase(name, init);
+        *task_result.value.lock() = Some(value);
+        task_result.done.wake_all();
+    })
+    .spawn()
+    .unwrap();
+    BootTask { result }
+}
+
+impl<T> BootTask<T> {
+    /// Waits for the phase to finish, and returns what it returned. Sleeps, so
+    /// it must be called from a task, as the boot phases after `sched` are.
+    pub fn join(self) -> T {
+        self.result
+            .done
+            .wait_until(|| self.result.value.lock().take())
+    }
+}
+
+/// Records the end of the boot, and logs how long it took.
+pub fn finish() {
+    let Some(start) = first_start(&PHASES.lock()) else {
+        return;
+    };
+    let total = *BOOT_TIME.call_once(|| monotonic_time() - start);
+    info!("Booted in {} us, see /proc/boot", total.as_micros());
+}
+
+fn first_start(phases: &[Phase]) -> Option<Duration> {
+    phases.iter().map(|phase| phase.start).min()
+}
+
+/// Returns the content of `/proc/boot`: each phase with its start since the
+/// first one and its duration, in microseconds, and then the whole boot.
+pub fn report() -> String {
+    let mut out = String::new();
+    let phases = PHASES.lock();
+    let Some(first_start) = first_start(&phases) else {
+        return out;
+    };
+    writeln!(out, "{:<16} {:>10} {:>10}", "phase", "start_us", "time_us").unwrap();
+    for phase in phases.iter() {
+        writeln!(
+            out,
+            "{:<16} {:>10} {:>10}",
+            phase.name,
+            (phase.start - first_start).as_micros(),
+            phase.duration.as_micros()
+        )
+        .unwrap();
+    }
+    if let Some(total) = BOOT_TIME.get() {
+        writeln!(out, "{:<16} {:>10} {:>10}", "total", 0, total.as_micros()).unwrap();
+    }
+    out
+}
@@ -0,0 +1,123 @@
+//! The monotonic clock, and the clock page that lets user space read it
+//! without a syscall.
+//!
+//! The clock page is mapped read-only at [`CLOCK_PAGE_VADDR`] in every
+//! process. Monotonic time is `(rdtime - time_offset) / timebase_frequency`
+//! seconds, see `user/clock_page.h`.
+
+use core::time::Duration;
+
+use alloc::sync::Arc;
+use ostd::{
+    Pod,
+    arch::{boot::DEVICE_TREE, read_tsc},
+    mm::{Frame, FrameAllocOptions, PAGE_SIZE, PageFlags, Vaddr, io_util::HasVmReaderWriter},
+    timer::Jiffies,
+};
+use riscv::register::scause::Exception;
+use spin::Once;
+
+use crate::{
+    error::{Errno, Error, Result},
+    mm::{
+        area::VmArea,
+        fault::{PageFaultContext, PageFaultHandler},
+    },
+};
+
+/// Where the clock page is mapped, between the user stack and the top of user
+/// space. `user/clock_page.h` hardcodes it.
+pub const CLOCK_PAGE_VADDR: Vaddr = 0x40_0000_0000 - 2 * PAGE_SIZE;
+
+/// "TEMPOCLK" in little endian.
+const CLOCK_PAGE_MAGIC: u64 = 0x4b4c_434f_504d_4554;
+const CLOCK_PAGE_VERSION: u32 = 1;
+
+/// The layout of the clock page, shared with `user/clock_page.h`.
+#[repr(C)]
+#[derive(Debug, Clone, Copy, Pod)]
+struct ClockPageLayout {
+    magic: u64,
+    version: u32,
+    _reserved: u32,
+    /// The frequency of the `time` counter, or 0 if it is unknown, in which
+    /// case user space has to make the syscall.
+    timebase_frequency: u64,
+    /// The `time` counter at monotonic time 0.
+    time_offset: u64,
+}
+
+/// The frequency of the `time` counter, from the device tree, or 0 if it does
+/// not say.
+static TIMEBASE_FREQUENCY: Once<u64> = Once::new();
+
+static CLOCK_PAGE: Once<Frame<()>> = Once::new();
+
+fn timebase_frequency() -> u64 {
+    *TIMEBASE_FREQUENCY.call_once(|| {
+        DEVICE_TREE
+            .get()
+            .and_then(|device_tree| device_tree.cpus().next())
+            .map_or(0, |cpu| cpu.timebase_frequency() as u64)
+    })
+}
+
+/// Returns the time since boot, to the resolution of the `time` counter rather
+/// than of timer ticks, so that short intervals can be measured.
+pub fn monotonic_time() -> Duration {
+    let frequency = timebase_frequency();
+    if frequency == 0 {
+        return Jiffies::elapsed().as_duration();
+    }
+    let ticks = read_tsc();
+    Duration::new(
+        ticks / frequency,
+        ((ticks % frequency) * 1_000_000_000 / frequency) as u32,
+    )
+}
+
+fn clock_page() -> &'static Frame<()> {
+    CLOCK_PAGE.call_once(|| {
+        let frame = FrameAllocOptions::new().alloc_frame().unwrap();
+        frame
+            .writer()
+            .write_val(&ClockPageLayout {
+                magic: CLOCK_PAGE_MAGIC,
+                version: CLOCK_PAGE_VERSION,
+                _reserved: 0,
+                timebase_frequency: timebase_frequency(),
+                time_offset: 0,
+            })
+            .unwrap();
+        frame
+    })
+}
+
+/// Returns the area mapping the clock page, for a new address space.
+pub fn clock_page_area() -> VmArea {
+    let mut area = VmArea::new_with_handler(
+        CLOCK_PAGE_VADDR,
+        1,
+        PageFlags::R,
+        Arc::new(ClockPageFaultHandler),
+    );
+    // Children map the same page rather than a copy-on-write one, so no
+    // process may make it writable.
+    area.set_shared(true);
+    area.set_max_perms(PageFlags::R);
+    area
+}
+
+#[derive(Debug)]
+struct ClockPageFaultHandler;
+
+impl PageFaultHandler for ClockPageFaultHandler {
+    fn handle_page_fault<'a>(&self, mut context: PageFaultContext<'a>) -> Result<()> {
+        let range = context.fault_around_range(1);
+        if range.is_empty() || matches!(context.fault, Exception::StorePageFault) {
+            return Err(Error::new(Errno::EACCES));
+        }
+        context.map_frames(range, [clock_page().clone()], None);
+        Ok(())
+    }
+}
@@ -1,40 +1,237 @@
-use ostd::mm::{
-    Fallible, Frame, FrameAllocOptions, HasPaddr, PAGE_SIZE, VmReader, io_util::HasVmReaderWriter,
+use ostd::{
+    cpu_local,
+    mm::{
+        FallibleVmRead, FallibleVmWrite, Frame, FrameAllocOptions, HasPaddr, PAGE_SIZE, VmReader,
+        VmWriter, io_util::HasVmReaderWriter,
+    },
+    sync::{SpinLock, WaitQueue},
+    task::disable_preempt,
 };
 use sbi_rt::Physical;
 use spin::Once;
 
+use crate::error::{Errno, Error, Result};
+use crate::fs::poll::Pollee;
+
 static RECEIVE_BUFFER: Once<Frame<()>> = Once::new();
 
-pub fn receive_str<F>(mut callback: F) -> usize
-where
-    F: FnMut(VmReader<Fallible>),
-{
-    if !RECEIVE_BUFFER.is_completed() {
-        RECEIVE_BUFFER.call_once(|| FrameAllocOptions::new().alloc_frame().unwrap());
+cpu_local! {
+    /// The page each CPU stages console output in, so that the SBI console
+    /// takes it a page at a time rather than a byte at a time.
+    static SEND_BUFFER: SpinLock<Option<Frame<()>>> = SpinLock::new(None);
+}
+
+/// Writes all of `readers` to the console, front to back, without checking
+/// that they hold text.
+///
+/// A fault ends the write, and fails it only if nothing was written.
+pub fn send(readers: &mut [VmReader]) -> Result<usize> {
+    let guard = disable_preempt();
+    let mut buffer = SEND_BUFFER.get_with(&guard).lock();
+    let frame = buffer.get_or_insert_with(|| FrameAllocOptions::new().alloc_frame().unwrap());
+
+    let mut sent = 0;
+    let mut staged = 0;
+    let mut faulted = false;
+    'readers: for reader in readers.iter_mut() {
+        while reader.has_remain() {
+            let mut writer = frame.writer();
+            writer.skip(staged);
+            match reader.read_fallible(&mut writer) {
+                Ok(len) => staged += len,
+                Err((_, len)) => {
+                    staged += len;
+                    faulted = true;
+                }
+            }
+            if staged == PAGE_SIZE || faulted {
+                flush(frame, staged);
+                sent += staged;
+                staged = 0;
+            }
+            if faulted {
+                break 'readers;
+            }
+        }
     }
+    // Do not hold output back for the next write.
+    flush(frame, staged);
+    sent += staged;
 
-    let paddr = RECEIVE_BUFFER.get().unwrap().paddr();
+    if sent == 0 && faulted {
+        return Err(Error::new(Errno::EFAULT));
+    }
+    Ok(sent)
+}
+
+/// Hands the first `len` bytes of `frame` to the SBI console.
+fn flush(frame: &Frame<()>, len: usize) {
+    let paddr = frame.paddr();
+    let mut done = 0;
+    while done < len {
+        let ret = sbi_rt::console_write(Physical::new(
+            len - done,
+            (paddr + done) & 0xFFFF_FFFF,
+            ((paddr + done) >> 32) & 0xFFFF_FFFF,
+        ));
+        if ret.is_ok() && ret.value > 0 {
+            done += ret.value;
+            continue;
+        }
+
+        // Without the debug console extension, send the rest bytewise.
+        let mut reader = frame.reader();
+        reader.skip(done).limit(len - done);
+        while reader.has_remain() {
+            sbi_rt::console_write_byte(reader.read_val::<u8>().unwrap());
+        }
+        return;
+    }
+}
+
+/// Takes what the SBI console has received, for when there is no receive
+/// interrupt. Called on timer ticks.
+pub fn poll_input() {
+    let frame = RECEIVE_BUFFER.call_once(|| FrameAllocOptions::new().alloc_frame().unwrap());
+    let paddr = frame.paddr();
     let ret = sbi_rt::console_read(Physical::new(
         PAGE_SIZE,
         paddr & 0xFFFF_FFFF,
         (paddr >> 32) & 0xFFFF_FFFF,
     ));
+    if ret.is_err() || ret.value == 0 {
+        return;
+    }
+
+    let mut reader = frame.reader();
+    reader.limit(ret.value);
+    while reader.has_remain() {
+        let mut bytes = [0u8; 64];
+        let len = reader.read(&mut VmWriter::from(&mut bytes as &mut [u8]));
+        push_input(&bytes[..len]);
+    }
+}
+
+/// The size of the console input buffer. Input past it is dropped until it is
+/// read.
+const INPUT_BUFFER_SIZE: usize = 4096;
+
+/// Received console input not yet read.
+struct InputBuffer {
+    bytes: [u8; INPUT_BUFFER_SIZE],
+    head: usize,
+    len: usize,
+}
+
+impl InputBuffer {
+    const fn new() -> Self {
+        Self {
+            bytes: [0; INPUT_BUFFER_SIZE],
+            head: 0,
+            len: 0,
+        }
+    }
 
-    if ret.is_err() {
-        return 0;
+    fn push(&mut self, byte: u8) {
+        if self.len == INPUT_BUFFER_SIZE {
+            return;
+        }
+        self.bytes[(self.head + self.len) % INPUT_BUFFER_SIZE] = byte;
+        self.len += 1;
     }
 
-    let read_bytes = ret.value;
+    fn pop(&mut self) -> Option<u8> {
+        if self.len == 0 {
+            return None;
+        }
+        let byte = self.bytes[self.head];
+        self.head = (self.head + 1) % INPUT_BUFFER_SIZE;
+        self.len -= 1;
+        Some(byte)
+    }
+}
 
-    let reader = RECEIVE_BUFFER
-        .get()
-        .unwrap()
-        .reader()
-        .limit(read_bytes)
-        .clone()
-        .to_fallible();
+/// Filled from interrupt context, so always locked with IRQs disabled.
+static INPUT: SpinLock<InputBuffer> = SpinLock::new(InputBuffer::new());
+/// Readers of the console wait here for input.
+static INPUT_QUEUE: WaitQueue = WaitQueue::new();
+static INPUT_POLLEE: Pollee = Pollee::new();
 
-    callback.call_mut((reader,));
-    read_bytes
+/// Adds received bytes to the console input, and wakes its readers.
+pub fn push_input(bytes: &[u8]) {
+    {
+        let mut input = INPUT.disable_irq().lock();
+        for &byte in bytes {
+            input.push(byte);
+        }
+    }
+    INPUT_QUEUE.wake_all();
+    INPUT_POLLEE.notify();
+}
+
+/// Returns whether there is input to read.
+pub fn has_input() -> bool {
+    INPUT.disable_irq().lock().len > 0
+}
+
+/// Returns what is notified when input arrives.
+pub fn input_pollee() -> &'static Pollee {
+    &INPUT_POLLEE
+}
+
+/// Reads console input into `writer` up to the end of a line, echoing it as it
+/// arrives. Returns early if `writer` fills up.
+///
+/// A carriage return, which is what the Enter key sends, is read as a line
+/// feed.
+pub fn read_line(writer: &mut VmWriter) -> Result<usize> {
+    let mut read_len = 0;
+    while writer.has_avail() {
+        let mut bytes = [0u8; 64];
+        let max_len = bytes.len().min(writer.avail());
+        let (len, line_end) = INPUT_QUEUE.wait_until(|| {
+            let mut input = INPUT.disable_irq().lock();
+            if input.len == 0 {
+                return None;
+            }
+            let mut len = 0;
+            while len < max_len {
+                let Some(byte) = input.pop() else {
+                    break;
+                };
+                let byte = if byte == b'\r' { b'\n' } else { byte };
+                bytes[len] = byte;
+                len += 1;
+                if byte == b'\n' {
+                    return Some((len, true));
+                }
+            }
+            Some((len, false))
+        });
+
+        echo(&bytes[..len]);
+        writer
+            .write_fallible(&mut VmReader::from(&bytes[..len]).to_fallible())
+            .map_err(|_| Error::new(Errno::EFAULT))?;
+        read_len += len;
+        if line_end {
+            break;
+        }
+    }
+    Ok(read_len)
+}
+
+/// Echoes input back to the console, in one write.
+fn echo(bytes: &[u8]) {
+    let mut echoed = [0u8; 128];
+    let mut len = 0;
+    for &byte in bytes {
+        if byte == b'\n' {
+            echoed[len] = b'\r';
+            len += 1;
+        }
+        echoed[len] = byte;
+        len += 1;
+    }
+    let _ = send(&mut [VmReader::from(&echoed[..len]).to_fallible()]);
 }
@@ -1,90 +1,457 @@
-use alloc::vec::Vec;
+use core::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+
+use alloc::{boxed::Box, collections::btree_map::BTreeMap, sync::Arc, vec, vec::Vec};
 use ostd::{
-    mm::{DmaStream, FrameAllocOptions, VmIo, VmWriter},
-    sync::Mutex,
+    mm::{DmaStream, HasSize, PAGE_SIZE, VmIo},
+    sync::{LocalIrqDisabled, RwMutex, SpinLock, WaitQueue},
 };
-use spin::Once;
 
-use crate::drivers::utils::{DmaSlice, DmaSliceAlloc};
+use crate::{
+    drivers::{
+        io_sched::{BlkPlug, IoQueue},
+        utils::dma_pool::DmaBuf,
+    },
+    error::{Errno, Error, Result},
+    mm::{reclaim, slab::SlabCache},
+    process::rusage,
+    stats::{self, Stat},
+};
 
 pub const SECTOR_SIZE: usize = 512;
 
-static DMA_ALLOCATOR: Once<Mutex<DmaSliceAlloc<[u8; SECTOR_SIZE], DmaStream>>> = Once::new();
+/// The number of buffered dirty sectors that triggers a writeback.
+const MAX_DIRTY_SECTORS: usize = 64;
+/// The maximum number of sectors merged into one write request.
+const MAX_SECTORS_PER_WRITE: usize = 32;
 
 pub trait BlockDevice: Send + Sync {
-    fn read_block(&self, req: &mut BioRequest);
+    /// Submits a request to the device and returns without waiting for it.
+    ///
+    /// The request is handed back through [`BioWaiter::wait`] once the device
+    /// has finished it, so callers can keep several requests in flight.
+    ///
+    /// This bypasses the I/O scheduler; the block layer submits through
+    /// [`Self::io_queue`].
+    fn submit(&self, request: BioRequest) -> BioWaiter;
+
+    /// Returns the queue that sorts and merges requests before [`Self::submit`].
+    fn io_queue(&self) -> &IoQueue;
+
+    /// Returns the buffer holding the writes not yet sent to the device.
+    fn write_buffer(&self) -> &WriteBuffer;
+
+    /// Returns the maximum number of sectors in one submitted request.
+    fn max_request_sectors(&self) -> usize;
 
-    fn write_block(&self, req: &BioRequest);
+    /// Returns the capacity of the device, in sectors.
+    fn num_sectors(&self) -> usize;
+
+    /// Returns the maximum number of sectors in one discard, or 0 if the
+    /// device cannot discard.
+    fn max_discard_sectors(&self) -> usize {
+        0
+    }
+
+    /// Returns the maximum number of sectors in one write-zeroes, or 0 if the
+    /// device cannot zero sectors without being sent the zeros.
+    fn max_write_zeroes_sectors(&self) -> usize {
+        0
+    }
 }
 
 impl dyn BlockDevice {
-    pub fn read_to_vm_writer(&self, index: usize, num_sectors: usize, writer: &mut VmWriter) {
-        let mut request = BioRequest::new(index, num_sectors);
-        self.read_block(&mut request);
+    /// Queues a request in the I/O scheduler and returns without waiting for it.
+    pub fn queue(&self, request: BioRequest) -> BioWaiter {
+        if request.type_.has_data() {
+            stats::inc(Stat::BlockRequests);
+            stats::add(
+                Stat::BlockBytes,
+                (request.num_sectors() * SECTOR_SIZE) as u64,
+            );
+            // Charged to the user thread issuing it, if any.
+            if let Some(usage) = rusage::current_usage() {
+                usage.count_sectors(request.type_ == BioType::Write, request.num_sectors());
+            }
+        }
+        self.io_queue().submit(self, request)
+    }
+
+    /// Holds requests back until the returned plug is dropped, so that the
+    /// ones queued meanwhile are dispatched together.
+    pub fn plug(&self) -> BlkPlug<'_> {
+        BlkPlug::new(self)
+    }
+
+    /// Reads `num_sectors` sectors starting from `index` and waits for the data.
+    ///
+    /// Fails with `EIO` if the device fails the read.
+    pub fn read_block(&self, index: usize, num_sectors: usize) -> Result<BioRequest> {
+        self.read_block_into(index, alloc_sectors(num_sectors))
+    }
+
+    /// Reads the sectors starting from `index` into `sectors`, one buffer per
+    /// sector, and waits for the data.
+    ///
+    /// The buffers may view memory the caller mapped, so that the device
+    /// transfers the data straight to its destination.
+    pub fn read_block_into(&self, index: usize, sectors: Vec<DmaBuf>) -> Result<BioRequest> {
+        let write_buffer = self.write_buffer();
+        // Keep a writeback from moving sectors out of the buffer while they are only
+        // half-way to the device.
+        let _guard = write_buffer.writeback_lock.read();
+
+        let request = self.start_read_into(index, sectors).wait()?;
+        write_buffer.apply_to(&request);
+        Ok(request)
+    }
+
+    /// Starts reading `num_sectors` sectors from `index` without waiting for them.
+    ///
+    /// Finish the read with [`Self::finish_read`].
+    pub fn start_read(&self, index: usize, num_sectors: usize) -> PendingRead {
+        self.start_read_into(index, alloc_sectors(num_sectors))
+    }
+
+    fn start_read_into(&self, index: usize, mut sectors: Vec<DmaBuf>) -> PendingRead {
+        let generation = self.write_buffer().generation.load(Ordering::Acquire);
+        let num_sectors = sectors.len();
+
+        // Split requests the device cannot take at once, but keep all parts in flight.
+        let max_sectors = self.max_request_sectors();
+        let mut waiters = Vec::with_capacity(num_sectors.div_ceil(max_sectors));
+        let mut start = 0;
+        let plug = self.plug();
+        while !sectors.is_empty() {
+            let rest = sectors.split_off(core::cmp::min(max_sectors, sectors.len()));
+            let part = core::mem::replace(&mut sectors, rest);
+            let len = part.len();
+            waiters.push(self.queue(BioRequest::from_slices(BioType::Read, index + start, part)));
+            start += len;
+        }
+        drop(plug);
+
+        PendingRead {
+            index,
+            num_sectors,
+            generation,
+            waiters,
+        }
+    }
+
+    /// Waits for a read started by [`Self::start_read`], failing with `EIO` if
+    /// the device fails it.
+    pub fn finish_read(&self, pending: PendingRead) -> Result<BioRequest> {
+        let (index, num_sectors, generation) =
+            (pending.index, pending.num_sectors, pending.generation);
+        let mut request = pending.wait()?;
+
+        let write_buffer = self.write_buffer();
+        {
+            let _guard = write_buffer.writeback_lock.read();
+            if write_buffer.generation.load(Ordering::Acquire) == generation {
+                write_buffer.apply_to(&request);
+                return Ok(request);
+            }
+        }
+
+        // A writeback ran meanwhile and may have raced with the read, so the
+        // data may be stale. Read again into the same buffers.
+        debug_assert_eq!(request.num_sectors(), num_sectors);
+        self.read_block_into(index, core::mem::take(&mut request.data))
+    }
+
+    /// Writes `sectors`, one buffer per sector, from `index` on, and waits for
+    /// them to reach the device.
+    ///
+    /// Bypasses the write buffer, so only devices nothing writes through it
+    /// may be written this way, such as a swap device. Fails with `EIO` if the
+    /// device fails any of the writes.
+    pub fn write_block_from(&self, index: usize, mut sectors: Vec<DmaBuf>) -> Result<()> {
+        let max_sectors = self.max_request_sectors();
+        let mut waiters = Vec::with_capacity(sectors.len().div_ceil(max_sectors));
+        let mut start = 0;
+        let plug = self.plug();
+        while !sectors.is_empty() {
+            let rest = sectors.split_off(core::cmp::min(max_sectors, sectors.len()));
+            let part = core::mem::replace(&mut sectors, rest);
+            let len = part.len();
+            waiters.push(self.queue(BioRequest::from_slices(BioType::Write, index + start, part)));
+            start += len;
+        }
+        drop(plug);
+        wait_all(waiters)
+    }
+
+    /// Queues the sectors of `request` for writing.
+    ///
+    /// Writes are buffered and merged with adjacent ones; use [`Self::flush`]
+    /// to make sure they have reached the disk. It also reports whether any
+    /// of them failed.
+    pub fn write_block(&self, mut request: BioRequest) {
+        let num_dirty = self
+            .write_buffer()
+            .insert(request.index, core::mem::take(&mut request.data));
 
-        for data in request.data.iter() {
-            data.read(0, &mut *writer).unwrap();
+        if num_dirty >= MAX_DIRTY_SECTORS {
+            // A failure is reported by the next flush.
+            let _ = self.write_back();
         }
     }
 
-    pub fn read_val_offset<T: ostd::Pod>(&self, index: usize, offset: usize) -> T {
+    /// Sends all buffered writes to the device and waits for them.
+    ///
+    /// Fails with `EIO` if the device fails any of them, which the next
+    /// [`Self::flush`] reports too.
+    pub fn write_back(&self) -> Result<()> {
+        let write_buffer = self.write_buffer();
+        let _guard = write_buffer.writeback_lock.write();
+        write_buffer.generation.fetch_add(1, Ordering::AcqRel);
+        let dirty = core::mem::take(&mut *write_buffer.dirty.lock());
+        let max_sectors = core::cmp::min(MAX_SECTORS_PER_WRITE, self.max_request_sectors());
+
+        let mut waiters = Vec::new();
+        let plug = self.plug();
+        let mut pending: Option<BioRequest> = None;
+        for (index, sector) in dirty {
+            if let Some(request) = pending.as_mut() {
+                if request.index + request.num_sectors() == index
+                    && request.num_sectors() < max_sectors
+                {
+                    request.data.push(sector);
+                    continue;
+                }
+            }
+
+            let request = BioRequest::from_slices(BioType::Write, index, vec![sector]);
+            if let Some(full) = pending.replace(request) {
+                waiters.push(self.queue(full));
+            }
+        }
+        if let Some(request) = pending {
+            waiters.push(self.queue(request));
+        }
+        drop(plug);
+
+        let written = wait_all(waiters);
+        if written.is_err() {
+            write_buffer.failed.store(true, Ordering::Release);
+        }
+        written
+    }
+
+    /// Writes back the buffered writes and flushes the device's volatile cache.
+    ///
+    /// Fails with `EIO` if the flush fails, or if a write or write-zeroes
+    /// failed since the last flush.
+    pub fn flush(&self) -> Result<()> {
+        // A failed writeback sets the flag checked below.
+        let _ = self.write_back();
+        let flushed = self
+            .queue(BioRequest::from_slices(BioType::Flush, 0, Vec::new()))
+            .wait();
+        if self.write_buffer().failed.swap(false, Ordering::AcqRel) {
+            return Err(Error::new(Errno::EIO));
+        }
+        flushed.map(|_| ())
+    }
+
+    /// Tells the device that the `num_sectors` sectors from `index` are no
+    /// longer in use, and waits for it. What they read afterwards is
+    /// undefined.
+    ///
+    /// Does nothing on a device that cannot discard.
+    pub fn discard(&self, index: usize, num_sectors: usize) {
+        let max_sectors = self.max_discard_sectors();
+        if max_sectors == 0 {
+            return;
+        }
+        // The sectors are undefined either way, so a failed discard loses
+        // nothing.
+        let _ = self.send_without_data(BioType::Discard, index, num_sectors, max_sectors);
+    }
+
+    /// Zeroes the `num_sectors` sectors from `index` on the device, and waits
+    /// for it.
+    ///
+    /// A device that can zero sectors is sent no data. On the others, this
+    /// writes zeros through the write buffer. Either way, a failure is
+    /// reported by the next [`Self::flush`].
+    pub fn write_zeroes(&self, index: usize, num_sectors: usize) {
+        let max_sectors = self.max_write_zeroes_sectors();
+        if max_sectors == 0 {
+            let request = BioRequest::with_type(BioType::Write, index, num_sectors);
+            for sector in request.data.iter() {
+                sector.write_bytes(0, &[0u8; SECTOR_SIZE]).unwrap();
+            }
+            self.write_block(request);
+            return;
+        }
+        if self
+            .send_without_data(BioType::WriteZeroes, index, num_sectors, max_sectors)
+            .is_err()
+        {
+            self.write_buffer().failed.store(true, Ordering::Release);
+        }
+    }
+
+    /// Sends a discard or write-zeroes of the `num_sectors` sectors from
+    /// `index`, in requests of at most `max_sectors`, and waits for them.
+    fn send_without_data(
+        &self,
+        type_: BioType,
+        index: usize,
+        num_sectors: usize,
+        max_sectors: usize,
+    ) -> Result<()> {
+        let write_buffer = self.write_buffer();
+        // Buffered writes to the sectors must not land after the request, and
+        // reads in flight may see the sectors change.
+        let _guard = write_buffer.writeback_lock.write();
+        write_buffer.generation.fetch_add(1, Ordering::AcqRel);
+        write_buffer.remove(index..index + num_sectors);
+
+        let mut waiters = Vec::with_capacity(num_sectors.div_ceil(max_sectors));
+        let plug = self.plug();
+        for start in (0..num_sectors).step_by(max_sectors) {
+            let len = core::cmp::min(max_sectors, num_sectors - start);
+            waiters.push(self.queue(BioRequest::without_data(type_, index + start, len)));
+        }
+        drop(plug);
+        wait_all(waiters)
+    }
+
+    /// Reads the sectors starting from `index` straight into `dma`, which must
+    /// be a whole number of sectors long.
+    pub fn read_to_dma_stream(&self, index: usize, dma: &Arc<DmaStream>) -> Result<()> {
+        self.read_block_into(index, dma_sectors(dma).collect())
+            .map(|_| ())
+    }
+
+    pub fn read_val_offset<T: ostd::Pod>(&self, index: usize, offset: usize) -> Result<T> {
         assert!(core::mem::size_of::<T>() + offset <= SECTOR_SIZE);
-        let mut request = BioRequest::new(index, 1);
-        self.read_block(&mut request);
-        request.data.pop().unwrap().read_val(offset).unwrap()
+        let request = self.read_block(index, 1)?;
+        Ok(request.data[0].read_val(offset).unwrap())
     }
 
-    pub fn write_val_offset<T: ostd::Pod>(&self, index: usize, offset: usize, val: &T) {
+    pub fn write_val_offset<T: ostd::Pod>(
+        &self,
+        index: usize,
+        offset: usize,
+        val: &T,
+    ) -> Result<()> {
         assert!(core::mem::size_of::<T>() + offset <= SECTOR_SIZE);
-        let request = BioRequest::new(index, 1);
+        // Read-modify-write, so that the rest of the sector is preserved.
+        let request = self.read_block(index, 1)?;
         request.data[0].write_val(offset, val).unwrap();
-        self.write_block(&request);
+        self.write_block(request.into_write());
+        Ok(())
     }
 
-    pub fn read_one(&self, index: usize) -> DmaSlice<DmaStream> {
-        let mut request = BioRequest::new(index, 1);
-        self.read_block(&mut request);
-        request.data.pop().unwrap()
+    pub fn read_one(&self, index: usize) -> Result<DmaBuf> {
+        let mut request = self.read_block(index, 1)?;
+        Ok(request.data.pop().unwrap())
     }
 
     pub fn write_one(&self, index: usize, data: &[u8; SECTOR_SIZE]) {
-        let request = BioRequest::new(index, 1);
+        let request = BioRequest::with_type(BioType::Write, index, 1);
         request.data[0].write_bytes(0, &data.as_ref()).unwrap();
-        self.write_block(&request);
+        self.write_block(request);
     }
 
-    pub fn read_val<T: ostd::Pod>(&self, index: usize) -> T {
+    pub fn read_val<T: ostd::Pod>(&self, index: usize) -> Result<T> {
         assert!(core::mem::size_of::<T>() <= SECTOR_SIZE);
-        let mut request = BioRequest::new(index, 1);
-        self.read_block(&mut request);
-        request.data.pop().unwrap().read_val(0).unwrap()
+        let request = self.read_block(index, 1)?;
+        Ok(request.data[0].read_val(0).unwrap())
     }
 
     pub fn write_val<T: ostd::Pod>(&self, index: usize, val: &T) {
         assert!(core::mem::size_of::<T>() <= SECTOR_SIZE);
-        let request = BioRequest::new(index, 1);
+        let request = BioRequest::with_type(BioType::Write, index, 1);
         request.data[0].write_val(0, val).unwrap();
-        self.write_block(&request);
+        self.write_block(request);
+    }
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum BioType {
+    Read,
+    Write,
+    Flush,
+    /// Frees sectors on the device.
+    Discard,
+    /// Zeroes sectors without transferring the zeros.
+    WriteZeroes,
+}
+
+impl BioType {
+    /// Returns whether requests of this type transfer data, one buffer per
+    /// sector.
+    ///
+    /// The others are barriers in the I/O scheduler, so they are never
+    /// reordered with the reads and writes around them.
+    pub fn has_data(self) -> bool {
+        matches!(self, BioType::Read | BioType::Write)
     }
 }
 
 pub struct BioRequest {
+    type_: BioType,
     index: usize,
-    pub data: Vec<DmaSlice<DmaStream>>,
+    pub data: Vec<DmaBuf>,
+    /// The number of sectors of a discard or write-zeroes, which has no data.
+    len: usize,
+    /// Called with the finished request instead of waking its waiter.
+    on_complete: Option<Box<dyn FnOnce(BioRequest, BioStatus) + Send>>,
 }
 
 impl BioRequest {
+    /// Creates a read request of `num_sectors` sectors starting from `index`.
     pub fn new(index: usize, num_sectors: usize) -> Self {
-        let mut data = Vec::with_capacity(num_sectors);
-        let mut dma_allocator = DMA_ALLOCATOR.get().unwrap().lock();
-        for _ in 0..num_sectors {
-            data.push(dma_allocator.alloc().unwrap());
+        Self::with_type(BioType::Read, index, num_sectors)
+    }
+
+    pub fn with_type(type_: BioType, index: usize, num_sectors: usize) -> Self {
+        let data = alloc_sectors(num_sectors);
+        Self::from_slices(type_, index, data)
+    }
+
+    pub(super) fn from_slices(type_: BioType, index: usize, data: Vec<DmaBuf>) -> Self {
+        Self {
+            type_,
+            index,
+            data,
+            len: 0,
+            on_complete: None,
         }
+    }
 
-        Self { index, data }
+    /// Creates a discard or write-zeroes of `num_sectors` sectors starting
+    /// from `index`.
+    pub(super) fn without_data(type_: BioType, index: usize, num_sectors: usize) -> Self {
+        debug_assert!(!type_.has_data());
+        Self {
+            len: num_sectors,
+            ..Self::from_slices(type_, index, Vec::new())
+        }
     }
 
-    pub fn data_slices_mut(&mut self) -> &mut [DmaSlice<DmaStream>] {
+    /// Makes the device hand the finished request to `f`, which may run in
+    /// interrupt context, instead of back through its waiter.
+    pub(super) fn set_on_complete(&mut self, f: Box<dyn FnOnce(BioRequest, BioStatus) + Send>) {
+        self.on_complete = Some(f);
+    }
+
+    /// Turns a finished request into a write of the same sectors.
+    pub fn into_write(mut self) -> Self {
+        self.type_ = BioType::Write;
+        self
+    }
+
+    pub fn type_(&self) -> BioType {
+        self.type_
+    }
+
+    pub fn data_slices_mut(&mut self) -> &mut [DmaBuf] {
         &mut self.data
     }
 
@@ -93,15 +460,272 @@ impl BioRequest {
     }
 
     pub fn num_sectors(&self) -> usize {
-        self.data.len()
+        if self.type_.has_data() {
+            self.data.len()
+        } else {
+            self.len
+        }
     }
 }
 
-pub(super) fn init() {
-    const POOL_SIZE: usize = 128;
-    let segment = FrameAllocOptions::new().alloc_segment(POOL_SIZE).unwrap();
-    let dma_allocator = DmaSliceAlloc::<[u8; SECTOR_SIZE], DmaStream>::new(
-        DmaStream::map(segment.into(), ostd::mm::DmaDirection::Bidirectional, false).unwrap(),
-    );
-    DMA_ALLOCATOR.call_once(|| Mutex::new(dma_allocator));
+/// Allocates one pooled buffer per sector for `num_sectors` sectors, evicting
+/// or swapping pages out while the pool cannot grow, see
+/// [`reclaim::alloc_or_reclaim`].
+fn alloc_sectors(num_sectors: usize) -> Vec<DmaBuf> {
+    reclaim::alloc_or_reclaim((num_sectors * SECTOR_SIZE).div_ceil(PAGE_SIZE), || {
+        DmaBuf::alloc_many(SECTOR_SIZE, num_sectors).map_err(|_| ostd::Error::NoMemory)
+    })
+}
+
+/// Splits `dma` into one buffer per sector, for the device to transfer to or
+/// from directly.
+pub fn dma_sectors(dma: &Arc<DmaStream>) -> impl Iterator<Item = DmaBuf> + '_ {
+    assert!(dma.size() % SECTOR_SIZE == 0);
+    (0..dma.size())
+        .step_by(SECTOR_SIZE)
+        .map(|offset| DmaBuf::from_stream(dma.clone(), offset, SECTOR_SIZE))
+}
+
+/// The sectors written to a block device but not yet sent to it.
+///
+/// Buffering lets adjacent sector writes be merged into one multi-sector
+/// request on writeback.
+pub struct WriteBuffer {
+    /// The dirty sectors, keyed by the sector index.
+    dirty: SpinLock<BTreeMap<usize, DmaBuf>, LocalIrqDisabled>,
+    /// Held for writing during a writeback and for reading by readers.
+    writeback_lock: RwMutex<()>,
+    /// The number of writebacks started, used to detect reads racing with one.
+    generation: AtomicUsize,
+    /// Whether a write failed since the last flush, which reports it.
+    failed: AtomicBool,
+}
+
+impl WriteBuffer {
+    pub fn new() -> Self {
+        Self {
+            dirty: SpinLock::new(BTreeMap::new()),
+            writeback_lock: RwMutex::new(()),
+            generation: AtomicUsize::new(0),
+            failed: AtomicBool::new(false),
+        }
+    }
+
+    /// Buffers sectors starting from `index`, returning the number of dirty sectors.
+    fn insert(&self, index: usize, sectors: Vec<DmaBuf>) -> usize {
+        let mut replaced = Vec::new();
+        let num_dirty = {
+            let mut dirty = self.dirty.lock();
+            for (i, sector) in sectors.into_iter().enumerate() {
+                if let Some(old) = dirty.insert(index + i, sector) {
+                    replaced.push(old);
+                }
+            }
+            dirty.len()
+        };
+
+        // Return the replaced buffers to the pool outside the lock.
+        drop(replaced);
+        num_dirty
+    }
+
+    /// Drops the buffered sectors in `range`.
+    fn remove(&self, range: core::ops::Range<usize>) {
+        let removed: Vec<DmaBuf> = {
+            let mut dirty = self.dirty.lock();
+            let mut tail = dirty.split_off(&range.start);
+            dirty.append(&mut tail.split_off(&range.end));
+            tail.into_values().collect()
+        };
+
+        // Return the buffers to the pool outside the lock.
+        drop(removed);
+    }
+
+    /// Overwrites the sectors of a finished read with their buffered contents.
+    fn apply_to(&self, request: &BioRequest) {
+        let dirty = self.dirty.lock();
+        if dirty.is_empty() {
+            return;
+        }
+
+        let range = request.index..request.index + request.num_sectors();
+        for (index, sector) in dirty.range(range) {
+            let mut buf = [0u8; SECTOR_SIZE];
+            sector.read_bytes(0, &mut buf).unwrap();
+            request.data[index - request.index]
+                .write_bytes(0, &buf)
+                .unwrap();
+        }
+    }
+}
+
+/// A read started by `start_read`, possibly split into several requests.
+pub struct PendingRead {
+    index: usize,
+    num_sectors: usize,
+    /// The writeback generation when the read was started.
+    generation: usize,
+    waiters: Vec<BioWaiter>,
+}
+
+impl PendingRead {
+    pub fn is_completed(&self) -> bool {
+        self.waiters.iter().all(|waiter| waiter.is_completed())
+    }
+
+    fn wait(self) -> Result<BioRequest> {
+        let mut data = Vec::with_capacity(self.num_sectors);
+        let mut failed = false;
+        // Wait for every part, so that none is left in flight.
+        for waiter in self.waiters {
+            match waiter.wait() {
+                Ok(mut part) => data.append(&mut part.data),
+                Err(_) => failed = true,
+            }
+        }
+        if failed {
+            return Err(Error::new(Errno::EIO));
+        }
+        Ok(BioRequest::from_slices(BioType::Read, self.index, data))
+    }
+}
+
+/// Waits for all of `waiters`, failing with `EIO` if any of them failed.
+fn wait_all(waiters: Vec<BioWaiter>) -> Result<()> {
+    let mut result = Ok(());
+    for waiter in waiters {
+        if let Err(err) = waiter.wait() {
+            result = Err(err);
+        }
+    }
+    result
+}
+
+/// How the device finished a request.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum BioStatus {
+    Ok,
+    /// The device failed the request, or does not support it.
+    IoError,
+}
+
+/// The submitter's side of an in-flight [`BioRequest`].
+pub struct BioWaiter {
+    inner: Arc<BioInner>,
+}
+
+/// The device's side of an in-flight [`BioRequest`].
+///
+/// The device keeps it until the request is finished and then calls
+/// [`BioCompletion::complete`] with how it went, which wakes up the
+/// corresponding waiter.
+pub struct BioCompletion {
+    inner: Arc<BioInner>,
+}
+
+/// The shared states of finished requests, reused by the next ones.
+static BIO_INNERS: SlabCache<Arc<BioInner>> = SlabCache::new("bio", size_of::<BioInner>());
+
+struct BioInner {
+    /// The request, owned here while the device is accessing its buffers.
+    request: SpinLock<Option<BioRequest>, LocalIrqDisabled>,
+    completed: AtomicBool,
+    /// Whether the device failed the request, set before `completed`.
+    failed: AtomicBool,
+    wait_queue: WaitQueue,
+}
+
+impl BioWaiter {
+    /// Creates a waiter/completion pair that owns `request` until it is finished.
+    pub fn new_pair(request: BioRequest) -> (BioWaiter, BioCompletion) {
+        let mut inner = BIO_INNERS.alloc(|| {
+            Arc::new(BioInner {
+                request: SpinLock::new(None),
+                completed: AtomicBool::new(false),
+                failed: AtomicBool::new(false),
+                wait_queue: WaitQueue::new(),
+            })
+        });
+        // Nothing else refers to a new or recycled state.
+        let state = Arc::get_mut(&mut inner).unwrap();
+        *state.request.get_mut() = Some(request);
+        *state.completed.get_mut() = false;
+        *state.failed.get_mut() = false;
+
+        (
+            BioWaiter {
+                inner: inner.clone(),
+            },
+            BioCompletion { inner },
+        )
+    }
+
+    pub fn is_completed(&self) -> bool {
+        self.inner.completed.load(Ordering::Acquire)
+    }
+
+    /// Sleeps until the device has finished the request and returns it, or
+    /// fails with `EIO` if the device failed it.
+    pub fn wait(self) -> Result<BioRequest> {
+        let request = self.inner.wait_queue.wait_until(|| {
+            if self.is_completed() {
+                self.inner.request.lock().take()
+            } else {
+                None
+            }
+        });
+        let failed = self.inner.failed.load(Ordering::Relaxed);
+        recycle(self.inner);
+        if failed {
+            return Err(Error::new(Errno::EIO));
+        }
+        Ok(request)
+    }
+}
+
+/// Returns the state of a request to [`BIO_INNERS`] if the other side is done
+/// with it too.
+fn recycle(mut inner: Arc<BioInner>) {
+    if let Some(state) = Arc::get_mut(&mut inner) {
+        // A waiter dropped without waiting leaves its request here.
+        state.request.get_mut().take();
+        BIO_INNERS.free(inner);
+    }
+}
+
+impl BioCompletion {
+    /// Marks the request as finished with `status`. This can be called in
+    /// interrupt context.
+    pub fn complete(self, status: BioStatus) {
+        let finished = {
+            let mut request = self.inner.request.lock();
+            match request
+                .as_mut()
+                .and_then(|request| request.on_complete.take())
+            {
+                Some(on_complete) => Some((on_complete, request.take().unwrap())),
+                None => None,
+            }
+        };
+        if let Some((on_complete, request)) = finished {
+            on_complete(request, status);
+        }
+
+        self.inner
+            .failed
+            .store(status != BioStatus::Ok, Ordering::Relaxed);
+        self.inner.completed.store(true, Ordering::Release);
+        self.inner.wait_queue.wake_all();
+        recycle(self.inner);
+    }
+
+    /// Finishes the request with `data` as its sectors, for requests whose
+    /// sectors the device transferred as part of a merged one.
+    pub fn complete_with_data(self, data: Vec<DmaBuf>, status: BioStatus) {
+        if let Some(request) = self.inner.request.lock().as_mut() {
+            request.data = data;
+        }
+        self.complete(status);
+    }
 }
@@ -0,0 +1,310 @@
+//! The I/O scheduler between the file systems and the block devices.
+//!
+//! Requests are queued, and whichever submitter finds no dispatch in progress
+//! sends them to the device in batches. The other submitters only queue
+//! theirs, so the requests that arrive while the device is busy are sorted by
+//! a policy and merged with their neighbours on the disk before they go out.
+//! A [`BlkPlug`] holds back the requests of a caller that is about to queue
+//! several, so that they are dispatched together.
+
+use core::time::Duration;
+
+use alloc::{boxed::Box, vec::Vec};
+use ostd::sync::SpinLock;
+
+use crate::{
+    clock::monotonic_time,
+    drivers::{
+        blk::{BioCompletion, BioRequest, BioType, BioWaiter, BlockDevice},
+        utils::dma_pool::DmaBuf,
+    },
+};
+
+pub struct IoQueue {
+    inner: SpinLock<IoQueueInner>,
+}
+
+struct IoQueueInner {
+    /// The requests not dispatched yet, in arrival order.
+    queued: Vec<QueuedBio>,
+    /// Whether a submitter is dispatching the queued requests.
+    dispatching: bool,
+    /// The number of plugs holding the requests back.
+    plugs: usize,
+    policy: Box<dyn IoPolicy>,
+}
+
+/// A request waiting in an [`IoQueue`].
+pub struct QueuedBio {
+    type_: BioType,
+    index: usize,
+    data: Vec<DmaBuf>,
+    num_sectors: usize,
+    completion: BioCompletion,
+    queued_at: Duration,
+}
+
+impl QueuedBio {
+    pub fn type_(&self) -> BioType {
+        self.type_
+    }
+
+    pub fn index(&self) -> usize {
+        self.index
+    }
+
+    pub fn num_sectors(&self) -> usize {
+        self.num_sectors
+    }
+
+    pub fn queued_at(&self) -> Duration {
+        self.queued_at
+    }
+}
+
+/// Decides the order in which queued requests are dispatched.
+pub trait IoPolicy: Send {
+    fn name(&self) -> &'static str;
+
+    /// Orders requests about to be dispatched, all of them reads and writes.
+    ///
+    /// Requests that end up next to each other and are adjacent on the disk
+    /// are merged afterwards.
+    fn order(&mut self, batch: &mut [QueuedBio], now: Duration);
+}
+
+/// Dispatches requests in arrival order, merging only consecutive ones.
+pub struct Noop;
+
+impl IoPolicy for Noop {
+    fn name(&self) -> &'static str {
+        "noop"
+    }
+
+    fn order(&mut self, _batch: &mut [QueuedBio], _now: Duration) {}
+}
+
+/// Dispatches requests in disk order, except that requests queued for longer
+/// than their deadline go first, so that a stream of requests elsewhere on
+/// the disk cannot starve them.
+pub struct Deadline {
+    read_expiry: Duration,
+    write_expiry: Duration,
+}
+
+impl Default for Deadline {
+    fn default() -> Self {
+        Self {
+            read_expiry: Duration::from_millis(500),
+            write_expiry: Duration::from_secs(5),
+        }
+    }
+}
+
+impl Deadline {
+    fn is_expired(&self, bio: &QueuedBio, now: Duration) -> bool {
+        let expiry = match bio.type_ {
+            BioType::Read => self.read_expiry,
+            _ => self.write_expiry,
+        };
+        now.saturating_sub(bio.queued_at) >= expiry
+    }
+}
+
+impl IoPolicy for Deadline {
+    fn name(&self) -> &'static str {
+        "deadline"
+    }
+
+    fn order(&mut self, batch: &mut [QueuedBio], now: Duration) {
+        // Expired requests in arrival order, then the others by sector. The
+        // sort is stable, so arrival order breaks ties.
+        batch.sort_by_key(|bio| {
+            if self.is_expired(bio, now) {
+                (false, 0)
+            } else {
+                (true, bio.index)
+            }
+        });
+    }
+}
+
+impl IoQueue {
+    pub fn new(policy: Box<dyn IoPolicy>) -> Self {
+        Self {
+            inner: SpinLock::new(IoQueueInner {
+                queued: Vec::new(),
+                dispatching: false,
+                plugs: 0,
+                policy,
+            }),
+        }
+    }
+
+    /// Replaces the policy, which applies from the next batch on.
+    pub fn set_policy(&self, policy: Box<dyn IoPolicy>) {
+        self.inner.lock().policy = policy;
+    }
+
+    pub fn policy_name(&self) -> &'static str {
+        self.inner.lock().policy.name()
+    }
+
+    /// Queues `request` for `device` and returns without waiting for it.
+    pub fn submit(&self, device: &dyn BlockDevice, mut request: BioRequest) -> BioWaiter {
+        let type_ = request.type_();
+        let index = request.index();
+        let num_sectors = request.num_sectors();
+        let data = core::mem::take(&mut request.data);
+        let (waiter, completion) = BioWaiter::new_pair(request);
+
+        let mut inner = self.inner.lock();
+        inner.queued.push(QueuedBio {
+            type_,
+            index,
+            data,
+            num_sectors,
+            completion,
+            queued_at: monotonic_time(),
+        });
+        if inner.dispatching || inner.plugs > 0 {
+            return waiter;
+        }
+        inner.dispatching = true;
+        drop(inner);
+
+        self.dispatch(device);
+        waiter
+    }
+
+    /// Dispatches the queued requests, until no more are queued or a plug
+    /// holds them back.
+    fn dispatch(&self, device: &dyn BlockDevice) {
+        let max_sectors = device.max_request_sectors();
+        loop {
+            let batch = {
+                let mut inner = self.inner.lock();
+                if inner.queued.is_empty() || inner.plugs > 0 {
+                    inner.dispatching = false;
+                    return;
+                }
+                let mut batch = core::mem::take(&mut inner.queued);
+                let now = monotonic_time();
+                // Flushes, discards and write-zeroes are barriers, so only the
+                // requests between two of them are reordered.
+                for segment in batch.split_mut(|bio| !bio.type_.has_data()) {
+                    inner.policy.order(segment, now);
+                }
+                batch
+            };
+
+            let mut pending: Option<MergedBio> = None;
+            for bio in batch {
+                if let Some(merged) = pending.as_mut()
+                    && merged.can_append(&bio, max_sectors)
+                {
+                    merged.append(bio);
+                    continue;
+                }
+                if let Some(full) = pending.replace(MergedBio::new(bio)) {
+                    full.submit(device);
+                }
+            }
+            if let Some(merged) = pending {
+                merged.submit(device);
+            }
+        }
+    }
+
+    fn plug(&self) {
+        self.inner.lock().plugs += 1;
+    }
+
+    fn unplug(&self, device: &dyn BlockDevice) {
+        let mut inner = self.inner.lock();
+        inner.plugs -= 1;
+        if inner.plugs > 0 || inner.dispatching || inner.queued.is_empty() {
+            return;
+        }
+        inner.dispatching = true;
+        drop(inner);
+
+        self.dispatch(device);
+    }
+}
+
+/// Holds the requests queued for a device back until dropped, so that a
+/// caller queueing several requests gets them merged and sorted together.
+///
+/// Do not wait for a request while holding a plug of its device.
+pub struct BlkPlug<'a> {
+    device: &'a dyn BlockDevice,
+}
+
+impl<'a> BlkPlug<'a> {
+    pub fn new(device: &'a dyn BlockDevice) -> Self {
+        device.io_queue().plug();
+        Self { device }
+    }
+}
+
+impl Drop for BlkPlug<'_> {
+    fn drop(&mut self) {
+        self.device.io_queue().unplug(self.device);
+    }
+}
+
+/// Queued requests adjacent on the disk, sent to the device as one.
+struct MergedBio {
+    type_: BioType,
+    index: usize,
+    data: Vec<DmaBuf>,
+    num_sectors: usize,
+    /// The completion and the number of sectors of each merged request.
+    parts: Vec<(BioCompletion, usize)>,
+}
+
+impl MergedBio {
+    fn new(bio: QueuedBio) -> Self {
+        let mut merged = Self {
+            type_: bio.type_,
+            index: bio.index,
+            data: Vec::new(),
+            num_sectors: 0,
+            parts: Vec::with_capacity(1),
+        };
+        merged.append(bio);
+        merged
+    }
+
+    fn can_append(&self, bio: &QueuedBio, max_sectors: usize) -> bool {
+        self.type_ == bio.type_
+            && self.type_.has_data()
+            && self.index + self.num_sectors == bio.index
+            && self.num_sectors + bio.num_sectors <= max_sectors
+    }
+
+    fn append(&mut self, bio: QueuedBio) {
+        self.parts.push((bio.completion, bio.data.len()));
+        self.data.extend(bio.data);
+        self.num_sectors += bio.num_sectors;
+    }
+
+    fn submit(self, device: &dyn BlockDevice) {
+        let parts = self.parts;
+        let mut request = if self.type_.has_data() {
+            BioRequest::from_slices(self.type_, self.index, self.data)
+        } else {
+            BioRequest::without_data(self.type_, self.index, self.num_sectors)
+        };
+        // This runs when the device completes the request, possibly in
+        // interrupt context, and hands each merged request its sectors back.
+        request.set_on_complete(Box::new(move |mut request: BioRequest, status| {
+            let mut data = core::mem::take(&mut request.data).into_iter();
+            for (completion, num_sectors) in parts {
+                completion.complete_with_data(data.by_ref().take(num_sectors).collect(), status);
+            }
+        }));
+        device.submit(request);
+    }
+}
@@ -1,32 +1,55 @@
 #![expect(dead_code)]
-#![expect(unused_variables)]
 
 use alloc::{sync::Arc, vec::Vec};
 use core::ffi::CStr;
 use ostd::early_println;
-use spin::{Mutex, Once};
+use ostd::sync::RwLock;
+use spin::Once;
 
+use crate::boot::BootTask;
 use crate::drivers::blk::{BlockDevice, SECTOR_SIZE};
 
 pub mod blk;
+pub mod io_sched;
+pub mod uart;
 pub mod utils;
 pub mod virtio;
 
-pub static BLOCK_DEVICES: Once<Mutex<Vec<Arc<dyn BlockDevice>>>> = Once::new();
+/// Read on every lookup, and only written as devices are probed.
+pub static BLOCK_DEVICES: Once<RwLock<Vec<Arc<dyn BlockDevice>>>> = Once::new();
 
-pub fn init() {
-    BLOCK_DEVICES.call_once(|| Mutex::new(Vec::new()));
-    virtio::init();
-    blk::init();
+/// Starts probing the devices, and returns the probes, which
+/// [`Probes::wait`] waits for.
+pub fn init() -> Probes {
+    BLOCK_DEVICES.call_once(|| RwLock::new(Vec::new()));
+    let probes = Probes(virtio::init());
+    uart::init();
     // test_blk_device_read();
+    probes
+}
+
+/// The devices being probed, see [`init`].
+pub struct Probes(Vec<BootTask<Option<Arc<dyn BlockDevice>>>>);
+
+impl Probes {
+    /// Waits for the probes, and adds the block devices found in the order
+    /// of the device tree rather than the order the probes finished in, so
+    /// that which device holds the root does not change from boot to boot.
+    pub fn wait(self) {
+        for probe in self.0 {
+            if let Some(device) = probe.join() {
+                BLOCK_DEVICES.get().unwrap().write().push(device);
+            }
+        }
+    }
 }
 
 fn test_blk_device_read() {
-    let block_devices = BLOCK_DEVICES.get().unwrap().lock();
+    let block_devices = BLOCK_DEVICES.get().unwrap().read();
 
     early_println!("Testing block device read...");
     for blk_device in block_devices.iter() {
-        let data: [u8; SECTOR_SIZE] = blk_device.read_val(0);
+        let data: [u8; SECTOR_SIZE] = blk_device.read_val(0).unwrap();
         let cstr = CStr::from_bytes_until_nul(&data).unwrap();
         early_println!("Read string: {}", cstr.to_str().unwrap());
     }
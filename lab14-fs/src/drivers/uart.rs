@@ -0,0 +1,93 @@
+//! The receive side of the NS16550A UART behind the SBI console.
+//!
+//! Received bytes are taken in the UART's interrupt and handed to the console
+//! input buffer, so readers of the console sleep instead of polling. Without a
+//! usable UART, the SBI console is polled on timer ticks instead.
+
+use log::warn;
+use ostd::{arch::boot::DEVICE_TREE, io::IoMem, irq::IrqLine, mm::VmIoOnce};
+use spin::Once;
+
+use crate::console;
+
+/// Receiver buffer register.
+const RBR: usize = 0;
+/// Interrupt enable register.
+const IER: usize = 1;
+/// Line status register.
+const LSR: usize = 5;
+
+const IER_RX_AVAILABLE: u8 = 1 << 0;
+const LSR_DATA_READY: u8 = 1 << 0;
+
+struct Uart {
+    io_mem: IoMem,
+    _irq_line: IrqLine,
+}
+
+static UART: Once<Uart> = Once::new();
+
+pub fn init() {
+    if !init_uart() {
+        warn!("No UART receive interrupt, polling the console on timer ticks");
+        ostd::timer::register_callback(console::poll_input);
+    }
+}
+
+/// Takes the UART interrupt, and returns whether it is enabled.
+fn init_uart() -> bool {
+    let device_tree = DEVICE_TREE.get().unwrap();
+    let Some(node) = device_tree.all_nodes().find(|node| {
+        node.compatible()
+            .is_some_and(|compatible| compatible.all().any(|c| c == "ns16550a"))
+    }) else {
+        return false;
+    };
+    let Some(region) = node.reg().and_then(|mut regs| regs.next()) else {
+        return false;
+    };
+    let Some(interrupt) = node
+        .interrupts()
+        .and_then(|mut irqs| irqs.next())
+        .and_then(|irq| u8::try_from(irq).ok())
+    else {
+        return false;
+    };
+
+    let start = region.starting_address as usize;
+    let Ok(io_mem) = IoMem::acquire(start..start + region.size.unwrap_or(0x100)) else {
+        return false;
+    };
+    let Ok(mut irq_line) = IrqLine::alloc_specific(interrupt) else {
+        return false;
+    };
+    irq_line.on_active(|_| handle_irq());
+
+    let uart = UART.call_once(|| Uart {
+        io_mem,
+        _irq_line: irq_line,
+    });
+    uart.io_mem.write_once(IER, &IER_RX_AVAILABLE).unwrap();
+    // Bytes that arrived before the interrupt was enabled.
+    handle_irq();
+    true
+}
+
+/// Moves the received bytes to the console input buffer.
+fn handle_irq() {
+    let Some(uart) = UART.get() else {
+        return;
+    };
+    let mut bytes = [0u8; 16];
+    loop {
+        let mut len = 0;
+        while len < bytes.len() && uart.io_mem.read_once::<u8>(LSR).unwrap() & LSR_DATA_READY != 0 {
+            bytes[len] = uart.io_mem.read_once::<u8>(RBR).unwrap();
+            len += 1;
+        }
+        if len == 0 {
+            return;
+        }
+        console::push_input(&bytes[..len]);
+    }
+}
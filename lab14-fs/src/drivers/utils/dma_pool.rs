@@ -0,0 +1,365 @@
+//! A pool of streaming DMA buffers in a few size classes.
+//!
+//! Each class keeps free buffers in a per-CPU magazine, so allocating and
+//! freeing usually takes only the local CPU's lock, and a shared depot that
+//! magazines refill from and spill into. When the depot runs dry, the class
+//! grows by mapping another chunk of frames, so the pool does not exhaust
+//! under load, and allocating fails with `ENOMEM` if no frames are left.
+//! Buffers go back to the pool when dropped, and under memory pressure the
+//! pool unmaps the chunks none of whose buffers is in use, see [`shrinker`].
+//!
+//! A [`DmaBuf`] can also view memory the caller mapped itself, such as a page
+//! cache frame, so that the device transfers data straight to its final place.
+
+use alloc::{
+    boxed::Box,
+    collections::{btree_map::BTreeMap, btree_set::BTreeSet},
+    sync::{Arc, Weak},
+    vec::Vec,
+};
+use ostd::{
+    cpu::{PinCurrentCpu, all_cpus},
+    mm::{
+        DmaDirection, DmaStream, FrameAllocOptions, HasDaddr, HasSize, PAGE_SIZE, VmIo, VmReader,
+        VmWriter,
+    },
+    sync::{LocalIrqDisabled, SpinLock},
+    task::disable_preempt,
+};
+use spin::Once;
+
+use crate::{
+    error::{Errno, Error, Result},
+    mm::shrinker::{self, Shrinker},
+};
+
+/// The buffer sizes, one per class.
+pub const DMA_BUF_SIZES: [usize; 3] = [512, 4096, 65536];
+
+/// The number of buffers a magazine holds before it spills half of them into
+/// the depot.
+const MAGAZINE_SIZE: usize = 64;
+
+/// The bytes mapped at once when a class grows.
+const CHUNK_SIZE: usize = 64 * 1024;
+
+static DMA_POOL: Once<DmaPool> = Once::new();
+
+struct DmaPool {
+    classes: [SizeClass; DMA_BUF_SIZES.len()],
+}
+
+struct SizeClass {
+    buf_size: usize,
+    magazines: Box<[SpinLock<Vec<FreeBuf>, LocalIrqDisabled>]>,
+    depot: SpinLock<Vec<FreeBuf>, LocalIrqDisabled>,
+    /// The chunks mapped so far and their pages, some of which may be gone,
+    /// for the report.
+    chunks: SpinLock<Vec<(Weak<DmaStream>, usize)>, LocalIrqDisabled>,
+}
+
+struct FreeBuf {
+    dma: Arc<DmaStream>,
+    offset: usize,
+}
+
+impl SizeClass {
+    fn new(buf_size: usize) -> Self {
+        Self {
+            buf_size,
+            magazines: all_cpus().map(|_| SpinLock::new(Vec::new())).collect(),
+            depot: SpinLock::new(Vec::new()),
+            chunks: SpinLock::new(Vec::new()),
+        }
+    }
+
+    /// Appends `count` free buffers to `out`, or none if the class cannot grow
+    /// to have them.
+    fn alloc(&self, count: usize, out: &mut Vec<FreeBuf>) -> Result<()> {
+        let guard = disable_preempt();
+        let mut magazine = self.magazines[guard.current_cpu().as_usize()].lock();
+        while out.len() < count {
+            if magazine.is_empty()
+                && let Err(err) = self.refill(&mut magazine, count - out.len())
+            {
+                // Keep those taken for the next allocation.
+                magazine.append(out);
+                return Err(err);
+            }
+            let take = magazine.len().min(count - out.len());
+            let start = magazine.len() - take;
+            out.extend(magazine.drain(start..));
+        }
+        Ok(())
+    }
+
+    /// Moves at least `wanted` buffers from the depot into `magazine`, growing
+    /// the class if the depot has too few.
+    ///
+    /// Fails only if it cannot move any, as the class cannot grow.
+    fn refill(&self, magazine: &mut Vec<FreeBuf>, wanted: usize) -> Result<()> {
+        let wanted = wanted.max(MAGAZINE_SIZE / 2);
+        {
+            let mut depot = self.depot.lock();
+            let take = depot.len().min(wanted);
+            let start = depot.len() - take;
+            magazine.extend(depot.drain(start..));
+        }
+        while magazine.len() < wanted {
+            if let Err(err) = self.grow(magazine) {
+                return if magazine.is_empty() {
+                    Err(err)
+                } else {
+                    Ok(())
+                };
+            }
+        }
+        Ok(())
+    }
+
+    /// Maps another chunk and adds its buffers to `magazine`.
+    fn grow(&self, magazine: &mut Vec<FreeBuf>) -> Result<()> {
+        let chunk_size = CHUNK_SIZE.max(self.buf_size);
+        let segment = FrameAllocOptions::new()
+            .alloc_segment(chunk_size / PAGE_SIZE)
+            .map_err(|_| Error::new(Errno::ENOMEM))?;
+        let dma = Arc::new(
+            DmaStream::map(segment.into(), DmaDirection::Bidirectional, false)
+                .map_err(|_| Error::new(Errno::ENOMEM))?,
+        );
+        {
+            let mut chunks = self.chunks.lock();
+            chunks.retain(|(chunk, _)| chunk.strong_count() > 0);
+            chunks.push((Arc::downgrade(&dma), chunk_size / PAGE_SIZE));
+        }
+        magazine.extend(
+            (0..chunk_size)
+                .step_by(self.buf_size)
+                .map(|offset| FreeBuf {
+                    dma: dma.clone(),
+                    offset,
+                }),
+        );
+        Ok(())
+    }
+
+    fn free(&self, buf: FreeBuf) {
+        let guard = disable_preempt();
+        let mut magazine = self.magazines[guard.current_cpu().as_usize()].lock();
+        magazine.push(buf);
+        if magazine.len() > MAGAZINE_SIZE {
+            let start = magazine.len() - MAGAZINE_SIZE / 2;
+            self.depot.lock().extend(magazine.drain(start..));
+        }
+    }
+
+    /// Returns the pages of the chunks mapped.
+    fn mapped_pages(&self) -> usize {
+        let chunks = self.chunks.lock();
+        chunks
+            .iter()
+            .filter(|(chunk, _)| chunk.strong_count() > 0)
+            .map(|&(_, pages)| pages)
+            .sum()
+    }
+
+    /// Returns the pages of the free buffers.
+    fn free_pages(&self) -> usize {
+        let magazines: usize = self
+            .magazines
+            .iter()
+            .map(|magazine| magazine.lock().len())
+            .sum();
+        (magazines + self.depot.lock().len()) * self.buf_size / PAGE_SIZE
+    }
+
+    /// Unmaps the chunks all of whose buffers are free, up to `target` pages
+    /// of them, and returns the pages unmapped.
+    fn shrink(&self, target: usize) -> usize {
+        let mut free = Vec::new();
+        for magazine in self.magazines.iter() {
+            free.append(&mut magazine.lock());
+        }
+        free.append(&mut self.depot.lock());
+
+        // A chunk's free buffers hold its only references if none is in use.
+        let mut free_bufs_by_chunk: BTreeMap<usize, (usize, &Arc<DmaStream>)> = BTreeMap::new();
+        for buf in free.iter() {
+            free_bufs_by_chunk
+                .entry(buf.dma.daddr())
+                .or_insert((0, &buf.dma))
+                .0 += 1;
+        }
+        let mut freed = 0;
+        let mut unused = BTreeSet::new();
+        for (daddr, (num_free, dma)) in free_bufs_by_chunk {
+            if freed >= target {
+                break;
+            }
+            if Arc::strong_count(dma) == num_free {
+                freed += dma.size() / PAGE_SIZE;
+                unused.insert(daddr);
+            }
+        }
+        free.retain(|buf| !unused.contains(&buf.dma.daddr()));
+        self.depot.lock().append(&mut free);
+        freed
+    }
+}
+
+fn pool() -> &'static DmaPool {
+    DMA_POOL.call_once(|| {
+        shrinker::register(&DmaPoolShrinker);
+        DmaPool {
+            classes: DMA_BUF_SIZES.map(SizeClass::new),
+        }
+    })
+}
+
+/// Returns the pages of the chunks the pool mapped.
+pub fn mapped_pages() -> usize {
+    DMA_POOL.get().map_or(0, |pool| {
+        pool.classes.iter().map(SizeClass::mapped_pages).sum()
+    })
+}
+
+/// Unmaps the pool's unused chunks.
+struct DmaPoolShrinker;
+
+impl Shrinker for DmaPoolShrinker {
+    fn name(&self) -> &'static str {
+        "dma_pool"
+    }
+
+    fn count(&self) -> usize {
+        DMA_POOL.get().map_or(0, |pool| {
+            pool.classes.iter().map(SizeClass::free_pages).sum()
+        })
+    }
+
+    fn shrink(&self, target: usize) -> usize {
+        let Some(pool) = DMA_POOL.get() else {
+            return 0;
+        };
+        let mut freed = 0;
+        for class in pool.classes.iter().rev() {
+            if freed >= target {
+                break;
+            }
+            freed += class.shrink(target - freed);
+        }
+        freed
+    }
+}
+
+/// A streaming DMA buffer, returned to the pool when dropped if it came from
+/// there.
+pub struct DmaBuf {
+    dma: Arc<DmaStream>,
+    offset: usize,
+    size: usize,
+    /// The size class of a pooled buffer, or `None` for a view of memory
+    /// mapped by the caller.
+    class: Option<usize>,
+}
+
+impl DmaBuf {
+    /// Allocates a buffer of at least `size` bytes.
+    pub fn alloc(size: usize) -> Result<Self> {
+        Ok(Self::alloc_many(size, 1)?.pop().unwrap())
+    }
+
+    /// Allocates `count` buffers of at least `size` bytes each, taking the
+    /// pool's locks once rather than once per buffer, or fails with `ENOMEM`.
+    pub fn alloc_many(size: usize, count: usize) -> Result<Vec<Self>> {
+        let class = DMA_BUF_SIZES
+            .iter()
+            .position(|&buf_size| buf_size >= size)
+            .expect("DMA buffer too large");
+        let mut free = Vec::with_capacity(count);
+        pool().classes[class].alloc(count, &mut free)?;
+        Ok(free
+            .into_iter()
+            .map(|buf| DmaBuf {
+                dma: buf.dma,
+                offset: buf.offset,
+                size: DMA_BUF_SIZES[class],
+                class: Some(class),
+            })
+            .collect())
+    }
+
+    /// Returns a buffer over `size` bytes at `offset` of `dma`, which the
+    /// caller mapped. The memory is unmapped once the last buffer over it is
+    /// gone.
+    pub fn from_stream(dma: Arc<DmaStream>, offset: usize, size: usize) -> Self {
+        assert!(offset + size <= dma.size());
+        Self {
+            dma,
+            offset,
+            size,
+            class: None,
+        }
+    }
+
+    pub fn dma(&self) -> &Arc<DmaStream> {
+        &self.dma
+    }
+
+    pub fn offset(&self) -> usize {
+        self.offset
+    }
+
+    pub fn size(&self) -> usize {
+        self.size
+    }
+
+    pub fn daddr(&self) -> usize {
+        self.dma.daddr() + self.offset
+    }
+}
+
+impl VmIo for DmaBuf {
+    fn read(&self, offset: usize, writer: &mut VmWriter) -> ostd::Result<()> {
+        if offset + writer.avail() > self.size() {
+            return Err(ostd::Error::AccessDenied);
+        }
+        self.dma.read(offset + self.offset, writer)
+    }
+
+    fn write(&self, offset: usize, reader: &mut VmReader) -> ostd::Result<()> {
+        if offset + reader.remain() > self.size() {
+            return Err(ostd::Error::AccessDenied);
+        }
+        self.dma.write(offset + self.offset, reader)
+    }
+}
+
+impl Drop for DmaBuf {
+    fn drop(&mut self) {
+        let Some(class) = self.class else {
+            return;
+        };
+        pool().classes[class].free(FreeBuf {
+            dma: self.dma.clone(),
+            offset: self.offset,
+        });
+    }
+}
+
+#[cfg(ktest)]
+mod test {
+    use ostd::prelude::ktest;
+
+    use super::DmaBuf;
+    use crate::{bench, drivers::blk::SECTOR_SIZE};
+
+    #[ktest]
+    fn bench_dma_buf_alloc() {
+        // A sector buffer, the size most requests take, taken from and given
+        // back to the local magazine.
+        bench::run("dma_buf_alloc", 1000, || {
+            drop(DmaBuf::alloc(SECTOR_SIZE).unwrap())
+        });
+    }
+}
@@ -1,3 +1,5 @@
+pub mod dma_pool;
+
 use alloc::sync::Arc;
 use id_alloc::IdAlloc;
 use ostd::{
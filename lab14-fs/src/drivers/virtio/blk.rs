@@ -1,116 +1,367 @@
 use alloc::boxed::Box;
+use alloc::sync::{Arc, Weak};
 use alloc::vec::Vec;
-use log::{debug, error};
+use log::{debug, error, warn};
 use ostd::{
     Pod,
-    mm::{DmaCoherent, FrameAllocOptions, VmIo},
-    sync::{LocalIrqDisabled, SpinLock},
+    cpu::{PinCurrentCpu, num_cpus},
+    irq::IrqLine,
+    mm::{DmaCoherent, FrameAllocOptions, PAGE_SIZE, VmIo},
+    sync::{LocalIrqDisabled, SpinLock, SpinLockGuard, WaitQueue},
+    task::{Task, disable_preempt},
 };
+use spin::Once;
 
-use crate::drivers::{
-    blk::BioRequest,
-    virtio::queue::{VirtqueueCoherentRequest, VirtqueueRequest, VirtqueueStreamRequest},
-};
 use crate::drivers::{
     blk::BlockDevice,
-    utils::DmaSliceAlloc,
     virtio::{mmio::VirtioMmioTransport, queue::Virtqueue},
 };
+use crate::drivers::{
+    blk::{BioCompletion, BioRequest, BioStatus, BioType, BioWaiter, WriteBuffer},
+    io_sched::{Deadline, IoQueue},
+    virtio::queue::{VirtqueueBuffer, VirtqueueCoherentRequest, VirtqueueStreamRequest},
+};
 
 pub struct VirtioBlkDevice {
     transport: VirtioMmioTransport,
     config: VirtioBlkConfig,
-    request_queue: SpinLock<Virtqueue, LocalIrqDisabled>,
+    /// The request queues, one per CPU up to the number the device has.
+    ///
+    /// Requests go to the queue of the submitting CPU, so CPUs submitting at
+    /// once do not contend for one lock.
+    queues: Box<[RequestQueue]>,
+    /// The IRQ line delivering completions, kept alive with the device.
+    irq_line: Once<IrqLine>,
+    /// Whether the device has a volatile write cache that needs flushing.
+    supports_flush: bool,
+    /// The most sectors in one discard or write-zeroes, or 0 if the device
+    /// does not support it.
+    max_discard_sectors: usize,
+    max_write_zeroes_sectors: usize,
+    /// The number of data descriptors left in a request besides the header and status.
+    max_request_sectors: usize,
+    write_buffer: WriteBuffer,
+    io_queue: IoQueue,
+}
 
-    request_alloc: SpinLock<DmaSliceAlloc<BlockReq, DmaCoherent>, LocalIrqDisabled>,
-    resp_alloc: SpinLock<DmaSliceAlloc<BlockResp, DmaCoherent>, LocalIrqDisabled>,
+/// A virtqueue of the device and the requests in flight on it.
+struct RequestQueue {
+    queue: SpinLock<Virtqueue, LocalIrqDisabled>,
+    /// The completions of the requests submitted to `queue`, indexed by their
+    /// descriptor head.
+    ///
+    /// Always locked after `queue`.
+    inflight: SpinLock<Vec<Option<BioCompletion>>, LocalIrqDisabled>,
+    /// Submitters waiting for free descriptors in `queue`.
+    free_desc_queue: WaitQueue,
+    queue_size: usize,
+    /// The header, range and status of a request, one of each per descriptor
+    /// that can head a chain, so that submitting allocates nothing. Only
+    /// discards and write-zeroes use their range.
+    ///
+    /// The headers come first, then the ranges, then the statuses.
+    contexts: Arc<DmaCoherent>,
 }
 
 impl VirtioBlkDevice {
-    pub fn new(transport: VirtioMmioTransport) -> Self {
-        let queue = Virtqueue::new(0, &transport).unwrap();
-        let request_dma = DmaCoherent::map(
-            FrameAllocOptions::new().alloc_segment(1).unwrap().into(),
-            false,
-        )
-        .unwrap();
-        let resp_dma = DmaCoherent::map(
-            FrameAllocOptions::new().alloc_segment(1).unwrap().into(),
-            false,
-        )
-        .unwrap();
-
+    pub fn new(transport: VirtioMmioTransport) -> Arc<Self> {
         let config_io_mem = transport.config_space();
         let blk_config: VirtioBlkConfig = config_io_mem.read_val(0).unwrap();
 
         debug!("Virtio Block Device config: {:#?}", blk_config);
 
+        let num_queues = if transport.device_features() & VIRTIO_BLK_F_MQ != 0 {
+            (blk_config.num_queues as usize).clamp(1, num_cpus())
+        } else {
+            1
+        };
+        let queues: Box<[RequestQueue]> = (0..num_queues)
+            .map(|index| RequestQueue::new(Virtqueue::new(index as u32, &transport).unwrap()))
+            .collect();
+
+        let supports_flush = transport.device_features() & VIRTIO_BLK_F_FLUSH != 0;
+        let max_discard_sectors = if transport.device_features() & VIRTIO_BLK_F_DISCARD != 0 {
+            blk_config.max_discard_sectors as usize
+        } else {
+            0
+        };
+        let max_write_zeroes_sectors =
+            if transport.device_features() & VIRTIO_BLK_F_WRITE_ZEROES != 0 {
+                blk_config.max_write_zeroes_sectors as usize
+            } else {
+                0
+            };
+        // Each sector is a segment of its own, besides the header and status.
+        let mut max_request_sectors = queues[0].queue.lock().max_chain_len() - 2;
+        if transport.device_features() & VIRTIO_BLK_F_SEG_MAX != 0 {
+            max_request_sectors = max_request_sectors.min(blk_config.seg_max as usize);
+        }
+        let irq_line = transport.alloc_irq_line();
+
         transport.finish_init();
 
-        Self {
+        let device = Arc::new(Self {
             transport,
-            request_queue: SpinLock::new(queue),
-            request_alloc: SpinLock::new(DmaSliceAlloc::new(request_dma)),
-            resp_alloc: SpinLock::new(DmaSliceAlloc::new(resp_dma)),
+            queues,
+            irq_line: Once::new(),
+            supports_flush,
+            max_discard_sectors,
+            max_write_zeroes_sectors,
+            max_request_sectors,
+            write_buffer: WriteBuffer::new(),
+            io_queue: IoQueue::new(Box::new(Deadline::default())),
             config: blk_config,
+        });
+
+        let weak_device = Arc::downgrade(&device);
+        let handle_completion = move || {
+            if let Some(device) = Weak::upgrade(&weak_device) {
+                device.handle_irq();
+            }
+        };
+        match irq_line {
+            Some(mut irq_line) => {
+                irq_line.on_active(move |_| handle_completion());
+                device.irq_line.call_once(|| irq_line);
+            }
+            None => {
+                // Without a usable interrupt, harvest the used ring on every timer tick.
+                warn!("Virtio block device has no IRQ line, polling completions on timer ticks");
+                ostd::timer::register_callback(handle_completion);
+            }
+        }
+
+        device
+    }
+
+    /// Harvests the finished requests from the used rings and wakes up their waiters.
+    ///
+    /// This is the interrupt handler of the device. An MMIO device has one
+    /// interrupt for all its queues, so all of them are checked.
+    fn handle_irq(&self) {
+        if self.irq_line.is_completed() {
+            self.transport.ack_interrupt();
+        }
+
+        for queue in self.queues.iter() {
+            queue.handle_completions();
+        }
+    }
+
+    /// Returns the queue of the current CPU.
+    fn local_queue(&self) -> &RequestQueue {
+        let cpu = disable_preempt().current_cpu().as_usize();
+        &self.queues[cpu % self.queues.len()]
+    }
+
+    /// Locks `queue` once it has the free descriptors for a chain of
+    /// `chain_len` requests.
+    fn lock_queue_with_free_desc<'a>(
+        &self,
+        queue: &'a RequestQueue,
+        chain_len: usize,
+    ) -> SpinLockGuard<'a, Virtqueue, LocalIrqDisabled> {
+        let try_lock = || {
+            let queue = queue.queue.lock();
+            queue.can_send(chain_len).then_some(queue)
+        };
+
+        if Task::current().is_some() {
+            return queue.free_desc_queue.wait_until(try_lock);
+        }
+
+        // We cannot sleep before the first task runs, so poll the used ring instead.
+        loop {
+            if let Some(queue) = try_lock() {
+                return queue;
+            }
+            self.handle_irq();
+            core::hint::spin_loop();
+        }
+    }
+}
+
+impl RequestQueue {
+    fn new(queue: Virtqueue) -> Self {
+        let queue_size = queue.queue_size();
+        let contexts_size = queue_size
+            * (size_of::<BlockReq>() + size_of::<DiscardWriteZeroes>() + size_of::<BlockResp>());
+        let contexts = DmaCoherent::map(
+            FrameAllocOptions::new()
+                .alloc_segment(contexts_size.div_ceil(PAGE_SIZE))
+                .unwrap()
+                .into(),
+            false,
+        )
+        .unwrap();
+
+        Self {
+            queue: SpinLock::new(queue),
+            inflight: SpinLock::new((0..queue_size).map(|_| None).collect()),
+            free_desc_queue: WaitQueue::new(),
+            queue_size,
+            contexts: Arc::new(contexts),
+        }
+    }
+
+    /// Completes the finished requests of this queue.
+    fn handle_completions(&self) {
+        let mut any_finished = false;
+        {
+            let mut queue = self.queue.lock();
+            let mut inflight = self.inflight.lock();
+            while let Some((head, _)) = queue.pop_finish_request() {
+                let Some(completion) = inflight[head as usize].take() else {
+                    error!("Virtio block device completed unknown request {}", head);
+                    continue;
+                };
+
+                // Read the status before the queue lock is released and the
+                // head is reused.
+                let resp: BlockResp = self.contexts.read_val(self.resp_offset(head)).unwrap();
+                let status = if resp.status == RespStatus::Ok as u8 {
+                    BioStatus::Ok
+                } else {
+                    error!("Block device request error: {:?}", resp.status);
+                    BioStatus::IoError
+                };
+                completion.complete(status);
+                any_finished = true;
+            }
         }
+
+        if any_finished {
+            self.free_desc_queue.wake_all();
+        }
+    }
+
+    fn req_offset(&self, head: u16) -> usize {
+        head as usize * size_of::<BlockReq>()
+    }
+
+    fn range_offset(&self, head: u16) -> usize {
+        self.queue_size * size_of::<BlockReq>() + head as usize * size_of::<DiscardWriteZeroes>()
+    }
+
+    fn resp_offset(&self, head: u16) -> usize {
+        self.queue_size * (size_of::<BlockReq>() + size_of::<DiscardWriteZeroes>())
+            + head as usize * size_of::<BlockResp>()
     }
 }
 
 impl BlockDevice for VirtioBlkDevice {
-    fn read_block(&self, bio_request: &mut BioRequest) {
-        let req_dma = self.request_alloc.lock().alloc().unwrap();
-        let resp_dma = self.resp_alloc.lock().alloc().unwrap();
+    fn submit(&self, bio_request: BioRequest) -> BioWaiter {
+        if bio_request.type_() == BioType::Flush && !self.supports_flush {
+            // Writes go straight to the disk, so there is nothing to flush.
+            let (waiter, completion) = BioWaiter::new_pair(bio_request);
+            completion.complete(BioStatus::Ok);
+            return waiter;
+        }
+
+        let (type_, device_writable) = match bio_request.type_() {
+            BioType::Read => (ReqType::In, true),
+            BioType::Write => (ReqType::Out, false),
+            BioType::Flush => (ReqType::Flush, false),
+            BioType::Discard => (ReqType::Discard, false),
+            BioType::WriteZeroes => (ReqType::WriteZeroes, false),
+        };
+        // A discard or write-zeroes has one range as its data.
+        let has_range = matches!(bio_request.type_(), BioType::Discard | BioType::WriteZeroes);
+        let num_data = bio_request.data.len() + has_range as usize;
+
+        let request_queue = self.local_queue();
+        let mut queue = self.lock_queue_with_free_desc(request_queue, num_data + 2);
 
+        // The chain's head indexes its header, range and status, which are free
+        // while the head descriptor is.
+        let head = queue.next_head();
+        let contexts = &request_queue.contexts;
+        let req_offset = request_queue.req_offset(head);
+        let resp_offset = request_queue.resp_offset(head);
         let req = BlockReq {
-            type_: ReqType::In as _,
+            type_: type_ as _,
             reserved: 0,
             sector: bio_request.index() as u64,
         };
-        req_dma.write_no_offset_val(&req).unwrap();
-
-        let resp = BlockResp::default();
-        resp_dma.write_no_offset_val(&resp).unwrap();
-
-        // Construct Requests
-        let mut requests: Vec<Box<dyn VirtqueueRequest>> =
-            Vec::with_capacity(bio_request.num_sectors() + 2);
-        requests.push(Box::new(VirtqueueCoherentRequest::from_dma_slice(
-            &req_dma, false,
-        )));
-        for data in bio_request.data_slices_mut().iter_mut() {
-            let stream_req = VirtqueueStreamRequest::from_dma_slice(data, true);
-            requests.push(Box::new(stream_req));
+        contexts.write_val(req_offset, &req).unwrap();
+        contexts
+            .write_val(resp_offset, &BlockResp::default())
+            .unwrap();
+
+        let range_offset = request_queue.range_offset(head);
+        let range = VirtqueueCoherentRequest::new(
+            contexts,
+            range_offset,
+            size_of::<DiscardWriteZeroes>(),
+            false,
+        );
+        if has_range {
+            let segment = DiscardWriteZeroes {
+                sector: bio_request.index() as u64,
+                num_sectors: bio_request.num_sectors() as u32,
+                flags: 0,
+            };
+            contexts.write_val(range_offset, &segment).unwrap();
         }
-        requests.push(Box::new(VirtqueueCoherentRequest::from_dma_slice(
-            &resp_dma, true,
-        )));
-        let queue_requests: Vec<&dyn VirtqueueRequest> =
-            requests.iter().map(|r| r.as_ref()).collect();
-
-        // Send requests
-        let mut queue = self.request_queue.lock();
-        queue.send_request(queue_requests.as_ref()).unwrap();
+
+        let header =
+            VirtqueueCoherentRequest::new(contexts, req_offset, size_of::<BlockReq>(), false);
+        let status =
+            VirtqueueCoherentRequest::new(contexts, resp_offset, size_of::<BlockResp>(), true);
+        let data = bio_request.data.iter().map(|data| {
+            VirtqueueBuffer::of(&VirtqueueStreamRequest::from_dma_buf(data, device_writable))
+        });
+        let range = has_range.then(|| VirtqueueBuffer::of(&range));
+        let chain = core::iter::once(VirtqueueBuffer::of(&header))
+            .chain(data)
+            .chain(range)
+            .chain(core::iter::once(VirtqueueBuffer::of(&status)));
+        let sent_head = queue.send_request(chain).unwrap();
+        debug_assert_eq!(sent_head, head);
+
+        // Record the request before the device can complete it.
+        let (waiter, completion) = BioWaiter::new_pair(bio_request);
+        request_queue.inflight.lock()[head as usize] = Some(completion);
+
         // Notify the device
         if queue.should_notify() {
             queue.notify_device();
         }
+        drop(queue);
 
-        // Wait for completion
-        while !queue.can_pop() {
-            core::hint::spin_loop();
+        if Task::current().is_none() {
+            while !waiter.is_completed() {
+                self.handle_irq();
+                core::hint::spin_loop();
+            }
         }
 
-        queue.pop_finish_request();
+        waiter
+    }
 
-        // Read response
-        let resp_read: BlockResp = resp_dma.read_no_offset_val().unwrap();
-        if resp_read.status != RespStatus::Ok as u8 {
-            error!("Block device read error: {:?}", resp_read.status);
-        }
+    fn io_queue(&self) -> &IoQueue {
+        &self.io_queue
+    }
+
+    fn write_buffer(&self) -> &WriteBuffer {
+        &self.write_buffer
+    }
+
+    fn max_request_sectors(&self) -> usize {
+        self.max_request_sectors
+    }
+
+    fn num_sectors(&self) -> usize {
+        self.config.capacity as usize
+    }
+
+    fn max_discard_sectors(&self) -> usize {
+        self.max_discard_sectors
     }
 
-    fn write_block(&self, bio_request: &BioRequest) {}
+    fn max_write_zeroes_sectors(&self) -> usize {
+        self.max_write_zeroes_sectors
+    }
 }
 
 #[repr(C)]
@@ -127,6 +378,16 @@ struct BlockResp {
     pub status: u8,
 }
 
+/// The range of a discard or write-zeroes, its only data segment.
+#[repr(C)]
+#[derive(Debug, Copy, Clone, Pod)]
+struct DiscardWriteZeroes {
+    sector: u64,
+    num_sectors: u32,
+    /// Unmapping is left to the device, so no flags are set.
+    flags: u32,
+}
+
 impl Default for BlockResp {
     fn default() -> Self {
         Self {
@@ -135,6 +396,18 @@ impl Default for BlockResp {
     }
 }
 
+/// The device has more than one request queue.
+const VIRTIO_BLK_F_MQ: u64 = 1 << 12;
+/// The device limits the number of data segments in a request to `seg_max`.
+const VIRTIO_BLK_F_SEG_MAX: u64 = 1 << 2;
+/// The device has a volatile write cache and supports [`ReqType::Flush`].
+const VIRTIO_BLK_F_FLUSH: u64 = 1 << 9;
+/// The device supports [`ReqType::Discard`], up to `max_discard_sectors`.
+const VIRTIO_BLK_F_DISCARD: u64 = 1 << 13;
+/// The device supports [`ReqType::WriteZeroes`], up to
+/// `max_write_zeroes_sectors`.
+const VIRTIO_BLK_F_WRITE_ZEROES: u64 = 1 << 14;
+
 #[repr(u32)]
 #[derive(Debug, Copy, Clone)]
 pub enum ReqType {
@@ -169,4 +442,39 @@ struct VirtioBlkConfig {
     alignment_offset: u8,
     min_io_size: u16,
     opt_io_size: u32,
+    writeback: u8,
+    unused0: u8,
+    /// The number of request queues, valid with [`VIRTIO_BLK_F_MQ`].
+    num_queues: u16,
+    /// The limits of discards, valid with [`VIRTIO_BLK_F_DISCARD`].
+    max_discard_sectors: u32,
+    max_discard_seg: u32,
+    discard_sector_alignment: u32,
+    /// The limits of write-zeroes, valid with [`VIRTIO_BLK_F_WRITE_ZEROES`].
+    max_write_zeroes_sectors: u32,
+    max_write_zeroes_seg: u32,
+    write_zeroes_may_unmap: u8,
+    unused1: [u8; 3],
+    _padding: u32,
+}
+
+#[cfg(ktest)]
+mod test {
+    use ostd::prelude::ktest;
+
+    use crate::{bench, drivers::blk::BioRequest};
+
+    #[ktest]
+    fn bench_virtqueue_round_trip() {
+        let device = bench::block_devices()
+            .into_iter()
+            .next()
+            .expect("no block device");
+        // One sector read, straight through the virtqueue and back, without
+        // the I/O scheduler.
+        let mut request = Some(BioRequest::new(0, 1));
+        bench::run("virtqueue_round_trip", 100, || {
+            request = Some(device.submit(request.take().unwrap()).wait().unwrap());
+        });
+    }
 }
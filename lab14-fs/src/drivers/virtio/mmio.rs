@@ -3,7 +3,8 @@ use core::mem::offset_of;
 use ostd::{
     Pod,
     io::IoMem,
-    mm::{DmaCoherent, HasDaddr, PAGE_SIZE, VmIoOnce},
+    irq::IrqLine,
+    mm::{Daddr, PAGE_SIZE, VmIoOnce},
 };
 
 use crate::drivers::virtio::DeviceStatus;
@@ -11,10 +12,12 @@ use crate::drivers::virtio::DeviceStatus;
 pub struct VirtioMmioTransport {
     layout_io_mem: IoMem,
     is_legacy: bool,
+    /// The interrupt number from the device tree, if any.
+    interrupt: Option<usize>,
 }
 
 impl VirtioMmioTransport {
-    pub fn new(layout_io_mem: IoMem) -> Self {
+    pub fn new(layout_io_mem: IoMem, interrupt: Option<usize>) -> Self {
         let version: u32 = layout_io_mem
             .read_once(offset_of!(VirtioMmioLayout, version))
             .unwrap();
@@ -22,6 +25,7 @@ impl VirtioMmioTransport {
         Self {
             layout_io_mem,
             is_legacy: version == 0x1,
+            interrupt,
         }
     }
 
@@ -97,6 +101,27 @@ impl VirtioMmioTransport {
         self.is_legacy
     }
 
+    /// Allocates the IRQ line wired to this device.
+    ///
+    /// Returns `None` if the device tree does not describe an interrupt or the
+    /// line cannot be taken, in which case the driver has to poll.
+    pub fn alloc_irq_line(&self) -> Option<IrqLine> {
+        let interrupt = u8::try_from(self.interrupt?).ok()?;
+        IrqLine::alloc_specific(interrupt).ok()
+    }
+
+    /// Reads the pending interrupt causes and acknowledges them.
+    pub fn ack_interrupt(&self) -> u32 {
+        let status: u32 = self
+            .layout_io_mem
+            .read_once(offset_of!(VirtioMmioLayout, interrupt_status))
+            .unwrap();
+        self.layout_io_mem
+            .write_once(offset_of!(VirtioMmioLayout, interrupt_ack), &status)
+            .unwrap();
+        status
+    }
+
     pub fn finish_init(&self) {
         self.set_device_status(
             DeviceStatus::ACKNOWLEDGE
@@ -110,24 +135,31 @@ impl VirtioMmioTransport {
         self.layout_io_mem.slice(0x100..0x200)
     }
 
-    pub fn enable_queue(
-        &self,
-        queue_index: u32,
-        queue_size: u16,
-        desc: &DmaCoherent,
-        avail: &DmaCoherent,
-        used: &DmaCoherent,
-    ) {
+    /// Returns the maximum size of the `queue_index`-th queue, or 0 if the
+    /// device does not have it.
+    pub fn queue_num_max(&self, queue_index: u32) -> u32 {
         self.layout_io_mem
             .write_once(offset_of!(VirtioMmioLayout, queue_select), &queue_index)
             .unwrap();
-
-        let queue_num_max: u32 = self
-            .layout_io_mem
+        self.layout_io_mem
             .read_once(offset_of!(VirtioMmioLayout, queue_num_max))
-            .unwrap();
+            .unwrap()
+    }
 
-        assert!(queue_size <= queue_num_max as u16);
+    /// Hands the rings of the `queue_index`-th queue to the device.
+    ///
+    /// A legacy device takes one page-aligned region laid out as the spec
+    /// requires, starting at `desc`, while a modern one takes the address of
+    /// each part.
+    pub fn enable_queue(
+        &self,
+        queue_index: u32,
+        queue_size: u16,
+        desc: Daddr,
+        avail: Daddr,
+        used: Daddr,
+    ) {
+        assert!(queue_size as u32 <= self.queue_num_max(queue_index));
 
         let queue_size = queue_size as u32;
 
@@ -135,10 +167,29 @@ impl VirtioMmioTransport {
             .write_once(offset_of!(VirtioMmioLayout, queue_num), &queue_size)
             .unwrap();
 
-        // We only suppport legacy virtio mmio device for now.
-        assert!(self.is_legacy);
+        if !self.is_legacy {
+            self.write_u64(
+                offset_of!(VirtioMmioLayout, queue_desc_low),
+                offset_of!(VirtioMmioLayout, queue_desc_high),
+                desc as u64,
+            );
+            self.write_u64(
+                offset_of!(VirtioMmioLayout, queue_driver_low),
+                offset_of!(VirtioMmioLayout, queue_driver_high),
+                avail as u64,
+            );
+            self.write_u64(
+                offset_of!(VirtioMmioLayout, queue_device_low),
+                offset_of!(VirtioMmioLayout, queue_device_high),
+                used as u64,
+            );
+            self.layout_io_mem
+                .write_once(offset_of!(VirtioMmioLayout, queue_ready), &1u32)
+                .unwrap();
+            return;
+        }
 
-        let daddr = desc.daddr() as u32;
+        let daddr = desc as u32;
 
         self.layout_io_mem
             .write_once(
@@ -150,6 +201,15 @@ impl VirtioMmioTransport {
             .write_once(offset_of!(VirtioMmioLayout, legacy_queue_pfn), &daddr)
             .unwrap();
     }
+
+    fn write_u64(&self, low_offset: usize, high_offset: usize, val: u64) {
+        self.layout_io_mem
+            .write_once(low_offset, &(val as u32))
+            .unwrap();
+        self.layout_io_mem
+            .write_once(high_offset, &((val >> 32) as u32))
+            .unwrap();
+    }
 }
 
 /// The memory layout of a Virtio MMIO transport device.
@@ -2,7 +2,7 @@ pub mod blk;
 pub mod mmio;
 pub mod queue;
 
-use core::{hint::spin_loop, mem::offset_of};
+use core::mem::offset_of;
 
 use alloc::{sync::Arc, vec::Vec};
 use ostd::{
@@ -11,14 +11,21 @@ use ostd::{
     early_println,
     io::IoMem,
     mm::{PodOnce, VmIoOnce},
+    task::Task,
 };
 
+use crate::boot::{self, BootTask};
+use crate::drivers::blk::BlockDevice;
 use crate::drivers::virtio::{
     blk::VirtioBlkDevice,
     mmio::{VirtioMmioLayout, VirtioMmioTransport},
+    queue::{VIRTIO_RING_F_EVENT_IDX, VIRTIO_RING_F_INDIRECT_DESC},
 };
 
-pub fn init() {
+/// Finds the virtio devices in the device tree, and starts probing each in a
+/// boot task of its own, as resetting a device may take a while. Returns the
+/// probes in the order of the device tree.
+pub fn init() -> Vec<BootTask<Option<Arc<dyn BlockDevice>>>> {
     // We use device tree to initialize virtio devices.
     let device_tree = DEVICE_TREE.get().unwrap();
     let mmio_virtio_nodes = device_tree.all_nodes().filter(|node| {
@@ -32,6 +39,7 @@ pub fn init() {
     let mut transports = Vec::new();
     for node in mmio_virtio_nodes {
         let mmio_region = node.reg().unwrap().next().unwrap();
+        let interrupt = node.interrupts().and_then(|mut irqs| irqs.next());
         let start = mmio_region.starting_address as usize;
         let size = mmio_region.size.unwrap();
 
@@ -69,57 +77,70 @@ pub fn init() {
             version
         );
 
-        transports.push(VirtioMmioTransport::new(layout_io_mem));
+        transports.push(VirtioMmioTransport::new(layout_io_mem, interrupt));
     }
 
-    // Next, Check if we support the device.
-    for transport in transports {
-        // Start initialization procedure
-        // First, reset device
-        transport.set_device_status(DeviceStatus::empty());
-        while transport.device_status() != DeviceStatus::empty() {
-            spin_loop();
-        }
+    transports
+        .into_iter()
+        .map(|transport| boot::spawn("virtio_probe", move || probe(transport)))
+        .collect()
+}
 
-        // Next, set to acknowledge
-        transport.set_device_status(DeviceStatus::ACKNOWLEDGE | DeviceStatus::DRIVER);
-
-        // Then, negotiate features
-        let device_id = transport.device_id();
-        let mut features = transport.device_features();
-        // Remove the indirect descriptor feature
-        features &= !(1u64 << 28);
-        features &= !(1u64 << 29);
-        match device_id {
-            2 => {
-                // Remove the MQ features
-                features &= !(1u64 << 12);
-            }
-            _ => unimplemented!(),
-        }
-        transport.set_driver_features(features);
+/// Initializes the device behind `transport`, if we support it.
+fn probe(transport: VirtioMmioTransport) -> Option<Arc<dyn BlockDevice>> {
+    // Start initialization procedure
+    // First, reset device
+    transport.set_device_status(DeviceStatus::empty());
+    // Let the other probes run meanwhile.
+    while transport.device_status() != DeviceStatus::empty() {
+        Task::yield_now();
+    }
 
-        if !transport.is_legacy() {
-            transport.set_device_status(
-                DeviceStatus::ACKNOWLEDGE | DeviceStatus::DRIVER | DeviceStatus::FEATURES_OK,
-            );
-        }
+    // Next, set to acknowledge
+    transport.set_device_status(DeviceStatus::ACKNOWLEDGE | DeviceStatus::DRIVER);
+
+    // Then, negotiate features
+    let device_id = transport.device_id();
+    // Keep the device-specific features, multiple queues included, and
+    // the ring features the virtqueue implements: indirect descriptors,
+    // EVENT_IDX and, for a modern device, the version 1 layout.
+    let features = transport.device_features()
+        & (DEVICE_FEATURES
+            | VIRTIO_RING_F_INDIRECT_DESC
+            | VIRTIO_RING_F_EVENT_IDX
+            | VIRTIO_F_VERSION_1);
+    match device_id {
+        2 => {}
+        _ => unimplemented!(),
+    }
+    transport.set_driver_features(features);
 
-        match device_id {
-            2 => {
-                let blk_device = VirtioBlkDevice::new(transport);
-
-                super::BLOCK_DEVICES
-                    .get()
-                    .unwrap()
-                    .lock()
-                    .push(Arc::new(blk_device));
-            }
-            _ => unimplemented!(),
+    if !transport.is_legacy() {
+        transport.set_device_status(
+            DeviceStatus::ACKNOWLEDGE | DeviceStatus::DRIVER | DeviceStatus::FEATURES_OK,
+        );
+        // The device clears FEATURES_OK if it cannot work with the features.
+        if !transport
+            .device_status()
+            .contains(DeviceStatus::FEATURES_OK)
+        {
+            early_println!("Virtio device {} rejected the features", device_id);
+            transport.set_device_status(DeviceStatus::FAILED);
+            return None;
         }
     }
+
+    match device_id {
+        2 => Some(VirtioBlkDevice::new(transport)),
+        _ => unimplemented!(),
+    }
 }
 
+/// The feature bits whose meaning depends on the device type.
+const DEVICE_FEATURES: u64 = (1 << 24) - 1;
+/// The device complies with version 1 of the spec, as modern devices must.
+const VIRTIO_F_VERSION_1: u64 = 1 << 32;
+
 bitflags::bitflags! {
     #[derive(Pod)]
     #[repr(C)]
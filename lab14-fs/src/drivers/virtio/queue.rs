@@ -7,13 +7,13 @@ use ostd::{
     Pod,
     io::IoMem,
     mm::{
-        DmaCoherent, DmaStream, FrameAllocOptions, HasDaddr, HasSize, PAGE_SIZE, PodOnce, Segment,
+        DmaCoherent, DmaStream, FrameAllocOptions, HasDaddr, HasSize, PAGE_SIZE, PodOnce, VmIo,
         VmIoOnce,
     },
 };
 
 use crate::drivers::{
-    utils::DmaSlice,
+    utils::{DmaSlice, dma_pool::DmaBuf},
     virtio::mmio::{VirtioMmioLayout, VirtioMmioTransport},
 };
 
@@ -24,7 +24,9 @@ pub struct Virtqueue {
 
     used_ring: UsedRingPtr,
 
-    notify: IoMem,
+    /// Where to notify the device, or `None` for a queue no device uses, as
+    /// in tests.
+    notify: Option<IoMem>,
 
     queue_index: u32,
 
@@ -37,40 +39,70 @@ pub struct Virtqueue {
     next_avail: u16,
     /// The last used index we have processed
     last_used_idx: u16,
+    /// The available index when the device was last considered for a notification
+    notified_avail: u16,
+    /// The indirect tables, if the device supports them.
+    indirect: Option<IndirectTables>,
+    /// Whether notifications are suppressed with `EVENT_IDX`.
+    event_idx: bool,
 }
 
 impl Virtqueue {
+    /// Sets up the `queue_index`-th queue of the device, as large as the
+    /// device allows up to [`MAX_QUEUE_SIZE`], or returns `None` if the device
+    /// has no such queue.
     pub fn new(queue_index: u32, mmio_transport: &VirtioMmioTransport) -> Option<Self> {
-        // We only support legacy device for now.
-        assert!(mmio_transport.is_legacy());
-
-        let queue_size = QUEUE_SIZE;
-        let frames = legacy_queue_size_to_frames(queue_size);
-
-        // First frame: (descriptors + available ring)
-        // Second frame: (used ring)
-        let (descriptor_frame, used_ring_frame) = frames.split(PAGE_SIZE);
+        let queue_num_max = mmio_transport.queue_num_max(queue_index);
+        if queue_num_max == 0 {
+            return None;
+        }
+        // The ring indices wrap around with a mask.
+        let queue_size = 1 << (queue_num_max.min(MAX_QUEUE_SIZE as u32)).ilog2();
+        // The features are negotiated as the device offers them.
+        let features = mmio_transport.device_features();
+        let notify_start = offset_of!(VirtioMmioLayout, queue_notify);
+        let notify = mmio_transport
+            .layout_io_mem()
+            .slice(notify_start..(notify_start + size_of::<u32>()));
 
-        let desc_dma = Arc::new(DmaCoherent::map(descriptor_frame.into(), false).unwrap());
-        let used_ring_dma = Arc::new(DmaCoherent::map(used_ring_frame.into(), false).unwrap());
-        debug!(
-            "Virtqueue {}: Descriptor DMA at {:#x}, size {}",
+        let queue = Self::with_size(queue_index, queue_size, features, Some(notify));
+        mmio_transport.enable_queue(
             queue_index,
-            desc_dma.daddr(),
-            desc_dma.size()
+            queue_size as _,
+            queue.descriptors[0].dma.daddr() + queue.descriptors[0].offset,
+            queue.available_ring.dma.daddr() + queue.available_ring.offset,
+            queue.used_ring.dma.daddr() + queue.used_ring.offset,
         );
+        Some(queue)
+    }
+
+    /// Sets up the rings of a queue of `queue_size` descriptors, using the
+    /// ring features in `features`.
+    fn with_size(
+        queue_index: u32,
+        queue_size: usize,
+        features: u64,
+        notify: Option<IoMem>,
+    ) -> Self {
+        let layout = QueueLayout::new(queue_size);
+
+        let frames = FrameAllocOptions::new()
+            .alloc_segment(layout.size.div_ceil(PAGE_SIZE))
+            .unwrap();
+        let dma = Arc::new(DmaCoherent::map(frames.into(), false).unwrap());
         debug!(
-            "Virtqueue {}: Used Ring DMA at {:#x}, size {}",
+            "Virtqueue {}: {} descriptors, rings DMA at {:#x}, size {}",
             queue_index,
-            used_ring_dma.daddr(),
-            used_ring_dma.size()
+            queue_size,
+            dma.daddr(),
+            dma.size()
         );
 
         let descriptors = (0..queue_size)
             .map(|i| {
                 Arc::new(DescriptorPtr::new(
-                    desc_dma.clone(),
-                    i * size_of::<Descriptor>(),
+                    dma.clone(),
+                    layout.desc + i * size_of::<Descriptor>(),
                 ))
             })
             .collect::<Vec<_>>();
@@ -81,45 +113,72 @@ impl Virtqueue {
             descriptors[descriptor_idx].set_next(next_descriptor_idx as u16);
         }
 
-        let notify_start = offset_of!(VirtioMmioLayout, queue_notify);
-        mmio_transport.enable_queue(
-            queue_index,
-            queue_size as _,
-            &desc_dma,
-            &desc_dma,
-            &used_ring_dma,
-        );
+        let indirect = (features & VIRTIO_RING_F_INDIRECT_DESC != 0).then(IndirectTables::new);
+        let event_idx = features & VIRTIO_RING_F_EVENT_IDX != 0;
 
-        let queue = Self {
+        Self {
             descriptors,
             available_ring: AvailRingPtr {
-                dma: desc_dma,
-                offset: queue_size * size_of::<Descriptor>(),
+                dma: dma.clone(),
+                offset: layout.avail,
+                queue_size,
             },
-            used_ring: UsedRingPtr::new(used_ring_dma),
-            notify: mmio_transport
-                .layout_io_mem()
-                .slice(notify_start..(notify_start + size_of::<u32>())),
+            used_ring: UsedRingPtr::new(dma, layout.used, queue_size),
+            notify,
             queue_index,
             queue_size: queue_size as _,
             used_desc: 0,
             head: 0,
             next_avail: 0,
             last_used_idx: 0,
-        };
-
-        Some(queue)
+            notified_avail: 0,
+            indirect,
+            event_idx,
+        }
     }
 
     /// Sends requests to device, return Ok(start_head) if success.
-    pub fn send_request(&mut self, requests: &[&dyn VirtqueueRequest]) -> Option<u16> {
-        let total_requests = requests.len();
-        assert!(total_requests + self.used_desc as usize <= self.queue_size as usize);
-
+    ///
+    /// The requests are taken from an iterator, so that a chain can be sent
+    /// without collecting it first. The head is the one [`Self::next_head`]
+    /// returned before. With indirect descriptors, the whole chain takes one
+    /// descriptor of the ring.
+    pub fn send_request(
+        &mut self,
+        requests: impl IntoIterator<Item = VirtqueueBuffer>,
+    ) -> Option<u16> {
         // 1. Config the descriptors
         let start_head = self.head;
-        let mut end_head = start_head;
+        let total_descs = match self.indirect.as_mut().and_then(|tables| tables.free.pop()) {
+            Some(table) => self.add_indirect_chain(table, requests),
+            None => self.add_chain(requests),
+        };
+
+        // 2. Setup the available ring
+        let slot = self.next_avail & (self.queue_size - 1);
+        self.available_ring.set_ring(slot, start_head);
+        self.next_avail = self.next_avail.wrapping_add(1);
+        // The device must see the descriptors before the new index.
+        fence(core::sync::atomic::Ordering::SeqCst);
+        self.available_ring.set_next_avail(self.next_avail);
+        debug!(
+            "Virtqueue {}: send_request with {} descriptors, next avail idx {}",
+            self.queue_index, total_descs, self.next_avail
+        );
+
+        fence(core::sync::atomic::Ordering::SeqCst);
+
+        self.used_desc += total_descs;
+        Some(start_head)
+    }
+
+    /// Links the requests as a chain of ring descriptors, returning their number.
+    fn add_chain(&mut self, requests: impl IntoIterator<Item = VirtqueueBuffer>) -> u16 {
+        let mut end_head = self.head;
+        let mut total_requests = 0;
         for request in requests {
+            assert!(total_requests + self.used_desc < self.queue_size);
+            total_requests += 1;
             let desc = &self.descriptors[self.head as usize];
             let mut flags = DescFlags::NEXT;
             if request.device_writable() {
@@ -151,30 +210,111 @@ impl Virtqueue {
                 self.queue_index, end_head
             );
         }
+        total_requests
+    }
+
+    /// Writes the requests to the indirect table `table` and points the free
+    /// head at it, returning the one ring descriptor used.
+    fn add_indirect_chain(
+        &mut self,
+        table: u16,
+        requests: impl IntoIterator<Item = VirtqueueBuffer>,
+    ) -> u16 {
+        assert!(self.used_desc < self.queue_size);
+        let indirect = &self.indirect.as_ref().unwrap().dma;
+        let table_offset = table as usize * INDIRECT_TABLE_LEN * size_of::<Descriptor>();
+
+        let mut requests = requests.into_iter().peekable();
+        let mut len = 0;
+        while let Some(request) = requests.next() {
+            assert!(len < INDIRECT_TABLE_LEN);
+            let mut flags = DescFlags::empty();
+            if requests.peek().is_some() {
+                flags |= DescFlags::NEXT;
+            }
+            if request.device_writable() {
+                flags |= DescFlags::WRITE;
+            }
+            let desc = Descriptor {
+                addr: request.daddr() as _,
+                len: request.len() as _,
+                flags,
+                next: (len + 1) as _,
+            };
+            indirect
+                .write_val(table_offset + len * size_of::<Descriptor>(), &desc)
+                .unwrap();
+            len += 1;
+        }
 
-        // 2. Setup the available ring
-        let slot = self.next_avail & (self.queue_size - 1);
-        self.available_ring.set_ring(slot, start_head);
-        self.next_avail = self.next_avail.wrapping_add(1);
-        self.available_ring.set_next_avail(self.next_avail);
+        let desc = &self.descriptors[self.head as usize];
+        desc.set_desc(
+            (indirect.daddr() + table_offset) as _,
+            (len * size_of::<Descriptor>()) as _,
+        );
+        desc.set_flags(DescFlags::INDIRECT);
         debug!(
-            "Virtqueue {}: send_request with {} descriptors, next avail idx {}",
-            self.queue_index, total_requests, self.next_avail
+            "Virtqueue {}: indirect descriptor {} with {} entries",
+            self.queue_index, self.head, len
         );
+        self.head = desc.next();
+        1
+    }
 
-        fence(core::sync::atomic::Ordering::SeqCst);
+    /// Returns whether a chain of `len` requests can be sent now.
+    ///
+    /// A chain takes one ring descriptor while there are free indirect tables,
+    /// and one descriptor per request otherwise.
+    pub fn can_send(&self, len: usize) -> bool {
+        let descs = match &self.indirect {
+            Some(tables) if !tables.free.is_empty() => 1,
+            _ => len,
+        };
+        self.available_desc() >= descs
+    }
 
-        self.used_desc += total_requests as u16;
-        Some(start_head)
+    /// Returns the maximum number of requests in one chain.
+    pub fn max_chain_len(&self) -> usize {
+        if self.indirect.is_some() {
+            INDIRECT_TABLE_LEN
+        } else {
+            self.queue_size as usize
+        }
+    }
+
+    /// Returns the descriptor at the head of the next chain sent.
+    pub fn next_head(&self) -> u16 {
+        self.head
+    }
+
+    /// Returns the number of descriptors.
+    pub fn queue_size(&self) -> usize {
+        self.queue_size as usize
     }
 
     /// Notify the device that there are new available requests.
     pub fn notify_device(&self) {
-        self.notify.write_once::<u32>(0, &self.queue_index).unwrap();
+        if let Some(notify) = &self.notify {
+            notify.write_once::<u32>(0, &self.queue_index).unwrap();
+        }
     }
 
-    pub fn should_notify(&self) -> bool {
-        self.used_ring.should_notify()
+    /// Returns whether the device has to be notified of the requests sent
+    /// since the last call.
+    ///
+    /// With `EVENT_IDX`, the device asks to be notified only once the available
+    /// index passes the one it names, so a device busy with the ring is not
+    /// notified again.
+    pub fn should_notify(&mut self) -> bool {
+        // Read the device's suppression state only after the new index is visible.
+        fence(core::sync::atomic::Ordering::SeqCst);
+        let old = core::mem::replace(&mut self.notified_avail, self.next_avail);
+        if self.event_idx {
+            let avail_event = self.used_ring.avail_event();
+            need_event(avail_event, self.next_avail, old)
+        } else {
+            self.used_ring.should_notify()
+        }
     }
 
     /// Gets one finished request.
@@ -182,7 +322,16 @@ impl Virtqueue {
     /// Return (start_head, bytes_written)
     pub fn pop_finish_request(&mut self) -> Option<(u16, u32)> {
         if !self.can_pop() {
-            return None;
+            if !self.event_idx {
+                return None;
+            }
+            // Ask for an interrupt on the next completion only, then check
+            // again for one that came before the request was visible.
+            self.available_ring.set_used_event(self.last_used_idx);
+            fence(core::sync::atomic::Ordering::SeqCst);
+            if !self.can_pop() {
+                return None;
+            }
         }
 
         let last_used_ring_idx = self.last_used_idx & (self.queue_size - 1);
@@ -194,6 +343,11 @@ impl Virtqueue {
         Some((used_elem.id as u16, used_elem.len))
     }
 
+    /// Returns the number of descriptors that are not used by in-flight requests.
+    pub fn available_desc(&self) -> usize {
+        (self.queue_size - self.used_desc) as usize
+    }
+
     /// Checks if there is finished request.
     pub fn can_pop(&self) -> bool {
         let used_idx: u16 = self.used_ring.idx();
@@ -207,10 +361,16 @@ impl Virtqueue {
 
         loop {
             let desc = &self.descriptors[start_head as usize];
+            let flags = desc.flags();
+            if flags.contains(DescFlags::INDIRECT) {
+                let tables = self.indirect.as_mut().unwrap();
+                let table_size = INDIRECT_TABLE_LEN * size_of::<Descriptor>();
+                let table = (desc.addr() as usize - tables.dma.daddr()) / table_size;
+                tables.free.push(table as u16);
+            }
             desc.set_desc(0, 0);
             self.used_desc -= 1;
 
-            let flags = desc.flags();
             if flags.contains(DescFlags::NEXT) {
                 // Not the end yet
                 desc.set_flags(DescFlags::empty());
@@ -218,7 +378,7 @@ impl Virtqueue {
             } else {
                 // Reached the end, link the last descriptor to current_free_head
                 desc.set_flags(DescFlags::empty());
-                self.descriptors[current_free_head as usize].set_next(start_head);
+                desc.set_next(current_free_head);
                 break;
             }
         }
@@ -233,6 +393,38 @@ pub trait VirtqueueRequest {
     fn device_writable(&self) -> bool;
 }
 
+/// A buffer in a descriptor chain, as passed to [`Virtqueue::send_request`].
+#[derive(Debug, Clone, Copy)]
+pub struct VirtqueueBuffer {
+    daddr: usize,
+    len: usize,
+    device_writable: bool,
+}
+
+impl VirtqueueBuffer {
+    pub fn of(request: &impl VirtqueueRequest) -> Self {
+        Self {
+            daddr: request.daddr(),
+            len: request.len(),
+            device_writable: request.device_writable(),
+        }
+    }
+}
+
+impl VirtqueueRequest for VirtqueueBuffer {
+    fn daddr(&self) -> usize {
+        self.daddr
+    }
+
+    fn len(&self) -> usize {
+        self.len
+    }
+
+    fn device_writable(&self) -> bool {
+        self.device_writable
+    }
+}
+
 pub struct VirtqueueCoherentRequest<'a> {
     bind_dma: &'a Arc<DmaCoherent>,
     offset: usize,
@@ -251,7 +443,7 @@ impl<'a> VirtqueueCoherentRequest<'a> {
         len: usize,
         device_writable: bool,
     ) -> Self {
-        assert!(offset + len < bind_dma.size());
+        assert!(offset + len <= bind_dma.size());
 
         Self {
             bind_dma,
@@ -284,8 +476,8 @@ pub struct VirtqueueStreamRequest<'a> {
 }
 
 impl<'a> VirtqueueStreamRequest<'a> {
-    pub fn from_dma_slice(slice: &'a DmaSlice<DmaStream>, device_writable: bool) -> Self {
-        Self::new(slice.dma(), slice.offset(), slice.size(), device_writable)
+    pub fn from_dma_buf(buf: &'a DmaBuf, device_writable: bool) -> Self {
+        Self::new(buf.dma(), buf.offset(), buf.size(), device_writable)
     }
 
     pub fn new(
@@ -294,7 +486,7 @@ impl<'a> VirtqueueStreamRequest<'a> {
         len: usize,
         device_writable: bool,
     ) -> Self {
-        assert!(offset + len < bind_dma.size());
+        assert!(offset + len <= bind_dma.size());
 
         Self {
             bind_dma,
@@ -319,21 +511,77 @@ impl VirtqueueRequest for VirtqueueStreamRequest<'_> {
     }
 }
 
-const QUEUE_SIZE: usize = 64;
+/// The maximum number of descriptors in a queue.
+pub const MAX_QUEUE_SIZE: usize = 1024;
+/// The number of entries in each indirect table.
+const INDIRECT_TABLE_LEN: usize = 128;
+/// The number of indirect tables of a queue, and so the number of requests
+/// that can be in flight with one ring descriptor each. Further requests use
+/// a chain of ring descriptors.
+const NUM_INDIRECT_TABLES: usize = 128;
+
+/// The device accepts descriptors pointing to tables of further descriptors.
+pub const VIRTIO_RING_F_INDIRECT_DESC: u64 = 1 << 28;
+/// The driver and the device name the ring index at which they want to be
+/// notified, instead of turning notifications on and off.
+pub const VIRTIO_RING_F_EVENT_IDX: u64 = 1 << 29;
+
+/// Returns whether moving an index from `old` to `new` passes `event`, as in
+/// the `vring_need_event` of the virtio spec.
+fn need_event(event: u16, new: u16, old: u16) -> bool {
+    new.wrapping_sub(event).wrapping_sub(1) < new.wrapping_sub(old)
+}
 
-/// Allocates a contiguous memory region for a legacy virtqueue with the given size in number of descriptors.
+/// The offsets of the parts of a split virtqueue in one contiguous region.
 ///
 /// For legacy device, the structure is organized as follows:
 /// [Descriptor Table] [Available Ring] [padding to 4096] [Used Ring]
-fn legacy_queue_size_to_frames(queue_size: usize) -> Segment<()> {
-    let descriptor_table_size = core::mem::size_of::<Descriptor>() * queue_size;
-    let avail_ring_size = core::mem::size_of::<AvailRing>();
-    let used_ring_size = core::mem::size_of::<UsedRing>();
-
-    let total_size = (descriptor_table_size + avail_ring_size).align_up(4096) + used_ring_size;
-    FrameAllocOptions::new()
-        .alloc_segment(total_size.align_up(PAGE_SIZE) / PAGE_SIZE)
-        .unwrap()
+///
+/// A modern device takes the address of each part, so the same layout works
+/// for both.
+struct QueueLayout {
+    desc: usize,
+    avail: usize,
+    used: usize,
+    size: usize,
+}
+
+impl QueueLayout {
+    fn new(queue_size: usize) -> Self {
+        let desc = 0;
+        let avail = desc + size_of::<Descriptor>() * queue_size;
+        // flags, idx, ring and used_event
+        let avail_size = size_of::<u16>() * (3 + queue_size);
+        let used = (avail + avail_size).align_up(PAGE_SIZE);
+        // flags, idx, ring and avail_event
+        let used_size = size_of::<u16>() * 3 + size_of::<UsedElem>() * queue_size;
+        Self {
+            desc,
+            avail,
+            used,
+            size: used + used_size,
+        }
+    }
+}
+
+/// The indirect tables of a queue.
+struct IndirectTables {
+    dma: Arc<DmaCoherent>,
+    /// The indices of the tables not used by in-flight requests.
+    free: Vec<u16>,
+}
+
+impl IndirectTables {
+    fn new() -> Self {
+        let size = NUM_INDIRECT_TABLES * INDIRECT_TABLE_LEN * size_of::<Descriptor>();
+        let frames = FrameAllocOptions::new()
+            .alloc_segment(size.div_ceil(PAGE_SIZE))
+            .unwrap();
+        Self {
+            dma: Arc::new(DmaCoherent::map(frames.into(), false).unwrap()),
+            free: (0..NUM_INDIRECT_TABLES as u16).rev().collect(),
+        }
+    }
 }
 
 #[repr(C, align(16))]
@@ -358,24 +606,6 @@ bitflags::bitflags! {
 
 impl PodOnce for DescFlags {}
 
-#[repr(C, align(2))]
-#[derive(Debug, Copy, Clone, Pod)]
-pub struct AvailRing {
-    flags: u16,
-    idx: u16,
-    ring: [u16; QUEUE_SIZE],
-    used_event: u16,
-}
-
-#[repr(C, align(4))]
-#[derive(Debug, Copy, Clone, Pod)]
-pub struct UsedRing {
-    flags: u16,
-    idx: u16,
-    ring: [UsedElem; QUEUE_SIZE],
-    avail_event: u16,
-}
-
 #[repr(C)]
 #[derive(Debug, Default, Copy, Clone, Pod)]
 pub struct UsedElem {
@@ -385,22 +615,32 @@ pub struct UsedElem {
 
 impl PodOnce for UsedElem {}
 
+/// The available ring: `flags: u16, idx: u16, ring: [u16; queue_size]`, and
+/// `used_event: u16`.
 struct AvailRingPtr {
     dma: Arc<DmaCoherent>,
     offset: usize,
+    queue_size: usize,
 }
 
 impl AvailRingPtr {
+    const IDX: usize = 2;
+    const RING: usize = 4;
+
     fn set_ring(&self, slot: u16, descriptor_head: u16) {
         self.write_once(
-            offset_of!(AvailRing, ring) + slot as usize * size_of::<u16>(),
+            Self::RING + slot as usize * size_of::<u16>(),
             &descriptor_head,
         )
         .unwrap();
     }
 
     fn set_next_avail(&self, next_slot: u16) {
-        self.write_once(offset_of!(AvailRing, idx), &next_slot)
+        self.write_once(Self::IDX, &next_slot).unwrap();
+    }
+
+    fn set_used_event(&self, used_idx: u16) {
+        self.write_once(Self::RING + self.queue_size * size_of::<u16>(), &used_idx)
             .unwrap();
     }
 }
@@ -434,6 +674,12 @@ impl DescriptorPtr {
             .unwrap();
     }
 
+    fn addr(&self) -> u64 {
+        self.dma
+            .read_once(self.offset + offset_of!(Descriptor, addr))
+            .unwrap()
+    }
+
     fn set_next(&self, next: u16) {
         self.dma
             .write_once(self.offset + offset_of!(Descriptor, next), &next)
@@ -459,27 +705,130 @@ impl DescriptorPtr {
     }
 }
 
+/// The used ring: `flags: u16, idx: u16, ring: [UsedElem; queue_size]`, and
+/// `avail_event: u16`.
 struct UsedRingPtr {
     dma: Arc<DmaCoherent>,
+    offset: usize,
+    queue_size: usize,
 }
 
 impl UsedRingPtr {
-    fn new(dma: Arc<DmaCoherent>) -> Self {
-        Self { dma }
+    const FLAGS: usize = 0;
+    const IDX: usize = 2;
+    const RING: usize = 4;
+
+    fn new(dma: Arc<DmaCoherent>, offset: usize, queue_size: usize) -> Self {
+        Self {
+            dma,
+            offset,
+            queue_size,
+        }
     }
 
     fn idx(&self) -> u16 {
-        self.dma.read_once(offset_of!(UsedRing, idx)).unwrap()
+        self.dma.read_once(self.offset + Self::IDX).unwrap()
     }
 
     fn should_notify(&self) -> bool {
-        let flags: u16 = self.dma.read_once(offset_of!(UsedRing, flags)).unwrap();
+        let flags: u16 = self.dma.read_once(self.offset + Self::FLAGS).unwrap();
         flags & 1 == 0
     }
 
+    fn avail_event(&self) -> u16 {
+        self.dma
+            .read_once(self.offset + Self::RING + self.queue_size * size_of::<UsedElem>())
+            .unwrap()
+    }
+
     fn get_used_elem(&self, index: u16) -> UsedElem {
         self.dma
-            .read_once(offset_of!(UsedRing, ring) + index as usize * size_of::<UsedElem>())
+            .read_once(self.offset + Self::RING + index as usize * size_of::<UsedElem>())
             .unwrap()
     }
 }
+
+#[cfg(ktest)]
+mod test {
+    use ostd::prelude::ktest;
+
+    use super::*;
+
+    /// Sends a chain of `len` descriptors, returning their indices.
+    fn send(queue: &mut Virtqueue, len: usize) -> Vec<u16> {
+        let buffers = (0..len).map(|i| VirtqueueBuffer {
+            daddr: 0x1000 * (i + 1),
+            len: 512,
+            device_writable: false,
+        });
+        let head = queue.send_request(buffers).unwrap();
+        let mut chain = alloc::vec![head];
+        while chain.len() < len {
+            let desc = &queue.descriptors[*chain.last().unwrap() as usize];
+            assert!(desc.flags().contains(DescFlags::NEXT));
+            chain.push(desc.next());
+        }
+        chain
+    }
+
+    /// Plays the device, putting the chain at `head` in the used ring.
+    fn complete(queue: &Virtqueue, used_idx: &mut u16, head: u16) {
+        let ring = &queue.used_ring;
+        let slot = (*used_idx & (queue.queue_size - 1)) as usize;
+        let elem = UsedElem {
+            id: head as u32,
+            len: 0,
+        };
+        ring.dma
+            .write_once(
+                ring.offset + UsedRingPtr::RING + slot * size_of::<UsedElem>(),
+                &elem,
+            )
+            .unwrap();
+        *used_idx = used_idx.wrapping_add(1);
+        ring.dma
+            .write_once(ring.offset + UsedRingPtr::IDX, used_idx)
+            .unwrap();
+    }
+
+    fn disjoint(a: &[u16], b: &[u16]) -> bool {
+        a.iter().all(|desc| !b.contains(desc))
+    }
+
+    #[ktest]
+    fn out_of_order_completion() {
+        let mut queue = Virtqueue::with_size(0, 8, 0, None);
+        let mut used_idx = 0;
+
+        let a = send(&mut queue, 3);
+        let b = send(&mut queue, 2);
+        let c = send(&mut queue, 2);
+        assert_eq!(queue.available_desc(), 1);
+
+        // B finishes first, while A and C are still in flight.
+        complete(&queue, &mut used_idx, b[0]);
+        assert_eq!(queue.pop_finish_request(), Some((b[0], 0)));
+        assert_eq!(queue.available_desc(), 3);
+
+        let d = send(&mut queue, 3);
+        assert!(disjoint(&d, &a) && disjoint(&d, &c));
+        complete(&queue, &mut used_idx, c[0]);
+        assert_eq!(queue.pop_finish_request(), Some((c[0], 0)));
+
+        let e = send(&mut queue, 2);
+        assert!(disjoint(&e, &a) && disjoint(&e, &d));
+
+        for head in [a[0], e[0], d[0]] {
+            complete(&queue, &mut used_idx, head);
+            assert_eq!(queue.pop_finish_request(), Some((head, 0)));
+        }
+        assert_eq!(queue.available_desc(), 8);
+        assert_eq!(queue.pop_finish_request(), None);
+
+        // The whole ring is free again as one list.
+        let all = send(&mut queue, 8);
+        let mut sorted = all.clone();
+        sorted.sort_unstable();
+        assert_eq!(sorted, (0..8).collect::<Vec<_>>());
+    }
+}
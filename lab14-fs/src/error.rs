@@ -57,6 +57,8 @@ pub enum Errno {
     EUNATCH = 49,      // Protocol driver not attached
     ENOCSI = 50,       // No CSI structure available
     EL2HLT = 51,       // Level 2 halted
+    EOPNOTSUPP = 95,   // Operation not supported on transport endpoint
+    ETIMEDOUT = 110,   // Connection timed out
 }
 
 #[derive(Debug)]
@@ -0,0 +1,252 @@
+//! The epoll instances of `epoll_create1`.
+//!
+//! An instance keeps the interests added with `epoll_ctl`, by fd. Each wait
+//! polls the files of the interests, registering with those not ready, see
+//! [`super::poll`]. Interests only hold their files weakly, so that closing
+//! the last fd of a file drops it from the instances watching it, much as on
+//! Linux.
+//!
+//! All interests are level-triggered: `EPOLLET` is accepted, and reports a
+//! ready file on every wait, as a level-triggered interest would. Programs
+//! that drain the file until `EAGAIN`, as edge-triggered ones must, see the
+//! same events.
+//!
+//! An instance may watch another, but not one that watches it back, directly
+//! or through others, and nesting is at most [`MAX_NESTING`] deep, as on Linux.
+//! Files are polled with no lock held, so a file may poll back into its
+//! instance.
+
+use alloc::{
+    collections::btree_map::BTreeMap,
+    sync::{Arc, Weak},
+    vec::Vec,
+};
+use core::time::Duration;
+use ostd::{
+    Pod,
+    mm::{VmReader, VmWriter},
+    sync::Mutex,
+};
+
+use crate::{
+    error::{Errno, Error, Result},
+    fs::{
+        FileLike,
+        file_table::FileDescriptor,
+        poll::{IoEvents, Poller, wait_for},
+    },
+};
+
+/// Reports the file once, until the interest is modified again.
+const EPOLLONESHOT: u32 = 1 << 30;
+/// The flags of `struct epoll_event` that are not events.
+const EPOLL_FLAGS: u32 = 0xf << 28;
+/// The most instances deep that one may watch through others.
+const MAX_NESTING: usize = 4;
+
+/// The `struct epoll_event` of Linux, which is not packed on RISC-V.
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy, Pod)]
+pub struct EpollEvent {
+    pub events: u32,
+    _padding: u32,
+    pub data: u64,
+}
+
+impl EpollEvent {
+    fn new(events: IoEvents, data: u64) -> Self {
+        Self {
+            events: events.bits(),
+            _padding: 0,
+            data,
+        }
+    }
+}
+
+struct Interest {
+    file: Weak<dyn FileLike>,
+    events: IoEvents,
+    one_shot: bool,
+    data: u64,
+    /// Cleared once a one-shot interest has been reported.
+    enabled: bool,
+}
+
+pub struct EpollFile {
+    interests: Mutex<BTreeMap<FileDescriptor, Interest>>,
+}
+
+impl EpollFile {
+    pub fn new() -> Self {
+        Self {
+            interests: Mutex::new(BTreeMap::new()),
+        }
+    }
+
+    /// Watches `file`, open at `fd`, for the events of `event`.
+    pub fn add(
+        &self,
+        fd: FileDescriptor,
+        file: &Arc<dyn FileLike>,
+        event: EpollEvent,
+    ) -> Result<()> {
+        self.check_nesting(file)?;
+        let mut interests = self.interests.lock();
+        if interests.contains_key(&fd) {
+            return Err(Error::new(Errno::EEXIST));
+        }
+        interests.insert(fd, Interest::new(file, event));
+        Ok(())
+    }
+
+    /// Changes the events watched for at `fd`, re-enabling a one-shot interest.
+    pub fn modify(
+        &self,
+        fd: FileDescriptor,
+        file: &Arc<dyn FileLike>,
+        event: EpollEvent,
+    ) -> Result<()> {
+        self.check_nesting(file)?;
+        let mut interests = self.interests.lock();
+        let interest = interests.get_mut(&fd).ok_or(Error::new(Errno::ENOENT))?;
+        *interest = Interest::new(file, event);
+        Ok(())
+    }
+
+    /// Fails with `ELOOP` if watching `file` would make an instance watch
+    /// itself, or nest instances too deep.
+    fn check_nesting(&self, file: &Arc<dyn FileLike>) -> Result<()> {
+        let Some(epoll) = file.as_epoll() else {
+            return Ok(());
+        };
+        if core::ptr::eq(epoll, self) || epoll.watches(self, MAX_NESTING) {
+            return Err(Error::new(Errno::ELOOP));
+        }
+        Ok(())
+    }
+
+    /// Returns whether this instance watches `target` through up to `depth`
+    /// instances, counting deeper nesting as watching it.
+    fn watches(&self, target: &EpollFile, depth: usize) -> bool {
+        let nested: Vec<Arc<dyn FileLike>> = self
+            .interests
+            .lock()
+            .values()
+            .filter_map(|interest| interest.file.upgrade())
+            .filter(|file| file.as_epoll().is_some())
+            .collect();
+        nested.iter().any(|file| {
+            let epoll = file.as_epoll().unwrap();
+            depth == 0 || core::ptr::eq(epoll, target) || epoll.watches(target, depth - 1)
+        })
+    }
+
+    /// Returns the files of the enabled interests, with their fds, events and
+    /// data, for polling with the lock released.
+    fn enabled_interests(&self) -> Vec<(FileDescriptor, Arc<dyn FileLike>, IoEvents, u64)> {
+        let mut interests = self.interests.lock();
+        // The files of closed fds are gone.
+        interests.retain(|_, interest| interest.file.strong_count() > 0);
+        interests
+            .iter()
+            .filter(|(_, interest)| interest.enabled)
+            .filter_map(|(&fd, interest)| {
+                let file = interest.file.upgrade()?;
+                Some((fd, file, interest.events, interest.data))
+            })
+            .collect()
+    }
+
+    pub fn remove(&self, fd: FileDescriptor) -> Result<()> {
+        self.interests
+            .lock()
+            .remove(&fd)
+            .map(|_| ())
+            .ok_or(Error::new(Errno::ENOENT))
+    }
+
+    /// Waits until a watched file is ready or the monotonic time reaches
+    /// `deadline`, and returns the events of up to `max_events` ready files.
+    pub fn wait(&self, max_events: usize, deadline: Option<Duration>) -> Vec<EpollEvent> {
+        wait_for(deadline, |poller| {
+            let ready = self.poll_interests(max_events, Some(poller));
+            (!ready.is_empty()).then_some(ready)
+        })
+        .unwrap_or_default()
+    }
+
+    /// Returns the events of up to `max_events` ready files, disabling the
+    /// one-shot interests reported.
+    fn poll_interests(&self, max_events: usize, poller: Option<&Arc<Poller>>) -> Vec<EpollEvent> {
+        let mut ready = Vec::new();
+        let mut reported = Vec::new();
+        for (fd, file, events, data) in self.enabled_interests() {
+            if ready.len() == max_events {
+                break;
+            }
+            let events = file.poll(events, poller);
+            if events.is_empty() {
+                continue;
+            }
+            ready.push(EpollEvent::new(events, data));
+            reported.push((fd, file));
+        }
+
+        let mut interests = self.interests.lock();
+        for (fd, file) in reported {
+            // Unless the fd was changed while its file was polled.
+            if let Some(interest) = interests.get_mut(&fd)
+                && interest.one_shot
+                && core::ptr::addr_eq(interest.file.as_ptr(), Arc::as_ptr(&file))
+            {
+                interest.enabled = false;
+            }
+        }
+        ready
+    }
+}
+
+impl Interest {
+    fn new(file: &Arc<dyn FileLike>, event: EpollEvent) -> Self {
+        Self {
+            file: Arc::downgrade(file),
+            events: IoEvents::from_bits_truncate(event.events & !EPOLL_FLAGS),
+            one_shot: event.events & EPOLLONESHOT != 0,
+            data: event.data,
+            enabled: true,
+        }
+    }
+}
+
+impl Default for EpollFile {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl FileLike for EpollFile {
+    fn read(&self, _writer: VmWriter) -> Result<usize> {
+        Err(Error::new(Errno::EINVAL))
+    }
+
+    fn write(&self, _reader: VmReader) -> Result<usize> {
+        Err(Error::new(Errno::EINVAL))
+    }
+
+    /// Readable when a watched file is ready, so that instances can be
+    /// nested.
+    fn poll(&self, mask: IoEvents, poller: Option<&Arc<Poller>>) -> IoEvents {
+        let mut events = IoEvents::empty();
+        for (_, file, interest_events, _) in self.enabled_interests() {
+            if !file.poll(interest_events, poller).is_empty() {
+                events = IoEvents::IN | IoEvents::RDNORM;
+                break;
+            }
+        }
+        events & mask
+    }
+
+    fn as_epoll(&self) -> Option<&EpollFile> {
+        Some(self)
+    }
+}
@@ -1,32 +1,196 @@
-use ostd::Pod;
+use alloc::{boxed::Box, vec};
+use ostd::{Pod, sync::Mutex};
 
-use crate::fs::ext2::Ext2Bid;
+use crate::fs::{ext2::Ext2Bid, util::block_cache::BlockCache};
 
-#[expect(unused)]
 pub struct BlockGroup {
-    bitmap_start_bid: u32,
-    inode_start_bid: u32,
+    /// Where the descriptor of this group is stored, as `(bid, offset)`.
+    descriptor_location: (usize, usize),
+    /// The number of blocks and of inodes in this group.
+    num_blocks: usize,
+    num_inodes: usize,
     inode_table_start_bid: u32,
-    free_blocks: u32,
-    free_inodes: u32,
-    direntries: u32,
+    state: Mutex<GroupState>,
+}
+
+/// The parts of a group that change as blocks and inodes are allocated.
+struct GroupState {
+    descriptor: RawGroupDescriptor,
+    /// The bitmaps, loaded on the first allocation.
+    block_bitmap: Option<Bitmap>,
+    inode_bitmap: Option<Bitmap>,
 }
 
 impl BlockGroup {
-    pub fn new(raw_descriptor: RawGroupDescriptor) -> Self {
+    pub fn new(
+        raw_descriptor: RawGroupDescriptor,
+        descriptor_location: (usize, usize),
+        num_blocks: usize,
+        num_inodes: usize,
+    ) -> Self {
         Self {
-            bitmap_start_bid: raw_descriptor.block_bitmap,
-            inode_start_bid: raw_descriptor.inode_bitmap,
+            descriptor_location,
+            num_blocks,
+            num_inodes,
             inode_table_start_bid: raw_descriptor.inode_table,
-            free_blocks: raw_descriptor.free_blocks_count as _,
-            free_inodes: raw_descriptor.free_inodes_count as _,
-            direntries: raw_descriptor.dirs_count as _,
+            state: Mutex::new(GroupState {
+                descriptor: raw_descriptor,
+                block_bitmap: None,
+                inode_bitmap: None,
+            }),
         }
     }
 
     pub fn inode_table_start_bid(&self) -> Ext2Bid {
         self.inode_table_start_bid.into()
     }
+
+    pub fn free_blocks(&self) -> usize {
+        self.state.lock().descriptor.free_blocks_count as usize
+    }
+
+    pub fn free_inodes(&self) -> usize {
+        self.state.lock().descriptor.free_inodes_count as usize
+    }
+
+    /// Allocates up to `max` free blocks in a row, starting at the `goal`-th
+    /// block of this group if it is free and otherwise at the next free one.
+    ///
+    /// Returns the index in this group of the first block and the number of
+    /// blocks allocated, or `None` if the group is full.
+    pub fn alloc_blocks(
+        &self,
+        block_cache: &BlockCache,
+        goal: usize,
+        max: usize,
+    ) -> Option<(usize, usize)> {
+        let mut state = self.state.lock();
+        if state.descriptor.free_blocks_count == 0 {
+            return None;
+        }
+        let bitmap_bid = state.descriptor.block_bitmap as usize;
+        let bitmap = state
+            .block_bitmap
+            .get_or_insert_with(|| Bitmap::load(block_cache, bitmap_bid, self.num_blocks));
+
+        let first = bitmap.find_free(goal)?;
+        let mut count = 0;
+        while count < max && first + count < self.num_blocks && !bitmap.is_set(first + count) {
+            bitmap.set(first + count);
+            count += 1;
+        }
+        bitmap.write_back(block_cache, first..first + count);
+
+        state.descriptor.free_blocks_count -= count as u16;
+        self.write_descriptor(block_cache, &state.descriptor);
+        Some((first, count))
+    }
+
+    /// Frees the `count` blocks from the `first`-th block of this group.
+    pub fn release_blocks(&self, block_cache: &BlockCache, first: usize, count: usize) {
+        let mut state = self.state.lock();
+        let bitmap_bid = state.descriptor.block_bitmap as usize;
+        let bitmap = state
+            .block_bitmap
+            .get_or_insert_with(|| Bitmap::load(block_cache, bitmap_bid, self.num_blocks));
+
+        for index in first..first + count {
+            debug_assert!(bitmap.is_set(index));
+            bitmap.clear(index);
+        }
+        bitmap.write_back(block_cache, first..first + count);
+
+        state.descriptor.free_blocks_count += count as u16;
+        self.write_descriptor(block_cache, &state.descriptor);
+    }
+
+    /// Allocates a free inode, returning its index in this group.
+    pub fn alloc_inode(&self, block_cache: &BlockCache, is_dir: bool) -> Option<usize> {
+        let mut state = self.state.lock();
+        if state.descriptor.free_inodes_count == 0 {
+            return None;
+        }
+        let bitmap_bid = state.descriptor.inode_bitmap as usize;
+        let bitmap = state
+            .inode_bitmap
+            .get_or_insert_with(|| Bitmap::load(block_cache, bitmap_bid, self.num_inodes));
+
+        let index = bitmap.find_free(0)?;
+        bitmap.set(index);
+        bitmap.write_back(block_cache, index..index + 1);
+
+        state.descriptor.free_inodes_count -= 1;
+        if is_dir {
+            state.descriptor.dirs_count += 1;
+        }
+        self.write_descriptor(block_cache, &state.descriptor);
+        Some(index)
+    }
+
+    fn write_descriptor(&self, block_cache: &BlockCache, descriptor: &RawGroupDescriptor) {
+        let (bid, offset) = self.descriptor_location;
+        block_cache.write_val(bid, offset, descriptor);
+    }
+}
+
+/// A cached block or inode bitmap. A set bit marks an item in use.
+struct Bitmap {
+    bid: usize,
+    bits: Box<[u8]>,
+    /// The number of items, which may be fewer than the bits in the block.
+    len: usize,
+}
+
+impl Bitmap {
+    fn load(block_cache: &BlockCache, bid: usize, len: usize) -> Self {
+        let mut bits = vec![0u8; len.div_ceil(8)].into_boxed_slice();
+        block_cache.read_bytes(bid, 0, &mut bits);
+        Self { bid, bits, len }
+    }
+
+    fn is_set(&self, index: usize) -> bool {
+        self.bits[index / 8] & (1 << (index % 8)) != 0
+    }
+
+    fn set(&mut self, index: usize) {
+        self.bits[index / 8] |= 1 << (index % 8);
+    }
+
+    fn clear(&mut self, index: usize) {
+        self.bits[index / 8] &= !(1 << (index % 8));
+    }
+
+    /// Returns the first clear bit at or after `from`, wrapping around.
+    fn find_free(&self, from: usize) -> Option<usize> {
+        let from = if from < self.len { from } else { 0 };
+        self.find_free_in(from..self.len)
+            .or_else(|| self.find_free_in(0..from))
+    }
+
+    fn find_free_in(&self, range: core::ops::Range<usize>) -> Option<usize> {
+        let mut index = range.start;
+        while index < range.end {
+            // Skip whole bytes in use.
+            if index % 8 == 0 && self.bits[index / 8] == 0xFF {
+                index += 8;
+                continue;
+            }
+            if !self.is_set(index) {
+                return Some(index);
+            }
+            index += 1;
+        }
+        None
+    }
+
+    /// Writes the bytes holding the bits in `range` through to the cache.
+    fn write_back(&self, block_cache: &BlockCache, range: core::ops::Range<usize>) {
+        if range.is_empty() {
+            return;
+        }
+        let bytes = range.start / 8..(range.end - 1) / 8 + 1;
+        block_cache.write_bytes(self.bid, bytes.start, &self.bits[bytes]);
+    }
 }
 
 #[repr(C)]
@@ -41,16 +205,3 @@ pub(super) struct RawGroupDescriptor {
     pad: u16,
     reserved: [u32; 3],
 }
-
-impl From<RawGroupDescriptor> for BlockGroup {
-    fn from(value: RawGroupDescriptor) -> Self {
-        Self {
-            bitmap_start_bid: value.block_bitmap,
-            inode_start_bid: value.inode_bitmap,
-            inode_table_start_bid: value.inode_table,
-            free_blocks: value.free_blocks_count as _,
-            free_inodes: value.free_inodes_count as _,
-            direntries: value.dirs_count as _,
-        }
-    }
-}
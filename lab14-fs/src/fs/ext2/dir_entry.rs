@@ -1,9 +1,11 @@
-use core::ffi::CStr;
-
 use alloc::string::{String, ToString};
 use ostd::Pod;
 
-const MAX_NAME_LEN: usize = 256;
+use crate::fs::InodeType;
+
+pub const MAX_NAME_LEN: usize = 255;
+/// The length of an entry before its name.
+const HEADER_LEN: usize = 8;
 
 #[repr(C)]
 #[derive(Debug, Clone, Copy, Pod)]
@@ -12,10 +14,39 @@ pub struct Ext2DirEntry {
     record_len: u16,
     name_len: u8,
     type_: u8,
-    name: [u8; MAX_NAME_LEN],
+    name: [u8; MAX_NAME_LEN + 1],
 }
 
 impl Ext2DirEntry {
+    /// Creates an entry for `name`, whose record holds just the entry.
+    pub fn new(ino: u32, name: &[u8], type_: u8) -> Self {
+        assert!(name.len() <= MAX_NAME_LEN);
+        let mut entry = Self {
+            ino,
+            record_len: Self::record_len_for(name.len()) as u16,
+            name_len: name.len() as u8,
+            type_,
+            ..Default::default()
+        };
+        entry.name[..name.len()].copy_from_slice(name);
+        entry
+    }
+
+    /// Returns the shortest record that holds an entry with a name of
+    /// `name_len` bytes. Records are 4-byte aligned.
+    pub fn record_len_for(name_len: usize) -> usize {
+        (HEADER_LEN + name_len).next_multiple_of(4)
+    }
+
+    /// Returns the bytes of the entry as stored on the disk.
+    pub fn record_bytes(&self) -> &[u8] {
+        &self.as_bytes()[..HEADER_LEN + self.name_len as usize]
+    }
+
+    pub fn set_length(&mut self, record_len: u16) {
+        self.record_len = record_len;
+    }
+
     pub fn inode(&self) -> u32 {
         self.ino
     }
@@ -28,11 +59,24 @@ impl Ext2DirEntry {
         self.name_len
     }
 
+    /// Returns the type of the file, or `None` if the file system does not
+    /// record types in its entries.
+    pub fn inode_type(&self) -> Option<InodeType> {
+        match self.type_ {
+            1 => Some(InodeType::File),
+            2 => Some(InodeType::Directory),
+            7 => Some(InodeType::SymbolLink),
+            _ => None,
+        }
+    }
+
     pub fn name(&self) -> String {
-        CStr::from_bytes_until_nul(&self.name)
-            .unwrap()
-            .to_string_lossy()
-            .to_string()
+        String::from_utf8_lossy(self.name_bytes()).to_string()
+    }
+
+    /// Returns the name, which is not NUL-terminated on disk.
+    pub fn name_bytes(&self) -> &[u8] {
+        &self.name[..self.name_len as usize]
     }
 }
 
@@ -42,7 +86,7 @@ impl Default for Ext2DirEntry {
             ino: Default::default(),
             record_len: Default::default(),
             name_len: Default::default(),
-            name: [0; MAX_NAME_LEN],
+            name: [0; MAX_NAME_LEN + 1],
             type_: 0,
         }
     }
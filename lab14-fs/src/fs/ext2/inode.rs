@@ -1,27 +1,50 @@
-#![expect(unused_variables)]
-
 use alloc::{
+    collections::btree_map::BTreeMap,
+    string::String,
     sync::{Arc, Weak},
+    vec,
     vec::Vec,
 };
 use log::debug;
-use ostd::Pod;
+use ostd::{
+    Pod,
+    mm::{
+        DmaDirection, DmaStream, FallibleVmRead, FallibleVmWrite, Frame, FrameAllocOptions,
+        PAGE_SIZE, Segment, VmIo, VmWriter, io_util::HasVmReaderWriter,
+    },
+    sync::{Mutex, RwMutex, SpinLock},
+};
+use spin::Once;
 
 use crate::{
-    drivers::blk::SECTOR_SIZE,
+    drivers::blk::{SECTOR_SIZE, dma_sectors},
+    error::{Errno, Error, Result},
     fs::{
-        InodeType,
-        ext2::{Ext2Bid, Ext2Fs, dir_entry::Ext2DirEntry},
-        util::sector_ptr::SectorPtr,
+        DirEntry, InodeStat, InodeType,
+        ext2::{
+            Ext2Bid, Ext2Fs,
+            dir_entry::{Ext2DirEntry, MAX_NAME_LEN},
+        },
+        util::{block_ptr::BlockPtr, dir_index::DirIndex, page_cache::PageCache},
     },
+    mm::{frame_pool, reclaim},
 };
 
-use core::time::Duration;
 use crate::fs::InodeMeta;
+use core::{ops::Range, time::Duration};
 
-#[expect(unused)]
 pub struct Inode {
-    sector_ptr: SectorPtr<RawInode>,
+    inode_ptr: BlockPtr<RawInode>,
+    /// The in-memory copy of the on-disk inode.
+    ///
+    /// Changes are written through to `inode_ptr` by [`Inode::update_raw_inode`].
+    raw_inode: RwMutex<RawInode>,
+    /// The logical-to-physical block mappings resolved so far.
+    block_map: SpinLock<BTreeMap<usize, Ext2Bid>>,
+    /// The file data, shared by `read_at` and file mappings.
+    page_cache: PageCache,
+    /// Serializes the changes that allocate blocks or grow the inode.
+    write_lock: Mutex<()>,
 
     inode_id: u32,
     type_: InodeType,
@@ -33,17 +56,25 @@ pub struct Inode {
 
 enum Inner {
     File,
-    Directory(Vec<Ext2DirEntry>),
+    Directory(RwMutex<Directory>),
+}
+
+struct Directory {
+    /// The entries in use, parsed on the first lookup or change, so that
+    /// opening or listing a directory does not read all of it up front.
+    entries: Once<Vec<Ext2DirEntry>>,
+    /// The name index over `entries`, built on the first lookup after a change.
+    index: Once<DirIndex>,
 }
 
 impl Inode {
     pub fn new(
-        sector_ptr: SectorPtr<RawInode>,
+        inode_ptr: BlockPtr<RawInode>,
         inode_id: u32,
         block_group_idx: usize,
         fs: Weak<Ext2Fs>,
     ) -> Arc<Self> {
-        let raw_inode: RawInode = sector_ptr.read();
+        let raw_inode: RawInode = inode_ptr.read();
 
         let type_ = match raw_inode.mode & 0xF000 {
             0x4000 => InodeType::Directory,
@@ -56,17 +87,14 @@ impl Inode {
         debug!("Raw inode data: {:#x?}", raw_inode);
 
         let inner = match type_ {
-            InodeType::Directory => {
-                Inner::Directory(read_directory(type_, &raw_inode, fs.clone()).unwrap())
-            }
+            InodeType::Directory => Inner::Directory(RwMutex::new(Directory {
+                entries: Once::new(),
+                index: Once::new(),
+            })),
             InodeType::File | InodeType::SymbolLink => Inner::File,
         };
 
-        let size = if type_ == InodeType::File {
-            ((raw_inode.size_high as usize) << 32) | (raw_inode.size_low as usize)
-        } else {
-            raw_inode.size_low as usize
-        };
+        let size = raw_inode.size(type_);
 
         let meta = InodeMeta {
             size,
@@ -81,44 +109,483 @@ impl Inode {
             block_group_idx,
             inner,
             fs,
-            sector_ptr,
+            inode_ptr,
+            raw_inode: RwMutex::new(raw_inode),
+            block_map: SpinLock::new(BTreeMap::new()),
+            page_cache: PageCache::new(),
+            write_lock: Mutex::new(()),
             meta,
         });
         inode
     }
+
+    /// Returns the physical block of the `index`-th block, or `None` for a hole.
+    fn map_block(&self, fs: &Ext2Fs, index: usize) -> Option<Ext2Bid> {
+        if let Some(&bid) = self.block_map.lock().get(&index) {
+            return Some(bid);
+        }
+
+        let block_ptrs = self.raw_inode.read().block_ptrs;
+        let bid = block_ptrs.map(index, fs)?;
+
+        let mut block_map = self.block_map.lock();
+        if block_map.len() >= MAX_CACHED_BLOCK_MAPPINGS {
+            block_map.clear();
+        }
+        block_map.insert(index, bid);
+        Some(bid)
+    }
+
+    /// Reads the file data at `offset` from the block cache, bypassing the
+    /// page cache.
+    fn read_blocks(
+        &self,
+        offset: usize,
+        mut writer: ostd::mm::VmWriter,
+    ) -> crate::error::Result<usize> {
+        let fs = self.fs.upgrade().expect("Filesystem has been dropped");
+        let block_size = fs.block_size as usize;
+        let file_size = self.raw_inode.read().size(self.type_);
+
+        if offset >= file_size {
+            return Ok(0);
+        }
+
+        let mut bytes_read = 0;
+        let mut current_offset = offset;
+        let max_to_read = core::cmp::min(writer.avail(), file_size - offset);
+        if max_to_read == 0 {
+            return Ok(0);
+        }
+
+        // Find start block and offset within block
+        let mut block_index = current_offset / block_size;
+        let mut offset_in_block = current_offset % block_size;
+
+        // Read data block by block
+        while bytes_read < max_to_read {
+            let remaining_in_file = max_to_read - bytes_read;
+            let remaining_in_block = block_size - offset_in_block;
+            let to_read = core::cmp::min(remaining_in_block, remaining_in_file);
+            let Some(block_ptr) = self.map_block(&fs, block_index) else {
+                // A hole reads as zeros, without I/O.
+                writer
+                    .fill_zeros(to_read)
+                    .map_err(|_| Error::new(Errno::EFAULT))?;
+                bytes_read += to_read;
+                current_offset += to_read;
+                offset_in_block = 0;
+                block_index += 1;
+                continue;
+            };
+
+            debug!(
+                "Reading block_index: {}, block_ptr: {:?}, offset_in_block: {}, to_read: {}",
+                block_index, block_ptr, offset_in_block, to_read
+            );
+            fs.block_cache().read_to_vm_writer(
+                block_ptr.0 as usize,
+                offset_in_block,
+                to_read,
+                &mut writer,
+            )?;
+
+            bytes_read += to_read;
+            current_offset += to_read;
+            offset_in_block = 0; // After first block, offset is 0
+            block_index += 1;
+        }
+
+        Ok(bytes_read)
+    }
+
+    /// Loads the uncached pages in `pages` ahead of use.
+    ///
+    /// Runs of pages whose blocks are consecutive on the disk are read by the
+    /// device straight into their page cache frames, one request per run. The
+    /// blocks of the other pages are fetched into the block cache, where
+    /// physically contiguous ones are again read with a single request.
+    fn prefetch_pages(&self, fs: &Ext2Fs, pages: Range<usize>) {
+        let mut bids = Vec::new();
+        let mut run: Option<DirectRun> = None;
+        for page_index in pages {
+            if self.page_cache.contains(page_index) {
+                continue;
+            }
+
+            let Some((first_bid, num_blocks)) = self.page_extent(fs, page_index) else {
+                bids.extend(self.page_bids(fs, page_index));
+                continue;
+            };
+            if let Some(run) = run.as_mut()
+                && run.can_append(fs, page_index, first_bid)
+            {
+                run.num_pages += 1;
+                run.num_blocks += num_blocks;
+                continue;
+            }
+            if let Some(full) = run.replace(DirectRun {
+                first_page: page_index,
+                first_bid,
+                num_pages: 1,
+                num_blocks,
+            }) {
+                self.read_pages_direct(fs, full, &mut bids);
+            }
+        }
+        if let Some(run) = run {
+            self.read_pages_direct(fs, run, &mut bids);
+        }
+
+        fs.block_cache().prefetch(&bids);
+    }
+
+    /// Returns the physical blocks of the `page_index`-th page as the first
+    /// one and their number, if they are consecutive on the disk.
+    ///
+    /// The last page of the file may have fewer blocks than a full page.
+    fn page_extent(&self, fs: &Ext2Fs, page_index: usize) -> Option<(usize, usize)> {
+        let block_size = fs.block_size as usize;
+        if block_size > PAGE_SIZE {
+            return None;
+        }
+        let file_size = self.raw_inode.read().size(self.type_);
+        let first_block = page_index * PAGE_SIZE / block_size;
+        let end_block = core::cmp::min(
+            (page_index + 1) * PAGE_SIZE / block_size,
+            file_size.div_ceil(block_size),
+        );
+        if first_block >= end_block {
+            return None;
+        }
+
+        let first_bid = self.map_block(fs, first_block)?.0 as usize;
+        for (i, index) in (first_block + 1..end_block).enumerate() {
+            if self.map_block(fs, index)?.0 as usize != first_bid + i + 1 {
+                return None;
+            }
+        }
+        Some((first_bid, end_block - first_block))
+    }
+
+    /// Returns the physical blocks of the `page_index`-th page up to the
+    /// first hole.
+    fn page_bids(&self, fs: &Ext2Fs, page_index: usize) -> Vec<usize> {
+        let block_size = fs.block_size as usize;
+        let first_block = page_index * PAGE_SIZE / block_size;
+        (first_block..(page_index + 1) * PAGE_SIZE / block_size)
+            .map_while(|index| self.map_block(fs, index))
+            .map(|bid| bid.0 as usize)
+            .collect()
+    }
+
+    /// Reads the pages of `run` from the device straight into new frames and
+    /// caches them.
+    ///
+    /// If the block cache holds some of the blocks, they may be newer than the
+    /// disk, so the blocks are added to `bids` to be read through the cache
+    /// instead.
+    fn read_pages_direct(&self, fs: &Ext2Fs, run: DirectRun, bids: &mut Vec<usize>) {
+        let block_size = fs.block_size as usize;
+        let seq = self.page_cache.load_seq();
+        let frames: Vec<Frame<()>> = (0..run.num_pages)
+            .map(|_| reclaim::alloc_or_reclaim(1, || FrameAllocOptions::new().alloc_frame()))
+            .collect();
+        let mut streams = Vec::with_capacity(frames.len());
+        for frame in frames.iter() {
+            let Ok(dma) = DmaStream::map(
+                Segment::from(frame.clone()).into(),
+                DmaDirection::FromDevice,
+                false,
+            ) else {
+                bids.extend(run.first_bid..run.first_bid + run.num_blocks);
+                return;
+            };
+            streams.push(Arc::new(dma));
+        }
+
+        let mut sectors: Vec<_> = streams.iter().flat_map(dma_sectors).collect();
+        // Only the blocks within the file are read into the last page.
+        sectors.truncate(run.num_blocks * block_size / SECTOR_SIZE);
+        if !fs.block_cache().read_uncached(run.first_bid, sectors) {
+            bids.extend(run.first_bid..run.first_bid + run.num_blocks);
+            return;
+        }
+        for dma in streams {
+            dma.sync(0..PAGE_SIZE).unwrap();
+        }
+
+        // The rest of the last block may hold stale data past the end of file.
+        let file_size = self.raw_inode.read().size(self.type_);
+        let valid = file_size - run.first_page * PAGE_SIZE;
+        for (i, frame) in frames.into_iter().enumerate() {
+            let start = i * PAGE_SIZE;
+            if valid < start + PAGE_SIZE {
+                let mut writer = frame.writer();
+                writer.skip(valid.saturating_sub(start));
+                writer.fill_zeros(writer.avail());
+            }
+            // Left to be read again if a write raced with the read.
+            self.page_cache.insert(run.first_page + i, frame, seq);
+        }
+    }
+
+    /// Returns whether all blocks of the `page_index`-th page in the file are
+    /// holes.
+    fn is_hole_page(&self, fs: &Ext2Fs, page_index: usize) -> bool {
+        let block_size = fs.block_size as usize;
+        let file_size = self.raw_inode.read().size(self.type_);
+        let first_block = page_index * PAGE_SIZE / block_size;
+        let end_block = ((page_index + 1) * PAGE_SIZE)
+            .div_ceil(block_size)
+            .min(file_size.div_ceil(block_size));
+        (first_block..end_block).all(|index| self.map_block(fs, index).is_none())
+    }
+
+    /// Returns the page cache frame holding the `page_index`-th page.
+    fn cached_page(&self, page_index: usize) -> crate::error::Result<Frame<()>> {
+        self.page_cache.get(page_index, |frame| {
+            self.read_blocks(page_index * PAGE_SIZE, frame.writer().to_fallible())
+                .map(|_| ())
+        })
+    }
+
+    /// Modifies the raw inode and writes it back to the block cache.
+    pub(super) fn update_raw_inode<F: FnOnce(&mut RawInode)>(&self, f: F) {
+        let mut raw_inode = self.raw_inode.write();
+        f(&mut raw_inode);
+        self.inode_ptr.write(&raw_inode);
+    }
+
+    /// Updates the access time after a read, but only if it is older than the
+    /// last change or than [`RELATIME_INTERVAL_SECS`], so that most reads do
+    /// not dirty the inode.
+    fn touch_atime(&self, fs: &Ext2Fs) {
+        let now = fs.now();
+        {
+            let raw_inode = self.raw_inode.read();
+            if raw_inode.atime > raw_inode.mtime
+                && raw_inode.atime > raw_inode.ctime
+                && now < raw_inode.atime.saturating_add(RELATIME_INTERVAL_SECS)
+            {
+                return;
+            }
+        }
+        self.update_raw_inode(|raw_inode| raw_inode.atime = now);
+    }
+
+    /// Allocates the holes among the blocks in `blocks`.
+    ///
+    /// Each run of holes is allocated as one run on the disk, right after the
+    /// block before it where possible, so that the file stays contiguous. The
+    /// block pointers only change in memory; the caller writes the raw inode
+    /// back once it is done changing it.
+    fn fill_holes(&self, fs: &Ext2Fs, blocks: Range<usize>) -> Result<()> {
+        let mut index = blocks.start;
+        while index < blocks.end {
+            if self.map_block(fs, index).is_some() {
+                index += 1;
+                continue;
+            }
+            let num_holes = (index..blocks.end)
+                .take_while(|&index| self.map_block(fs, index).is_none())
+                .count();
+            let goal = match index
+                .checked_sub(1)
+                .and_then(|prev| self.map_block(fs, prev))
+            {
+                Some(prev) => Ext2Bid(prev.0 + 1),
+                None => fs.group_first_bid(self.block_group_idx),
+            };
+            let (first, count) = fs.alloc_blocks(goal, num_holes)?;
+
+            let mut raw_inode = self.raw_inode.write();
+            let mut num_allocated = 0;
+            let mut result = Ok(());
+            for i in 0..count {
+                let bid = Ext2Bid(first.0 + i as u32);
+                match raw_inode.block_ptrs.set(index + i, bid, fs) {
+                    Ok(num_indirect) => num_allocated += 1 + num_indirect,
+                    Err(err) => {
+                        // Give back the blocks the file does not point to.
+                        fs.release_blocks(bid, count - i);
+                        result = Err(err);
+                        break;
+                    }
+                }
+                self.block_map.lock().insert(index + i, bid);
+            }
+            raw_inode.blocks_count += (num_allocated * fs.block_size / SECTOR_SIZE) as u32;
+            drop(raw_inode);
+            result?;
+            index += count;
+        }
+        Ok(())
+    }
+
+    /// Copies the data from `reader` to the file at `offset`, whose blocks
+    /// must be allocated, and returns the number of bytes written.
+    fn write_blocks(
+        &self,
+        fs: &Ext2Fs,
+        offset: usize,
+        mut reader: ostd::mm::VmReader,
+    ) -> Result<usize> {
+        let block_size = fs.block_size;
+        let end = offset + reader.remain();
+        let mut buf = vec![0u8; block_size];
+        let mut current_offset = offset;
+        while current_offset < end {
+            let offset_in_block = current_offset % block_size;
+            let chunk =
+                &mut buf[..core::cmp::min(block_size - offset_in_block, end - current_offset)];
+            reader
+                .read_fallible(&mut VmWriter::from(&mut *chunk))
+                .map_err(|_| Error::new(Errno::EFAULT))?;
+
+            let bid = self.map_block(fs, current_offset / block_size).unwrap();
+            fs.block_cache()
+                .write_data(bid.0 as usize, offset_in_block, chunk);
+            self.update_cached_pages(current_offset, chunk);
+            current_offset += chunk.len();
+        }
+        Ok(current_offset - offset)
+    }
+
+    /// Copies `data`, just written to the file at `offset`, into the cached
+    /// pages it covers, so that reads and file mappings see it.
+    fn update_cached_pages(&self, offset: usize, data: &[u8]) {
+        let mut done = 0;
+        while done < data.len() {
+            let current_offset = offset + done;
+            let offset_in_page = current_offset % PAGE_SIZE;
+            let len = core::cmp::min(PAGE_SIZE - offset_in_page, data.len() - done);
+            if let Some(frame) = self.page_cache.lookup(current_offset / PAGE_SIZE) {
+                frame
+                    .write_bytes(offset_in_page, &data[done..done + len])
+                    .unwrap();
+            }
+            done += len;
+        }
+    }
+
+    /// Returns the entries of this directory, parsing them on first use.
+    fn dir_entries<'a>(&self, dir: &'a Directory) -> &'a Vec<Ext2DirEntry> {
+        dir.entries.call_once(|| {
+            let fs = self.fs.upgrade().expect("Filesystem has been dropped");
+            read_directory(self.type_, &self.raw_inode.read(), &fs)
+        })
+    }
+
+    /// Adds `entry` to this directory on the disk, in the first record with
+    /// room left after its own entry, or in a new block at the end.
+    fn add_dir_entry(&self, fs: &Ext2Fs, mut entry: Ext2DirEntry) -> Result<()> {
+        let block_size = fs.block_size;
+        let needed = Ext2DirEntry::record_len_for(entry.name_length() as usize);
+        let num_blocks = self.raw_inode.read().size(self.type_).div_ceil(block_size);
+
+        let mut block = vec![0u8; block_size];
+        for block_index in 0..num_blocks {
+            let Some(bid) = self.map_block(fs, block_index) else {
+                continue;
+            };
+            let bid = bid.0 as usize;
+            fs.block_cache().read_bytes(bid, 0, &mut block);
+
+            let mut offset = 0;
+            while offset < block_size {
+                let mut existing = Ext2DirEntry::default();
+                let len = core::cmp::min(size_of::<Ext2DirEntry>(), block_size - offset);
+                existing.as_bytes_mut()[..len].copy_from_slice(&block[offset..offset + len]);
+                let record_len = existing.length() as usize;
+                if record_len == 0 {
+                    break;
+                }
+
+                let used = if existing.inode() == 0 {
+                    0
+                } else {
+                    Ext2DirEntry::record_len_for(existing.name_length() as usize)
+                };
+                if record_len.saturating_sub(used) >= needed {
+                    // Split the slack off the existing record.
+                    if used > 0 {
+                        existing.set_length(used as u16);
+                        fs.block_cache()
+                            .write_bytes(bid, offset, existing.record_bytes());
+                    }
+                    entry.set_length((record_len - used) as u16);
+                    fs.block_cache()
+                        .write_bytes(bid, offset + used, entry.record_bytes());
+                    return Ok(());
+                }
+                offset += record_len;
+            }
+        }
+
+        self.fill_holes(fs, num_blocks..num_blocks + 1)?;
+        let bid = self.map_block(fs, num_blocks).unwrap();
+        entry.set_length(block_size as u16);
+        fs.block_cache()
+            .write_bytes(bid.0 as usize, 0, entry.record_bytes());
+        self.update_raw_inode(|raw_inode| raw_inode.size_low += block_size as u32);
+        Ok(())
+    }
 }
 
-fn read_directory(
-    type_: InodeType,
-    raw_inode: &RawInode,
-    fs: Weak<Ext2Fs>,
-) -> Option<Vec<Ext2DirEntry>> {
-    if type_ != InodeType::Directory {
-        return None;
+/// Uncached pages of a file whose blocks are consecutive on the disk.
+struct DirectRun {
+    first_page: usize,
+    first_bid: usize,
+    num_pages: usize,
+    /// The blocks within the file, fewer than the pages hold at the end of it.
+    num_blocks: usize,
+}
+
+impl DirectRun {
+    /// Returns whether the `page_index`-th page, starting at block `first_bid`,
+    /// continues this run.
+    fn can_append(&self, fs: &Ext2Fs, page_index: usize, first_bid: usize) -> bool {
+        let blocks_per_page = PAGE_SIZE / fs.block_size as usize;
+        self.first_page + self.num_pages == page_index
+            && self.num_blocks == self.num_pages * blocks_per_page
+            && self.first_bid + self.num_blocks == first_bid
+            && self.num_pages < MAX_PAGES_PER_DIRECT_READ
     }
+}
+
+fn read_directory(type_: InodeType, raw_inode: &RawInode, fs: &Ext2Fs) -> Vec<Ext2DirEntry> {
+    let block_size = fs.block_size as usize;
+    let num_blocks = raw_inode.size(type_).div_ceil(block_size);
 
     // Read directory entries
     let mut dir_entries = Vec::new();
-    for &block_ptr in &raw_inode.block_ptrs.direct_pointers {
-        if block_ptr.0 == 0 {
+    for block_index in 0..num_blocks {
+        let Some(block_ptr) = raw_inode.block_ptrs.map(block_index, fs) else {
             continue;
-        }
-
-        let fs = fs.upgrade().expect("Filesystem has been dropped");
-        let block_size = fs.block_size as usize;
-        let sector = fs.bid_to_sector(block_ptr);
+        };
 
         let mut offset = 0;
         while offset < block_size {
-            let dir_entry: Ext2DirEntry = fs
-                .blk_device
-                .read_val_offset(sector + offset / SECTOR_SIZE, offset % SECTOR_SIZE);
+            // An entry is shorter than `Ext2DirEntry` and the last one may end
+            // right at the end of the block.
+            let mut dir_entry = Ext2DirEntry::default();
+            let len = core::cmp::min(size_of::<Ext2DirEntry>(), block_size - offset);
+            fs.block_cache().read_bytes(
+                block_ptr.0 as usize,
+                offset,
+                &mut dir_entry.as_bytes_mut()[..len],
+            );
 
-            if dir_entry.inode() == 0 {
+            if dir_entry.length() == 0 {
                 break;
             }
-
             offset += dir_entry.length() as usize;
+
+            // An unused entry, e.g., one left by a removed file.
+            if dir_entry.inode() == 0 {
+                continue;
+            }
             dir_entries.push(dir_entry);
 
             debug!(
@@ -131,7 +598,7 @@ fn read_directory(
         }
     }
 
-    Some(dir_entries)
+    dir_entries
 }
 
 impl super::super::Inode for Inode {
@@ -140,13 +607,20 @@ impl super::super::Inode for Inode {
             return Err(crate::error::Error::new(crate::error::Errno::ENOTDIR));
         }
 
-        if let Inner::Directory(ref entries) = self.inner {
-            for entry in entries {
-                if entry.name() == name {
-                    let fs = self.fs.upgrade().expect("Filesystem has been dropped");
-                    let inode = fs.lookup_inode(entry.inode())?;
-                    return Ok(inode);
-                }
+        if let Inner::Directory(ref dir) = self.inner {
+            let dir = dir.read();
+            let entries = self.dir_entries(&dir);
+            let index = dir
+                .index
+                .call_once(|| DirIndex::new(entries.iter().map(|entry| entry.name_bytes())));
+            if let Some(position) =
+                index.lookup(name.as_bytes(), |position| entries[position].name_bytes())
+            {
+                let inode_number = entries[position].inode();
+                drop(dir);
+                let fs = self.fs.upgrade().expect("Filesystem has been dropped");
+                let inode = fs.lookup_inode(inode_number)?;
+                return Ok(inode);
             }
         }
         Err(crate::error::Error::new(crate::error::Errno::ENOENT))
@@ -157,15 +631,190 @@ impl super::super::Inode for Inode {
         name: &str,
         type_: InodeType,
     ) -> crate::error::Result<alloc::sync::Arc<dyn crate::fs::Inode>> {
-        todo!()
+        let Inner::Directory(ref dir) = self.inner else {
+            return Err(Error::new(Errno::ENOTDIR));
+        };
+        if name.len() > MAX_NAME_LEN {
+            return Err(Error::new(Errno::ENAMETOOLONG));
+        }
+
+        let fs = self.fs.upgrade().expect("Filesystem has been dropped");
+        let mut dir = dir.write();
+        if self
+            .dir_entries(&dir)
+            .iter()
+            .any(|entry| entry.name_bytes() == name.as_bytes())
+        {
+            return Err(Error::new(Errno::EEXIST));
+        }
+
+        let inode_number = fs.alloc_inode(self.block_group_idx, type_)?;
+        let now = fs.now();
+        let mut raw_inode = RawInode {
+            mode: match type_ {
+                InodeType::File => 0x8000 | 0o644,
+                InodeType::Directory => 0x4000 | 0o755,
+                InodeType::SymbolLink => 0xA000 | 0o777,
+            },
+            hard_links: 1,
+            atime: now,
+            ctime: now,
+            mtime: now,
+            ..Default::default()
+        };
+        if type_ == InodeType::Directory {
+            let group_idx = ((inode_number - 1) / fs.inodes_per_group) as usize;
+            let (bid, _) = fs.alloc_blocks(fs.group_first_bid(group_idx), 1)?;
+            let dir_type = fs.dir_entry_type(InodeType::Directory);
+            let dot = Ext2DirEntry::new(inode_number, b".", dir_type);
+            let mut dot_dot = Ext2DirEntry::new(self.inode_id, b"..", dir_type);
+            dot_dot.set_length((fs.block_size - dot.length() as usize) as u16);
+            fs.block_cache()
+                .write_bytes(bid.0 as usize, 0, dot.record_bytes());
+            fs.block_cache().write_bytes(
+                bid.0 as usize,
+                dot.length() as usize,
+                dot_dot.record_bytes(),
+            );
+
+            raw_inode.hard_links = 2;
+            raw_inode.size_low = fs.block_size as u32;
+            raw_inode.blocks_count = (fs.block_size / SECTOR_SIZE) as u32;
+            raw_inode.block_ptrs.direct_pointers[0] = bid;
+        }
+        fs.inode_ptr(inode_number).write(&raw_inode);
+
+        let entry = Ext2DirEntry::new(inode_number, name.as_bytes(), fs.dir_entry_type(type_));
+        {
+            let _guard = self.write_lock.lock();
+            self.add_dir_entry(&fs, entry)?;
+            self.update_raw_inode(|raw_inode| {
+                raw_inode.mtime = now;
+                raw_inode.ctime = now;
+                if type_ == InodeType::Directory {
+                    // The new directory's `..`.
+                    raw_inode.hard_links += 1;
+                }
+            });
+        }
+        dir.entries.get_mut().unwrap().push(entry);
+        dir.index = Once::new();
+        drop(dir);
+
+        Ok(fs.lookup_inode(inode_number)?)
     }
 
     fn read_link(&self) -> crate::error::Result<alloc::string::String> {
-        todo!()
+        if self.type_ != InodeType::SymbolLink {
+            return Err(Error::new(Errno::EINVAL));
+        }
+
+        let raw_inode = *self.raw_inode.read();
+        let size = raw_inode.size(self.type_);
+        let mut target = vec![0u8; size];
+        if raw_inode.blocks_count == 0 {
+            // A fast symlink, stored in place of the block pointers.
+            let stored = raw_inode.block_ptrs.as_bytes();
+            target.copy_from_slice(stored.get(..size).ok_or(Error::new(Errno::EIO))?);
+        } else {
+            let fs = self.fs.upgrade().expect("Filesystem has been dropped");
+            if size > fs.block_size {
+                return Err(Error::new(Errno::EIO));
+            }
+            let bid = self.map_block(&fs, 0).ok_or(Error::new(Errno::EIO))?;
+            fs.block_cache().read_bytes(bid.0 as usize, 0, &mut target);
+        }
+        String::from_utf8(target).map_err(|_| Error::new(Errno::EINVAL))
     }
 
     fn write_link(&self, target: &str) -> crate::error::Result<()> {
-        todo!()
+        if self.type_ != InodeType::SymbolLink {
+            return Err(Error::new(Errno::EINVAL));
+        }
+        let fs = self.fs.upgrade().expect("Filesystem has been dropped");
+        let target = target.as_bytes();
+        if target.len() > fs.block_size {
+            return Err(Error::new(Errno::ENAMETOOLONG));
+        }
+
+        let _guard = self.write_lock.lock();
+        let is_fast = self.raw_inode.read().blocks_count == 0;
+        if is_fast && target.len() < size_of::<BlockPointers>() {
+            self.update_raw_inode(|raw_inode| {
+                raw_inode.block_ptrs = BlockPointers::default();
+                raw_inode.block_ptrs.as_bytes_mut()[..target.len()].copy_from_slice(target);
+                raw_inode.size_low = target.len() as u32;
+            });
+            return Ok(());
+        }
+
+        if is_fast {
+            // The block pointers hold the old target.
+            self.raw_inode.write().block_ptrs = BlockPointers::default();
+        }
+        let result = self.fill_holes(&fs, 0..1).map(|()| {
+            let bid = self.map_block(&fs, 0).unwrap();
+            let mut block = vec![0u8; fs.block_size];
+            block[..target.len()].copy_from_slice(target);
+            fs.block_cache().write_data(bid.0 as usize, 0, &block);
+        });
+        self.update_raw_inode(|raw_inode| {
+            if result.is_ok() {
+                raw_inode.size_low = target.len() as u32;
+            }
+        });
+        result
+    }
+
+    fn read_dir(&self, offset: usize, visit: &mut dyn FnMut(DirEntry) -> bool) -> Result<usize> {
+        let Inner::Directory(ref dir) = self.inner else {
+            return Err(Error::new(Errno::ENOTDIR));
+        };
+        // Keeps entries from being added meanwhile.
+        let _dir = dir.read();
+
+        // Walks the records in the cached blocks, so the entries need not be
+        // parsed.
+        let fs = self.fs.upgrade().expect("Filesystem has been dropped");
+        let block_size = fs.block_size;
+        let size = self.raw_inode.read().size(self.type_);
+        let mut block = vec![0u8; block_size];
+        let mut offset = offset;
+        while offset < size {
+            let block_index = offset / block_size;
+            let block_start = block_index * block_size;
+            let Some(bid) = self.map_block(&fs, block_index) else {
+                offset = block_start + block_size;
+                continue;
+            };
+            fs.block_cache().read_bytes(bid.0 as usize, 0, &mut block);
+
+            let mut in_block = offset - block_start;
+            while in_block < block_size {
+                let mut entry = Ext2DirEntry::default();
+                let len = core::cmp::min(size_of::<Ext2DirEntry>(), block_size - in_block);
+                entry.as_bytes_mut()[..len].copy_from_slice(&block[in_block..in_block + len]);
+                let record_len = entry.length() as usize;
+                if record_len < Ext2DirEntry::record_len_for(entry.name_length() as usize) {
+                    // A corrupted record. Skip the rest of the block.
+                    break;
+                }
+
+                let next_offset = block_start + in_block + record_len;
+                let listed = DirEntry {
+                    ino: entry.inode() as u64,
+                    type_: entry.inode_type(),
+                    name: entry.name_bytes(),
+                    next_offset,
+                };
+                if entry.inode() != 0 && !visit(listed) {
+                    return Ok(block_start + in_block);
+                }
+                in_block += record_len;
+            }
+            offset = block_start + block_size;
+        }
+        Ok(offset)
     }
 
     fn read_at(
@@ -177,73 +826,142 @@ impl super::super::Inode for Inode {
             return Err(crate::error::Error::new(crate::error::Errno::EISDIR));
         }
 
-        let sector_ptr = &self.sector_ptr;
-        let raw_inode: RawInode = sector_ptr.read();
-        let fs = self.fs.upgrade().expect("Filesystem has been dropped");
-        let block_size = fs.block_size as usize;
         let file_size = self.size();
-
         if offset >= file_size {
             return Ok(0);
         }
+        let end = core::cmp::min(offset + writer.avail(), file_size);
+        if offset == end {
+            return Ok(0);
+        }
+
+        let fs = self.fs.upgrade().expect("Filesystem has been dropped");
+        self.prefetch_pages(&fs, offset / PAGE_SIZE..end.div_ceil(PAGE_SIZE));
 
-        let mut bytes_read = 0;
         let mut current_offset = offset;
-        let max_to_read = core::cmp::min(writer.avail(), file_size - offset);
+        while current_offset < end {
+            let page_index = current_offset / PAGE_SIZE;
+            // Pages of holes are read from the zero frame rather than cached.
+            let frame =
+                if !self.page_cache.contains(page_index) && self.is_hole_page(&fs, page_index) {
+                    frame_pool::zero_frame().clone()
+                } else {
+                    self.cached_page(page_index)?
+                };
+            let offset_in_page = current_offset % PAGE_SIZE;
+            let to_read = core::cmp::min(PAGE_SIZE - offset_in_page, end - current_offset);
 
-        // Find start block and offset within block
-        let mut block_index = current_offset / block_size;
-        let mut offset_in_block = current_offset % block_size;
+            let mut reader = frame.reader();
+            reader.skip(offset_in_page).limit(to_read);
+            writer
+                .write_fallible(&mut reader)
+                .map_err(|_| crate::error::Error::new(crate::error::Errno::EFAULT))?;
+            current_offset += to_read;
+        }
 
-        // Read data block by block
-        while bytes_read < max_to_read {
-            let block_ptr = if block_index < 12 {
-                raw_inode.block_ptrs.direct_pointers[block_index as usize]
-            } else {
-                // For simplicity, we only handle direct pointers here
-                break;
-            };
-            if block_ptr.0 == 0 {
-                break;
+        self.touch_atime(&fs);
+        Ok(current_offset - offset)
+    }
+
+    fn write_at(&self, offset: usize, reader: ostd::mm::VmReader) -> crate::error::Result<usize> {
+        if self.type_ != InodeType::File {
+            return Err(Error::new(Errno::EISDIR));
+        }
+        let len = reader.remain();
+        if len == 0 {
+            return Ok(0);
+        }
+        let end = offset.checked_add(len).ok_or(Error::new(Errno::EFBIG))?;
+
+        let fs = self.fs.upgrade().expect("Filesystem has been dropped");
+        let block_size = fs.block_size;
+        let _guard = self.write_lock.lock();
+        let _write_guard = self.page_cache.start_write();
+        let result = self
+            .fill_holes(&fs, offset / block_size..end.div_ceil(block_size))
+            .and_then(|()| self.write_blocks(&fs, offset, reader));
+
+        // Write the new block pointers and size back in one go, also after a
+        // failure, as some blocks may have been allocated.
+        let now = fs.now();
+        self.update_raw_inode(|raw_inode| {
+            if let Ok(&written) = result.as_ref() {
+                raw_inode.mtime = now;
+                raw_inode.ctime = now;
+                if offset + written > raw_inode.size(InodeType::File) {
+                    let size = offset + written;
+                    raw_inode.size_low = size as u32;
+                    raw_inode.size_high = (size >> 32) as u32;
+                }
             }
-            let sector = fs.bid_to_sector(block_ptr);
-            let remaining_in_file = max_to_read - bytes_read;
-            let remaining_in_block = block_size - offset_in_block;
-            let to_read = core::cmp::min(remaining_in_block, remaining_in_file);
+        });
+        result
+    }
 
-            debug!(
-                "Reading block_index: {}, block_ptr: {:?}, sector: {}, offset_in_block: {}, to_read: {}",
-                block_index, block_ptr, sector, offset_in_block, to_read
-            );
-            fs.blk_device.read_to_vm_writer(
-                sector + offset_in_block / SECTOR_SIZE,
-                (to_read + SECTOR_SIZE - 1) / SECTOR_SIZE,
-                &mut writer,
-            );
+    fn read_ahead(&self, range: core::ops::Range<usize>) {
+        if self.type_ != InodeType::File {
+            return;
+        }
 
-            bytes_read += to_read;
-            current_offset += to_read;
-            offset_in_block = 0; // After first block, offset is 0
-            block_index += 1;
+        let fs = self.fs.upgrade().expect("Filesystem has been dropped");
+        let block_size = fs.block_size;
+        let end = core::cmp::min(range.end, self.size());
+        if range.start >= end {
+            return;
         }
 
-        Ok(bytes_read)
+        let bids: Vec<usize> = (range.start / block_size..end.div_ceil(block_size))
+            .map_while(|index| self.map_block(&fs, index))
+            .map(|bid| bid.0 as usize)
+            .collect();
+        fs.block_cache().read_ahead(&bids);
     }
 
-    fn write_at(&self, offset: usize, reader: ostd::mm::VmReader) -> crate::error::Result<usize> {
-        todo!()
+    fn page_frames(&self, pages: Range<usize>) -> Option<crate::error::Result<Vec<Frame<()>>>> {
+        if self.type_ != InodeType::File {
+            return None;
+        }
+
+        let fs = self.fs.upgrade().expect("Filesystem has been dropped");
+        self.prefetch_pages(&fs, pages.clone());
+        Some(pages.map(|index| self.cached_page(index)).collect())
     }
 
     fn metadata(&self) -> &crate::fs::InodeMeta {
         &self.meta
     }
 
+    fn sync(&self) -> crate::error::Result<()> {
+        // Blocks are not tracked per file, so this writes back the whole file
+        // system.
+        let fs = self.fs.upgrade().expect("Filesystem has been dropped");
+        fs.sync()
+    }
+
     fn size(&self) -> usize {
-        let raw_inode: RawInode = self.sector_ptr.read();
-        if self.type_ == InodeType::File {
-            ((raw_inode.size_high as usize) << 32) | (raw_inode.size_low as usize)
-        } else {
-            raw_inode.size_low as usize
+        self.raw_inode.read().size(self.type_)
+    }
+
+    fn data_version(&self) -> u64 {
+        self.page_cache.load_seq()
+    }
+
+    fn stat(&self) -> InodeStat {
+        let raw_inode = *self.raw_inode.read();
+        let block_size = self.fs.upgrade().map_or(PAGE_SIZE, |fs| fs.block_size);
+        InodeStat {
+            ino: self.inode_id as u64,
+            type_: self.type_,
+            perm: raw_inode.mode & 0o7777,
+            nlink: raw_inode.hard_links as u32,
+            uid: raw_inode.uid as u32,
+            gid: raw_inode.gid as u32,
+            size: raw_inode.size(self.type_) as u64,
+            blocks: raw_inode.blocks_count as u64,
+            block_size: block_size as u32,
+            atime: Duration::from_secs(raw_inode.atime as u64),
+            mtime: Duration::from_secs(raw_inode.mtime as u64),
+            ctime: Duration::from_secs(raw_inode.ctime as u64),
         }
     }
 
@@ -252,6 +970,16 @@ impl super::super::Inode for Inode {
     }
 }
 
+/// The number of direct block pointers in an inode.
+const NUM_DIRECT_POINTERS: usize = 12;
+/// The maximum number of resolved block mappings an inode keeps.
+const MAX_CACHED_BLOCK_MAPPINGS: usize = 4096;
+/// How old the access time may get before a read updates it even though the
+/// file has not changed since, as with `relatime`.
+const RELATIME_INTERVAL_SECS: u32 = 24 * 60 * 60;
+/// The maximum number of pages read straight from the device by one request.
+const MAX_PAGES_PER_DIRECT_READ: usize = 16;
+
 #[repr(C)]
 #[derive(Clone, Copy, Default, Debug, Pod)]
 pub(super) struct RawInode {
@@ -294,15 +1022,126 @@ pub(super) struct RawInode {
     pub os_dependent_2: OsDependent2,
 }
 
+impl RawInode {
+    /// Returns the size in bytes. `size_high` only holds the size for regular files.
+    fn size(&self, type_: InodeType) -> usize {
+        if type_ == InodeType::File {
+            ((self.size_high as usize) << 32) | (self.size_low as usize)
+        } else {
+            self.size_low as usize
+        }
+    }
+}
+
 #[repr(C)]
 #[derive(Debug, Clone, Copy, Pod, Default)]
 pub struct BlockPointers {
-    direct_pointers: [Ext2Bid; 12],
+    direct_pointers: [Ext2Bid; NUM_DIRECT_POINTERS],
     single_indirect_pointer: Ext2Bid,
     double_indirect_pointer: Ext2Bid,
     triple_indirect_pointer: Ext2Bid,
 }
 
+impl BlockPointers {
+    /// Returns the physical block of the `index`-th block, or `None` for a hole.
+    ///
+    /// The indirect blocks are read through the block cache of `fs`.
+    fn map(&self, index: usize, fs: &Ext2Fs) -> Option<Ext2Bid> {
+        let ptrs_per_block = fs.block_size / size_of::<Ext2Bid>();
+
+        let mut index = index;
+        if index < NUM_DIRECT_POINTERS {
+            return non_hole(self.direct_pointers[index]);
+        }
+        index -= NUM_DIRECT_POINTERS;
+
+        // The single, double and triple indirect trees, in the order they
+        // cover the logical blocks.
+        let roots = [
+            self.single_indirect_pointer,
+            self.double_indirect_pointer,
+            self.triple_indirect_pointer,
+        ];
+        let mut covered = ptrs_per_block;
+        for (level, root) in roots.into_iter().enumerate() {
+            if index >= covered {
+                index -= covered;
+                covered *= ptrs_per_block;
+                continue;
+            }
+
+            let mut bid = non_hole(root)?;
+            for depth in (0..=level as u32).rev() {
+                let slot = index / ptrs_per_block.pow(depth) % ptrs_per_block;
+                bid = non_hole(
+                    fs.block_cache()
+                        .read_val(bid.0 as usize, slot * size_of::<Ext2Bid>()),
+                )?;
+            }
+            return Some(bid);
+        }
+
+        None
+    }
+}
+
+impl BlockPointers {
+    /// Points the `index`-th block at `bid`, allocating the indirect blocks on
+    /// the way, and returns the number of indirect blocks allocated.
+    fn set(&mut self, index: usize, bid: Ext2Bid, fs: &Ext2Fs) -> Result<usize> {
+        let ptrs_per_block = fs.block_size / size_of::<Ext2Bid>();
+
+        let mut index = index;
+        if index < NUM_DIRECT_POINTERS {
+            self.direct_pointers[index] = bid;
+            return Ok(0);
+        }
+        index -= NUM_DIRECT_POINTERS;
+
+        let roots = [
+            &mut self.single_indirect_pointer,
+            &mut self.double_indirect_pointer,
+            &mut self.triple_indirect_pointer,
+        ];
+        let mut covered = ptrs_per_block;
+        for (level, root) in roots.into_iter().enumerate() {
+            if index >= covered {
+                index -= covered;
+                covered *= ptrs_per_block;
+                continue;
+            }
+
+            // Indirect blocks go right after the data block they lead to.
+            let mut num_allocated = 0;
+            if root.0 == 0 {
+                *root = fs.alloc_blocks(bid, 1)?.0;
+                num_allocated += 1;
+            }
+            let mut node = *root;
+            for depth in (1..=level as u32).rev() {
+                let offset =
+                    index / ptrs_per_block.pow(depth) % ptrs_per_block * size_of::<Ext2Bid>();
+                let mut child: Ext2Bid = fs.block_cache().read_val(node.0 as usize, offset);
+                if child.0 == 0 {
+                    child = fs.alloc_blocks(bid, 1)?.0;
+                    fs.block_cache().write_val(node.0 as usize, offset, &child);
+                    num_allocated += 1;
+                }
+                node = child;
+            }
+            let offset = index % ptrs_per_block * size_of::<Ext2Bid>();
+            fs.block_cache().write_val(node.0 as usize, offset, &bid);
+            return Ok(num_allocated);
+        }
+
+        Err(Error::new(Errno::EFBIG))
+    }
+}
+
+fn non_hole(bid: Ext2Bid) -> Option<Ext2Bid> {
+    (bid.0 != 0).then_some(bid)
+}
+
 /// OS dependent 2.
 ///
 /// Here we use the Linux definition.
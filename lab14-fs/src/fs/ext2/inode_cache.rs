@@ -0,0 +1,90 @@
+//! A bounded cache of the parsed inodes of an [`Ext2Fs`](super::Ext2Fs).
+
+use core::sync::atomic::{AtomicU64, Ordering};
+
+use alloc::{collections::btree_map::BTreeMap, sync::Arc, vec::Vec};
+use ostd::sync::RwLock;
+
+use crate::fs::ext2::inode::Inode;
+
+/// The default maximum number of cached inodes.
+pub const DEFAULT_INODE_CACHE_CAPACITY: usize = 512;
+
+/// The number of shards. Inodes are spread over the shards by inode number,
+/// so lookups of different inodes rarely contend on the same lock.
+const NUM_SHARDS: usize = 8;
+
+pub struct InodeCache {
+    shards: [RwLock<BTreeMap<u32, CacheEntry>>; NUM_SHARDS],
+    /// The maximum number of inodes in one shard.
+    shard_capacity: usize,
+    /// A logical clock, advanced on every access to order the entries for LRU.
+    clock: AtomicU64,
+}
+
+struct CacheEntry {
+    inode: Arc<Inode>,
+    last_access: AtomicU64,
+}
+
+impl InodeCache {
+    pub fn new(capacity: usize) -> Self {
+        Self {
+            shards: core::array::from_fn(|_| RwLock::new(BTreeMap::new())),
+            shard_capacity: capacity.div_ceil(NUM_SHARDS).max(1),
+            clock: AtomicU64::new(0),
+        }
+    }
+
+    /// Looks up an inode. Hits only take the shard lock for reading.
+    pub fn get(&self, inode_number: u32) -> Option<Arc<Inode>> {
+        let shard = self.shard(inode_number).read();
+        let entry = shard.get(&inode_number)?;
+        entry.last_access.store(self.tick(), Ordering::Relaxed);
+        Some(entry.inode.clone())
+    }
+
+    /// Inserts a newly loaded inode, returning the cached one.
+    ///
+    /// If another task has inserted the same inode meanwhile, that one is kept
+    /// and returned so that all users share a single `Inode`.
+    pub fn insert(&self, inode_number: u32, inode: Arc<Inode>) -> Arc<Inode> {
+        let mut shard = self.shard(inode_number).write();
+        let cached = shard
+            .entry(inode_number)
+            .or_insert_with(|| CacheEntry {
+                inode,
+                last_access: AtomicU64::new(self.tick()),
+            })
+            .inode
+            .clone();
+
+        let len = shard.len();
+        if len > self.shard_capacity {
+            Self::evict(&mut shard, len - self.shard_capacity);
+        }
+        cached
+    }
+
+    /// Evicts up to `count` least recently used inodes that nobody else references.
+    fn evict(shard: &mut BTreeMap<u32, CacheEntry>, count: usize) {
+        let mut candidates: Vec<(u64, u32)> = shard
+            .iter()
+            .filter(|(_, entry)| Arc::strong_count(&entry.inode) == 1)
+            .map(|(&inode_number, entry)| (entry.last_access.load(Ordering::Relaxed), inode_number))
+            .collect();
+        candidates.sort_unstable();
+
+        for (_, inode_number) in candidates.into_iter().take(count) {
+            shard.remove(&inode_number);
+        }
+    }
+
+    fn shard(&self, inode_number: u32) -> &RwLock<BTreeMap<u32, CacheEntry>> {
+        &self.shards[inode_number as usize % NUM_SHARDS]
+    }
+
+    fn tick(&self) -> u64 {
+        self.clock.fetch_add(1, Ordering::Relaxed)
+    }
+}
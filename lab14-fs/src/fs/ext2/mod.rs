@@ -6,19 +6,23 @@ use core::fmt::Debug;
 use core::ops::Add;
 
 use alloc::sync::Weak;
-use alloc::{collections::btree_map::BTreeMap, sync::Arc, vec::Vec};
-use log::{debug, info};
+use alloc::{sync::Arc, vec::Vec};
+use log::{debug, error, info};
 use ostd::Pod;
-use ostd::{early_println, sync::Mutex};
+use ostd::early_println;
+use ostd::sync::Mutex;
 
 use crate::fs::ext2::inode::RawInode;
+use crate::fs::ext2::inode_cache::{DEFAULT_INODE_CACHE_CAPACITY, InodeCache};
 use crate::fs::ext2::super_block::EXT2_FIRST_SUPERBLOCK_OFFSET;
-use crate::fs::util::sector_ptr::SectorPtr;
+use crate::fs::util::block_cache::{BlockCache, DEFAULT_CACHE_CAPACITY};
+use crate::fs::util::block_ptr::BlockPtr;
+use crate::fs::util::writeback;
 use crate::{
     drivers::blk::{BlockDevice, SECTOR_SIZE},
-    error::{Error, Result},
+    error::{Errno, Error, Result},
     fs::{
-        FileSystem,
+        FileSystem, InodeType,
         ext2::{
             block_group::BlockGroup,
             inode::Inode,
@@ -30,22 +34,37 @@ use crate::{
 mod block_group;
 mod dir_entry;
 mod inode;
+mod inode_cache;
 mod super_block;
 
 const EXT2_MAGIC: u16 = 0xEF53;
 /// The root inode number.
 const ROOT_INO: u32 = 2;
+/// The block sizes supported. Larger blocks would span several pages.
+const SUPPORTED_BLOCK_SIZES: [u32; 3] = [1024, 2048, 4096];
+/// The inode size and first non-reserved inode of revision 0 file systems,
+/// whose super blocks do not record them.
+const GOOD_OLD_INODE_SIZE: u16 = 128;
+const GOOD_OLD_FIRST_INO: u32 = 11;
+/// The incompatible feature bit for the file type in directory entries.
+const EXT2_FEATURE_INCOMPAT_FILETYPE: u32 = 0x2;
 
 pub struct Ext2Fs {
-    blk_device: Arc<dyn BlockDevice>,
+    block_cache: Arc<BlockCache>,
     super_block: SuperBlock,
+    /// The on-disk super block, whose free counts change on allocation.
+    raw_super_block: Mutex<RawSuperBlock>,
     block_groups: Vec<BlockGroup>,
 
-    inode_cache: Mutex<BTreeMap<u32, Arc<Inode>>>,
+    inode_cache: InodeCache,
     inodes_per_group: u32,
     blocks_per_group: u32,
     inode_size: usize,
     block_size: usize,
+    /// The time of the last mount or write recorded in the super block, in
+    /// seconds since the epoch. There is no real-time clock, so timestamps
+    /// count on from it with the monotonic clock.
+    time_base: u32,
 
     self_ref: Weak<Ext2Fs>,
 }
@@ -53,7 +72,7 @@ pub struct Ext2Fs {
 impl Ext2Fs {
     pub fn new(blk_device: Arc<dyn BlockDevice>) -> Result<Arc<Self>> {
         let raw_super_block: RawSuperBlock =
-            blk_device.read_val(EXT2_FIRST_SUPERBLOCK_OFFSET / SECTOR_SIZE);
+            blk_device.read_val(EXT2_FIRST_SUPERBLOCK_OFFSET / SECTOR_SIZE)?;
 
         if raw_super_block.magic != EXT2_MAGIC {
             return Err(Error::new(crate::error::Errno::EACCES));
@@ -61,30 +80,63 @@ impl Ext2Fs {
 
         debug!("Ext2 raw super block:{:#x?}", raw_super_block);
 
-        let super_block = SuperBlock::from(raw_super_block);
-
-        // We currently only support exactly one block group.
-        assert!(super_block.inodes_per_group == super_block.inodes_count);
-        assert!(super_block.blocks_per_group == super_block.blocks_count);
-        // We currently only support 4KB block size.
-        assert!(super_block.block_size == 4096);
-
-        let first_group_bid = super_block.group_descriptor_table_bid();
-
-        let raw_descriptor: block_group::RawGroupDescriptor = blk_device
-            .read_val(first_group_bid.0 as usize * super_block.block_size as usize / SECTOR_SIZE);
+        let mut super_block = SuperBlock::from(raw_super_block);
+        if raw_super_block.rev_level == 0 {
+            super_block.inode_size = GOOD_OLD_INODE_SIZE;
+            super_block.first_ino = GOOD_OLD_FIRST_INO;
+        }
+        if !SUPPORTED_BLOCK_SIZES.contains(&super_block.block_size)
+            || super_block.blocks_per_group == 0
+            || super_block.inodes_per_group == 0
+        {
+            return Err(Error::new(Errno::EINVAL));
+        }
 
-        let mut blk_groups = Vec::new();
-        blk_groups.push(BlockGroup::new(raw_descriptor));
+        let block_cache = Arc::new(BlockCache::new(
+            blk_device,
+            super_block.block_size as usize,
+            DEFAULT_CACHE_CAPACITY,
+        ));
+        writeback::register(&block_cache);
+
+        // The descriptor table follows the super block and packs the
+        // descriptors of all groups back to back.
+        let table_bid = super_block.group_descriptor_table_bid().0 as usize;
+        let block_size = super_block.block_size as usize;
+        let blocks_per_group = super_block.blocks_per_group as usize;
+        let num_data_blocks = (super_block.blocks_count - super_block.first_data_block) as usize;
+        let num_groups = num_data_blocks.div_ceil(blocks_per_group);
+        let blk_groups: Vec<BlockGroup> = (0..num_groups)
+            .map(|group_idx| {
+                let offset = group_idx * size_of::<block_group::RawGroupDescriptor>();
+                let location = (table_bid + offset / block_size, offset % block_size);
+                let raw_descriptor: block_group::RawGroupDescriptor =
+                    block_cache.read_val(location.0, location.1);
+                // The last group may be shorter.
+                let num_blocks = core::cmp::min(
+                    blocks_per_group,
+                    num_data_blocks - group_idx * blocks_per_group,
+                );
+                BlockGroup::new(
+                    raw_descriptor,
+                    location,
+                    num_blocks,
+                    super_block.inodes_per_group as usize,
+                )
+            })
+            .collect();
+        debug!("Ext2 block groups: {}", num_groups);
 
         let fs = Arc::new_cyclic(|fs| Ext2Fs {
-            blk_device,
+            block_cache,
             inodes_per_group: super_block.inodes_per_group,
             blocks_per_group: super_block.blocks_per_group,
             block_size: super_block.block_size as usize,
             inode_size: super_block.inode_size as usize,
+            time_base: raw_super_block.mtime.max(raw_super_block.wtime),
             super_block,
-            inode_cache: Mutex::new(BTreeMap::new()),
+            raw_super_block: Mutex::new(raw_super_block),
+            inode_cache: InodeCache::new(DEFAULT_INODE_CACHE_CAPACITY),
             block_groups: blk_groups,
             self_ref: fs.clone(),
         });
@@ -94,19 +146,39 @@ impl Ext2Fs {
 
     fn lookup_inode(&self, inode_number: u32) -> Result<Arc<Inode>> {
         let idx = inode_number - 1;
-        if let Some(inode) = self.inode_cache.lock().get(&inode_number) {
-            return Ok(inode.clone());
+        if let Some(inode) = self.inode_cache.get(inode_number) {
+            return Ok(inode);
         }
 
         if idx >= self.super_block.inodes_count {
             return Err(Error::new(crate::error::Errno::ENOENT));
         }
 
+        let inode = Inode::new(
+            self.inode_ptr(inode_number),
+            inode_number,
+            (idx / self.inodes_per_group) as usize,
+            self.self_ref.clone(),
+        );
+
+        Ok(self.inode_cache.insert(inode_number, inode))
+    }
+
+    /// Returns the current time for timestamps, in seconds since the epoch.
+    fn now(&self) -> u32 {
+        self.time_base
+            .saturating_add(crate::clock::monotonic_time().as_secs() as u32)
+    }
+
+    /// Returns a pointer to the on-disk inode `inode_number`.
+    fn inode_ptr(&self, inode_number: u32) -> BlockPtr<RawInode> {
+        let idx = inode_number - 1;
         let inode_table_block =
             self.block_groups[(idx / self.inodes_per_group) as usize].inode_table_start_bid();
+        let idx_in_group = idx % self.inodes_per_group;
         let inodes_per_block = (self.block_size / self.inode_size) as u32;
-        let bid_offset = Ext2Bid::from(idx / inodes_per_block);
-        let offset_in_block = idx % inodes_per_block;
+        let bid_offset = Ext2Bid::from(idx_in_group / inodes_per_block);
+        let offset_in_block = idx_in_group % inodes_per_block;
         let bid_num = inode_table_block + bid_offset;
 
         debug!(
@@ -114,27 +186,122 @@ impl Ext2Fs {
             inode_table_block, inodes_per_block, bid_offset, offset_in_block, bid_num
         );
 
-        // Convert to sector number and offset within sector
-        let sector =
-            self.bid_to_sector(bid_num) + offset_in_block as usize * self.inode_size / SECTOR_SIZE;
-        let sector_offset = (offset_in_block as usize * self.inode_size) % SECTOR_SIZE;
+        BlockPtr::new(
+            bid_num.0 as usize,
+            offset_in_block as usize * self.inode_size,
+            &self.block_cache,
+        )
+    }
 
-        let sector_ptr: SectorPtr<RawInode> =
-            SectorPtr::new(sector, sector_offset, &self.blk_device);
+    /// Allocates up to `count` blocks in a row, as close after `goal` as
+    /// possible, and returns the first one and their number.
+    ///
+    /// The blocks are zeroed in the block cache, without reading them.
+    fn alloc_blocks(&self, goal: Ext2Bid, count: usize) -> Result<(Ext2Bid, usize)> {
+        let first_data_block = self.super_block.first_data_block as usize;
+        let blocks_per_group = self.blocks_per_group as usize;
+        let goal = (goal.0 as usize).max(first_data_block) - first_data_block;
+        let goal_group = goal / blocks_per_group % self.block_groups.len();
+
+        // The goal's group first, then the others in order.
+        let num_groups = self.block_groups.len();
+        for i in 0..num_groups {
+            let group_idx = (goal_group + i) % num_groups;
+            let group = &self.block_groups[group_idx];
+            if group.free_blocks() == 0 {
+                continue;
+            }
+            let goal_in_group = if i == 0 { goal % blocks_per_group } else { 0 };
+            let Some((first, count)) = group.alloc_blocks(&self.block_cache, goal_in_group, count)
+            else {
+                continue;
+            };
+
+            self.update_raw_super_block(|raw| raw.free_blocks_count -= count as u32);
+            let first = first_data_block + group_idx * blocks_per_group + first;
+            for bid in first..first + count {
+                self.block_cache.zero_block(bid);
+            }
+            return Ok((Ext2Bid(first as u32), count));
+        }
+        Err(Error::new(Errno::ENOSPC))
+    }
 
-        let inode = Inode::new(
-            sector_ptr,
-            inode_number,
-            (idx / self.inodes_per_group) as usize,
-            self.self_ref.clone(),
-        );
+    /// Frees `count` blocks in a row from `first`, which must be in one
+    /// group, and discards them on the device.
+    fn release_blocks(&self, first: Ext2Bid, count: usize) {
+        let first_data_block = self.super_block.first_data_block as usize;
+        let blocks_per_group = self.blocks_per_group as usize;
+        let index = first.0 as usize - first_data_block;
+        let group = &self.block_groups[index / blocks_per_group];
+        group.release_blocks(&self.block_cache, index % blocks_per_group, count);
+
+        self.update_raw_super_block(|raw| raw.free_blocks_count += count as u32);
+        self.block_cache.discard(first.0 as usize, count);
+    }
+
+    /// Allocates an inode, preferring the group `group_idx`, and returns its
+    /// number.
+    fn alloc_inode(&self, group_idx: usize, type_: InodeType) -> Result<u32> {
+        let num_groups = self.block_groups.len();
+        for i in 0..num_groups {
+            let group_idx = (group_idx + i) % num_groups;
+            let group = &self.block_groups[group_idx];
+            if group.free_inodes() == 0 {
+                continue;
+            }
+            let Some(index) = group.alloc_inode(&self.block_cache, type_ == InodeType::Directory)
+            else {
+                continue;
+            };
+
+            self.update_raw_super_block(|raw| raw.free_inodes_count -= 1);
+            return Ok(group_idx as u32 * self.inodes_per_group + index as u32 + 1);
+        }
+        Err(Error::new(Errno::ENOSPC))
+    }
+
+    /// Returns the first block of the group `group_idx`.
+    fn group_first_bid(&self, group_idx: usize) -> Ext2Bid {
+        Ext2Bid(self.super_block.first_data_block + group_idx as u32 * self.blocks_per_group)
+    }
+
+    /// Returns the file type recorded in directory entries of `type_`.
+    fn dir_entry_type(&self, type_: InodeType) -> u8 {
+        if self.super_block.feature_incompat & EXT2_FEATURE_INCOMPAT_FILETYPE == 0 {
+            return 0;
+        }
+        match type_ {
+            InodeType::File => 1,
+            InodeType::Directory => 2,
+            InodeType::SymbolLink => 7,
+        }
+    }
 
-        Ok(inode)
+    /// Modifies the on-disk super block and writes it back to the block cache.
+    fn update_raw_super_block(&self, f: impl FnOnce(&mut RawSuperBlock)) {
+        let mut raw = self.raw_super_block.lock();
+        f(&mut raw);
+        self.block_cache.write_val(
+            EXT2_FIRST_SUPERBLOCK_OFFSET / self.block_size,
+            EXT2_FIRST_SUPERBLOCK_OFFSET % self.block_size,
+            &*raw,
+        );
     }
 
     pub fn bid_to_sector(&self, bid: Ext2Bid) -> usize {
         bid.0 as usize * self.block_size / SECTOR_SIZE
     }
+
+    pub fn block_cache(&self) -> &Arc<BlockCache> {
+        &self.block_cache
+    }
+
+    /// Writes back the cached blocks and flushes the device, failing with
+    /// `EIO` if any of the writes failed.
+    pub fn sync(&self) -> Result<()> {
+        self.block_cache.flush()
+    }
 }
 
 impl Debug for Ext2Fs {
@@ -157,6 +324,13 @@ impl FileSystem for Ext2Fs {
     fn root_inode(&self) -> Arc<dyn crate::fs::Inode> {
         self.lookup_inode(ROOT_INO).unwrap()
     }
+
+    fn sync(&self) {
+        // `sync` has no way to report the failure.
+        if let Err(err) = Ext2Fs::sync(self) {
+            error!("ext2: sync failed: {:?}", err);
+        }
+    }
 }
 
 #[repr(C)]
@@ -176,3 +350,23 @@ impl Add for Ext2Bid {
         Self(self.0 + rhs.0)
     }
 }
+
+#[cfg(ktest)]
+mod test {
+    use ostd::prelude::ktest;
+
+    use super::{Ext2Fs, ROOT_INO};
+    use crate::bench;
+
+    #[ktest]
+    fn bench_ext2_lookup_inode() {
+        let fs = bench::block_devices()
+            .into_iter()
+            .find_map(|device| Ext2Fs::new(device).ok())
+            .expect("no ext2 device");
+        // A hit in the inode cache, as all lookups of an inode but the first.
+        bench::run("ext2_lookup_inode", 1000, || {
+            fs.lookup_inode(ROOT_INO).unwrap();
+        });
+    }
+}
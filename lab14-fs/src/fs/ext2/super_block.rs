@@ -29,11 +29,14 @@ pub struct SuperBlock {
     pub max_mnt_count: u16,
     pub first_ino: u32,
     pub inode_size: u16,
+    pub feature_incompat: u32,
 }
 
 impl SuperBlock {
+    /// Returns the first block of the group descriptor table that follows
+    /// this copy of the super block.
     pub fn group_descriptor_table_bid(&self) -> Ext2Bid {
-        (self.idx * self.blocks_per_group + 1).into()
+        (self.first_data_block + self.idx * self.blocks_per_group + 1).into()
     }
 }
 
@@ -93,6 +96,7 @@ impl From<RawSuperBlock> for SuperBlock {
             max_mnt_count: value.max_mnt_count,
             first_ino: value.first_ino,
             inode_size: value.inode_size,
+            feature_incompat: value.feature_incompat,
             idx: value.block_group_idx as u32,
         }
     }
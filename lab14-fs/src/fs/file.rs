@@ -1,60 +1,170 @@
-use alloc::{sync::Arc, vec};
-use ostd::{
-    early_print,
-    mm::{Fallible, FallibleVmRead, VmReader, VmWriter},
-};
+use alloc::{sync::Arc, vec::Vec};
+use ostd::mm::{Segment, VmReader, VmWriter};
 
 use crate::{
-    console::receive_str,
+    console,
     error::{Errno, Error, Result},
-    fs::Inode,
+    fs::{
+        DirEntry, Inode,
+        epoll::EpollFile,
+        io_uring::IoUring,
+        pipe::{PipeReader, PipeWriter},
+        poll::{IoEvents, Poller},
+    },
 };
-use core::str;
+
+#[derive(Debug, Clone, Copy)]
+pub enum SeekFrom {
+    Start(usize),
+    Current(isize),
+    End(isize),
+}
 
 pub trait FileLike: Sync + Send {
     fn read(&self, writer: VmWriter) -> Result<usize>;
     fn write(&self, reader: VmReader) -> Result<usize>;
 
+    /// Reads at `offset`, leaving the file offset alone, as for `pread`.
+    fn read_at(&self, _offset: usize, _writer: VmWriter) -> Result<usize> {
+        Err(Error::new(Errno::ESPIPE))
+    }
+
+    /// Writes at `offset`, leaving the file offset alone, as for `pwrite`.
+    fn write_at(&self, _offset: usize, _reader: VmReader) -> Result<usize> {
+        Err(Error::new(Errno::ESPIPE))
+    }
+
+    /// Reads into each of `writers` in turn, as for `readv`.
+    fn read_vectored(&self, writers: Vec<VmWriter>) -> Result<usize> {
+        for_each_segment(writers, VmWriter::avail, |_, writer| self.read(writer))
+    }
+
+    /// Writes from each of `readers` in turn, as for `writev`.
+    fn write_vectored(&self, readers: Vec<VmReader>) -> Result<usize> {
+        for_each_segment(readers, VmReader::remain, |_, reader| self.write(reader))
+    }
+
+    /// Reads into each of `writers` in turn from `offset` on, leaving the file
+    /// offset alone, as for `preadv`.
+    fn read_vectored_at(&self, offset: usize, writers: Vec<VmWriter>) -> Result<usize> {
+        for_each_segment(writers, VmWriter::avail, |done, writer| {
+            self.read_at(offset + done, writer)
+        })
+    }
+
+    /// Writes from each of `readers` in turn from `offset` on, leaving the
+    /// file offset alone, as for `pwritev`.
+    fn write_vectored_at(&self, offset: usize, readers: Vec<VmReader>) -> Result<usize> {
+        for_each_segment(readers, VmReader::remain, |done, reader| {
+            self.write_at(offset + done, reader)
+        })
+    }
+
+    /// Lists the directory entries from the file offset on, calling `visit`
+    /// on each until it returns `false`, and then `finish`, as for
+    /// `getdents64`.
+    ///
+    /// Moves the offset past the entries `visit` accepted only if `finish`
+    /// succeeds, so that entries that never reached the caller are listed
+    /// again.
+    fn read_dir(
+        &self,
+        _visit: &mut dyn FnMut(DirEntry) -> bool,
+        _finish: &mut dyn FnMut() -> Result<()>,
+    ) -> Result<()> {
+        Err(Error::new(Errno::ENOTDIR))
+    }
+
+    /// Moves the file offset, and returns the new offset.
+    fn seek(&self, _pos: SeekFrom) -> Result<usize> {
+        Err(Error::new(Errno::ESPIPE))
+    }
+
+    /// Returns the events in `mask`, and the [`IoEvents::ALWAYS`] ones, that
+    /// the file is ready for. With a `poller`, registers it first, to be woken
+    /// when that may change, see [`super::poll`].
+    ///
+    /// Files that never block are always ready.
+    fn poll(&self, mask: IoEvents, _poller: Option<&Arc<Poller>>) -> IoEvents {
+        mask & (IoEvents::IN | IoEvents::OUT | IoEvents::RDNORM | IoEvents::WRNORM)
+    }
+
+    /// Returns the frames of the `pages` pages from `offset` on, for files
+    /// without an inode that share their memory with the processes mapping
+    /// them, as the rings of io_uring do.
+    fn mmap_frames(&self, _offset: usize, _pages: usize) -> Result<Segment<()>> {
+        Err(Error::new(Errno::EBADF))
+    }
+
     fn as_inode(&self) -> Option<Arc<dyn Inode>> {
         None
     }
+
+    fn as_pipe_reader(&self) -> Option<&PipeReader> {
+        None
+    }
+
+    fn as_pipe_writer(&self) -> Option<&PipeWriter> {
+        None
+    }
+
+    fn as_epoll(&self) -> Option<&EpollFile> {
+        None
+    }
+
+    fn as_io_uring(&self) -> Option<&IoUring> {
+        None
+    }
+}
+
+/// Calls `transfer` with the bytes done so far and each segment in turn, until
+/// it moves fewer bytes than the segment's `len`.
+///
+/// An error on the first segment is returned, and one on a later segment ends
+/// the call with what was done, as a short transfer would.
+fn for_each_segment<S>(
+    segments: Vec<S>,
+    len: impl Fn(&S) -> usize,
+    mut transfer: impl FnMut(usize, S) -> Result<usize>,
+) -> Result<usize> {
+    let mut done = 0;
+    for segment in segments {
+        let len = len(&segment);
+        let moved = match transfer(done, segment) {
+            Ok(moved) => moved,
+            Err(err) if done == 0 => return Err(err),
+            Err(_) => break,
+        };
+        done += moved;
+        if moved < len {
+            break;
+        }
+    }
+    Ok(done)
 }
 
 pub struct Stdin;
 
 impl FileLike for Stdin {
+    /// Waits for a line of input, which is echoed as it is typed.
     fn read(&self, mut buf: VmWriter) -> Result<usize> {
-        let mut read_len = 0;
-        let mut need_return = false;
-
-        while !need_return {
-            let mut callback = |mut reader: VmReader<Fallible>| {
-                while reader.has_remain() {
-                    if let Some(ascii_char) =
-                        core::ascii::Char::from_u8(reader.read_val::<u8>().unwrap())
-                    {
-                        read_len += 1;
-                        // Return.
-                        if ascii_char.to_u8() == 13 {
-                            need_return = true;
-                            // We convert "Return" to "New Line" (Ascii 10)
-                            buf.write_val::<u8>(&10).unwrap();
-                        }
-                        // Output the character, although we cannot use backspace and other special char :)
-                        early_print!("{}", ascii_char);
-                        buf.write_val(&ascii_char.to_u8()).unwrap();
-                    }
-                }
-            };
-
-            receive_str(&mut callback);
-        }
-        Ok(read_len)
+        console::read_line(&mut buf)
     }
 
     fn write(&self, _buf: VmReader) -> Result<usize> {
         Err(Error::new(Errno::ENOSYS))
     }
+
+    fn poll(&self, mask: IoEvents, poller: Option<&Arc<Poller>>) -> IoEvents {
+        if let Some(poller) = poller {
+            console::input_pollee().register(poller);
+        }
+        if console::has_input() {
+            mask & (IoEvents::IN | IoEvents::RDNORM)
+        } else {
+            IoEvents::empty()
+        }
+    }
 }
 
 pub struct Stdout;
@@ -64,14 +174,12 @@ impl FileLike for Stdout {
         Err(Error::new(Errno::ENOSYS))
     }
 
-    fn write(&self, mut buf: VmReader) -> Result<usize> {
-        let mut buffer = vec![0u8; buf.remain()];
-        buf.read_fallible(&mut VmWriter::from(&mut buffer as &mut [u8]))
-            .unwrap();
-
-        early_print!("{}", str::from_utf8(&buffer).unwrap());
+    fn write(&self, buf: VmReader) -> Result<usize> {
+        console::send(&mut [buf])
+    }
 
-        Ok(buffer.len())
+    fn write_vectored(&self, mut bufs: Vec<VmReader>) -> Result<usize> {
+        console::send(&mut bufs)
     }
 }
 
@@ -82,13 +190,11 @@ impl FileLike for Stderr {
         Err(Error::new(Errno::ENOSYS))
     }
 
-    fn write(&self, mut buf: VmReader) -> Result<usize> {
-        let mut buffer = vec![0u8; buf.remain()];
-        buf.read_fallible(&mut VmWriter::from(&mut buffer as &mut [u8]))
-            .unwrap();
-
-        early_print!("{}", str::from_utf8(&buffer).unwrap());
+    fn write(&self, buf: VmReader) -> Result<usize> {
+        console::send(&mut [buf])
+    }
 
-        Ok(buffer.len())
+    fn write_vectored(&self, mut bufs: Vec<VmReader>) -> Result<usize> {
+        console::send(&mut bufs)
     }
 }
@@ -1,10 +1,11 @@
-use alloc::{sync::Arc, vec::Vec};
+use alloc::{sync::Arc, vec, vec::Vec};
 
 use crate::fs::{FileLike, Stderr, Stdin, Stdout};
 
 pub type FileDescriptor = i32;
 
 /// Represents an open file entry
+#[derive(Clone)]
 pub struct FileEntry {
     file: Arc<dyn FileLike>,
 }
@@ -20,8 +21,20 @@ impl FileEntry {
 }
 
 /// File table structure
+///
+/// The entries are shared copy-on-write between duplicates, so forking
+/// copies no entries, and a child that calls `execve` or exits without
+/// touching its fds never copies them at all.
 pub struct FileTable {
+    entries: Arc<Entries>,
+}
+
+#[derive(Clone)]
+struct Entries {
     table: Vec<Option<FileEntry>>,
+    /// Bit `fd % 64` of word `fd / 64` is set if `fd` is open, so that the
+    /// lowest free fd is found a word at a time.
+    in_use: Vec<u64>,
     fds_in_use: usize,
 }
 
@@ -29,70 +42,72 @@ impl FileTable {
     /// Creates a new file table
     pub fn new() -> Self {
         FileTable {
-            table: Vec::new(),
-            fds_in_use: 0,
+            entries: Arc::new(Entries {
+                table: Vec::new(),
+                in_use: Vec::new(),
+                fds_in_use: 0,
+            }),
         }
     }
 
     pub fn len(&self) -> usize {
-        self.fds_in_use
+        self.entries.fds_in_use
     }
 
+    /// Returns a table with the same entries, which are copied the first time
+    /// either table is modified.
     pub fn duplicate(&self) -> Self {
-        let mut new_table = Vec::new();
-        for entry in &self.table {
-            if let Some(e) = entry {
-                new_table.push(Some(FileEntry {
-                    file: e.file.clone(),
-                }));
-            } else {
-                new_table.push(None);
-            }
-        }
         FileTable {
-            table: new_table,
-            fds_in_use: self.fds_in_use,
+            entries: self.entries.clone(),
         }
     }
 
     pub fn new_with_standard_io() -> Self {
-        let mut table = Vec::new();
-        table.push(Some(FileEntry {
-            file: Arc::new(Stdin),
-        }));
-        table.push(Some(FileEntry {
-            file: Arc::new(Stdout),
-        }));
-        table.push(Some(FileEntry {
-            file: Arc::new(Stderr),
-        }));
+        let table = vec![
+            Some(FileEntry::new(Arc::new(Stdin))),
+            Some(FileEntry::new(Arc::new(Stdout))),
+            Some(FileEntry::new(Arc::new(Stderr))),
+        ];
         FileTable {
-            table,
-            fds_in_use: 3,
+            entries: Arc::new(Entries {
+                table,
+                in_use: vec![0b111],
+                fds_in_use: 3,
+            }),
         }
     }
 
+    /// Installs `entry` at the lowest free fd.
     pub fn insert(&mut self, entry: FileEntry) -> FileDescriptor {
-        let fd = if self.fds_in_use == self.table.len() {
-            self.table.push(Some(entry));
-            self.fds_in_use as FileDescriptor
-        } else {
-            let index = self.table.iter().position(|e| e.is_none()).unwrap();
-            self.table[index] = Some(entry);
-            index as FileDescriptor
+        let entries = Arc::make_mut(&mut self.entries);
+        let index = match entries.in_use.iter().position(|&word| word != u64::MAX) {
+            Some(word) => word * 64 + entries.in_use[word].trailing_ones() as usize,
+            None => {
+                entries.in_use.push(0);
+                (entries.in_use.len() - 1) * 64
+            }
         };
-        self.fds_in_use += 1;
-        fd
+        entries.in_use[index / 64] |= 1 << (index % 64);
+        if index >= entries.table.len() {
+            entries.table.resize_with(index + 1, || None);
+        }
+        entries.table[index] = Some(entry);
+        entries.fds_in_use += 1;
+        index as FileDescriptor
     }
 
     pub fn get(&self, fd: FileDescriptor) -> Option<&FileEntry> {
-        self.table.get(fd as usize)?.as_ref()
+        self.entries.table.get(fd as usize)?.as_ref()
     }
 
     /// Closes a file descriptor
     pub fn close(&mut self, fd: FileDescriptor) -> Option<FileEntry> {
-        let entry = self.table.get_mut(fd as usize)?.take()?;
-        self.fds_in_use -= 1;
+        // Do not copy shared entries only to find that `fd` is not open.
+        self.get(fd)?;
+        let entries = Arc::make_mut(&mut self.entries);
+        let entry = entries.table[fd as usize].take()?;
+        entries.in_use[fd as usize / 64] &= !(1 << (fd as usize % 64));
+        entries.fds_in_use -= 1;
         Some(entry)
     }
 }
@@ -0,0 +1,349 @@
+//! The submission and completion rings of `io_uring_setup`.
+//!
+//! The rings live in kernel frames that the process maps with `mmap`, with
+//! the layout of Linux: one mapping holds the ring heads and tails, the
+//! completion queue entries (CQEs) and the submission queue (SQ) array, and
+//! another the submission queue entries (SQEs). The process writes SQEs and
+//! moves the SQ tail, and `io_uring_enter` takes a batch of them, runs each
+//! to completion in order, and posts their results to the completion queue
+//! (CQ).
+//!
+//! The kernel keeps its own SQ head and CQ tail, so that a process scribbling
+//! over the shared ones only confuses itself.
+
+use core::sync::atomic::{Ordering, fence};
+
+use alloc::{sync::Arc, vec::Vec};
+use ostd::{
+    Pod,
+    mm::{FrameAllocOptions, PAGE_SIZE, Segment, VmIo, VmReader, VmWriter},
+    sync::Mutex,
+};
+
+use crate::{
+    error::{Errno, Error, Result},
+    fs::{
+        FileLike,
+        poll::{IoEvents, Pollee, Poller},
+    },
+};
+
+/// The most SQEs a ring may have.
+const MAX_ENTRIES: u32 = 4096;
+
+/// The `mmap` offsets of the rings and of the SQEs.
+pub const IORING_OFF_SQ_RING: usize = 0;
+pub const IORING_OFF_CQ_RING: usize = 0x800_0000;
+pub const IORING_OFF_SQES: usize = 0x1000_0000;
+
+// Where the fields of the rings are, in the first mapping.
+const SQ_HEAD: usize = 0;
+const SQ_TAIL: usize = 4;
+const SQ_RING_MASK: usize = 8;
+const SQ_RING_ENTRIES: usize = 12;
+const SQ_FLAGS: usize = 16;
+const SQ_DROPPED: usize = 20;
+const CQ_HEAD: usize = 64;
+const CQ_TAIL: usize = 68;
+const CQ_RING_MASK: usize = 72;
+const CQ_RING_ENTRIES: usize = 76;
+const CQ_OVERFLOW: usize = 80;
+const CQ_FLAGS: usize = 84;
+const CQES: usize = 128;
+
+/// A submission queue entry, the `struct io_uring_sqe` of Linux.
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy, Pod)]
+pub struct Sqe {
+    pub opcode: u8,
+    pub flags: u8,
+    pub ioprio: u16,
+    pub fd: i32,
+    pub off: u64,
+    pub addr: u64,
+    pub len: u32,
+    /// The flags of the operation, e.g., those of `openat`.
+    pub op_flags: u32,
+    pub user_data: u64,
+    pub buf_index: u16,
+    pub personality: u16,
+    pub splice_fd_in: i32,
+    pub addr3: u64,
+    _pad: u64,
+}
+
+/// A completion queue entry, the `struct io_uring_cqe` of Linux.
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy, Pod)]
+struct Cqe {
+    user_data: u64,
+    res: i32,
+    flags: u32,
+}
+
+/// The `struct io_sqring_offsets` of Linux.
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy, Pod)]
+pub struct SqRingOffsets {
+    pub head: u32,
+    pub tail: u32,
+    pub ring_mask: u32,
+    pub ring_entries: u32,
+    pub flags: u32,
+    pub dropped: u32,
+    pub array: u32,
+    pub resv1: u32,
+    pub user_addr: u64,
+}
+
+/// The `struct io_cqring_offsets` of Linux.
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy, Pod)]
+pub struct CqRingOffsets {
+    pub head: u32,
+    pub tail: u32,
+    pub ring_mask: u32,
+    pub ring_entries: u32,
+    pub overflow: u32,
+    pub cqes: u32,
+    pub flags: u32,
+    pub resv1: u32,
+    pub user_addr: u64,
+}
+
+pub struct IoUring {
+    /// The heads and tails, the CQEs and the SQ array.
+    rings: Segment<()>,
+    sqes: Segment<()>,
+    sq_entries: u32,
+    cq_entries: u32,
+    /// Where the SQ array starts in `rings`.
+    sq_array: usize,
+    /// The kernel's SQ head and CQ tail, taken by submissions only while they
+    /// take SQEs and post CQEs.
+    state: Mutex<RingState>,
+    /// Notified when completions are posted.
+    pollee: Pollee,
+}
+
+struct RingState {
+    sq_head: u32,
+    cq_tail: u32,
+    /// The CQEs kept free for the SQEs taken and still running.
+    cq_reserved: u32,
+}
+
+impl IoUring {
+    /// Makes rings of at least `sq_entries` SQEs and, if given, at least
+    /// `cq_entries` CQEs, or twice as many as SQEs otherwise.
+    pub fn new(sq_entries: u32, cq_entries: Option<u32>) -> Result<Self> {
+        if sq_entries == 0 || sq_entries > MAX_ENTRIES {
+            return Err(Error::new(Errno::EINVAL));
+        }
+        let sq_entries = sq_entries.next_power_of_two();
+        let cq_entries = match cq_entries {
+            Some(entries) if entries < sq_entries || entries > 2 * MAX_ENTRIES => {
+                return Err(Error::new(Errno::EINVAL));
+            }
+            Some(entries) => entries.next_power_of_two(),
+            None => 2 * sq_entries,
+        };
+
+        let sq_array = CQES + cq_entries as usize * size_of::<Cqe>();
+        let rings_len = sq_array + sq_entries as usize * size_of::<u32>();
+        let sqes_len = sq_entries as usize * size_of::<Sqe>();
+        let alloc = |len: usize| {
+            FrameAllocOptions::new()
+                .alloc_segment(len.div_ceil(PAGE_SIZE))
+                .map_err(|_| Error::new(Errno::ENOMEM))
+        };
+        let ring = Self {
+            rings: alloc(rings_len)?,
+            sqes: alloc(sqes_len)?,
+            sq_entries,
+            cq_entries,
+            sq_array,
+            state: Mutex::new(RingState {
+                sq_head: 0,
+                cq_tail: 0,
+                cq_reserved: 0,
+            }),
+            pollee: Pollee::new(),
+        };
+        ring.store(SQ_RING_MASK, sq_entries - 1);
+        ring.store(SQ_RING_ENTRIES, sq_entries);
+        ring.store(CQ_RING_MASK, cq_entries - 1);
+        ring.store(CQ_RING_ENTRIES, cq_entries);
+        Ok(ring)
+    }
+
+    pub fn sq_entries(&self) -> u32 {
+        self.sq_entries
+    }
+
+    pub fn cq_entries(&self) -> u32 {
+        self.cq_entries
+    }
+
+    pub fn sq_offsets(&self) -> SqRingOffsets {
+        SqRingOffsets {
+            head: SQ_HEAD as u32,
+            tail: SQ_TAIL as u32,
+            ring_mask: SQ_RING_MASK as u32,
+            ring_entries: SQ_RING_ENTRIES as u32,
+            flags: SQ_FLAGS as u32,
+            dropped: SQ_DROPPED as u32,
+            array: self.sq_array as u32,
+            ..Default::default()
+        }
+    }
+
+    pub fn cq_offsets(&self) -> CqRingOffsets {
+        CqRingOffsets {
+            head: CQ_HEAD as u32,
+            tail: CQ_TAIL as u32,
+            ring_mask: CQ_RING_MASK as u32,
+            ring_entries: CQ_RING_ENTRIES as u32,
+            overflow: CQ_OVERFLOW as u32,
+            cqes: CQES as u32,
+            flags: CQ_FLAGS as u32,
+            ..Default::default()
+        }
+    }
+
+    /// Takes up to `to_submit` SQEs, and posts the results `run` returns for
+    /// them, one per SQE and in order, as their completions.
+    ///
+    /// Takes no more SQEs than the CQ has room for, and fails with `EBUSY` if
+    /// it has none. Returns how many SQEs were taken, including those with an
+    /// SQ array index out of range, which are dropped.
+    ///
+    /// `run` runs with the lock released, as the SQEs may block, and room for
+    /// their CQEs is reserved meanwhile.
+    pub fn submit(&self, to_submit: u32, run: impl FnOnce(&[Sqe]) -> Vec<i32>) -> Result<usize> {
+        let mut state = self.state.lock();
+
+        let sq_tail = self.load(SQ_TAIL);
+        let cq_head = self.load(CQ_HEAD);
+        // Pairs with the release of the process moving the tail.
+        fence(Ordering::Acquire);
+        let pending = sq_tail.wrapping_sub(state.sq_head).min(self.sq_entries);
+        let cq_free = self
+            .cq_entries
+            .saturating_sub(state.cq_tail.wrapping_sub(cq_head))
+            .saturating_sub(state.cq_reserved);
+        let count = to_submit.min(pending);
+        if count > 0 && cq_free == 0 {
+            return Err(Error::new(Errno::EBUSY));
+        }
+        let count = count.min(cq_free);
+
+        let mut sqes = Vec::with_capacity(count as usize);
+        let mut dropped = 0;
+        for i in 0..count {
+            let slot = state.sq_head.wrapping_add(i) & (self.sq_entries - 1);
+            let index: u32 = self.load(self.sq_array + slot as usize * size_of::<u32>());
+            if index >= self.sq_entries {
+                dropped += 1;
+                continue;
+            }
+            let sqe = self
+                .sqes
+                .read_val(index as usize * size_of::<Sqe>())
+                .unwrap();
+            sqes.push(sqe);
+        }
+        state.sq_head = state.sq_head.wrapping_add(count);
+        // The SQEs were copied, so the process may reuse them.
+        self.store(SQ_HEAD, state.sq_head);
+        if dropped > 0 {
+            self.store(SQ_DROPPED, self.load(SQ_DROPPED).wrapping_add(dropped));
+        }
+        let reserved = sqes.len() as u32;
+        state.cq_reserved += reserved;
+        drop(state);
+
+        let results = run(&sqes);
+        let mut state = self.state.lock();
+        state.cq_reserved -= reserved;
+        for (sqe, res) in sqes.iter().zip(results) {
+            let slot = state.cq_tail & (self.cq_entries - 1);
+            let cqe = Cqe {
+                user_data: sqe.user_data,
+                res,
+                flags: 0,
+            };
+            self.rings
+                .write_val(CQES + slot as usize * size_of::<Cqe>(), &cqe)
+                .unwrap();
+            state.cq_tail = state.cq_tail.wrapping_add(1);
+        }
+        // The CQEs must be visible before the tail that publishes them.
+        fence(Ordering::Release);
+        self.store(CQ_TAIL, state.cq_tail);
+        drop(state);
+
+        if !sqes.is_empty() {
+            self.pollee.notify();
+        }
+        Ok(count as usize)
+    }
+
+    /// Returns how many completions the process has not consumed.
+    fn completions(&self) -> u32 {
+        let cq_tail = self.state.lock().cq_tail;
+        cq_tail
+            .wrapping_sub(self.load(CQ_HEAD))
+            .min(self.cq_entries)
+    }
+
+    fn load(&self, offset: usize) -> u32 {
+        self.rings.read_val(offset).unwrap()
+    }
+
+    fn store(&self, offset: usize, value: u32) {
+        self.rings.write_val(offset, &value).unwrap();
+    }
+}
+
+impl FileLike for IoUring {
+    fn read(&self, _writer: VmWriter) -> Result<usize> {
+        Err(Error::new(Errno::EINVAL))
+    }
+
+    fn write(&self, _reader: VmReader) -> Result<usize> {
+        Err(Error::new(Errno::EINVAL))
+    }
+
+    /// Readable while completions are not consumed.
+    fn poll(&self, mask: IoEvents, poller: Option<&Arc<Poller>>) -> IoEvents {
+        if let Some(poller) = poller {
+            self.pollee.register(poller);
+        }
+        if self.completions() > 0 {
+            mask & (IoEvents::IN | IoEvents::RDNORM)
+        } else {
+            IoEvents::empty()
+        }
+    }
+
+    fn mmap_frames(&self, offset: usize, pages: usize) -> Result<Segment<()>> {
+        let (segment, offset) = if offset >= IORING_OFF_SQES {
+            (&self.sqes, offset - IORING_OFF_SQES)
+        } else if offset >= IORING_OFF_CQ_RING {
+            (&self.rings, offset - IORING_OFF_CQ_RING)
+        } else {
+            (&self.rings, offset - IORING_OFF_SQ_RING)
+        };
+        let end = pages
+            .checked_mul(PAGE_SIZE)
+            .and_then(|len| offset.checked_add(len))
+            .filter(|&end| end <= segment.size())
+            .ok_or(Error::new(Errno::EINVAL))?;
+        Ok(segment.slice(&(offset..end)))
+    }
+
+    fn as_io_uring(&self) -> Option<&IoUring> {
+        Some(self)
+    }
+}
@@ -0,0 +1,99 @@
+//! The mount table, which grafts the root directories of file systems over
+//! directories of the root file system or of other mounts.
+//!
+//! Path walks cross into a mounted file system when they reach the directory
+//! it covers, see [`PathString::lookup`](super::util::PathString::lookup).
+
+use alloc::{sync::Arc, vec::Vec};
+use ostd::sync::RwLock;
+
+use crate::{
+    error::{Errno, Error, Result},
+    fs::{FileSystem, Inode, InodeType, ROOT, util::PathString},
+};
+
+/// The mounts, in the order they were made. There are few, so lookups scan.
+static MOUNTS: RwLock<Vec<Mount>> = RwLock::new(Vec::new());
+
+struct Mount {
+    /// The directory the mount covers. Holding it keeps its file system from
+    /// dropping and reloading it, so it stays the same object.
+    covered: Arc<dyn Inode>,
+    root: Arc<dyn Inode>,
+    fs: Arc<dyn FileSystem>,
+}
+
+/// Mounts `fs` over the directory at `path`, creating the directory if it does
+/// not exist.
+pub fn mount(path: &str, fs: Arc<dyn FileSystem>) -> Result<()> {
+    let root = ROOT.get().ok_or(Error::new(Errno::ENOENT))?.root_inode();
+    let covered = match PathString::new(path).lookup(&root) {
+        Ok(inode) => inode,
+        Err(err) if err.code == Errno::ENOENT => {
+            PathString::new(path).create(&root, InodeType::Directory)?
+        }
+        Err(err) => return Err(err),
+    };
+    if covered.typ() != InodeType::Directory {
+        return Err(Error::new(Errno::ENOTDIR));
+    }
+
+    let mut mounts = MOUNTS.write();
+    if mounts
+        .iter()
+        .any(|mount| same_inode(&mount.covered, &covered))
+    {
+        return Err(Error::new(Errno::EBUSY));
+    }
+    mounts.push(Mount {
+        covered,
+        root: fs.root_inode(),
+        fs,
+    });
+    Ok(())
+}
+
+/// Returns the root of the file system mounted over `inode`, or `inode` if
+/// nothing is.
+pub fn cross_down(inode: Arc<dyn Inode>) -> Arc<dyn Inode> {
+    let mounts = MOUNTS.read();
+    if mounts.is_empty() {
+        return inode;
+    }
+    let mut current = inode;
+    // A mount may itself be covered by a later one.
+    while let Some(mount) = mounts
+        .iter()
+        .find(|mount| same_inode(&mount.covered, &current))
+    {
+        current = mount.root.clone();
+    }
+    current
+}
+
+/// Returns the directory the file system rooted at `inode` covers, or `inode`
+/// if it is not the root of a mount, so that `..` leaves the mount.
+pub fn cross_up(inode: Arc<dyn Inode>) -> Arc<dyn Inode> {
+    let mounts = MOUNTS.read();
+    let mut current = inode;
+    while let Some(mount) = mounts
+        .iter()
+        .find(|mount| same_inode(&mount.root, &current))
+    {
+        current = mount.covered.clone();
+    }
+    current
+}
+
+/// Writes the dirty data of the mounted file systems to their devices.
+pub fn sync_all() {
+    let file_systems: Vec<Arc<dyn FileSystem>> =
+        MOUNTS.read().iter().map(|mount| mount.fs.clone()).collect();
+    for fs in file_systems {
+        fs.sync();
+    }
+}
+
+fn same_inode(a: &Arc<dyn Inode>, b: &Arc<dyn Inode>) -> bool {
+    Arc::as_ptr(a) as *const () == Arc::as_ptr(b) as *const ()
+}
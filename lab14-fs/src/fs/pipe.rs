@@ -1,8 +1,19 @@
+use core::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+
 use crate::error::{Errno, Error, Result};
-use crate::fs::FileLike;
-use alloc::sync::Arc;
-use ostd::mm::{FrameAllocOptions, PAGE_SIZE, Segment, VmIo, VmReader, VmWriter};
-use spin::Mutex;
+use crate::fs::poll::{IoEvents, Pollee, Poller};
+use crate::fs::{FileLike, Inode};
+use crate::lock_stat::{StatMutex, lock_site};
+use crate::mm::shrinker;
+use crate::sched;
+use crate::stats::{self, Stat};
+use align_ext::AlignExt;
+use alloc::{sync::Arc, vec, vec::Vec};
+use ostd::mm::{
+    FallibleVmRead, FallibleVmWrite, Frame, FrameAllocOptions, Infallible, PAGE_SIZE, VmReader,
+    VmWriter, io_util::HasVmReaderWriter,
+};
+use ostd::sync::{SpinLock, WaitQueue};
 
 pub struct PipeReader {
     pipe: Arc<Pipe>,
@@ -12,30 +23,85 @@ pub struct PipeWriter {
     pipe: Arc<Pipe>,
 }
 
+/// A single-producer, single-consumer ring buffer.
+///
+/// The reader only moves `head` and the writer only moves `tail`, so the two
+/// ends never contend on a lock. Readers sharing the read end take turns
+/// through `read_lock`, and writers through `write_lock`.
+///
+/// The pages of the ring are allocated when written to and released once read,
+/// so an idle pipe holds no memory. A slot is reused only once the reader is
+/// done with the page in it, so the space free is counted in whole pages from
+/// the one the reader is on, see [`Self::writable`].
 pub struct Pipe {
-    buffer: Segment<()>,
-    inner: Mutex<Inner>,
-}
-
-struct Inner {
-    pos: usize,
-    current_size: usize,
+    /// The page slots of the ring. Byte `pos` lives in slot
+    /// `pos / PAGE_SIZE % pages.len()`.
+    pages: SpinLock<Vec<Option<Frame<()>>>>,
+    /// The number of bytes ever read.
+    head: AtomicUsize,
+    /// The number of bytes ever written.
+    tail: AtomicUsize,
+    /// Taken before `write_lock` when both are needed.
+    read_lock: StatMutex<()>,
+    write_lock: StatMutex<()>,
+    /// Readers wait here for data, or for the write end to close.
+    read_queue: WaitQueue,
+    /// Writers wait here for space, or for the read end to close.
+    write_queue: WaitQueue,
+    reader_closed: AtomicBool,
+    writer_closed: AtomicBool,
+    /// Notified whenever `read_queue` or `write_queue` is woken.
+    pollee: Pollee,
 }
 
 const DEFAULT_PIPE_BUF_SIZE: usize = 65536;
+/// The capacity of a new pipe in the low-memory mode, see [`shrinker`].
+const LOW_MEMORY_PIPE_BUF_SIZE: usize = 16384;
+
+/// The size up to which writes are atomic.
+pub const PIPE_BUF: usize = PAGE_SIZE;
+
+/// The largest capacity `F_SETPIPE_SZ` may set.
+pub const MAX_PIPE_BUF_SIZE: usize = 1024 * 1024;
+
+/// The total capacity of all pipes, in pages, past which new pipes get a
+/// single page and pipes cannot grow.
+const PIPE_PAGES_LIMIT: usize = 16384;
+/// The limit in the low-memory mode.
+const LOW_MEMORY_PIPE_PAGES_LIMIT: usize = 2048;
+
+/// The total capacity of all pipes, in pages.
+static PIPE_PAGES: AtomicUsize = AtomicUsize::new(0);
+/// The frames the pipes hold, which back their buffered data.
+static PIPE_FRAMES: AtomicUsize = AtomicUsize::new(0);
 
 impl Pipe {
     pub fn new_pair() -> (Arc<PipeReader>, Arc<PipeWriter>) {
-        let buffer = FrameAllocOptions::new()
-            .alloc_segment(DEFAULT_PIPE_BUF_SIZE / PAGE_SIZE)
-            .unwrap();
+        let default_size = if shrinker::is_low_memory() {
+            LOW_MEMORY_PIPE_BUF_SIZE
+        } else {
+            DEFAULT_PIPE_BUF_SIZE
+        };
+        let default_pages = default_size / PAGE_SIZE;
+        let pages = if reserve_pages(default_pages) {
+            default_pages
+        } else {
+            // Over the limit, a pipe still works, just in smaller steps.
+            PIPE_PAGES.fetch_add(1, Ordering::Relaxed);
+            1
+        };
 
         let pipe = Arc::new(Self {
-            buffer,
-            inner: Mutex::new(Inner {
-                pos: 0,
-                current_size: 0,
-            }),
+            pages: SpinLock::new(vec![None; pages]),
+            head: AtomicUsize::new(0),
+            tail: AtomicUsize::new(0),
+            read_lock: StatMutex::new((), lock_site!("pipe.read")),
+            write_lock: StatMutex::new((), lock_site!("pipe.write")),
+            read_queue: WaitQueue::new(),
+            write_queue: WaitQueue::new(),
+            reader_closed: AtomicBool::new(false),
+            writer_closed: AtomicBool::new(false),
+            pollee: Pollee::new(),
         });
 
         let reader = Arc::new(PipeReader { pipe: pipe.clone() });
@@ -43,93 +109,570 @@ impl Pipe {
 
         (reader, writer)
     }
-}
 
-impl FileLike for PipeWriter {
-    fn read(&self, _writer: VmWriter) -> Result<usize> {
-        Err(Error::new(Errno::EBADF))
+    /// Returns the capacity in bytes.
+    pub fn capacity(&self) -> usize {
+        self.pages.lock().len() * PAGE_SIZE
     }
 
-    fn write(&self, mut reader: VmReader) -> Result<usize> {
-        let mut total_written = 0;
-        let mut inner = self.pipe.inner.lock();
+    /// Sets the capacity to at least `size` bytes, rounded up to a power of
+    /// two number of pages, and returns the new capacity.
+    ///
+    /// Fails with `EBUSY` if the buffered data would not fit, and with `EPERM`
+    /// above [`MAX_PIPE_BUF_SIZE`] or the system-wide limit.
+    pub fn set_capacity(&self, size: usize) -> Result<usize> {
+        if size > MAX_PIPE_BUF_SIZE {
+            return Err(Error::new(Errno::EPERM));
+        }
+        let new_len = size.div_ceil(PAGE_SIZE).max(1).next_power_of_two();
 
-        loop {
-            let current_size = inner.current_size;
-            if current_size >= DEFAULT_PIPE_BUF_SIZE {
+        // Stop both ends, so that nothing moves while the slots are rebuilt.
+        let _read_guard = self.read_lock.lock();
+        let _write_guard = self.write_lock.lock();
+        let head = self.head.load(Ordering::Relaxed);
+        let tail = self.tail.load(Ordering::Relaxed);
+
+        let mut pages = self.pages.lock();
+        let old_len = pages.len();
+        if new_len == old_len {
+            return Ok(new_len * PAGE_SIZE);
+        }
+        // The buffered data must fit in whole pages of the new ring.
+        if tail - head.align_down(PAGE_SIZE) > new_len * PAGE_SIZE {
+            return Err(Error::new(Errno::EBUSY));
+        }
+        let first_page = head / PAGE_SIZE;
+        let end_page = tail.div_ceil(PAGE_SIZE);
+        if new_len > old_len && !reserve_pages(new_len - old_len) {
+            return Err(Error::new(Errno::EPERM));
+        }
+
+        let mut new_pages = vec![None; new_len];
+        for page in first_page..end_page {
+            new_pages[page % new_len] = pages[page % old_len].take();
+        }
+        let old_pages = core::mem::replace(&mut *pages, new_pages);
+        PIPE_FRAMES.fetch_sub(old_pages.iter().flatten().count(), Ordering::Relaxed);
+        if new_len < old_len {
+            PIPE_PAGES.fetch_sub(old_len - new_len, Ordering::Relaxed);
+        }
+        drop(pages);
+
+        // Writers may have room now.
+        self.write_queue.wake_all();
+        self.pollee.notify();
+        Ok(new_len * PAGE_SIZE)
+    }
+
+    /// Returns the frame of the page holding byte `pos`, allocating it if it
+    /// is not there.
+    fn page_for_write(&self, pos: usize) -> Frame<()> {
+        let mut pages = self.pages.lock();
+        let slot = pos / PAGE_SIZE % pages.len();
+        if let Some(frame) = &pages[slot] {
+            return frame.clone();
+        }
+        // Every byte is written before it is read, so no need to zero.
+        let frame = FrameAllocOptions::new()
+            .zeroed(false)
+            .alloc_frame()
+            .unwrap();
+        pages[slot] = Some(frame.clone());
+        PIPE_FRAMES.fetch_add(1, Ordering::Relaxed);
+        frame
+    }
+
+    /// Returns the frame of the page holding byte `pos`, which is buffered.
+    fn page_for_read(&self, pos: usize) -> Frame<()> {
+        let pages = self.pages.lock();
+        pages[pos / PAGE_SIZE % pages.len()].clone().unwrap()
+    }
+
+    /// Releases the page holding byte `pos`, which has been read to its end.
+    fn release_page(&self, pos: usize) {
+        let mut pages = self.pages.lock();
+        let slot = pos / PAGE_SIZE % pages.len();
+        if pages[slot].take().is_some() {
+            PIPE_FRAMES.fetch_sub(1, Ordering::Relaxed);
+        }
+    }
+
+    /// Returns the number of bytes buffered. Exact for the reader.
+    fn readable(&self) -> usize {
+        self.tail.load(Ordering::Acquire) - self.head.load(Ordering::Relaxed)
+    }
+
+    /// Returns the number of bytes that fit. Exact for the writer.
+    ///
+    /// The page the reader is on counts as used in full, as the writer must
+    /// not wrap into its slot before the reader releases it.
+    fn writable(&self) -> usize {
+        let head = self.head.load(Ordering::Acquire);
+        self.capacity() - (self.tail.load(Ordering::Relaxed) - head.align_down(PAGE_SIZE))
+    }
+
+    /// Appends up to `len` bytes, which must fit, handing `fill` a writer for
+    /// each page of the free space. `fill` returns how much it wrote, and a
+    /// short write ends the call.
+    ///
+    /// The caller must be in [`Self::write_with`].
+    fn produce(
+        &self,
+        len: usize,
+        mut fill: impl FnMut(VmWriter<'_, Infallible>) -> Result<usize>,
+    ) -> Result<usize> {
+        let tail = self.tail.load(Ordering::Relaxed);
+        let mut done = 0;
+        while done < len {
+            let pos = tail + done;
+            let offset = pos % PAGE_SIZE;
+            let chunk = (len - done).min(PAGE_SIZE - offset);
+            let frame = self.page_for_write(pos);
+            let mut writer = frame.writer();
+            writer.skip(offset).limit(chunk);
+
+            let written = match fill(writer) {
+                Ok(written) => written,
+                Err(err) if done == 0 => return Err(err),
+                Err(_) => break,
+            };
+            done += written;
+            if written < chunk {
                 break;
             }
+        }
+        // Publish the data to the reader.
+        self.tail.store(tail + done, Ordering::Release);
+        Ok(done)
+    }
 
-            let write_pos = (inner.pos + current_size) % DEFAULT_PIPE_BUF_SIZE;
+    /// Takes up to `len` buffered bytes, handing `drain` a reader for each
+    /// page of them. `drain` returns how much it read, and a short read ends
+    /// the call.
+    ///
+    /// The caller must be in [`Self::read_with`].
+    fn consume(
+        &self,
+        len: usize,
+        mut drain: impl FnMut(VmReader<'_, Infallible>) -> Result<usize>,
+    ) -> Result<usize> {
+        let head = self.head.load(Ordering::Relaxed);
+        let mut done = 0;
+        while done < len {
+            let pos = head + done;
+            let offset = pos % PAGE_SIZE;
+            let chunk = (len - done).min(PAGE_SIZE - offset);
+            let frame = self.page_for_read(pos);
+            let mut reader = frame.reader();
+            reader.skip(offset).limit(chunk);
 
-            let to_write = core::cmp::min(reader.remain(), DEFAULT_PIPE_BUF_SIZE - current_size);
-            if to_write == 0 {
+            let read = match drain(reader) {
+                Ok(read) => read,
+                Err(err) if done == 0 => return Err(err),
+                Err(_) => break,
+            };
+            done += read;
+            if offset + read == PAGE_SIZE {
+                // Before `head` moves on, so that the writer cannot reuse the
+                // slot yet.
+                self.release_page(pos);
+            }
+            if read < chunk {
                 break;
             }
+        }
+        // Hand the space back to the writer.
+        self.head.store(head + done, Ordering::Release);
+        if done > 0 {
+            self.skip_drained_page();
+        }
+        stats::add(Stat::PipeBytes, done as u64);
+        Ok(done)
+    }
+
+    /// Moves both ends past the rest of the page the reader is on, if the pipe
+    /// is drained, so that the writer has the whole ring again. Otherwise a
+    /// pipe of one page drained mid-page could never take a write of
+    /// [`PIPE_BUF`] bytes.
+    ///
+    /// The caller must be in [`Self::read_with`].
+    fn skip_drained_page(&self) {
+        let head = self.head.load(Ordering::Relaxed);
+        if head % PAGE_SIZE == 0 || self.tail.load(Ordering::Acquire) != head {
+            return;
+        }
+        let _write_guard = self.write_lock.lock();
+        if self.tail.load(Ordering::Relaxed) != head {
+            return;
+        }
+        self.release_page(head);
+        let next = head.align_up(PAGE_SIZE);
+        self.tail.store(next, Ordering::Release);
+        self.head.store(next, Ordering::Release);
+    }
+
+    /// Waits for data, then calls `read` with the read end to itself and the
+    /// number of bytes buffered. Returns 0 once the write end is closed and the
+    /// pipe is drained.
+    ///
+    /// No lock is held while waiting, so that `set_capacity` is not held up
+    /// by an idle reader.
+    fn read_with(&self, mut read: impl FnMut(usize) -> Result<usize>) -> Result<usize> {
+        loop {
+            self.read_queue.wait_until(|| {
+                (self.writer_closed.load(Ordering::Acquire) || self.readable() > 0).then_some(())
+            });
+
+            let _guard = self.read_lock.lock();
+            // Check for closing first, so that data written just before it is
+            // not missed.
+            let writer_closed = self.writer_closed.load(Ordering::Acquire);
+            let readable = self.readable();
+            if readable == 0 {
+                if writer_closed {
+                    return Ok(0);
+                }
+                // Another reader took the data.
+                continue;
+            }
 
-            let buffer_offset = write_pos % DEFAULT_PIPE_BUF_SIZE;
-            let first_chunk = core::cmp::min(to_write, DEFAULT_PIPE_BUF_SIZE - buffer_offset);
-            let second_chunk = to_write - first_chunk;
+            let done = read(readable)?;
+            if done > 0 {
+                // The writer likely waits for this reader to take more.
+                sched::wake_affine(|| {
+                    self.write_queue.wake_all();
+                    self.pollee.notify();
+                });
+            }
+            return Ok(done);
+        }
+    }
 
-            // Write first chunk
-            self.pipe.buffer.write(buffer_offset, &mut reader).unwrap();
-            total_written += first_chunk;
+    /// Waits for at least `min_space` bytes of space, then calls `write` with
+    /// the write end to itself and the space available. Fails with `EPIPE`
+    /// once the read end is closed.
+    fn write_with(
+        &self,
+        min_space: usize,
+        mut write: impl FnMut(usize) -> Result<usize>,
+    ) -> Result<usize> {
+        // A write never needs more than the whole buffer.
+        let enough = |writable: usize| writable >= min_space.min(self.capacity());
+        loop {
+            self.write_queue.wait_until(|| {
+                (self.reader_closed.load(Ordering::Acquire) || enough(self.writable()))
+                    .then_some(())
+            });
 
-            // Write second chunk if needed
-            if second_chunk > 0 {
-                self.pipe.buffer.write(0, &mut reader).unwrap();
-                total_written += second_chunk;
+            let _guard = self.write_lock.lock();
+            if self.reader_closed.load(Ordering::Acquire) {
+                return Err(Error::new(Errno::EPIPE));
+            }
+            let writable = self.writable();
+            if !enough(writable) {
+                // Another writer took the space, or the capacity shrank.
+                continue;
             }
 
-            inner.current_size += to_write;
+            let done = write(writable)?;
+            if done > 0 {
+                // The reader likely replies, and this writer waits for it.
+                sched::wake_affine(|| {
+                    self.read_queue.wake_all();
+                    self.pollee.notify();
+                });
+            }
+            return Ok(done);
         }
+    }
+}
 
-        Ok(total_written)
+/// Copies from the first of `readers` with data left into `writer`, moving on
+/// to the next one until `writer` is full or `readers` run out.
+///
+/// A fault ends the copy, and fails it only if nothing was copied.
+fn gather(readers: &mut [VmReader], writer: &mut VmWriter<'_, Infallible>) -> Result<usize> {
+    let mut copied = 0;
+    for reader in readers.iter_mut().filter(|reader| reader.has_remain()) {
+        if !writer.has_avail() {
+            break;
+        }
+        match reader.read_fallible(writer) {
+            Ok(len) => copied += len,
+            Err((_, len)) if copied + len > 0 => return Ok(copied + len),
+            Err(_) => return Err(Error::new(Errno::EFAULT)),
+        }
     }
+    Ok(copied)
 }
 
-impl FileLike for PipeReader {
-    fn read(&self, mut writer: VmWriter) -> Result<usize> {
-        let mut total_read = 0;
-        let mut inner = Some(self.pipe.inner.lock());
+/// Copies from `reader` into the first of `writers` with room left, moving on
+/// to the next one until `reader` is drained or `writers` are full.
+///
+/// A fault ends the copy, and fails it only if nothing was copied.
+fn scatter(reader: &mut VmReader<'_, Infallible>, writers: &mut [VmWriter]) -> Result<usize> {
+    let mut copied = 0;
+    for writer in writers.iter_mut().filter(|writer| writer.has_avail()) {
+        if !reader.has_remain() {
+            break;
+        }
+        match writer.write_fallible(reader) {
+            Ok(len) => copied += len,
+            Err((_, len)) if copied + len > 0 => return Ok(copied + len),
+            Err(_) => return Err(Error::new(Errno::EFAULT)),
+        }
+    }
+    Ok(copied)
+}
 
-        let mut inner = inner.take().unwrap();
+impl Drop for Pipe {
+    fn drop(&mut self) {
+        let pages = self.pages.get_mut();
+        PIPE_PAGES.fetch_sub(pages.len(), Ordering::Relaxed);
+        PIPE_FRAMES.fetch_sub(pages.iter().flatten().count(), Ordering::Relaxed);
+    }
+}
 
-        loop {
-            let current_size = inner.current_size;
+/// Returns the frames all pipes hold.
+pub fn frames() -> usize {
+    PIPE_FRAMES.load(Ordering::Relaxed)
+}
 
-            if current_size == 0 {
-                break;
-            }
+/// Adds `pages` to the total capacity of all pipes, unless that goes over
+/// [`PIPE_PAGES_LIMIT`], or [`LOW_MEMORY_PIPE_PAGES_LIMIT`] in the low-memory
+/// mode.
+fn reserve_pages(pages: usize) -> bool {
+    let limit = if shrinker::is_low_memory() {
+        LOW_MEMORY_PIPE_PAGES_LIMIT
+    } else {
+        PIPE_PAGES_LIMIT
+    };
+    PIPE_PAGES
+        .fetch_update(Ordering::Relaxed, Ordering::Relaxed, |total| {
+            (total + pages <= limit).then_some(total + pages)
+        })
+        .is_ok()
+}
 
-            let read_pos = inner.pos % DEFAULT_PIPE_BUF_SIZE;
+impl PipeWriter {
+    pub fn pipe(&self) -> &Arc<Pipe> {
+        &self.pipe
+    }
 
-            let to_read = core::cmp::min(writer.avail(), current_size);
-            if to_read == 0 {
-                break;
+    /// Moves up to `len` bytes at `offset` in `inode` into the pipe, without
+    /// going through user space.
+    pub fn splice_from(&self, inode: &Arc<dyn Inode>, offset: usize, len: usize) -> Result<usize> {
+        let pipe = &self.pipe;
+        let mut file_offset = offset;
+        pipe.write_with(1, |writable| {
+            pipe.produce(len.min(writable), |writer| {
+                let read = inode.read_at(file_offset, writer.to_fallible())?;
+                file_offset += read;
+                Ok(read)
+            })
+        })
+    }
+
+    /// Writes all of `readers`, front to back, waiting for space as needed.
+    /// Fails with `EPIPE` if the read end is closed before anything is written.
+    ///
+    /// Writes of up to [`PIPE_BUF`] bytes in total are not interleaved with
+    /// others.
+    fn write_segments(&self, readers: &mut [VmReader]) -> Result<usize> {
+        let pipe = &self.pipe;
+        let len: usize = readers.iter().map(VmReader::remain).sum();
+        let min_space = if len <= PIPE_BUF { len } else { 1 };
+
+        let mut total_written = 0;
+        while total_written < len {
+            let result = pipe.write_with(min_space, |writable| {
+                pipe.produce(writable.min(len - total_written), |mut writer| {
+                    gather(readers, &mut writer)
+                })
+            });
+            match result {
+                Ok(written) => total_written += written,
+                Err(_) if total_written > 0 => break,
+                Err(err) => return Err(err),
             }
+        }
+
+        Ok(total_written)
+    }
+}
 
-            let buffer_offset = read_pos % DEFAULT_PIPE_BUF_SIZE;
-            let first_chunk = core::cmp::min(to_read, DEFAULT_PIPE_BUF_SIZE - buffer_offset);
-            let second_chunk = to_read - first_chunk;
+impl FileLike for PipeWriter {
+    fn read(&self, _writer: VmWriter) -> Result<usize> {
+        Err(Error::new(Errno::EBADF))
+    }
 
-            // Read first chunk
-            self.pipe.buffer.read(buffer_offset, &mut writer).unwrap();
-            total_read += first_chunk;
+    fn write(&self, reader: VmReader) -> Result<usize> {
+        self.write_segments(&mut [reader])
+    }
 
-            // Read second chunk if needed
-            if second_chunk > 0 {
-                self.pipe.buffer.read(0, &mut writer).unwrap();
-                total_read += second_chunk;
-            }
+    fn write_vectored(&self, mut readers: Vec<VmReader>) -> Result<usize> {
+        self.write_segments(&mut readers)
+    }
+
+    /// Ready to write once a write of up to [`PIPE_BUF`] bytes would not block.
+    fn poll(&self, mask: IoEvents, poller: Option<&Arc<Poller>>) -> IoEvents {
+        let pipe = &self.pipe;
+        if let Some(poller) = poller {
+            pipe.pollee.register(poller);
+        }
+        let events = if pipe.reader_closed.load(Ordering::Acquire) {
+            IoEvents::ERR
+        } else if pipe.writable() >= PIPE_BUF.min(pipe.capacity()) {
+            IoEvents::OUT | IoEvents::WRNORM
+        } else {
+            IoEvents::empty()
+        };
+        events & (mask | IoEvents::ALWAYS)
+    }
+
+    fn as_pipe_writer(&self) -> Option<&PipeWriter> {
+        Some(self)
+    }
+}
+
+impl Drop for PipeWriter {
+    fn drop(&mut self) {
+        self.pipe.writer_closed.store(true, Ordering::Release);
+        self.pipe.read_queue.wake_all();
+        self.pipe.pollee.notify();
+    }
+}
+
+impl PipeReader {
+    pub fn pipe(&self) -> &Arc<Pipe> {
+        &self.pipe
+    }
+
+    /// Moves up to `len` bytes from the pipe to `offset` in `inode`, without
+    /// going through user space.
+    pub fn splice_to(&self, inode: &Arc<dyn Inode>, offset: usize, len: usize) -> Result<usize> {
+        let pipe = &self.pipe;
+        let mut file_offset = offset;
+        pipe.read_with(|readable| {
+            pipe.consume(len.min(readable), |reader| {
+                let written = inode.write_at(file_offset, reader.to_fallible())?;
+                file_offset += written;
+                Ok(written)
+            })
+        })
+    }
 
-            inner.current_size -= to_read;
+    /// Fills `writers`, front to back, with what is buffered. Waits until there
+    /// is data to read, and returns 0 only once the write end is closed and the
+    /// pipe is drained.
+    fn read_segments(&self, writers: &mut [VmWriter]) -> Result<usize> {
+        let len: usize = writers.iter().map(VmWriter::avail).sum();
+        if len == 0 {
+            return Ok(0);
         }
 
-        Ok(total_read)
+        let pipe = &self.pipe;
+        pipe.read_with(|readable| {
+            pipe.consume(len.min(readable), |mut reader| {
+                scatter(&mut reader, writers)
+            })
+        })
+    }
+}
+
+impl FileLike for PipeReader {
+    fn read(&self, writer: VmWriter) -> Result<usize> {
+        self.read_segments(&mut [writer])
+    }
+
+    fn read_vectored(&self, mut writers: Vec<VmWriter>) -> Result<usize> {
+        self.read_segments(&mut writers)
     }
 
     fn write(&self, _reader: VmReader) -> Result<usize> {
         Err(Error::new(Errno::EBADF))
     }
+
+    fn poll(&self, mask: IoEvents, poller: Option<&Arc<Poller>>) -> IoEvents {
+        let pipe = &self.pipe;
+        if let Some(poller) = poller {
+            pipe.pollee.register(poller);
+        }
+        let mut events = IoEvents::empty();
+        // Check for closing first, as in `Pipe::read_with`.
+        if pipe.writer_closed.load(Ordering::Acquire) {
+            events |= IoEvents::HUP;
+        }
+        if pipe.readable() > 0 {
+            events |= IoEvents::IN | IoEvents::RDNORM;
+        }
+        events & (mask | IoEvents::ALWAYS)
+    }
+
+    fn as_pipe_reader(&self) -> Option<&PipeReader> {
+        Some(self)
+    }
+}
+
+impl Drop for PipeReader {
+    fn drop(&mut self) {
+        self.pipe.reader_closed.store(true, Ordering::Release);
+        self.pipe.pollee.notify();
+        self.pipe.write_queue.wake_all();
+    }
+}
+
+#[cfg(ktest)]
+mod test {
+    use alloc::{vec, vec::Vec};
+    use ostd::{
+        mm::{PAGE_SIZE, VmReader, VmWriter},
+        prelude::ktest,
+    };
+
+    use super::Pipe;
+    use crate::{bench, fs::FileLike};
+
+    #[ktest]
+    fn wrap_after_partial_read() {
+        let (reader, writer) = Pipe::new_pair();
+        let capacity = writer.pipe().capacity();
+        let data: Vec<u8> = (0..capacity).map(|i| i as u8).collect();
+        let mut buf = vec![0u8; capacity];
+
+        // Leave the reader mid-page, then fill the whole ring.
+        let small = 100;
+        writer
+            .write(VmReader::from(&data[..small]).to_fallible())
+            .unwrap();
+        reader
+            .read(VmWriter::from(&mut buf[..small]).to_fallible())
+            .unwrap();
+        let written = writer
+            .write(VmReader::from(&data[..]).to_fallible())
+            .unwrap();
+        assert_eq!(written, capacity);
+        let read = reader
+            .read(VmWriter::from(&mut buf[..]).to_fallible())
+            .unwrap();
+        assert_eq!(read, capacity);
+        assert!(buf == data);
+    }
+
+    #[ktest]
+    fn bench_pipe_transfer() {
+        let (reader, writer) = Pipe::new_pair();
+        let data = vec![0x5au8; PAGE_SIZE];
+        let mut buf = vec![0u8; PAGE_SIZE];
+        // A page written and read back, which fits in the pipe without
+        // either end waiting.
+        bench::run("pipe_transfer", 200, || {
+            writer
+                .write(VmReader::from(&data[..]).to_fallible())
+                .unwrap();
+            reader
+                .read(VmWriter::from(&mut buf[..]).to_fallible())
+                .unwrap();
+        });
+    }
 }
@@ -0,0 +1,146 @@
+//! Readiness notification, for `ppoll` and epoll.
+//!
+//! A file reports which [`IoEvents`] it is ready for with
+//! [`FileLike::poll`](super::FileLike::poll), and, given a [`Poller`],
+//! registers it with the [`Pollee`] that is notified when its readiness may
+//! change. Registrations are one-shot: a notification wakes and forgets the
+//! pollers, which poll again and register anew until something is ready.
+
+use core::{
+    sync::atomic::{AtomicBool, Ordering, fence},
+    time::Duration,
+};
+
+use alloc::{
+    sync::{Arc, Weak},
+    vec::Vec,
+};
+use ostd::sync::{LocalIrqDisabled, SpinLock, WaitQueue};
+
+use crate::{clock::monotonic_time, hrtimer};
+
+bitflags::bitflags! {
+    /// The events of `poll`, which epoll shares.
+    pub struct IoEvents: u32 {
+        const IN     = 0x0001;
+        const PRI    = 0x0002;
+        const OUT    = 0x0004;
+        const ERR    = 0x0008;
+        const HUP    = 0x0010;
+        const NVAL   = 0x0020;
+        const RDNORM = 0x0040;
+        const WRNORM = 0x0100;
+    }
+}
+
+impl IoEvents {
+    /// The events reported whether or not they were asked for.
+    pub const ALWAYS: Self = Self::ERR.union(Self::HUP).union(Self::NVAL);
+}
+
+/// A task waiting for any of the files it polls to become ready.
+pub struct Poller {
+    woken: AtomicBool,
+    queue: WaitQueue,
+}
+
+impl Poller {
+    pub fn new() -> Arc<Self> {
+        Arc::new(Self {
+            woken: AtomicBool::new(false),
+            queue: WaitQueue::new(),
+        })
+    }
+
+    /// Waits until a file it is registered with is notified, or until the
+    /// monotonic time reaches `deadline`.
+    pub fn wait(self: &Arc<Self>, deadline: Option<Duration>) {
+        let timer = deadline.map(|deadline| {
+            let poller = self.clone();
+            hrtimer::arm(deadline, move || poller.wake())
+        });
+        self.queue
+            .wait_until(|| self.woken.swap(false, Ordering::AcqRel).then_some(()));
+        if let Some(timer) = timer {
+            hrtimer::cancel(timer);
+        }
+    }
+
+    fn wake(&self) {
+        self.woken.store(true, Ordering::Release);
+        self.queue.wake_all();
+    }
+}
+
+/// Calls `poll` with a poller until it returns something or the monotonic
+/// time reaches `deadline`, waiting for a notification between calls.
+///
+/// `poll` registers the poller with whatever it finds not ready, and is
+/// called once without waiting if `deadline` has passed.
+pub fn wait_for<T>(
+    deadline: Option<Duration>,
+    mut poll: impl FnMut(&Arc<Poller>) -> Option<T>,
+) -> Option<T> {
+    let poller = Poller::new();
+    loop {
+        if let Some(ready) = poll(&poller) {
+            return Some(ready);
+        }
+        if deadline.is_some_and(|deadline| monotonic_time() >= deadline) {
+            return None;
+        }
+        poller.wait(deadline);
+    }
+}
+
+/// The pollers waiting for a file's readiness to change.
+pub struct Pollee {
+    pollers: SpinLock<Vec<Weak<Poller>>, LocalIrqDisabled>,
+    /// Whether `pollers` may be non-empty, so that notifying no one does not
+    /// take the lock.
+    has_pollers: AtomicBool,
+}
+
+impl Pollee {
+    pub const fn new() -> Self {
+        Self {
+            pollers: SpinLock::new(Vec::new()),
+            has_pollers: AtomicBool::new(false),
+        }
+    }
+
+    /// Has `poller` woken on the next notification.
+    pub fn register(&self, poller: &Arc<Poller>) {
+        let mut pollers = self.pollers.lock();
+        // Drop the pollers that stopped waiting without being notified.
+        pollers.retain(|poller| poller.strong_count() > 0);
+        pollers.push(Arc::downgrade(poller));
+        self.has_pollers.store(true, Ordering::Relaxed);
+        // Pairs with the fence in `notify`: either the caller sees the change
+        // polling after this, or the notifier sees the poller.
+        fence(Ordering::SeqCst);
+    }
+
+    /// Wakes the registered pollers. Called after the change, and may be
+    /// called in interrupt context.
+    pub fn notify(&self) {
+        fence(Ordering::SeqCst);
+        if !self.has_pollers.load(Ordering::Relaxed) {
+            return;
+        }
+        let pollers = {
+            let mut pollers = self.pollers.lock();
+            self.has_pollers.store(false, Ordering::Relaxed);
+            core::mem::take(&mut *pollers)
+        };
+        for poller in pollers.iter().filter_map(Weak::upgrade) {
+            poller.wake();
+        }
+    }
+}
+
+impl Default for Pollee {
+    fn default() -> Self {
+        Self::new()
+    }
+}
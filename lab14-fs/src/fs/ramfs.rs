@@ -1,3 +1,19 @@
+//! A file system kept in memory.
+//!
+//! File data lives in page frames, one per page written, so growing a file
+//! never copies it, holes take no memory, and file mappings map the frames
+//! themselves.
+//!
+//! Reads and writes copy to and from the frames without holding the page
+//! list's lock, which is only written to add pages. Writers lock the bytes
+//! they write, so they only wait for writers overlapping them, and readers
+//! never wait for writers.
+
+use core::{
+    ops::Range,
+    sync::atomic::{AtomicU64, AtomicUsize, Ordering},
+};
+
 use alloc::{
     collections::btree_map::BTreeMap,
     string::{String, ToString},
@@ -5,27 +21,35 @@ use alloc::{
     vec::Vec,
 };
 use ostd::{
-    mm::{FallibleVmRead, FallibleVmWrite, VmReader, VmWriter},
-    sync::{Mutex, RwMutex},
+    mm::{
+        FallibleVmRead, FallibleVmWrite, Frame, FrameAllocOptions, PAGE_SIZE, VmReader, VmWriter,
+        io_util::HasVmReaderWriter,
+    },
+    sync::RwMutex,
 };
 
 use crate::error::{Errno, Error, Result};
-use crate::fs::{Inode, InodeMeta, InodeType};
+use crate::fs::{DirEntry, Inode, InodeMeta, InodeStat, InodeType, util::range_lock::RangeLock};
+
+/// The next inode number to hand out, shared by all RamFS instances.
+static NEXT_INO: AtomicU64 = AtomicU64::new(1);
 
 pub struct RamInode {
+    ino: u64,
     inner: Inner,
     metadata: InodeMeta,
 }
 
 enum Inner {
-    File(Mutex<Vec<u8>>),
+    File(FileData),
     Directory(RwMutex<BTreeMap<String, Arc<RamInode>>>),
 }
 
 impl RamInode {
     fn new_file() -> Arc<Self> {
         Arc::new(RamInode {
-            inner: Inner::File(Mutex::new(Vec::new())),
+            ino: NEXT_INO.fetch_add(1, Ordering::Relaxed),
+            inner: Inner::File(FileData::new()),
             metadata: InodeMeta {
                 size: 0,
                 atime: core::time::Duration::new(0, 0),
@@ -37,6 +61,7 @@ impl RamInode {
 
     fn new_directory() -> Arc<Self> {
         Arc::new(RamInode {
+            ino: NEXT_INO.fetch_add(1, Ordering::Relaxed),
             inner: Inner::Directory(RwMutex::new(BTreeMap::new())),
             metadata: InodeMeta {
                 size: 0,
@@ -48,24 +73,88 @@ impl RamInode {
     }
 }
 
+/// The contents of a file.
+struct FileData {
+    /// The pages written so far, keyed by page index. Pages missing below
+    /// `size` are holes, which read as zeros. Pages are never removed.
+    pages: RwMutex<BTreeMap<usize, Frame<()>>>,
+    size: AtomicUsize,
+    /// Held over the bytes being written.
+    write_ranges: RangeLock,
+    /// Bumped by each write, see [`Inode::data_version`].
+    version: AtomicU64,
+}
+
+impl FileData {
+    fn new() -> Self {
+        Self {
+            pages: RwMutex::new(BTreeMap::new()),
+            size: AtomicUsize::new(0),
+            write_ranges: RangeLock::new(),
+            version: AtomicU64::new(0),
+        }
+    }
+
+    /// Returns the frames of the pages in `pages`, with `None` for holes.
+    fn frames(&self, pages: Range<usize>) -> Vec<Option<Frame<()>>> {
+        let map = self.pages.read();
+        pages.map(|index| map.get(&index).cloned()).collect()
+    }
+
+    /// Returns the frames of the pages in `pages`, allocating zeroed ones for
+    /// holes.
+    fn frames_or_alloc(&self, pages: Range<usize>) -> Result<Vec<Frame<()>>> {
+        let frames = self.frames(pages.clone());
+        if frames.iter().all(Option::is_some) {
+            return Ok(frames.into_iter().map(Option::unwrap).collect());
+        }
+
+        let mut map = self.pages.write();
+        pages
+            .map(|index| {
+                if let Some(frame) = map.get(&index) {
+                    return Ok(frame.clone());
+                }
+                let frame = FrameAllocOptions::new()
+                    .alloc_frame()
+                    .map_err(|_| Error::new(Errno::ENOMEM))?;
+                map.insert(index, frame.clone());
+                Ok(frame)
+            })
+            .collect()
+    }
+}
+
 impl Inode for RamInode {
     fn read_at(&self, offset: usize, mut writer: ostd::mm::VmWriter) -> Result<usize> {
         let Inner::File(data) = &self.inner else {
             return Err(Error::new(Errno::EISDIR));
         };
 
-        let data = data.lock();
-        if offset >= data.len() {
+        let size = data.size.load(Ordering::Acquire);
+        if offset >= size {
             return Ok(0);
         }
+        let end = core::cmp::min(offset + writer.avail(), size);
+        let first_page = offset / PAGE_SIZE;
+        let frames = data.frames(first_page..end.div_ceil(PAGE_SIZE));
 
-        let read_len = core::cmp::min(data.len() - offset, writer.avail());
-        writer
-            .write_fallible(&mut VmReader::from(
-                &(*data.as_slice())[offset..offset + read_len],
-            ))
-            .unwrap();
-        Ok(read_len)
+        let mut current_offset = offset;
+        while current_offset < end {
+            let offset_in_page = current_offset % PAGE_SIZE;
+            let len = core::cmp::min(PAGE_SIZE - offset_in_page, end - current_offset);
+            let copied = match &frames[current_offset / PAGE_SIZE - first_page] {
+                Some(frame) => {
+                    let mut reader = frame.reader();
+                    reader.skip(offset_in_page).limit(len);
+                    writer.write_fallible(&mut reader)
+                }
+                None => writer.fill_zeros(len),
+            };
+            copied.map_err(|_| Error::new(Errno::EFAULT))?;
+            current_offset += len;
+        }
+        Ok(end - offset)
     }
 
     fn write_at(&self, offset: usize, mut reader: ostd::mm::VmReader) -> Result<usize> {
@@ -73,29 +162,62 @@ impl Inode for RamInode {
             return Err(Error::new(Errno::EISDIR));
         };
 
-        let mut data = data.lock();
-        if offset > data.len() {
-            // Fill the gap with zeros
-            data.resize(offset, 0);
+        let len = reader.remain();
+        if len == 0 {
+            return Ok(0);
         }
+        let end = offset.checked_add(len).ok_or(Error::new(Errno::EFBIG))?;
+        let _guard = data.write_ranges.lock(offset..end);
+        let first_page = offset / PAGE_SIZE;
+        let frames = data.frames_or_alloc(first_page..end.div_ceil(PAGE_SIZE))?;
 
-        // Expand the data vector if necessary
-        if offset + reader.remain() > data.len() {
-            data.resize(offset + reader.remain(), 0);
+        let mut current_offset = offset;
+        while current_offset < end {
+            let offset_in_page = current_offset % PAGE_SIZE;
+            let len = core::cmp::min(PAGE_SIZE - offset_in_page, end - current_offset);
+            let mut writer = frames[current_offset / PAGE_SIZE - first_page].writer();
+            writer.skip(offset_in_page).limit(len);
+            let copied = reader.read_fallible(&mut writer);
+            if copied.is_err() {
+                // Keep what was copied before the fault.
+                break;
+            }
+            current_offset += len;
         }
 
-        let write_len = core::cmp::min(data.len() - offset, reader.remain());
-        reader
-            .read_fallible(&mut VmWriter::from(
-                &mut (*data.as_mut_slice())[offset..offset + write_len],
-            ))
-            .unwrap();
-        Ok(write_len)
+        // A gap left before `offset` stays a hole.
+        data.size.fetch_max(current_offset, Ordering::AcqRel);
+        data.version.fetch_add(1, Ordering::AcqRel);
+        if current_offset == offset {
+            return Err(Error::new(Errno::EFAULT));
+        }
+        Ok(current_offset - offset)
+    }
+
+    fn page_frames(&self, pages: Range<usize>) -> Option<Result<Vec<Frame<()>>>> {
+        let Inner::File(data) = &self.inner else {
+            return None;
+        };
+
+        // Holes get frames here, so that mappings share them with later reads
+        // and writes.
+        Some(data.frames_or_alloc(pages))
+    }
+
+    fn keeps_mapped_writes(&self) -> bool {
+        true
+    }
+
+    fn data_version(&self) -> u64 {
+        match &self.inner {
+            Inner::File(data) => data.version.load(Ordering::Acquire),
+            _ => 0,
+        }
     }
 
     fn size(&self) -> usize {
         match &self.inner {
-            Inner::File(data) => data.lock().len(),
+            Inner::File(data) => data.size.load(Ordering::Acquire),
             Inner::Directory(_) => 12,
         }
     }
@@ -104,6 +226,27 @@ impl Inode for RamInode {
         &self.metadata
     }
 
+    fn stat(&self) -> InodeStat {
+        let (perm, nlink, blocks) = match &self.inner {
+            Inner::File(data) => (0o644, 1, data.pages.read().len() * (PAGE_SIZE / 512)),
+            Inner::Directory(_) => (0o755, 2, 0),
+        };
+        InodeStat {
+            ino: self.ino,
+            type_: self.typ(),
+            perm,
+            nlink,
+            uid: 0,
+            gid: 0,
+            size: self.size() as u64,
+            blocks: blocks as u64,
+            block_size: PAGE_SIZE as u32,
+            atime: self.metadata.atime,
+            mtime: self.metadata.mtime,
+            ctime: self.metadata.ctime,
+        }
+    }
+
     fn lookup(&self, name: &str) -> Result<Arc<dyn Inode>> {
         let Inner::Directory(ref entries) = self.inner else {
             return Err(Error::new(Errno::ENOTDIR));
@@ -131,6 +274,31 @@ impl Inode for RamInode {
         Ok(inode)
     }
 
+    /// Lists the entries in name order. The position of an entry is its
+    /// index in that order. There are no `.` and `..` entries, as `lookup`
+    /// does not resolve them either.
+    fn read_dir(&self, offset: usize, visit: &mut dyn FnMut(DirEntry) -> bool) -> Result<usize> {
+        let Inner::Directory(ref entries) = self.inner else {
+            return Err(Error::new(Errno::ENOTDIR));
+        };
+
+        let entries = entries.read();
+        let mut position = offset;
+        for (name, inode) in entries.iter().skip(offset) {
+            let entry = DirEntry {
+                ino: inode.ino,
+                type_: Some(inode.typ()),
+                name: name.as_bytes(),
+                next_offset: position + 1,
+            };
+            if !visit(entry) {
+                break;
+            }
+            position += 1;
+        }
+        Ok(position)
+    }
+
     fn read_link(&self) -> Result<String> {
         todo!()
     }
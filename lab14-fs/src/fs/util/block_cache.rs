@@ -0,0 +1,624 @@
+//! A write-back cache of file system blocks in front of a block device.
+//!
+//! The file system reads and writes its metadata and file data through the
+//! cache, so repeated accesses to the same block cost no device I/O.
+//!
+//! Dirty blocks stay in the cache until the writeback task commits them, in
+//! the style of ordered-mode journaling: the file data first, then, after a
+//! flush barrier, the metadata. So the disk never holds metadata pointing to
+//! data that has not reached it, and writes finish without waiting for the
+//! device unless too many blocks are dirty. Data blocks that are all zeros, as
+//! newly allocated ones, are zeroed on the device without sending the zeros,
+//! where the device can do that.
+
+use core::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+
+use alloc::{
+    boxed::Box,
+    collections::btree_map::{BTreeMap, Entry},
+    sync::Arc,
+    vec,
+    vec::Vec,
+};
+use ostd::{
+    Pod,
+    mm::{FallibleVmWrite, VmIo, VmReader, VmWriter},
+    sync::{Mutex, RwMutex, SpinLock, WaitQueue},
+};
+
+use crate::{
+    drivers::{
+        blk::{BioRequest, BioType, BlockDevice, PendingRead, SECTOR_SIZE},
+        utils::dma_pool::DmaBuf,
+    },
+    error::{Errno, Error, Result},
+    fs::util::writeback,
+    stats::{self, Stat},
+};
+
+/// The default number of blocks kept in a cache.
+pub const DEFAULT_CACHE_CAPACITY: usize = 256;
+/// The maximum number of blocks fetched by one device request in [`BlockCache::prefetch`].
+const MAX_BLOCKS_PER_READ: usize = 16;
+/// The maximum number of blocks being read ahead at once.
+const MAX_READ_AHEAD_BLOCKS: usize = 32;
+/// The dirty blocks, as a percentage of the capacity, that make the writeback
+/// task start writing them back.
+const DIRTY_BACKGROUND_RATIO: usize = 50;
+/// The dirty blocks, as a percentage of the capacity, that make writers wait
+/// for the writeback task. Dirty blocks are not evicted, so the cache grows
+/// past its capacity with them.
+const DIRTY_RATIO: usize = 200;
+
+pub struct BlockCache {
+    blk_device: Arc<dyn BlockDevice>,
+    block_size: usize,
+    /// The maximum number of cached blocks.
+    capacity: usize,
+    inner: SpinLock<CacheInner>,
+    /// The read-ahead requests still in flight. Always locked after `inner`.
+    pending: SpinLock<Vec<PendingRun>>,
+    /// Held by a commit, so that commits do not interleave.
+    commit_lock: Mutex<()>,
+    num_dirty: AtomicUsize,
+    /// Writers waiting for the number of dirty blocks to drop below the limit.
+    throttle_queue: WaitQueue,
+    /// Whether a commit failed since the last flush, which reports it.
+    failed: AtomicBool,
+}
+
+struct PendingRun {
+    first: usize,
+    count: usize,
+    read: PendingRead,
+}
+
+struct CacheInner {
+    blocks: BTreeMap<usize, CacheEntry>,
+    /// The block id the CLOCK hand points at.
+    clock_hand: usize,
+}
+
+struct CacheEntry {
+    block: Arc<CachedBlock>,
+    /// Set on each access and cleared when the CLOCK hand passes by.
+    referenced: bool,
+}
+
+struct CachedBlock {
+    bid: usize,
+    data: RwMutex<Box<[u8]>>,
+    dirty: AtomicBool,
+    /// Whether the block holds metadata, which is only written on a commit.
+    metadata: AtomicBool,
+}
+
+impl BlockCache {
+    pub fn new(blk_device: Arc<dyn BlockDevice>, block_size: usize, capacity: usize) -> Self {
+        assert!(block_size % SECTOR_SIZE == 0);
+        assert!(capacity > 0);
+
+        Self {
+            blk_device,
+            block_size,
+            capacity,
+            inner: SpinLock::new(CacheInner {
+                blocks: BTreeMap::new(),
+                clock_hand: 0,
+            }),
+            pending: SpinLock::new(Vec::new()),
+            commit_lock: Mutex::new(()),
+            num_dirty: AtomicUsize::new(0),
+            throttle_queue: WaitQueue::new(),
+            failed: AtomicBool::new(false),
+        }
+    }
+
+    pub fn block_size(&self) -> usize {
+        self.block_size
+    }
+
+    pub fn blk_device(&self) -> &Arc<dyn BlockDevice> {
+        &self.blk_device
+    }
+
+    /// Reads `buf.len()` bytes at `offset` of block `bid`.
+    pub fn read_bytes(&self, bid: usize, offset: usize, buf: &mut [u8]) {
+        assert!(offset + buf.len() <= self.block_size);
+
+        let block = self.get_or_panic(bid);
+        let data = block.data.read();
+        buf.copy_from_slice(&data[offset..offset + buf.len()]);
+    }
+
+    pub fn read_val<T: Pod>(&self, bid: usize, offset: usize) -> T {
+        let mut val = T::new_zeroed();
+        self.read_bytes(bid, offset, val.as_bytes_mut());
+        val
+    }
+
+    /// Writes metadata `buf` at `offset` of block `bid`.
+    ///
+    /// The block reaches the device on the next commit, after the file data
+    /// written before it.
+    pub fn write_bytes(&self, bid: usize, offset: usize, buf: &[u8]) {
+        self.write_block_bytes(bid, offset, buf, true);
+    }
+
+    /// Writes file data `buf` at `offset` of block `bid`.
+    ///
+    /// The block reaches the device on the next commit. Waits for the
+    /// writeback task if too many blocks are dirty.
+    pub fn write_data(&self, bid: usize, offset: usize, buf: &[u8]) {
+        self.write_block_bytes(bid, offset, buf, false);
+        self.throttle();
+    }
+
+    fn write_block_bytes(&self, bid: usize, offset: usize, buf: &[u8], metadata: bool) {
+        assert!(offset + buf.len() <= self.block_size);
+
+        let block = self.get_or_panic(bid);
+        let mut data = block.data.write();
+        data[offset..offset + buf.len()].copy_from_slice(buf);
+        if metadata {
+            block.metadata.store(true, Ordering::Relaxed);
+        }
+        self.mark_dirty(&block);
+    }
+
+    fn mark_dirty(&self, block: &CachedBlock) {
+        if !block.dirty.swap(true, Ordering::AcqRel) {
+            let num_dirty = self.num_dirty.fetch_add(1, Ordering::Relaxed) + 1;
+            if num_dirty >= self.capacity * DIRTY_BACKGROUND_RATIO / 100 {
+                writeback::kick();
+            }
+        }
+    }
+
+    pub fn is_over_background_threshold(&self) -> bool {
+        self.num_dirty.load(Ordering::Relaxed) >= self.capacity * DIRTY_BACKGROUND_RATIO / 100
+    }
+
+    /// Waits until the dirty blocks are below the dirty limit.
+    ///
+    /// Without the writeback task, as early in boot, the blocks are committed
+    /// right away instead.
+    fn throttle(&self) {
+        let limit = self.capacity * DIRTY_RATIO / 100;
+        if self.num_dirty.load(Ordering::Relaxed) < limit {
+            return;
+        }
+        if !writeback::is_running() {
+            self.commit();
+            return;
+        }
+        writeback::kick();
+        self.throttle_queue
+            .wait_until(|| (self.num_dirty.load(Ordering::Relaxed) < limit).then_some(()));
+    }
+
+    pub fn write_val<T: Pod>(&self, bid: usize, offset: usize, val: &T) {
+        self.write_bytes(bid, offset, val.as_bytes());
+    }
+
+    /// Zeroes block `bid`, as for a newly allocated block, without reading it
+    /// from the device.
+    pub fn zero_block(&self, bid: usize) {
+        let block = {
+            let mut inner = self.inner.lock();
+            let block = match inner.blocks.entry(bid) {
+                Entry::Occupied(mut entry) => {
+                    entry.get_mut().referenced = true;
+                    entry.get().block.clone()
+                }
+                Entry::Vacant(entry) => entry
+                    .insert(CacheEntry {
+                        block: Arc::new(CachedBlock {
+                            bid,
+                            data: RwMutex::new(vec![0u8; self.block_size].into_boxed_slice()),
+                            dirty: AtomicBool::new(false),
+                            metadata: AtomicBool::new(false),
+                        }),
+                        referenced: true,
+                    })
+                    .block
+                    .clone(),
+            };
+            inner.evict(self.capacity);
+            block
+        };
+
+        block.data.write().fill(0);
+        block.metadata.store(false, Ordering::Relaxed);
+        self.mark_dirty(&block);
+    }
+
+    /// Drops the `count` blocks from `first`, which the file system freed,
+    /// dirty or not, and discards them on the device.
+    pub fn discard(&self, first: usize, count: usize) {
+        let removed: Vec<CacheEntry> = {
+            let mut inner = self.inner.lock();
+            let mut tail = inner.blocks.split_off(&first);
+            inner.blocks.append(&mut tail.split_off(&(first + count)));
+            tail.into_values().collect()
+        };
+        for entry in removed {
+            if entry.block.dirty.swap(false, Ordering::AcqRel) {
+                self.num_dirty.fetch_sub(1, Ordering::Relaxed);
+            }
+        }
+
+        self.blk_device.discard(
+            self.bid_to_sector(first),
+            count * self.block_size / SECTOR_SIZE,
+        );
+    }
+
+    /// Copies `len` bytes at `offset` of block `bid` to `writer`.
+    pub fn read_to_vm_writer(
+        &self,
+        bid: usize,
+        offset: usize,
+        len: usize,
+        writer: &mut VmWriter,
+    ) -> Result<usize> {
+        assert!(offset + len <= self.block_size);
+
+        let block = self.get(bid)?;
+        let data = block.data.read();
+        writer
+            .write_fallible(&mut VmReader::from(&data[offset..offset + len]))
+            .map_err(|_| Error::new(Errno::EFAULT))
+    }
+
+    /// Reads the blocks from `first` on straight into `sectors`, one buffer per
+    /// sector, bypassing the cache.
+    ///
+    /// Returns `false` without reading if any of the blocks is cached or being
+    /// read ahead, as the copy in the cache may be newer than the disk, and
+    /// if the device fails the read, for the caller to read through the cache,
+    /// which reports the failure.
+    pub fn read_uncached(&self, first: usize, sectors: Vec<DmaBuf>) -> bool {
+        let count = (sectors.len() * SECTOR_SIZE).div_ceil(self.block_size);
+        let range = first..first + count;
+        {
+            let inner = self.inner.lock();
+            let pending = self.pending.lock();
+            if inner.blocks.range(range.clone()).next().is_some()
+                || pending
+                    .iter()
+                    .any(|run| run.first < range.end && range.start < run.first + run.count)
+            {
+                return false;
+            }
+        }
+
+        self.blk_device
+            .read_block_into(self.bid_to_sector(first), sectors)
+            .is_ok()
+    }
+
+    /// Commits all dirty blocks and flushes the device, so that they are on
+    /// the disk when this returns.
+    ///
+    /// Fails with `EIO` if any write failed since the last flush, including
+    /// those of the commits by the writeback task.
+    pub fn flush(&self) -> Result<()> {
+        self.commit();
+        let flushed = self.blk_device.flush();
+        if self.failed.swap(false, Ordering::AcqRel) {
+            return Err(Error::new(Errno::EIO));
+        }
+        flushed
+    }
+
+    /// Writes the dirty blocks back as one transaction: the data blocks, a
+    /// flush barrier, and then the metadata blocks as they were when the
+    /// commit started, so that they only point to data already on the disk.
+    ///
+    /// The blocks are written in block order. The metadata is written to the
+    /// device, but only flushed by the next commit's barrier or by
+    /// [`Self::flush`].
+    pub fn commit(&self) {
+        let _guard = self.commit_lock.lock();
+
+        let (metadata_blocks, data_blocks): (Vec<_>, Vec<_>) = self
+            .inner
+            .lock()
+            .blocks
+            .values()
+            .filter(|entry| entry.block.dirty.load(Ordering::Acquire))
+            .map(|entry| entry.block.clone())
+            .partition(|block| block.metadata.load(Ordering::Relaxed));
+        let metadata_writes: Vec<BioRequest> = metadata_blocks
+            .iter()
+            .filter_map(|block| self.write_request(block))
+            .collect();
+
+        let write_zeroes = self.blk_device.max_write_zeroes_sectors() > 0;
+        let mut zero_runs: Vec<(usize, usize)> = Vec::new();
+        for block in data_blocks {
+            if write_zeroes && self.take_if_zero(&block) {
+                match zero_runs.last_mut() {
+                    Some((first, count)) if *first + *count == block.bid => *count += 1,
+                    _ => zero_runs.push((block.bid, 1)),
+                }
+                continue;
+            }
+            if let Some(request) = self.write_request(&block) {
+                self.blk_device.write_block(request);
+            }
+        }
+        for (first, count) in zero_runs {
+            self.blk_device.write_zeroes(
+                self.bid_to_sector(first),
+                count * self.block_size / SECTOR_SIZE,
+            );
+        }
+        if !metadata_writes.is_empty() {
+            // The barrier's flush reports the failed writes, so keep them for
+            // the next [`Self::flush`].
+            if self.blk_device.flush().is_err() {
+                self.failed.store(true, Ordering::Release);
+            }
+            for request in metadata_writes {
+                self.blk_device.write_block(request);
+            }
+        }
+
+        self.throttle_queue.wake_all();
+        // Evict what the cache held beyond its capacity while it was dirty.
+        self.inner.lock().evict(self.capacity);
+    }
+
+    /// Loads the blocks in `bids` that are not cached yet.
+    ///
+    /// Runs of consecutive block ids are read with one device request each.
+    pub fn prefetch(&self, bids: &[usize]) {
+        for (first, count) in self.missing_runs(bids) {
+            // A block that failed to load is read again when accessed.
+            let _ = self.load(first, count);
+        }
+    }
+
+    /// Starts loading the blocks in `bids` that are not cached yet, without
+    /// waiting for them.
+    ///
+    /// The blocks are cached once the reads complete, or when someone accesses
+    /// them first. Blocks beyond the limit of in-flight read-ahead are skipped.
+    pub fn read_ahead(&self, bids: &[usize]) {
+        self.reap_read_ahead();
+
+        for (first, count) in self.missing_runs(bids) {
+            let num_pending: usize = self.pending.lock().iter().map(|run| run.count).sum();
+            if num_pending + count > MAX_READ_AHEAD_BLOCKS {
+                return;
+            }
+
+            // Submitting may wait for free descriptors, so do it without the lock.
+            let read = self.blk_device.start_read(
+                self.bid_to_sector(first),
+                count * self.block_size / SECTOR_SIZE,
+            );
+            self.pending.lock().push(PendingRun { first, count, read });
+        }
+    }
+
+    /// Returns the cached block `bid`, reading it from the device on a miss.
+    ///
+    /// Fails with `EIO` if the device fails the read.
+    fn get(&self, bid: usize) -> Result<Arc<CachedBlock>> {
+        if let Some(entry) = self.inner.lock().blocks.get_mut(&bid) {
+            entry.referenced = true;
+            stats::inc(Stat::BlockCacheHits);
+            return Ok(entry.block.clone());
+        }
+
+        let pending_run = {
+            let mut pending = self.pending.lock();
+            pending
+                .iter()
+                .position(|run| (run.first..run.first + run.count).contains(&bid))
+                .map(|index| pending.swap_remove(index))
+        };
+        // A block being read ahead counts as a hit.
+        stats::inc(if pending_run.is_some() {
+            Stat::BlockCacheHits
+        } else {
+            Stat::BlockCacheMisses
+        });
+        if let Some(run) = pending_run {
+            let request = self.blk_device.finish_read(run.read)?;
+            let blocks = self.install(run.first, request);
+            return Ok(blocks[bid - run.first].clone());
+        }
+
+        Ok(self.load(bid, 1)?.pop().unwrap())
+    }
+
+    /// Returns the cached block `bid` for a caller with no way to report a
+    /// failed read. The file system cannot go on without its metadata, so
+    /// this panics then, as ext2 does with `errors=panic`.
+    fn get_or_panic(&self, bid: usize) -> Arc<CachedBlock> {
+        self.get(bid)
+            .unwrap_or_else(|_| panic!("block cache: failed to read block {}", bid))
+    }
+
+    /// Caches the read-ahead runs that have completed.
+    fn reap_read_ahead(&self) {
+        let completed: Vec<PendingRun> = {
+            let mut pending = self.pending.lock();
+            let (completed, in_flight) = core::mem::take(&mut *pending)
+                .into_iter()
+                .partition(|run| run.read.is_completed());
+            *pending = in_flight;
+            completed
+        };
+
+        for run in completed {
+            // A block that failed to load is read again when accessed.
+            if let Ok(request) = self.blk_device.finish_read(run.read) {
+                self.install(run.first, request);
+            }
+        }
+    }
+
+    /// Splits the blocks in `bids` that are neither cached nor being read into
+    /// runs of consecutive block ids, as `(first, count)`.
+    fn missing_runs(&self, bids: &[usize]) -> Vec<(usize, usize)> {
+        let missing: Vec<usize> = {
+            let inner = self.inner.lock();
+            let pending = self.pending.lock();
+            bids.iter()
+                .copied()
+                .filter(|bid| !inner.blocks.contains_key(bid))
+                .filter(|bid| {
+                    !pending
+                        .iter()
+                        .any(|run| (run.first..run.first + run.count).contains(bid))
+                })
+                .collect()
+        };
+
+        let mut runs = Vec::new();
+        let mut i = 0;
+        while i < missing.len() {
+            let first = missing[i];
+            let mut count = 1;
+            while i + count < missing.len()
+                && missing[i + count] == first + count
+                && count < MAX_BLOCKS_PER_READ
+            {
+                count += 1;
+            }
+            runs.push((first, count));
+            i += count;
+        }
+        runs
+    }
+
+    /// Reads `count` blocks starting from `first` with one device request and
+    /// caches them.
+    fn load(&self, first: usize, count: usize) -> Result<Vec<Arc<CachedBlock>>> {
+        // Do the I/O without holding the lock. Another task may load the same
+        // block meanwhile, in which case we keep the first one inserted.
+        let request = self.blk_device.read_block(
+            self.bid_to_sector(first),
+            count * self.block_size / SECTOR_SIZE,
+        )?;
+        Ok(self.install(first, request))
+    }
+
+    /// Caches the blocks read by `request`, which starts from block `first`.
+    fn install(&self, first: usize, request: BioRequest) -> Vec<Arc<CachedBlock>> {
+        let sectors_per_block = self.block_size / SECTOR_SIZE;
+        let loaded = request
+            .data
+            .chunks(sectors_per_block)
+            .enumerate()
+            .map(|(i, sectors)| {
+                let mut data = vec![0u8; self.block_size].into_boxed_slice();
+                for (sector, chunk) in sectors.iter().zip(data.chunks_mut(SECTOR_SIZE)) {
+                    sector.read_bytes(0, chunk).unwrap();
+                }
+                Arc::new(CachedBlock {
+                    bid: first + i,
+                    data: RwMutex::new(data),
+                    dirty: AtomicBool::new(false),
+                    metadata: AtomicBool::new(false),
+                })
+            })
+            .collect::<Vec<_>>();
+        drop(request);
+
+        let blocks = {
+            let mut inner = self.inner.lock();
+            let blocks = loaded
+                .into_iter()
+                .map(|block| match inner.blocks.entry(block.bid) {
+                    Entry::Occupied(mut entry) => {
+                        entry.get_mut().referenced = true;
+                        entry.get().block.clone()
+                    }
+                    Entry::Vacant(entry) => entry
+                        .insert(CacheEntry {
+                            block,
+                            referenced: true,
+                        })
+                        .block
+                        .clone(),
+                })
+                .collect::<Vec<_>>();
+            inner.evict(self.capacity);
+            blocks
+        };
+        blocks
+    }
+
+    /// Returns a write of the current contents of `block` and marks it clean,
+    /// or `None` if it is clean already.
+    fn write_request(&self, block: &CachedBlock) -> Option<BioRequest> {
+        if !block.dirty.swap(false, Ordering::AcqRel) {
+            return None;
+        }
+        self.num_dirty.fetch_sub(1, Ordering::Relaxed);
+
+        let request = BioRequest::with_type(
+            BioType::Write,
+            self.bid_to_sector(block.bid),
+            self.block_size / SECTOR_SIZE,
+        );
+        let data = block.data.read();
+        for (sector, chunk) in request.data.iter().zip(data.chunks(SECTOR_SIZE)) {
+            sector.write_bytes(0, chunk).unwrap();
+        }
+        Some(request)
+    }
+
+    /// Marks `block` clean if it is dirty and all zeros, for the caller to
+    /// zero it on the device instead of writing it.
+    fn take_if_zero(&self, block: &CachedBlock) -> bool {
+        // Writers mark the block dirty with the data locked, so it cannot
+        // change between the check and marking it clean.
+        let data = block.data.read();
+        if data.iter().any(|&byte| byte != 0) || !block.dirty.swap(false, Ordering::AcqRel) {
+            return false;
+        }
+        self.num_dirty.fetch_sub(1, Ordering::Relaxed);
+        true
+    }
+
+    fn bid_to_sector(&self, bid: usize) -> usize {
+        bid * self.block_size / SECTOR_SIZE
+    }
+}
+
+impl CacheInner {
+    /// Evicts blocks with the CLOCK algorithm until at most `capacity` are cached.
+    ///
+    /// Blocks still in use are skipped, so the cache may stay over capacity for
+    /// a while. Dirty blocks stay until they are committed.
+    fn evict(&mut self, capacity: usize) {
+        // Two rounds: one to clear the referenced bits and one to evict.
+        let mut budget = self.blocks.len() * 2;
+
+        while self.blocks.len() > capacity && budget > 0 {
+            budget -= 1;
+
+            let bid = match self.blocks.range(self.clock_hand..).next() {
+                Some((&bid, _)) => bid,
+                None => *self.blocks.keys().next().unwrap(),
+            };
+            self.clock_hand = bid + 1;
+
+            let entry = self.blocks.get_mut(&bid).unwrap();
+            if entry.referenced {
+                entry.referenced = false;
+            } else if Arc::strong_count(&entry.block) == 1
+                && !entry.block.dirty.load(Ordering::Acquire)
+            {
+                self.blocks.remove(&bid);
+            }
+        }
+    }
+}
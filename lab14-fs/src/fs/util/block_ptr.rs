@@ -0,0 +1,37 @@
+use alloc::sync::{Arc, Weak};
+use ostd::Pod;
+
+use crate::fs::util::block_cache::BlockCache;
+
+/// A typed pointer to a value stored at `offset` in block `bid`.
+pub struct BlockPtr<T: Pod> {
+    bid: usize,
+    offset: usize,
+    _marker: core::marker::PhantomData<T>,
+    block_cache: Weak<BlockCache>,
+}
+
+impl<T: Pod> BlockPtr<T> {
+    pub fn new(bid: usize, offset: usize, block_cache: &Arc<BlockCache>) -> Self {
+        BlockPtr {
+            bid,
+            offset,
+            _marker: core::marker::PhantomData,
+            block_cache: Arc::downgrade(block_cache),
+        }
+    }
+
+    pub fn read(&self) -> T {
+        self.block_cache().read_val::<T>(self.bid, self.offset)
+    }
+
+    pub fn write(&self, val: &T) {
+        self.block_cache().write_val(self.bid, self.offset, val)
+    }
+
+    fn block_cache(&self) -> Arc<BlockCache> {
+        self.block_cache
+            .upgrade()
+            .expect("Block cache has been dropped")
+    }
+}
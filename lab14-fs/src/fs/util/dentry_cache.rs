@@ -0,0 +1,129 @@
+//! A global cache of path component lookups.
+//!
+//! It maps a (parent directory, name) pair to the child inode, or records that
+//! the name does not exist, so that walking a hot path does not go through the
+//! file systems' `lookup` again.
+//!
+//! Children are held weakly, so that a cached name does not keep its inode
+//! alive past the file system's own caches, such as the ext2 inode cache. A
+//! name whose inode was dropped is a miss.
+
+use alloc::{
+    collections::{btree_map::BTreeMap, vec_deque::VecDeque},
+    string::{String, ToString},
+    sync::{Arc, Weak},
+};
+use ostd::sync::SpinLock;
+
+use crate::{
+    error::{Errno, Error, Result},
+    fs::Inode,
+};
+
+/// The maximum number of cached names, including negative ones.
+const DENTRY_CACHE_CAPACITY: usize = 1024;
+
+pub static DENTRY_CACHE: DentryCache = DentryCache::new();
+
+pub struct DentryCache {
+    inner: SpinLock<Inner>,
+}
+
+struct Inner {
+    /// The cached names, keyed by the address of the parent inode.
+    dirs: BTreeMap<usize, CachedDir>,
+    /// The cached names in insertion order, for eviction.
+    order: VecDeque<(usize, String)>,
+}
+
+struct CachedDir {
+    /// Keeps the parent's allocation, and hence its address, from being reused
+    /// while it is a key.
+    parent: Weak<dyn Inode>,
+    /// `None` marks a name known not to exist.
+    children: BTreeMap<String, Option<Weak<dyn Inode>>>,
+}
+
+impl DentryCache {
+    const fn new() -> Self {
+        Self {
+            inner: SpinLock::new(Inner {
+                dirs: BTreeMap::new(),
+                order: VecDeque::new(),
+            }),
+        }
+    }
+
+    /// Looks up `name` in `parent`, going to the file system on a miss.
+    pub fn lookup(&self, parent: &Arc<dyn Inode>, name: &str) -> Result<Arc<dyn Inode>> {
+        if let Some(child) = self.get(parent, name) {
+            return child.ok_or(Error::new(Errno::ENOENT));
+        }
+
+        match parent.lookup(name) {
+            Ok(child) => {
+                self.insert(parent, name, Some(child.clone()));
+                Ok(child)
+            }
+            Err(err) if err.code == Errno::ENOENT => {
+                self.insert(parent, name, None);
+                Err(err)
+            }
+            Err(err) => Err(err),
+        }
+    }
+
+    /// Records the result of looking up `name` in `parent`.
+    ///
+    /// File systems must call this, or [`Self::invalidate`], when they add or
+    /// remove a name.
+    pub fn insert(&self, parent: &Arc<dyn Inode>, name: &str, child: Option<Arc<dyn Inode>>) {
+        let key = key_of(parent);
+        let mut inner = self.inner.lock();
+
+        let dir = inner.dirs.entry(key).or_insert_with(|| CachedDir {
+            parent: Arc::downgrade(parent),
+            children: BTreeMap::new(),
+        });
+        let child = child.as_ref().map(Arc::downgrade);
+        if dir.children.insert(name.to_string(), child).is_none() {
+            inner.order.push_back((key, name.to_string()));
+        }
+
+        while inner.order.len() > DENTRY_CACHE_CAPACITY {
+            let (key, name) = inner.order.pop_front().unwrap();
+            inner.remove(key, &name);
+        }
+    }
+
+    /// Forgets what is cached about `name` in `parent`.
+    pub fn invalidate(&self, parent: &Arc<dyn Inode>, name: &str) {
+        self.inner.lock().remove(key_of(parent), name);
+    }
+
+    /// Returns `Some(None)` for a known missing name and `None` on a miss.
+    fn get(&self, parent: &Arc<dyn Inode>, name: &str) -> Option<Option<Arc<dyn Inode>>> {
+        let inner = self.inner.lock();
+        let dir = inner.dirs.get(&key_of(parent))?;
+        match dir.children.get(name)? {
+            None => Some(None),
+            Some(child) => child.upgrade().map(Some),
+        }
+    }
+}
+
+impl Inner {
+    fn remove(&mut self, key: usize, name: &str) {
+        let Some(dir) = self.dirs.get_mut(&key) else {
+            return;
+        };
+        dir.children.remove(name);
+        if dir.children.is_empty() || dir.parent.strong_count() == 0 {
+            self.dirs.remove(&key);
+        }
+    }
+}
+
+fn key_of(inode: &Arc<dyn Inode>) -> usize {
+    Arc::as_ptr(inode) as *const () as usize
+}
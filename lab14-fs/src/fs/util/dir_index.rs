@@ -0,0 +1,47 @@
+//! A hash index over the entry names of a directory.
+
+use alloc::{vec, vec::Vec};
+
+/// Maps entry names to their positions in a directory's entry list.
+///
+/// The index only stores positions, so the names are compared against the
+/// entries themselves on lookup.
+pub struct DirIndex {
+    /// Each bucket holds the positions of the entries hashing into it.
+    buckets: Vec<Vec<u32>>,
+}
+
+impl DirIndex {
+    /// Builds an index over `names`, where the `i`-th name is the entry at position `i`.
+    pub fn new<'a>(names: impl ExactSizeIterator<Item = &'a [u8]>) -> Self {
+        // Keep the load factor at most 1.
+        let num_buckets = names.len().next_power_of_two().max(1);
+        let mut buckets = vec![Vec::new(); num_buckets];
+        for (position, name) in names.enumerate() {
+            buckets[hash(name) as usize & (num_buckets - 1)].push(position as u32);
+        }
+
+        Self { buckets }
+    }
+
+    /// Returns the position of the entry named `name`.
+    ///
+    /// `name_at` returns the name of the entry at a position.
+    pub fn lookup<'a>(&self, name: &[u8], name_at: impl Fn(usize) -> &'a [u8]) -> Option<usize> {
+        let bucket = &self.buckets[hash(name) as usize & (self.buckets.len() - 1)];
+        bucket
+            .iter()
+            .map(|&position| position as usize)
+            .find(|&position| name_at(position) == name)
+    }
+}
+
+/// The 64-bit FNV-1a hash.
+fn hash(name: &[u8]) -> u64 {
+    const OFFSET_BASIS: u64 = 0xcbf2_9ce4_8422_2325;
+    const PRIME: u64 = 0x0100_0000_01b3;
+
+    name.iter().fold(OFFSET_BASIS, |hash, &byte| {
+        (hash ^ byte as u64).wrapping_mul(PRIME)
+    })
+}
@@ -0,0 +1,359 @@
+//! A cache of the pages of one file, in frames that can be mapped to user space.
+//!
+//! `read()` and file mappings go through the same frames, so processes reading
+//! or mapping the same file share one copy of its data.
+//!
+//! Cached pages are always clean, as writes go to the block cache too and
+//! shared mappings of the files cached may not be written, see
+//! [`crate::fs::Inode::keeps_mapped_writes`]. So any of them can be dropped
+//! and read again. The pages of all caches are kept on
+//! two LRU lists: new pages enter the inactive list, and [`shrink`] evicts
+//! from its cold end, giving the pages referenced since they entered another
+//! round on the active list. The active list shrinks back into the inactive
+//! list whenever it is the longer one. Pages mapped by user space are skipped
+//! until they are unmapped, see [`crate::mm::reclaim`].
+
+use core::sync::atomic::{AtomicU64, AtomicUsize, Ordering};
+
+use alloc::{
+    collections::{VecDeque, btree_map::BTreeMap},
+    format,
+    string::String,
+    sync::{Arc, Weak},
+    vec::Vec,
+};
+use log::warn;
+use ostd::{
+    mm::{Frame, FrameAllocOptions},
+    sync::SpinLock,
+};
+use spin::Once;
+
+use crate::{
+    error::Result,
+    kcmd_option,
+    mm::{reclaim, shrinker},
+    stats::{self, Stat},
+};
+
+/// The pages cached by all files above which inserting a page evicts cold
+/// ones, unless set with `pagecache.max_pages=` on the command line.
+const DEFAULT_MAX_CACHED_PAGES: usize = 65536;
+/// The limit in the low-memory mode, see [`shrinker`].
+const LOW_MEMORY_MAX_CACHED_PAGES: usize = 4096;
+
+/// The pages evicted at once when the caches are over their limit.
+const SHRINK_BATCH: usize = 32;
+
+/// The cached pages of one file, keyed by page index in the file.
+type Pages = SpinLock<BTreeMap<usize, CachedPage>>;
+
+static LRU: SpinLock<Lru> = SpinLock::new(Lru {
+    active: VecDeque::new(),
+    inactive: VecDeque::new(),
+});
+/// The pages cached by all files.
+static CACHED_PAGES: AtomicUsize = AtomicUsize::new(0);
+static NEXT_PAGE_ID: AtomicU64 = AtomicU64::new(0);
+static SCANNED: AtomicU64 = AtomicU64::new(0);
+static EVICTED: AtomicU64 = AtomicU64::new(0);
+
+struct Lru {
+    active: VecDeque<LruEntry>,
+    inactive: VecDeque<LruEntry>,
+}
+
+/// A page on an LRU list, the coldest at the front. Entries of pages that left
+/// their cache are dropped when scanned.
+struct LruEntry {
+    pages: Weak<Pages>,
+    index: usize,
+    id: u64,
+}
+
+struct CachedPage {
+    frame: Frame<()>,
+    /// Tells the page from a later one at the same index.
+    id: u64,
+    /// Set on each hit, and cleared when the page is scanned.
+    referenced: bool,
+}
+
+pub struct PageCache {
+    pages: Arc<Pages>,
+    /// Bumped at the start and at the end of each write to the file, so that
+    /// a page loaded while the file changed is not cached with the old data.
+    /// Odd while a write is in progress.
+    write_seq: AtomicU64,
+}
+
+impl PageCache {
+    pub fn new() -> Self {
+        Self {
+            pages: Arc::new(SpinLock::new(BTreeMap::new())),
+            write_seq: AtomicU64::new(0),
+        }
+    }
+
+    /// Returns the frame caching the `index`-th page.
+    ///
+    /// On a miss, `load` fills a zeroed frame with the page's data. A load
+    /// that races with a write is done again, as it may have read the data
+    /// from before the write.
+    pub fn get(
+        &self,
+        index: usize,
+        mut load: impl FnMut(&Frame<()>) -> Result<()>,
+    ) -> Result<Frame<()>> {
+        loop {
+            let seq = self.load_seq();
+            if let Some(frame) = self.lookup(index) {
+                stats::inc(Stat::PageCacheHits);
+                return Ok(frame);
+            }
+            stats::inc(Stat::PageCacheMisses);
+
+            // Load without the lock held, as it sleeps on I/O. If another
+            // loader wins the race, its frame is kept.
+            let frame = reclaim::alloc_or_reclaim(1, || FrameAllocOptions::new().alloc_frame());
+            load(&frame)?;
+            if let Some(frame) = self.insert(index, frame, seq) {
+                return Ok(frame);
+            }
+        }
+    }
+
+    /// Returns the count to pass to [`Self::insert`] for a page loaded from
+    /// now on.
+    pub fn load_seq(&self) -> u64 {
+        self.write_seq.load(Ordering::Acquire)
+    }
+
+    /// Marks a write to the file in progress until the guard is dropped.
+    ///
+    /// The writer must update the cached pages it writes to itself. Writers
+    /// must be serialized.
+    pub fn start_write(&self) -> WriteGuard<'_> {
+        self.write_seq.fetch_add(1, Ordering::AcqRel);
+        WriteGuard(self)
+    }
+
+    /// Caches `frame`, filled by the caller, as the `index`-th page, and
+    /// returns the frame that ends up cached, which is the existing one if
+    /// there is one.
+    ///
+    /// Returns `None`, caching nothing, if a write started since `seq` was
+    /// taken with [`Self::load_seq`], as `frame` may then hold stale data.
+    pub fn insert(&self, index: usize, frame: Frame<()>, seq: u64) -> Option<Frame<()>> {
+        let mut pages = self.pages.lock();
+        if let Some(page) = pages.get_mut(&index) {
+            page.referenced = true;
+            return Some(page.frame.clone());
+        }
+        // Checked under the lock, so that a write either sees the page cached
+        // when it updates the cached pages, or is seen here.
+        if seq % 2 == 1 || self.write_seq.load(Ordering::Acquire) != seq {
+            return None;
+        }
+        let id = NEXT_PAGE_ID.fetch_add(1, Ordering::Relaxed);
+        pages.insert(
+            index,
+            CachedPage {
+                frame: frame.clone(),
+                id,
+                referenced: false,
+            },
+        );
+        drop(pages);
+
+        let mut lru = LRU.lock();
+        lru.inactive.push_back(LruEntry {
+            pages: Arc::downgrade(&self.pages),
+            index,
+            id,
+        });
+        // Drop the entries of dropped caches once they outnumber the pages.
+        if lru.active.len() + lru.inactive.len()
+            > 2 * CACHED_PAGES.load(Ordering::Relaxed) + SHRINK_BATCH
+        {
+            lru.active.retain(|entry| entry.pages.strong_count() > 0);
+            lru.inactive.retain(|entry| entry.pages.strong_count() > 0);
+        }
+        drop(lru);
+
+        if CACHED_PAGES.fetch_add(1, Ordering::Relaxed) >= max_cached_pages()
+            && shrink(SHRINK_BATCH, None) == 0
+        {
+            // Only mapped pages are left to evict.
+            reclaim::kick();
+        }
+        Some(frame)
+    }
+
+    /// Returns the frame caching the `index`-th page, if it is cached.
+    pub fn lookup(&self, index: usize) -> Option<Frame<()>> {
+        let mut pages = self.pages.lock();
+        let page = pages.get_mut(&index)?;
+        page.referenced = true;
+        Some(page.frame.clone())
+    }
+
+    pub fn contains(&self, index: usize) -> bool {
+        self.pages.lock().contains_key(&index)
+    }
+}
+
+/// A write to a file in progress, see [`PageCache::start_write`].
+pub struct WriteGuard<'a>(&'a PageCache);
+
+impl Drop for WriteGuard<'_> {
+    fn drop(&mut self) {
+        self.0.write_seq.fetch_add(1, Ordering::AcqRel);
+    }
+}
+
+impl Default for PageCache {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl Drop for PageCache {
+    fn drop(&mut self) {
+        CACHED_PAGES.fetch_sub(self.pages.lock().len(), Ordering::Relaxed);
+    }
+}
+
+/// Evicts up to `target` cold pages that user space does not map, and returns
+/// the number evicted.
+///
+/// The cold pages found mapped stay cached. With `mapped`, they are also
+/// collected there, for the caller to unmap them before shrinking again.
+pub fn shrink(target: usize, mut mapped: Option<&mut Vec<Frame<()>>>) -> usize {
+    let mut evicted = 0;
+    // Look at each page about once.
+    let mut budget = {
+        let lru = LRU.lock();
+        lru.active.len() + lru.inactive.len()
+    };
+    while evicted < target && budget > 0 {
+        budget -= 1;
+        let Some(entry) = next_inactive() else {
+            break;
+        };
+        SCANNED.fetch_add(1, Ordering::Relaxed);
+        let Some(pages) = entry.pages.upgrade() else {
+            continue;
+        };
+        let mut pages = pages.lock();
+        let Some(page) = pages
+            .get_mut(&entry.index)
+            .filter(|page| page.id == entry.id)
+        else {
+            continue;
+        };
+
+        if page.referenced {
+            page.referenced = false;
+            drop(pages);
+            LRU.lock().active.push_back(entry);
+            continue;
+        }
+        // The cache holds one reference, and page tables and mappings the
+        // others.
+        if page.frame.reference_count() > 1 {
+            if let Some(mapped) = mapped.as_deref_mut() {
+                mapped.push(page.frame.clone());
+            }
+            drop(pages);
+            LRU.lock().inactive.push_back(entry);
+            continue;
+        }
+
+        pages.remove(&entry.index);
+        CACHED_PAGES.fetch_sub(1, Ordering::Relaxed);
+        evicted += 1;
+    }
+    EVICTED.fetch_add(evicted as u64, Ordering::Relaxed);
+    evicted
+}
+
+/// Takes the coldest entry of the inactive list, first moving the coldest
+/// active ones over while the active list is the longer one.
+fn next_inactive() -> Option<LruEntry> {
+    let mut lru = LRU.lock();
+    while lru.inactive.len() < lru.active.len() {
+        let entry = lru.active.pop_front().unwrap();
+        lru.inactive.push_back(entry);
+    }
+    lru.inactive.pop_front()
+}
+
+fn max_cached_pages() -> usize {
+    static MAX_CACHED_PAGES: Once<usize> = Once::new();
+    *MAX_CACHED_PAGES.call_once(|| {
+        let default = if shrinker::is_low_memory() {
+            LOW_MEMORY_MAX_CACHED_PAGES
+        } else {
+            DEFAULT_MAX_CACHED_PAGES
+        };
+        match kcmd_option("pagecache.max_pages=").map(str::parse::<usize>) {
+            None => default,
+            Some(Ok(pages)) => pages,
+            Some(Err(_)) => {
+                warn!("Invalid page cache limit, using {} pages", default);
+                default
+            }
+        }
+    })
+}
+
+/// Returns the pages the caches hold.
+pub fn cached_pages() -> usize {
+    CACHED_PAGES.load(Ordering::Relaxed)
+}
+
+/// Returns the page cache counts, in the format of `/proc/vmstat`.
+pub fn report() -> String {
+    let (active, inactive) = {
+        let lru = LRU.lock();
+        (lru.active.len(), lru.inactive.len())
+    };
+    format!(
+        "nr_file_pages {}\nnr_active_file {}\nnr_inactive_file {}\npgscan {}\npgsteal {}\n",
+        CACHED_PAGES.load(Ordering::Relaxed),
+        active,
+        inactive,
+        SCANNED.load(Ordering::Relaxed),
+        EVICTED.load(Ordering::Relaxed)
+    )
+}
+
+#[cfg(ktest)]
+mod test {
+    use ostd::{mm::FrameAllocOptions, prelude::ktest};
+
+    use super::{PageCache, shrink};
+
+    #[ktest]
+    fn evicts_in_access_order() {
+        let cache = PageCache::new();
+        // Inserted in reverse index order, so that the coldest page is not
+        // the lowest index.
+        for index in [2, 1, 0] {
+            let frame = FrameAllocOptions::new().alloc_frame().unwrap();
+            cache.insert(index, frame, cache.load_seq()).unwrap();
+        }
+        // Page 2 is the oldest, but gets another round for being hit.
+        cache.lookup(2).unwrap();
+
+        // Other caches may have colder pages, so shrink until one of these
+        // goes.
+        while cache.contains(0) && cache.contains(1) && cache.contains(2) {
+            assert_eq!(shrink(1, None), 1);
+        }
+        assert!(cache.contains(2));
+        assert!(!cache.contains(1));
+        assert!(cache.contains(0));
+    }
+}
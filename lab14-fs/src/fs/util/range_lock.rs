@@ -0,0 +1,62 @@
+//! A lock over byte ranges of a file.
+//!
+//! Holders of disjoint ranges proceed together, so writers to different parts
+//! of one file do not wait for each other, while overlapping writes still
+//! happen one at a time.
+
+use core::ops::Range;
+
+use alloc::vec::Vec;
+use ostd::sync::{SpinLock, WaitQueue};
+
+pub struct RangeLock {
+    /// The ranges held now. Few writers share a file, so a list suffices.
+    held: SpinLock<Vec<Range<usize>>>,
+    wait_queue: WaitQueue,
+}
+
+impl RangeLock {
+    pub const fn new() -> Self {
+        Self {
+            held: SpinLock::new(Vec::new()),
+            wait_queue: WaitQueue::new(),
+        }
+    }
+
+    /// Locks `range`, waiting until no holder overlaps it.
+    pub fn lock(&self, range: Range<usize>) -> RangeLockGuard<'_> {
+        self.wait_queue.wait_until(|| {
+            let mut held = self.held.lock();
+            if held
+                .iter()
+                .any(|other| other.start < range.end && range.start < other.end)
+            {
+                return None;
+            }
+            held.push(range.clone());
+            Some(())
+        });
+        RangeLockGuard { lock: self, range }
+    }
+}
+
+impl Default for RangeLock {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+pub struct RangeLockGuard<'a> {
+    lock: &'a RangeLock,
+    range: Range<usize>,
+}
+
+impl Drop for RangeLockGuard<'_> {
+    fn drop(&mut self) {
+        let mut held = self.lock.held.lock();
+        let position = held.iter().position(|range| *range == self.range).unwrap();
+        held.swap_remove(position);
+        drop(held);
+        self.lock.wait_queue.wake_all();
+    }
+}
@@ -0,0 +1,77 @@
+//! Detection of sequential reads for read-ahead.
+
+use core::ops::Range;
+
+use ostd::{mm::PAGE_SIZE, sync::SpinLock};
+
+/// The window of the first read-ahead after a sequential read is detected.
+const INITIAL_WINDOW: usize = 4 * PAGE_SIZE;
+/// The default maximum read-ahead window.
+pub const DEFAULT_MAX_WINDOW: usize = 32 * PAGE_SIZE;
+
+/// The read-ahead state of one open file or file mapping.
+///
+/// Each sequential read doubles the window, up to the maximum. A read that
+/// does not continue where the last one ended resets it.
+pub struct ReadAhead {
+    max_window: usize,
+    inner: SpinLock<Window>,
+}
+
+struct Window {
+    /// Where the last read ended.
+    last_end: usize,
+    /// The size of the current window, 0 if the access is not sequential.
+    size: usize,
+    /// Where the data read ahead so far ends.
+    ahead_end: usize,
+}
+
+impl ReadAhead {
+    pub fn new(max_window: usize) -> Self {
+        Self {
+            max_window,
+            inner: SpinLock::new(Window {
+                last_end: 0,
+                size: 0,
+                ahead_end: 0,
+            }),
+        }
+    }
+
+    /// Records a read of `len` bytes at `offset`, and returns the range to read
+    /// ahead, if any.
+    pub fn on_read(&self, offset: usize, len: usize) -> Option<Range<usize>> {
+        let mut window = self.inner.lock();
+        let end = offset + len;
+        let sequential = offset == window.last_end;
+        window.last_end = end;
+
+        if !sequential {
+            window.size = 0;
+            window.ahead_end = 0;
+            return None;
+        }
+
+        window.size = if window.size == 0 {
+            INITIAL_WINDOW
+        } else {
+            core::cmp::min(window.size * 2, self.max_window)
+        };
+
+        // Only issue what has not been read ahead yet.
+        let start = core::cmp::max(end, window.ahead_end);
+        let ahead_end = end + window.size;
+        if start >= ahead_end {
+            return None;
+        }
+        window.ahead_end = ahead_end;
+        Some(start..ahead_end)
+    }
+}
+
+impl Default for ReadAhead {
+    fn default() -> Self {
+        Self::new(DEFAULT_MAX_WINDOW)
+    }
+}
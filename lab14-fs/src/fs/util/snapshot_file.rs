@@ -0,0 +1,55 @@
+use alloc::string::String;
+use ostd::mm::{FallibleVmWrite, VmReader, VmWriter};
+use ostd::sync::Mutex;
+
+use crate::error::{Errno, Error, Result};
+use crate::fs::{FileLike, SeekFrom};
+
+/// A read-only file holding text generated when it was opened, for pseudo
+/// files reporting kernel state.
+pub struct SnapshotFile {
+    content: String,
+    offset: Mutex<usize>,
+}
+
+impl SnapshotFile {
+    pub fn new(content: String) -> Self {
+        Self {
+            content,
+            offset: Mutex::new(0),
+        }
+    }
+}
+
+impl FileLike for SnapshotFile {
+    fn read(&self, writer: VmWriter) -> Result<usize> {
+        let mut offset = self.offset.lock();
+        let len = self.read_at(*offset, writer)?;
+        *offset += len;
+        Ok(len)
+    }
+
+    fn write(&self, _reader: VmReader) -> Result<usize> {
+        Err(Error::new(Errno::EBADF))
+    }
+
+    fn read_at(&self, offset: usize, mut writer: VmWriter) -> Result<usize> {
+        let Some(bytes) = self.content.as_bytes().get(offset..) else {
+            return Ok(0);
+        };
+        writer
+            .write_fallible(&mut VmReader::from(bytes))
+            .map_err(|_| Error::new(Errno::EFAULT))
+    }
+
+    fn seek(&self, pos: SeekFrom) -> Result<usize> {
+        let mut offset = self.offset.lock();
+        let new_offset = match pos {
+            SeekFrom::Start(start) => Some(start),
+            SeekFrom::Current(delta) => offset.checked_add_signed(delta),
+            SeekFrom::End(delta) => self.content.len().checked_add_signed(delta),
+        };
+        *offset = new_offset.ok_or(Error::new(Errno::EINVAL))?;
+        Ok(*offset)
+    }
+}
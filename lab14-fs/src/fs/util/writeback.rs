@@ -0,0 +1,94 @@
+//! The writeback task, which commits the dirty blocks of the block caches in
+//! the background.
+//!
+//! Writes only dirty blocks in memory, and the task writes them to the device
+//! every [`WRITEBACK_INTERVAL_SECS`] seconds, or sooner when a cache has more
+//! dirty blocks than its background threshold. Writers only wait for it when
+//! a cache reaches its dirty limit.
+
+use core::sync::atomic::{AtomicBool, AtomicU64, Ordering};
+
+use alloc::{
+    sync::{Arc, Weak},
+    vec::Vec,
+};
+use ostd::{
+    sync::{SpinLock, WaitQueue},
+    task::{Task, TaskOptions},
+    timer::{Jiffies, TIMER_FREQ},
+};
+use spin::Once;
+
+use crate::fs::util::block_cache::BlockCache;
+
+/// The interval between periodic writebacks.
+const WRITEBACK_INTERVAL_SECS: u64 = 5;
+
+/// The caches the task writes back.
+static CACHES: SpinLock<Vec<Weak<BlockCache>>> = SpinLock::new(Vec::new());
+static WAIT_QUEUE: WaitQueue = WaitQueue::new();
+/// Set to make the task run a round of writeback.
+static KICKED: AtomicBool = AtomicBool::new(false);
+/// The tick at which the next periodic writeback is due.
+static NEXT_PERIODIC: AtomicU64 = AtomicU64::new(0);
+static TASK: Once<Arc<Task>> = Once::new();
+
+/// Starts the writeback task.
+pub fn init() {
+    TASK.call_once(|| TaskOptions::new(writeback_main).spawn().unwrap());
+    ostd::timer::register_callback(on_tick);
+}
+
+/// Has the writeback task write back `cache` from now on.
+pub fn register(cache: &Arc<BlockCache>) {
+    CACHES.lock().push(Arc::downgrade(cache));
+}
+
+/// Returns whether the writeback task has been started.
+pub fn is_running() -> bool {
+    TASK.is_completed()
+}
+
+/// Makes the writeback task run a round soon. This can be called in interrupt
+/// context.
+pub fn kick() {
+    if !KICKED.swap(true, Ordering::AcqRel) {
+        WAIT_QUEUE.wake_all();
+    }
+}
+
+fn on_tick() {
+    let now = Jiffies::elapsed().as_u64();
+    let next = NEXT_PERIODIC.load(Ordering::Relaxed);
+    if now >= next
+        && NEXT_PERIODIC
+            .compare_exchange(
+                next,
+                now + WRITEBACK_INTERVAL_SECS * TIMER_FREQ,
+                Ordering::Relaxed,
+                Ordering::Relaxed,
+            )
+            .is_ok()
+    {
+        kick();
+    }
+}
+
+fn writeback_main() {
+    loop {
+        WAIT_QUEUE.wait_until(|| KICKED.swap(false, Ordering::AcqRel).then_some(()));
+
+        let caches: Vec<Arc<BlockCache>> = {
+            let mut caches = CACHES.lock();
+            caches.retain(|cache| cache.strong_count() > 0);
+            caches.iter().filter_map(Weak::upgrade).collect()
+        };
+        for cache in caches {
+            cache.commit();
+            // Writers dirtied more blocks meanwhile.
+            if cache.is_over_background_threshold() {
+                kick();
+            }
+        }
+    }
+}
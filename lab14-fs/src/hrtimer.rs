@@ -0,0 +1,130 @@
+//! Timers on monotonic time, finer than the timer tick.
+//!
+//! Armed timers are kept ordered by deadline, and the tick callback fires them
+//! as they come due, in interrupt context. A timer can be cancelled until it
+//! fires.
+//!
+//! Sleeps block on a timer armed at their deadline, so that they wake up on
+//! the first tick after it, at most a tick late, and leave the CPU to other
+//! tasks or to idle meanwhile.
+//!
+//! ostd programs the timer interrupt itself and counts every interrupt as a
+//! tick, so deadlines cannot be programmed one-shot through SBI, and idle CPUs
+//! keep taking the periodic tick.
+
+use core::{
+    sync::atomic::{AtomicBool, AtomicU64, Ordering},
+    time::Duration,
+};
+
+use alloc::{boxed::Box, collections::btree_map::BTreeMap, sync::Arc, vec::Vec};
+use ostd::sync::{LocalIrqDisabled, SpinLock, WaitQueue};
+
+use crate::clock::monotonic_time;
+
+type Callback = Box<dyn FnOnce() + Send>;
+
+/// The armed timers, keyed by deadline and then by when they were armed.
+static TIMERS: SpinLock<BTreeMap<TimerKey, Callback>, LocalIrqDisabled> =
+    SpinLock::new(BTreeMap::new());
+/// The earliest deadline in `TIMERS`, in nanoseconds, so that ticks with no
+/// timer due do not take the lock.
+static NEXT_DEADLINE: AtomicU64 = AtomicU64::new(u64::MAX);
+static NEXT_TIMER_ID: AtomicU64 = AtomicU64::new(0);
+
+type TimerKey = (Duration, u64);
+
+/// An armed timer, which [`cancel`] takes.
+pub struct Timer(TimerKey);
+
+/// Starts firing the timers on ticks.
+pub fn init() {
+    ostd::timer::register_callback(on_tick);
+}
+
+/// Arms a timer that calls `callback` in interrupt context once the monotonic
+/// time reaches `deadline`.
+pub fn arm(deadline: Duration, callback: impl FnOnce() + Send + 'static) -> Timer {
+    let key = (deadline, NEXT_TIMER_ID.fetch_add(1, Ordering::Relaxed));
+    let mut timers = TIMERS.lock();
+    timers.insert(key, Box::new(callback));
+    NEXT_DEADLINE.store(next_deadline(&timers), Ordering::Release);
+    Timer(key)
+}
+
+/// Disarms `timer`, unless it has fired.
+pub fn cancel(timer: Timer) {
+    let mut timers = TIMERS.lock();
+    if timers.remove(&timer.0).is_some() {
+        NEXT_DEADLINE.store(next_deadline(&timers), Ordering::Release);
+    }
+}
+
+/// Blocks the current task until the monotonic time reaches `deadline`.
+pub fn sleep_until(deadline: Duration) {
+    if deadline > monotonic_time() {
+        block_until(deadline);
+    }
+}
+
+/// Blocks the current task until the next tick, so that it is queued anew,
+/// on a CPU the scheduler picks, when woken.
+pub fn sleep_tick() {
+    block_until(monotonic_time());
+}
+
+/// Blocks the current task until the tick that fires a timer armed for
+/// `wake_at`.
+fn block_until(wake_at: Duration) {
+    let sleeper = Arc::new(Sleeper {
+        fired: AtomicBool::new(false),
+        queue: WaitQueue::new(),
+    });
+    let waker = sleeper.clone();
+    arm(wake_at, move || {
+        waker.fired.store(true, Ordering::Release);
+        waker.queue.wake_all();
+    });
+    sleeper
+        .queue
+        .wait_until(|| sleeper.fired.load(Ordering::Acquire).then_some(()));
+}
+
+/// Blocks the current task for `duration`.
+pub fn sleep(duration: Duration) {
+    sleep_until(monotonic_time() + duration);
+}
+
+struct Sleeper {
+    fired: AtomicBool,
+    queue: WaitQueue,
+}
+
+fn next_deadline(timers: &BTreeMap<TimerKey, Callback>) -> u64 {
+    timers
+        .first_key_value()
+        .map_or(u64::MAX, |((deadline, _), _)| deadline.as_nanos() as u64)
+}
+
+fn on_tick() {
+    let now = monotonic_time();
+    if (now.as_nanos() as u64) < NEXT_DEADLINE.load(Ordering::Acquire) {
+        return;
+    }
+
+    let mut due = Vec::new();
+    {
+        let mut timers = TIMERS.lock();
+        while let Some(entry) = timers.first_entry() {
+            if entry.key().0 > now {
+                break;
+            }
+            due.push(entry.remove());
+        }
+        NEXT_DEADLINE.store(next_deadline(&timers), Ordering::Release);
+    }
+    // Without the lock, so that callbacks may arm timers.
+    for callback in due {
+        callback();
+    }
+}
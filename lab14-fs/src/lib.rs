@@ -3,27 +3,65 @@
 #![feature(fn_traits)]
 #![feature(ascii_char)]
 
+#[cfg(ktest)]
+mod bench;
+mod boot;
+mod clock;
 pub mod console;
 mod drivers;
 mod error;
 mod fs;
+mod hrtimer;
+mod lock_stat;
 mod logger;
 mod mm;
 pub mod process;
+#[cfg(feature = "profiler")]
+pub mod profiler;
 pub mod progs;
 mod sched;
+mod stats;
 pub mod syscall;
 
 extern crate alloc;
 
+/// Boots, timing each phase, see [`boot`]. Once the scheduler is in, the
+/// rest of the boot runs in the first kernel task, since waiting for the
+/// probes needs a task to put to sleep, and the probes need the CPU while it
+/// sleeps.
 #[ostd::main]
 pub fn main() {
-    logger::init();
-    progs::init();
-    drivers::init();
-    sched::init();
-    fs::init();
+    boot::phase("logger", logger::init);
+    boot::phase("progs", progs::init);
+    boot::phase("sched", sched::init);
+    ostd::task::TaskOptions::new(first_task).spawn().unwrap();
+}
+
+/// Runs the rest of the boot, and then `init_proc`. The devices are probed in
+/// boot tasks while the phases that need none run.
+fn first_task() {
+    let probes = boot::phase("drivers", drivers::init);
+    boot::phase("log_drain", logger::init_drain);
+    boot::phase("frame_pool", mm::frame_pool::init);
+    boot::phase("reclaim", mm::reclaim::init);
+    boot::phase("reaper", mm::reaper::init);
+    boot::phase("hrtimer", hrtimer::init);
+    boot::phase("probe_wait", || probes.wait());
+    boot::phase("fs", fs::init);
+    boot::phase("swap", mm::swap::init);
+    #[cfg(feature = "profiler")]
+    boot::phase("profiler", profiler::init);
+    boot::phase("trim", mm::shrinker::trim);
+    boot::finish();
 
     let process = process::Process::new(progs::lookup_progs("init_proc").unwrap());
     process.run();
 }
+
+/// Returns the value of the kernel command-line option starting with `prefix`.
+fn kcmd_option(prefix: &str) -> Option<&'static str> {
+    ostd::boot::boot_info()
+        .kernel_cmdline
+        .split_whitespace()
+        .find_map(|arg| arg.strip_prefix(prefix))
+}
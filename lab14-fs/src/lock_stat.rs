@@ -0,0 +1,306 @@
+//! Locks that count their acquisitions, built with the `lock-stat` feature.
+//!
+//! [`StatMutex`] and [`StatRwMutex`] wrap the ostd sleeping locks, and each
+//! instance reports to a [`LockSite`], usually one per field or static, named
+//! where it is declared with [`lock_site!`]. A site counts acquisitions, those
+//! that found the lock held, and a histogram of how long the lock was held.
+//! Without the feature the wrappers are the plain locks.
+//!
+//! `/proc/locks` shows the sites that were used, in ticks of the `time`
+//! counter.
+
+use core::ops::{Deref, DerefMut};
+#[cfg(feature = "lock-stat")]
+use core::{
+    fmt::Write,
+    sync::atomic::{AtomicBool, AtomicU64, Ordering},
+};
+
+#[cfg(feature = "lock-stat")]
+use alloc::{string::String, vec::Vec};
+use ostd::sync::{Mutex, MutexGuard, RwMutex, RwMutexReadGuard, RwMutexWriteGuard};
+#[cfg(feature = "lock-stat")]
+use ostd::{arch::read_tsc, sync::SpinLock};
+
+/// Hold times of up to `2^HISTOGRAM_BUCKETS - 1` ticks are told apart; longer
+/// ones share the last bucket.
+#[cfg(feature = "lock-stat")]
+const HISTOGRAM_BUCKETS: usize = 24;
+
+/// Returns the `&'static LockSite` named `$name`, one per expansion.
+macro_rules! lock_site {
+    ($name:expr) => {{
+        static SITE: $crate::lock_stat::LockSite = $crate::lock_stat::LockSite::new($name);
+        &SITE
+    }};
+}
+pub(crate) use lock_site;
+
+/// The statistics of the locks declared in one place.
+pub struct LockSite {
+    #[cfg_attr(not(feature = "lock-stat"), expect(dead_code))]
+    name: &'static str,
+    #[cfg(feature = "lock-stat")]
+    registered: AtomicBool,
+    #[cfg(feature = "lock-stat")]
+    acquisitions: AtomicU64,
+    #[cfg(feature = "lock-stat")]
+    contended: AtomicU64,
+    #[cfg(feature = "lock-stat")]
+    hold_ticks: AtomicU64,
+    /// Bucket `i` counts the holds that took `2^(i-1)` to `2^i - 1` ticks.
+    #[cfg(feature = "lock-stat")]
+    hold_histogram: [AtomicU64; HISTOGRAM_BUCKETS],
+}
+
+/// The sites used so far, in the order they were first used.
+#[cfg(feature = "lock-stat")]
+static SITES: SpinLock<Vec<&'static LockSite>> = SpinLock::new(Vec::new());
+
+impl LockSite {
+    pub const fn new(name: &'static str) -> Self {
+        Self {
+            name,
+            #[cfg(feature = "lock-stat")]
+            registered: AtomicBool::new(false),
+            #[cfg(feature = "lock-stat")]
+            acquisitions: AtomicU64::new(0),
+            #[cfg(feature = "lock-stat")]
+            contended: AtomicU64::new(0),
+            #[cfg(feature = "lock-stat")]
+            hold_ticks: AtomicU64::new(0),
+            #[cfg(feature = "lock-stat")]
+            hold_histogram: [const { AtomicU64::new(0) }; HISTOGRAM_BUCKETS],
+        }
+    }
+
+    /// Takes a lock with `try_lock`, and with `lock` if it is held, counting
+    /// the acquisition.
+    #[cfg(feature = "lock-stat")]
+    fn acquire<G>(
+        &'static self,
+        try_lock: impl FnOnce() -> Option<G>,
+        lock: impl FnOnce() -> G,
+    ) -> (G, HoldTimer) {
+        if !self.registered.swap(true, Ordering::Relaxed) {
+            SITES.disable_irq().lock().push(self);
+        }
+        self.acquisitions.fetch_add(1, Ordering::Relaxed);
+        let guard = try_lock().unwrap_or_else(|| {
+            self.contended.fetch_add(1, Ordering::Relaxed);
+            lock()
+        });
+        (
+            guard,
+            HoldTimer {
+                site: self,
+                acquired_at: read_tsc(),
+            },
+        )
+    }
+
+    #[cfg(not(feature = "lock-stat"))]
+    fn acquire<G>(
+        &'static self,
+        _try_lock: impl FnOnce() -> Option<G>,
+        lock: impl FnOnce() -> G,
+    ) -> (G, HoldTimer) {
+        (lock(), HoldTimer)
+    }
+
+    /// Counts an acquisition taken without waiting, as with `try_lock`.
+    #[cfg(feature = "lock-stat")]
+    fn acquired(&'static self) -> HoldTimer {
+        if !self.registered.swap(true, Ordering::Relaxed) {
+            SITES.disable_irq().lock().push(self);
+        }
+        self.acquisitions.fetch_add(1, Ordering::Relaxed);
+        HoldTimer {
+            site: self,
+            acquired_at: read_tsc(),
+        }
+    }
+
+    #[cfg(not(feature = "lock-stat"))]
+    fn acquired(&'static self) -> HoldTimer {
+        HoldTimer
+    }
+}
+
+/// Records how long a lock was held when dropped, after the guard it comes
+/// with.
+#[cfg(feature = "lock-stat")]
+struct HoldTimer {
+    site: &'static LockSite,
+    acquired_at: u64,
+}
+
+#[cfg(not(feature = "lock-stat"))]
+struct HoldTimer;
+
+#[cfg(feature = "lock-stat")]
+impl Drop for HoldTimer {
+    fn drop(&mut self) {
+        let ticks = read_tsc().saturating_sub(self.acquired_at);
+        let bucket = ((u64::BITS - ticks.leading_zeros()) as usize).min(HISTOGRAM_BUCKETS - 1);
+        self.site.hold_ticks.fetch_add(ticks, Ordering::Relaxed);
+        self.site.hold_histogram[bucket].fetch_add(1, Ordering::Relaxed);
+    }
+}
+
+/// A [`Mutex`] reporting to a [`LockSite`].
+pub struct StatMutex<T> {
+    inner: Mutex<T>,
+    site: &'static LockSite,
+}
+
+// The guard is declared before the timer, so the lock is released before the
+// hold is recorded.
+pub struct StatMutexGuard<'a, T> {
+    guard: MutexGuard<'a, T>,
+    _timer: HoldTimer,
+}
+
+impl<T> StatMutex<T> {
+    pub const fn new(value: T, site: &'static LockSite) -> Self {
+        Self {
+            inner: Mutex::new(value),
+            site,
+        }
+    }
+
+    pub fn lock(&self) -> StatMutexGuard<'_, T> {
+        let (guard, timer) = self
+            .site
+            .acquire(|| self.inner.try_lock(), || self.inner.lock());
+        StatMutexGuard {
+            guard,
+            _timer: timer,
+        }
+    }
+
+    /// Takes the lock if it is free.
+    pub fn try_lock(&self) -> Option<StatMutexGuard<'_, T>> {
+        let guard = self.inner.try_lock()?;
+        Some(StatMutexGuard {
+            guard,
+            _timer: self.site.acquired(),
+        })
+    }
+}
+
+impl<T> Deref for StatMutexGuard<'_, T> {
+    type Target = T;
+
+    fn deref(&self) -> &T {
+        &self.guard
+    }
+}
+
+impl<T> DerefMut for StatMutexGuard<'_, T> {
+    fn deref_mut(&mut self) -> &mut T {
+        &mut self.guard
+    }
+}
+
+/// A [`RwMutex`] reporting to a [`LockSite`]. Readers and writers count
+/// alike.
+pub struct StatRwMutex<T> {
+    inner: RwMutex<T>,
+    site: &'static LockSite,
+}
+
+pub struct StatRwMutexReadGuard<'a, T> {
+    guard: RwMutexReadGuard<'a, T>,
+    _timer: HoldTimer,
+}
+
+pub struct StatRwMutexWriteGuard<'a, T> {
+    guard: RwMutexWriteGuard<'a, T>,
+    _timer: HoldTimer,
+}
+
+impl<T> StatRwMutex<T> {
+    pub const fn new(value: T, site: &'static LockSite) -> Self {
+        Self {
+            inner: RwMutex::new(value),
+            site,
+        }
+    }
+
+    pub fn read(&self) -> StatRwMutexReadGuard<'_, T> {
+        let (guard, timer) = self
+            .site
+            .acquire(|| self.inner.try_read(), || self.inner.read());
+        StatRwMutexReadGuard {
+            guard,
+            _timer: timer,
+        }
+    }
+
+    pub fn write(&self) -> StatRwMutexWriteGuard<'_, T> {
+        let (guard, timer) = self
+            .site
+            .acquire(|| self.inner.try_write(), || self.inner.write());
+        StatRwMutexWriteGuard {
+            guard,
+            _timer: timer,
+        }
+    }
+}
+
+impl<T> Deref for StatRwMutexReadGuard<'_, T> {
+    type Target = T;
+
+    fn deref(&self) -> &T {
+        &self.guard
+    }
+}
+
+impl<T> Deref for StatRwMutexWriteGuard<'_, T> {
+    type Target = T;
+
+    fn deref(&self) -> &T {
+        &self.guard
+    }
+}
+
+impl<T> DerefMut for StatRwMutexWriteGuard<'_, T> {
+    fn deref_mut(&mut self) -> &mut T {
+        &mut self.guard
+    }
+}
+
+/// Renders the contents of `/proc/locks`, the sites that contend the most
+/// first.
+#[cfg(feature = "lock-stat")]
+pub fn report() -> String {
+    let mut sites = SITES.disable_irq().lock().clone();
+    sites.sort_by_key(|site| core::cmp::Reverse(site.contended.load(Ordering::Relaxed)));
+
+    let mut out = String::new();
+    let _ = writeln!(
+        out,
+        "{:<24} {:>10} {:>10} {:>10}  hold histogram (bucket i: 2^(i-1) to 2^i-1 ticks)",
+        "site", "acquired", "contended", "avg hold"
+    );
+    for site in sites {
+        let acquisitions = site.acquisitions.load(Ordering::Relaxed);
+        let _ = write!(
+            out,
+            "{:<24} {:>10} {:>10} {:>10} ",
+            site.name,
+            acquisitions,
+            site.contended.load(Ordering::Relaxed),
+            site.hold_ticks.load(Ordering::Relaxed) / acquisitions.max(1)
+        );
+        for (bucket, holds) in site.hold_histogram.iter().enumerate() {
+            let holds = holds.load(Ordering::Relaxed);
+            if holds > 0 {
+                let _ = write!(out, " {}:{}", bucket, holds);
+            }
+        }
+        out.push('\n');
+    }
+    out
+}
@@ -1,36 +1,379 @@
-use log::{Metadata, Record};
-use ostd::early_println;
+//! The kernel logger.
+//!
+//! ostd sets the maximum level from `ostd.log_level`, and the `log` macros
+//! compare against it before formatting anything, so a disabled `debug!`
+//! costs a load and a branch.
+//!
+//! Enabled records are formatted into a lock-free ring of the CPU logging
+//! them, as a binary record of level, time and message. A drain task merges
+//! the rings by time, styles the records and writes them to the console, and
+//! keeps the most recent [`HISTORY_CAPACITY`] bytes of them as plain text for
+//! `syslog`. The tick kicks the drain task when a ring is not empty, so that
+//! logging never wakes a task.
+//!
+//! Errors, and everything logged before the drain task starts, are written
+//! out synchronously, after what the rings hold, so that an error right
+//! before a crash still reaches the console. Records are taken out of the
+//! rings with [`HISTORY`] locked and printed after it is released, so that
+//! the slow console write runs with IRQs enabled and holds up no other
+//! logger. A full ring drops the records
+//! that do not fit and the drain task reports how many.
+
+use core::{
+    fmt::{self, Write},
+    sync::atomic::{AtomicU64, AtomicUsize, Ordering},
+    time::Duration,
+};
+
+use alloc::{
+    collections::vec_deque::VecDeque,
+    string::{String, ToString},
+    sync::Arc,
+    vec::Vec,
+};
+use log::{Level, Metadata, Record};
+use ostd::{
+    cpu::all_cpus,
+    cpu_local, early_println,
+    irq::disable_local,
+    sync::{LocalIrqDisabled, SpinLock, WaitQueue},
+    task::{Task, TaskOptions},
+};
 use owo_colors::Style;
+use spin::Once;
+
+use crate::clock::monotonic_time;
+
+/// The words in the ring of each CPU.
+const RING_WORDS: usize = 2048;
+/// The words before the message of a record: the level and length, and then
+/// the time.
+const HEADER_WORDS: usize = 2;
+/// Longer messages are cut.
+const MAX_MESSAGE_LEN: usize = 1024;
+/// The bytes of text the log keeps for `syslog`.
+pub const HISTORY_CAPACITY: usize = 64 * 1024;
 
 struct ColorLogger;
 
 static LOGGER: ColorLogger = ColorLogger;
 
+/// A CPU's records, written only by that CPU with local IRQs disabled and
+/// read only with [`HISTORY`] locked.
+struct LogRing {
+    /// The word after the last record, only ever increasing.
+    head: AtomicUsize,
+    /// The word of the first record not yet drained.
+    tail: AtomicUsize,
+    /// The records that did not fit since the last drain.
+    dropped: AtomicU64,
+    words: [AtomicU64; RING_WORDS],
+}
+
+cpu_local! {
+    static RINGS: LogRing = LogRing {
+        head: AtomicUsize::new(0),
+        tail: AtomicUsize::new(0),
+        dropped: AtomicU64::new(0),
+        words: [const { AtomicU64::new(0) }; RING_WORDS],
+    };
+}
+
+/// The drained text. Its lock also serializes draining the rings.
+static HISTORY: SpinLock<VecDeque<u8>, LocalIrqDisabled> = SpinLock::new(VecDeque::new());
+static WAIT_QUEUE: WaitQueue = WaitQueue::new();
+static TASK: Once<Arc<Task>> = Once::new();
+
 impl log::Log for ColorLogger {
-    fn enabled(&self, _metadata: &Metadata) -> bool {
-        true
+    fn enabled(&self, metadata: &Metadata) -> bool {
+        metadata.level() <= log::max_level()
     }
 
     fn log(&self, record: &Record) {
-        let record_style = Style::new().default_color();
-        let level_style = match record.level() {
-            log::Level::Error => Style::new().red(),
-            log::Level::Warn => Style::new().bright_yellow(),
-            log::Level::Info => Style::new().blue(),
-            log::Level::Debug => Style::new().bright_green(),
-            log::Level::Trace => Style::new().bright_black(),
+        if !self.enabled(record.metadata()) {
+            return;
+        }
+        if record.level() == Level::Error || !TASK.is_completed() {
+            let records = {
+                let mut history = HISTORY.lock();
+                let mut records = drain(&mut history);
+                records.push(emit(
+                    &mut history,
+                    record.level(),
+                    monotonic_time(),
+                    record.args(),
+                ));
+                records
+            };
+            print(records);
+            return;
+        }
+
+        let guard = disable_local();
+        RINGS.get_with(&guard).push(record);
+    }
+
+    fn flush(&self) {
+        let records = drain(&mut HISTORY.lock());
+        print(records);
+    }
+}
+
+/// Packs the message of a record into the words of a ring, byte by byte.
+struct RecordWriter<'a> {
+    ring: &'a LogRing,
+    /// The first word of the message.
+    start: usize,
+    /// The bytes the message may take, at most [`MAX_MESSAGE_LEN`].
+    capacity: usize,
+    len: usize,
+    word: u64,
+}
+
+impl Write for RecordWriter<'_> {
+    fn write_str(&mut self, s: &str) -> fmt::Result {
+        for ch in s.chars() {
+            let mut bytes = [0; 4];
+            let bytes = ch.encode_utf8(&mut bytes).as_bytes();
+            // Cut at a character, so that the message stays UTF-8.
+            if self.len + bytes.len() > self.capacity {
+                return Err(fmt::Error);
+            }
+            for &byte in bytes {
+                self.word |= (byte as u64) << (self.len % 8 * 8);
+                self.len += 1;
+                if self.len % 8 == 0 {
+                    self.flush_word();
+                }
+            }
+        }
+        Ok(())
+    }
+}
+
+impl RecordWriter<'_> {
+    fn flush_word(&mut self) {
+        let index = self.start + (self.len - 1) / 8;
+        self.ring.words[index % RING_WORDS].store(self.word, Ordering::Relaxed);
+        self.word = 0;
+    }
+}
+
+impl LogRing {
+    fn push(&self, record: &Record) {
+        let head = self.head.load(Ordering::Relaxed);
+        let free = RING_WORDS - (head - self.tail.load(Ordering::Acquire));
+        if free <= HEADER_WORDS {
+            self.dropped.fetch_add(1, Ordering::Relaxed);
+            return;
+        }
+
+        let mut writer = RecordWriter {
+            ring: self,
+            start: head + HEADER_WORDS,
+            capacity: ((free - HEADER_WORDS) * 8).min(MAX_MESSAGE_LEN),
+            len: 0,
+            word: 0,
+        };
+        // A message that does not fit is cut, not dropped.
+        let _ = writer.write_fmt(*record.args());
+        let len = writer.len;
+        if len % 8 != 0 {
+            writer.flush_word();
+        }
+
+        let header = (record.level() as u64) << 32 | len as u64;
+        self.words[head % RING_WORDS].store(header, Ordering::Relaxed);
+        self.words[(head + 1) % RING_WORDS]
+            .store(monotonic_time().as_nanos() as u64, Ordering::Relaxed);
+        self.head
+            .store(head + HEADER_WORDS + len.div_ceil(8), Ordering::Release);
+    }
+
+    fn is_empty(&self) -> bool {
+        self.tail.load(Ordering::Relaxed) == self.head.load(Ordering::Acquire)
+    }
+
+    /// Returns the time of the first record, if any.
+    fn peek_time(&self) -> Option<u64> {
+        let tail = self.tail.load(Ordering::Relaxed);
+        (tail != self.head.load(Ordering::Acquire))
+            .then(|| self.words[(tail + 1) % RING_WORDS].load(Ordering::Relaxed))
+    }
+
+    /// Removes the first record, adds it to `history` and returns it.
+    fn pop(&self, history: &mut VecDeque<u8>) -> Drained {
+        let tail = self.tail.load(Ordering::Relaxed);
+        let header = self.words[tail % RING_WORDS].load(Ordering::Relaxed);
+        let time = self.words[(tail + 1) % RING_WORDS].load(Ordering::Relaxed);
+        let len = (header & u32::MAX as u64) as usize;
+        let level = match header >> 32 {
+            1 => Level::Error,
+            2 => Level::Warn,
+            3 => Level::Info,
+            4 => Level::Debug,
+            _ => Level::Trace,
         };
 
+        let mut message = [0u8; MAX_MESSAGE_LEN];
+        for (i, chunk) in message[..len].chunks_mut(8).enumerate() {
+            let word = self.words[(tail + HEADER_WORDS + i) % RING_WORDS].load(Ordering::Relaxed);
+            chunk.copy_from_slice(&word.to_le_bytes()[..chunk.len()]);
+        }
+        self.tail
+            .store(tail + HEADER_WORDS + len.div_ceil(8), Ordering::Release);
+
+        // The producer only cuts at characters.
+        let message = core::str::from_utf8(&message[..len]).unwrap_or("<invalid UTF-8>");
+        emit(
+            history,
+            level,
+            Duration::from_nanos(time),
+            &format_args!("{}", message),
+        )
+    }
+}
+
+/// A record taken out of the rings, for [`print`] to write to the console.
+struct Drained {
+    level: Level,
+    message: String,
+}
+
+/// Takes the records out of all rings, oldest first, adds them to `history`
+/// and returns them.
+fn drain(history: &mut VecDeque<u8>) -> Vec<Drained> {
+    let mut records = Vec::new();
+    for cpu in all_cpus() {
+        let dropped = RINGS.get_on_cpu(cpu).dropped.swap(0, Ordering::Relaxed);
+        if dropped > 0 {
+            records.push(emit(
+                history,
+                Level::Warn,
+                monotonic_time(),
+                &format_args!("{} log records dropped on CPU {}", dropped, cpu.as_usize()),
+            ));
+        }
+    }
+    loop {
+        let oldest = all_cpus()
+            .filter_map(|cpu| {
+                let ring = RINGS.get_on_cpu(cpu);
+                ring.peek_time().map(|time| (time, ring))
+            })
+            .min_by_key(|(time, _)| *time);
+        let Some((_, ring)) = oldest else {
+            break;
+        };
+        records.push(ring.pop(history));
+    }
+    records
+}
+
+/// Adds a record to `history`, as plain text, and returns it for [`print`].
+fn emit(
+    history: &mut VecDeque<u8>,
+    level: Level,
+    time: Duration,
+    args: &fmt::Arguments,
+) -> Drained {
+    let message = args.to_string();
+    let _ = writeln!(
+        HistoryWriter(history),
+        "[{:>5}.{:06}] [{:<5}] {}",
+        time.as_secs(),
+        time.subsec_micros(),
+        level,
+        message
+    );
+    Drained { level, message }
+}
+
+/// Writes records to the console, styled. Called with [`HISTORY`] unlocked,
+/// so batches drained at the same time may interleave.
+fn print(records: Vec<Drained>) {
+    let record_style = Style::new().default_color();
+    for record in records {
+        let level_style = match record.level {
+            Level::Error => Style::new().red(),
+            Level::Warn => Style::new().bright_yellow(),
+            Level::Info => Style::new().blue(),
+            Level::Debug => Style::new().bright_green(),
+            Level::Trace => Style::new().bright_black(),
+        };
         early_println!(
             "{} {}",
-            level_style.style(format_args!("[{:<5}]", record.level())),
-            record_style.style(record.args())
+            level_style.style(format_args!("[{:<5}]", record.level)),
+            record_style.style(record.message)
         );
     }
+}
+
+/// Appends to the history, forgetting its oldest bytes once it is full.
+struct HistoryWriter<'a>(&'a mut VecDeque<u8>);
+
+impl Write for HistoryWriter<'_> {
+    fn write_str(&mut self, s: &str) -> fmt::Result {
+        let history = &mut *self.0;
+        history.extend(s.bytes());
+        let excess = history.len().saturating_sub(HISTORY_CAPACITY);
+        history.drain(..excess);
+        Ok(())
+    }
+}
+
+/// Copies the most recent log text to `buf`, returning its length, and
+/// forgets all of it if `clear`.
+pub fn read_history(buf: &mut [u8], clear: bool) -> usize {
+    let mut history = HISTORY.lock();
+    let records = drain(&mut history);
+    let len = buf.len().min(history.len());
+    let skip = history.len() - len;
+    for (dst, src) in buf.iter_mut().zip(history.range(skip..)) {
+        *dst = *src;
+    }
+    if clear {
+        history.clear();
+    }
+    drop(history);
+    print(records);
+    len
+}
+
+/// Forgets the log text.
+pub fn clear_history() {
+    HISTORY.lock().clear();
+}
 
-    fn flush(&self) {}
+/// Returns the bytes of log text kept.
+pub fn history_len() -> usize {
+    HISTORY.lock().len()
 }
 
 pub(super) fn init() {
     ostd::logger::inject_logger(&LOGGER);
 }
+
+/// Starts the drain task, after which records are written out asynchronously.
+pub(super) fn init_drain() {
+    TASK.call_once(|| TaskOptions::new(drain_main).spawn().unwrap());
+    ostd::timer::register_callback(on_tick);
+}
+
+fn on_tick() {
+    if all_cpus().any(|cpu| !RINGS.get_on_cpu(cpu).is_empty()) {
+        WAIT_QUEUE.wake_all();
+    }
+}
+
+fn drain_main() {
+    loop {
+        WAIT_QUEUE.wait_until(|| {
+            all_cpus()
+                .any(|cpu| !RINGS.get_on_cpu(cpu).is_empty())
+                .then_some(())
+        });
+        let records = drain(&mut HISTORY.lock());
+        print(records);
+    }
+}
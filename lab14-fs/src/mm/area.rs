@@ -1,11 +1,15 @@
-use alloc::{collections::linked_list::LinkedList, sync::Arc};
+use align_ext::AlignExt;
+use alloc::{collections::btree_map::BTreeMap, sync::Arc};
+use core::ops::Range;
 use ostd::mm::{PAGE_SIZE, PageFlags, Vaddr};
 use riscv::register::scause::Exception;
 
 use crate::{
+    error::Result,
     mm::{
         VmMapping,
         fault::{DefaultPageFaultHandler, PageFaultContext, PageFaultHandler},
+        swap::{self, SWAP_READAHEAD_PAGES, SwapSlot},
     },
     process::Process,
 };
@@ -17,7 +21,16 @@ pub struct VmArea {
     /// Mapping page count with PAGE_SIZE as unit.
     pages: usize,
     perms: PageFlags,
-    mappings: LinkedList<VmMapping>,
+    /// The permissions `mprotect` may raise `perms` to.
+    max_perms: PageFlags,
+    /// Whether the pages are shared with the children, as for `MAP_SHARED`,
+    /// instead of copied on write.
+    shared: bool,
+    /// The mapped pages, keyed by their base address.
+    mappings: BTreeMap<Vaddr, VmMapping>,
+    /// The swapped-out pages, keyed by their base address. A page is either
+    /// mapped, swapped out or neither.
+    swapped: BTreeMap<Vaddr, Arc<SwapSlot>>,
     fault_handler: Arc<dyn PageFaultHandler>,
 }
 
@@ -27,7 +40,10 @@ impl VmArea {
             base_vaddr,
             pages,
             perms,
-            mappings: LinkedList::new(),
+            max_perms: PageFlags::RWX,
+            shared: false,
+            mappings: BTreeMap::new(),
+            swapped: BTreeMap::new(),
             fault_handler: Arc::new(DefaultPageFaultHandler),
         }
     }
@@ -42,7 +58,10 @@ impl VmArea {
             base_vaddr,
             pages,
             perms,
-            mappings: LinkedList::new(),
+            max_perms: PageFlags::RWX,
+            shared: false,
+            mappings: BTreeMap::new(),
+            swapped: BTreeMap::new(),
             fault_handler,
         }
     }
@@ -52,21 +71,154 @@ impl VmArea {
         process: &Arc<Process>,
         vaddr: Vaddr,
         fault: Exception,
-    ) -> crate::error::Result<()> {
+    ) -> Result<()> {
         debug_assert!(
             self.contains_vaddr(vaddr),
             "VmArea does not contain vaddr {:x?}",
             vaddr
         );
+        if matches!(fault, Exception::StorePageFault) && self.perms.contains(PageFlags::W) {
+            let cow_mapping = self
+                .mappings
+                .get_mut(&vaddr.align_down(PAGE_SIZE))
+                .filter(|mapping| mapping.is_cow());
+            if let Some(mapping) = cow_mapping {
+                mapping.break_cow(process.memory_space().vm_space());
+                return Ok(());
+            }
+        }
+
+        let page = vaddr.align_down(PAGE_SIZE);
+        if self.swapped.contains_key(&page) {
+            return self.swap_in(process, page);
+        }
+
+        let area_range = self.unswapped_range(page);
         self.fault_handler.handle_page_fault(PageFaultContext::new(
             self.perms,
             &mut self.mappings,
+            area_range,
             process,
             vaddr,
             fault,
         ))
     }
 
+    /// Maps all unmapped pages in `range` ahead of any access.
+    pub fn populate(&mut self, process: &Arc<Process>, range: Range<Vaddr>) -> Result<()> {
+        let area_range = self.range();
+        let end = range.end.min(area_range.end);
+        let mut vaddr = range.start.max(area_range.start).align_down(PAGE_SIZE);
+        while vaddr < end {
+            if self.swapped.contains_key(&vaddr) {
+                self.swap_in(process, vaddr)?;
+            } else if !self.mappings.contains_key(&vaddr) {
+                let area_range = self.unswapped_range(vaddr);
+                self.fault_handler.handle_page_fault(
+                    PageFaultContext::new(
+                        self.perms,
+                        &mut self.mappings,
+                        area_range,
+                        process,
+                        vaddr,
+                        Exception::LoadPageFault,
+                    )
+                    .with_window(vaddr..end),
+                )?;
+            }
+            vaddr += PAGE_SIZE;
+        }
+        Ok(())
+    }
+
+    /// Returns the part of the area around `page` that holds no swapped-out
+    /// page, so that the fault handler, which knows nothing of them, maps no
+    /// page over one.
+    fn unswapped_range(&self, page: Vaddr) -> Range<Vaddr> {
+        let range = self.range();
+        let start = self
+            .swapped
+            .range(range.start..page)
+            .next_back()
+            .map_or(range.start, |(&vaddr, _)| vaddr + PAGE_SIZE);
+        let end = self
+            .swapped
+            .range(page..range.end)
+            .next()
+            .map_or(range.end, |(&vaddr, _)| vaddr);
+        start..end
+    }
+
+    /// Reads the swapped-out page at `page` back in and maps it, with the
+    /// pages around it in the same [`SWAP_READAHEAD_PAGES`]-page window that
+    /// were swapped out to the slots next to its slot, in one request.
+    fn swap_in(&mut self, process: &Arc<Process>, page: Vaddr) -> Result<()> {
+        let slot = self.swapped[&page].index();
+        let window_size = SWAP_READAHEAD_PAGES * PAGE_SIZE;
+        let window_start = (page / window_size * window_size).max(self.base_vaddr);
+        let window_end = (page / window_size * window_size + window_size).min(self.range().end);
+        let follows = |vaddr: Vaddr, swapped: &BTreeMap<Vaddr, Arc<SwapSlot>>| {
+            swapped.get(&vaddr).is_some_and(|other| {
+                other.index() as isize - slot as isize
+                    == (vaddr as isize - page as isize) / PAGE_SIZE as isize
+            })
+        };
+        let mut start = page;
+        while start > window_start && follows(start - PAGE_SIZE, &self.swapped) {
+            start -= PAGE_SIZE;
+        }
+        let mut end = page + PAGE_SIZE;
+        while end < window_end && follows(end, &self.swapped) {
+            end += PAGE_SIZE;
+        }
+
+        let frames = swap::read_in(slot - (page - start) / PAGE_SIZE, (end - start) / PAGE_SIZE)?;
+        // Frees the slots, unless other address spaces still hold them.
+        let mut removed = self.swapped.split_off(&start);
+        let mut rest = removed.split_off(&end);
+        self.swapped.append(&mut rest);
+        PageFaultContext::new(
+            self.perms,
+            &mut self.mappings,
+            start..end,
+            process,
+            page,
+            Exception::LoadPageFault,
+        )
+        .map_frames(start..end, frames, None);
+        Ok(())
+    }
+
+    /// Removes the mappings in `range` and returns them, and forgets the
+    /// swapped-out pages in it.
+    pub fn remove_mappings(&mut self, range: Range<Vaddr>) -> BTreeMap<Vaddr, VmMapping> {
+        let mut swapped = self.swapped.split_off(&range.start);
+        let mut rest = swapped.split_off(&range.end);
+        self.swapped.append(&mut rest);
+
+        let mut removed = self.mappings.split_off(&range.start);
+        let mut rest = removed.split_off(&range.end);
+        self.mappings.append(&mut rest);
+        removed
+    }
+
+    /// Returns whether the pages of the area may be swapped out, i.e., it is
+    /// private, writable and anonymous.
+    pub fn is_swappable(&self) -> bool {
+        !self.shared && self.perms.contains(PageFlags::W) && self.fault_handler.is_anonymous()
+    }
+
+    /// Records the page at `vaddr` as swapped out to `slot`. The caller must
+    /// have removed its mapping.
+    pub fn add_swapped(&mut self, vaddr: Vaddr, slot: Arc<SwapSlot>) {
+        debug_assert!(!self.mappings.contains_key(&vaddr));
+        self.swapped.insert(vaddr, slot);
+    }
+
+    pub fn swapped(&self) -> &BTreeMap<Vaddr, Arc<SwapSlot>> {
+        &self.swapped
+    }
+
     pub fn page_fault_handler(&self) -> &Arc<dyn PageFaultHandler> {
         &self.fault_handler
     }
@@ -75,15 +227,42 @@ impl VmArea {
         self.perms
     }
 
+    /// Sets the permissions of the area and of its mappings. The caller must
+    /// update the page table.
+    pub fn set_perms(&mut self, perms: PageFlags) {
+        self.perms = perms;
+        for mapping in self.mappings.values_mut() {
+            mapping.set_perms(perms);
+        }
+    }
+
+    pub fn max_perms(&self) -> PageFlags {
+        self.max_perms
+    }
+
+    /// Limits the permissions the area may be given later, as for a page that
+    /// must stay read-only.
+    pub fn set_max_perms(&mut self, max_perms: PageFlags) {
+        self.max_perms = max_perms;
+    }
+
+    pub fn is_shared(&self) -> bool {
+        self.shared
+    }
+
+    pub fn set_shared(&mut self, shared: bool) {
+        self.shared = shared;
+    }
+
     pub fn add_mapping(&mut self, mapping: VmMapping) {
-        self.mappings.push_back(mapping);
+        self.mappings.insert(mapping.base_vaddr(), mapping);
     }
 
-    pub fn mappings_mut(&mut self) -> &mut LinkedList<VmMapping> {
+    pub fn mappings_mut(&mut self) -> &mut BTreeMap<Vaddr, VmMapping> {
         &mut self.mappings
     }
 
-    pub fn mappings(&self) -> &LinkedList<VmMapping> {
+    pub fn mappings(&self) -> &BTreeMap<Vaddr, VmMapping> {
         &self.mappings
     }
 
@@ -95,6 +274,55 @@ impl VmArea {
         self.pages
     }
 
+    /// Sets the number of pages, and returns the mappings that no longer fit.
+    pub fn resize(&mut self, pages: usize) -> BTreeMap<Vaddr, VmMapping> {
+        self.pages = pages;
+        let end = self.base_vaddr + pages * PAGE_SIZE;
+        self.swapped.split_off(&end);
+        self.mappings.split_off(&end)
+    }
+
+    /// Splits the area at `at`, which must be a page boundary inside it, and
+    /// returns the part from `at` on. Both parts keep the fault handler.
+    pub fn split_off(&mut self, at: Vaddr) -> VmArea {
+        debug_assert!(at % PAGE_SIZE == 0 && self.base_vaddr < at && at < self.range().end);
+        let upper = VmArea {
+            base_vaddr: at,
+            pages: (self.range().end - at) / PAGE_SIZE,
+            perms: self.perms,
+            max_perms: self.max_perms,
+            shared: self.shared,
+            mappings: self.mappings.split_off(&at),
+            swapped: self.swapped.split_off(&at),
+            fault_handler: self.fault_handler.clone(),
+        };
+        self.pages = (at - self.base_vaddr) / PAGE_SIZE;
+        upper
+    }
+
+    /// Returns whether `next` directly follows this area and differs from it
+    /// in nothing, as after a split, so that [`Self::merge`] can join them.
+    pub fn can_merge(&self, next: &VmArea) -> bool {
+        self.range().end == next.base_vaddr
+            && self.perms == next.perms
+            && self.max_perms == next.max_perms
+            && self.shared == next.shared
+            && Arc::as_ptr(&self.fault_handler) as *const ()
+                == Arc::as_ptr(&next.fault_handler) as *const ()
+    }
+
+    /// Appends `next`, which [`Self::can_merge`] must allow, to this area.
+    pub fn merge(&mut self, mut next: VmArea) {
+        debug_assert!(self.can_merge(&next));
+        self.pages += next.pages;
+        self.mappings.append(&mut next.mappings);
+        self.swapped.append(&mut next.swapped);
+    }
+
+    pub fn range(&self) -> Range<Vaddr> {
+        self.base_vaddr..self.base_vaddr + self.pages * PAGE_SIZE
+    }
+
     pub fn contains_vaddr(&self, vaddr: Vaddr) -> bool {
         vaddr >= self.base_vaddr && vaddr < self.base_vaddr + self.pages * PAGE_SIZE
     }
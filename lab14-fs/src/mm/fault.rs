@@ -1,31 +1,41 @@
-use core::fmt::Debug;
+use core::{fmt::Debug, ops::Range};
 
 use crate::{
     error::{Errno, Error, Result},
-    mm::VmMapping,
+    kcmd_option,
+    mm::{VmMapping, frame_pool},
     process::Process,
 };
 use align_ext::AlignExt;
-use alloc::{collections::linked_list::LinkedList, sync::Arc};
-use log::error;
+use alloc::{collections::btree_map::BTreeMap, sync::Arc};
+use log::{error, warn};
 use ostd::{
     irq::disable_local,
-    mm::{CachePolicy, FrameAllocOptions, PAGE_SIZE, PageFlags, PageProperty, Vaddr},
+    mm::{CachePolicy, Frame, FrameAllocOptions, PAGE_SIZE, PageFlags, PageProperty, Vaddr},
 };
 use riscv::register::scause::Exception;
+use spin::Once;
+
+/// The default number of pages mapped around a faulting page.
+pub const DEFAULT_FAULT_AROUND_PAGES: usize = 16;
 
 pub struct PageFaultContext<'a> {
     pub perms: PageFlags,
-    pub mappings: &'a mut LinkedList<VmMapping>,
+    pub mappings: &'a mut BTreeMap<Vaddr, VmMapping>,
+    /// The range of the faulting area.
+    pub area_range: Range<Vaddr>,
     pub process: &'a Arc<Process>,
     pub vaddr: Vaddr,
     pub fault: Exception,
+    /// Overrides the fault-around window, e.g., to populate a whole range.
+    pub window: Option<Range<Vaddr>>,
 }
 
 impl PageFaultContext<'_> {
     pub fn new<'a>(
         perms: PageFlags,
-        mappings: &'a mut LinkedList<VmMapping>,
+        mappings: &'a mut BTreeMap<Vaddr, VmMapping>,
+        area_range: Range<Vaddr>,
         process: &'a Arc<Process>,
         vaddr: Vaddr,
         fault: Exception,
@@ -33,15 +43,108 @@ impl PageFaultContext<'_> {
         PageFaultContext {
             perms,
             mappings,
+            area_range,
             process,
             vaddr,
             fault,
+            window: None,
+        }
+    }
+
+    pub fn with_window(mut self, window: Range<Vaddr>) -> Self {
+        self.window = Some(window);
+        self
+    }
+
+    /// Returns the run of unmapped pages around the faulting page.
+    ///
+    /// The run stays within the `max_pages`-page window holding the faulting
+    /// page, or [`Self::window`] if set, and within the area. It is empty if
+    /// the faulting page is mapped.
+    pub fn fault_around_range(&self, max_pages: usize) -> Range<Vaddr> {
+        let fault_page = self.vaddr.align_down(PAGE_SIZE);
+        if self.mappings.contains_key(&fault_page) {
+            return fault_page..fault_page;
+        }
+
+        let window = self.window.clone().unwrap_or_else(|| {
+            let window_size = max_pages.max(1) * PAGE_SIZE;
+            let window_start = fault_page / window_size * window_size;
+            window_start..window_start + window_size
+        });
+        let start = window.start.max(self.area_range.start);
+        let end = window.end.min(self.area_range.end);
+
+        // Stop at the closest mapped pages on either side.
+        let start = self
+            .mappings
+            .range(start..fault_page)
+            .next_back()
+            .map_or(start, |(&vaddr, _)| vaddr + PAGE_SIZE);
+        let end = self
+            .mappings
+            .range(fault_page..end)
+            .next()
+            .map_or(end, |(&vaddr, _)| vaddr);
+        start..end
+    }
+
+    /// Maps `frames` at `range` in one cursor pass and records the mappings.
+    ///
+    /// With a `cow_token`, the frames are mapped copy-on-write, see
+    /// [`VmMapping::new_cow`].
+    pub fn map_frames(
+        &mut self,
+        range: Range<Vaddr>,
+        frames: impl IntoIterator<Item = Frame<()>>,
+        cow_token: Option<Arc<()>>,
+    ) {
+        let perms = if cow_token.is_some() {
+            self.perms - PageFlags::W
+        } else {
+            self.perms
+        };
+
+        let memory_space = self.process.memory_space();
+        let guard = disable_local();
+        let mut cursor_mut = memory_space.vm_space().cursor_mut(&guard, &range).unwrap();
+        for (i, frame) in frames.into_iter().enumerate() {
+            cursor_mut.map(
+                frame.clone().into(),
+                PageProperty::new_user(perms, CachePolicy::Writeback),
+            );
+
+            // Add mapping
+            let vaddr = range.start + i * PAGE_SIZE;
+            let mapping = match &cow_token {
+                Some(cow_token) => VmMapping::new_cow(vaddr, self.perms, frame, cow_token.clone()),
+                None => VmMapping::new(vaddr, self.perms, frame),
+            };
+            self.mappings.insert(vaddr, mapping);
         }
     }
 }
 
+/// The access pattern hints of `madvise`.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum MemoryAdvice {
+    Normal,
+    Random,
+    Sequential,
+    WillNeed,
+}
+
 pub trait PageFaultHandler: Send + Sync + Debug {
     fn handle_page_fault<'a>(&self, context: PageFaultContext<'a>) -> Result<()>;
+
+    /// Takes a hint about how `range` of the area will be accessed.
+    fn advise(&self, _advice: MemoryAdvice, _range: Range<Vaddr>) {}
+
+    /// Returns whether the pages are zero-filled memory backed by nothing,
+    /// and may thus be swapped out, see [`super::swap`].
+    fn is_anonymous(&self) -> bool {
+        false
+    }
 }
 
 #[derive(Debug)]
@@ -57,29 +160,86 @@ impl PageFaultHandler for DefaultPageFaultHandler {
     }
 }
 
+/// The size of a huge page, the span of one second-level page table entry.
+pub const HUGE_PAGE_SIZE: usize = 512 * PAGE_SIZE;
+
+/// Returns whether anonymous areas are backed by huge pages where they can
+/// be, with `transparent_hugepage=always` on the command line.
+///
+/// They are not by default: the page table still maps a huge block with 512
+/// base pages, so it saves no TLB entries, while the first fault in the
+/// block allocates 2 MiB however little of it the process touches.
+fn huge_pages_enabled() -> bool {
+    static ENABLED: Once<bool> = Once::new();
+    *ENABLED.call_once(|| match kcmd_option("transparent_hugepage=") {
+        None | Some("never") => false,
+        Some("always") => true,
+        Some(other) => {
+            warn!("Unknown huge page policy {:?}, using never", other);
+            false
+        }
+    })
+}
+
+/// Maps zeroed pages on a fault, a few neighbouring pages at a time.
+///
+/// The frames come from the pre-zeroed stock, see [`frame_pool`]. With huge
+/// pages enabled, see [`huge_pages_enabled`], a fault in an unmapped,
+/// [`HUGE_PAGE_SIZE`]-aligned block that lies wholly within the area maps the
+/// whole block with one physically contiguous segment instead, and falls back
+/// to base pages when no segment is free. Each page of the
+/// block is still a mapping of its own, so a partial unmap or protection
+/// change splits the block without copying.
 #[derive(Debug)]
-pub struct AllocationPageFaultHandler;
+pub struct AllocationPageFaultHandler {
+    fault_around_pages: usize,
+}
+
+impl AllocationPageFaultHandler {
+    pub fn new(fault_around_pages: usize) -> Self {
+        Self { fault_around_pages }
+    }
+}
+
+impl Default for AllocationPageFaultHandler {
+    fn default() -> Self {
+        Self::new(DEFAULT_FAULT_AROUND_PAGES)
+    }
+}
 
 impl PageFaultHandler for AllocationPageFaultHandler {
-    fn handle_page_fault<'a>(&self, context: PageFaultContext<'a>) -> Result<()> {
-        let memory_space = context.process.memory_space();
-        let vm_space = memory_space.vm_space();
-        let frame = FrameAllocOptions::new().alloc_frame().unwrap();
-        let align_down_vaddr = context.vaddr.align_down(PAGE_SIZE);
+    fn handle_page_fault<'a>(&self, mut context: PageFaultContext<'a>) -> Result<()> {
+        let range = context.fault_around_range(self.fault_around_pages);
+        if range.is_empty() {
+            return Err(Error::new(Errno::EACCES));
+        }
 
-        let guard = disable_local();
-        let mut cursor_mut = vm_space
-            .cursor_mut(&guard, &(align_down_vaddr..align_down_vaddr + PAGE_SIZE))
-            .unwrap();
-        cursor_mut.map(
-            frame.clone().into(),
-            PageProperty::new_user(context.perms, CachePolicy::Writeback),
-        );
+        if let Some(block) = huge_block(&context) {
+            if let Ok(segment) = FrameAllocOptions::new().alloc_segment(block.len() / PAGE_SIZE) {
+                context.map_frames(block, segment, None);
+                return Ok(());
+            }
+        }
 
-        // Add mapping
-        let mapping = VmMapping::new(align_down_vaddr, context.perms, frame);
-        context.mappings.push_back(mapping);
+        let frames = frame_pool::alloc_zeroed(range.len() / PAGE_SIZE);
+        context.map_frames(range, frames, None);
 
         Ok(())
     }
+
+    fn is_anonymous(&self) -> bool {
+        true
+    }
+}
+
+/// Returns the huge page block holding the faulting page if it can be mapped
+/// whole, i.e., it lies within the area and none of its pages is mapped.
+fn huge_block(context: &PageFaultContext) -> Option<Range<Vaddr>> {
+    if !huge_pages_enabled() {
+        return None;
+    }
+    let start = context.vaddr.align_down(HUGE_PAGE_SIZE);
+    let block = start..start + HUGE_PAGE_SIZE;
+    let fits = context.area_range.start <= block.start && block.end <= context.area_range.end;
+    (fits && context.mappings.range(block.clone()).next().is_none()).then_some(block)
 }
@@ -0,0 +1,162 @@
+//! A stock of pre-zeroed frames for the page fault handlers.
+//!
+//! Zeroing a frame on the faulting path delays the faulting thread by a whole
+//! page of stores. Instead, each CPU keeps a stock of frames a background task
+//! zeroed ahead of time. A fault takes frames from its CPU's stock, and only
+//! zeroes frames itself when the stock runs dry. The task refills a stock with
+//! one segment allocation per batch once it falls below its low watermark, and
+//! yields between batches so that it runs in the time runnable tasks leave.
+//!
+//! The stocks give their frames back under memory pressure, and are smaller
+//! in the low-memory mode, see [`shrinker`].
+
+use core::sync::atomic::{AtomicBool, Ordering};
+
+use alloc::{boxed::Box, sync::Arc, vec::Vec};
+use ostd::{
+    cpu::{PinCurrentCpu, all_cpus},
+    mm::{Frame, FrameAllocOptions, PAGE_SIZE, io_util::HasVmReaderWriter},
+    sync::{LocalIrqDisabled, SpinLock, WaitQueue},
+    task::{Task, TaskOptions, disable_preempt},
+};
+use spin::Once;
+
+use crate::mm::{
+    reclaim,
+    shrinker::{self, Shrinker},
+};
+
+/// The frames the task keeps in each CPU's stock.
+const STOCK_SIZE: usize = 64;
+/// The stock size in the low-memory mode.
+const LOW_MEMORY_STOCK_SIZE: usize = 16;
+
+/// The frames allocated and zeroed at once on a refill.
+const REFILL_BATCH: usize = 16;
+
+static STOCKS: Once<Box<[SpinLock<Vec<Frame<()>>, LocalIrqDisabled>]>> = Once::new();
+static WAIT_QUEUE: WaitQueue = WaitQueue::new();
+/// Set to make the task refill the stocks.
+static KICKED: AtomicBool = AtomicBool::new(false);
+static TASK: Once<Arc<Task>> = Once::new();
+static ZERO_FRAME: Once<Frame<()>> = Once::new();
+
+/// Starts the refill task, which fills the stocks.
+pub fn init() {
+    STOCKS.call_once(|| all_cpus().map(|_| SpinLock::new(Vec::new())).collect());
+    TASK.call_once(|| TaskOptions::new(refill_main).spawn().unwrap());
+    shrinker::register(&StockShrinker);
+    kick();
+}
+
+/// Returns the frames the task keeps in each CPU's stock.
+fn stock_size() -> usize {
+    if shrinker::is_low_memory() {
+        LOW_MEMORY_STOCK_SIZE
+    } else {
+        STOCK_SIZE
+    }
+}
+
+/// Returns the stock below which a CPU has the task refill it.
+fn low_watermark() -> usize {
+    stock_size() / 4
+}
+
+/// Returns `count` zeroed frames, taken from the local CPU's stock first.
+pub fn alloc_zeroed(count: usize) -> Vec<Frame<()>> {
+    let mut frames = Vec::with_capacity(count);
+    if let Some(stocks) = STOCKS.get() {
+        let guard = disable_preempt();
+        let mut stock = stocks[guard.current_cpu().as_usize()].lock();
+        let start = stock.len().saturating_sub(count);
+        frames.extend(stock.drain(start..));
+        let is_low = stock.len() < low_watermark();
+        drop(stock);
+        drop(guard);
+        if is_low {
+            kick();
+        }
+    }
+
+    if frames.len() < count {
+        frames.extend(reclaim::alloc_segment(count - frames.len()));
+    }
+    frames
+}
+
+/// Returns the frame that stays all zeros, for readers of data known to be
+/// zero. Nothing may write to it.
+pub fn zero_frame() -> &'static Frame<()> {
+    ZERO_FRAME.call_once(|| reclaim::alloc_segment(1).next().unwrap())
+}
+
+fn kick() {
+    if !KICKED.swap(true, Ordering::AcqRel) {
+        WAIT_QUEUE.wake_all();
+    }
+}
+
+fn refill_main() {
+    let stocks = STOCKS.get().unwrap();
+    loop {
+        WAIT_QUEUE.wait_until(|| KICKED.swap(false, Ordering::AcqRel).then_some(()));
+
+        for stock in stocks.iter() {
+            loop {
+                let missing = stock_size().saturating_sub(stock.lock().len());
+                if missing == 0 {
+                    break;
+                }
+
+                let batch = missing.min(REFILL_BATCH);
+                // Zero here rather than in the allocator, with no lock held.
+                let Ok(segment) = FrameAllocOptions::new().zeroed(false).alloc_segment(batch)
+                else {
+                    // Memory runs low. Leave what is left to the faults, which
+                    // fall back to the allocator, and free some.
+                    reclaim::set_memory_low(true);
+                    break;
+                };
+                reclaim::set_memory_low(false);
+                segment.writer().fill_zeros(batch * PAGE_SIZE);
+                stock.lock().extend(segment);
+                Task::yield_now();
+            }
+        }
+    }
+}
+
+/// Empties the stocks, which the task refills as faults take from them again.
+struct StockShrinker;
+
+impl Shrinker for StockShrinker {
+    fn name(&self) -> &'static str {
+        "frame_stock"
+    }
+
+    fn count(&self) -> usize {
+        STOCKS
+            .get()
+            .into_iter()
+            .flatten()
+            .map(|stock| stock.lock().len())
+            .sum()
+    }
+
+    fn shrink(&self, target: usize) -> usize {
+        let mut freed = 0;
+        for stock in STOCKS.get().into_iter().flatten() {
+            if freed >= target {
+                break;
+            }
+            let frames: Vec<Frame<()>> = {
+                let mut stock = stock.lock();
+                let start = stock.len().saturating_sub(target - freed);
+                stock.drain(start..).collect()
+            };
+            freed += frames.len();
+        }
+        freed
+    }
+}
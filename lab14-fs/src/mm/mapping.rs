@@ -1,10 +1,50 @@
-use ostd::mm::{Frame, PAGE_SIZE, PageFlags, Vaddr};
+use alloc::sync::Arc;
+use core::sync::atomic::{Ordering, fence};
+
+use ostd::{
+    mm::{
+        CachePolicy, Frame, FrameAllocOptions, PAGE_SIZE, PageFlags, PageProperty, Vaddr, VmSpace,
+        io_util::HasVmReaderWriter, tlb::TlbFlushOp,
+    },
+    task::disable_preempt,
+};
+use spin::Once;
+
+use crate::mm::{reclaim, slab::SlabCache};
+
+/// The share tokens of mappings no longer shared, reused by the next forks.
+static COW_TOKENS: SlabCache<Arc<()>> = SlabCache::new("cow_token", 0);
+
+/// Returns the copy-on-write share token for mappings of frames owned by a
+/// cache, such as the page cache.
+///
+/// The token is never dropped, so a write to such a mapping always copies the
+/// frame instead of taking it over.
+pub fn cache_cow_token() -> Arc<()> {
+    static CACHE_COW_TOKEN: Once<Arc<()>> = Once::new();
+    CACHE_COW_TOKEN.call_once(|| Arc::new(())).clone()
+}
 
 #[derive(Debug, Clone)]
 pub struct VmMapping {
     base_vaddr: Vaddr,
     frame: Frame<()>,
     perms: PageFlags,
+    /// Set while the frame is shared copy-on-write with other mappings. All
+    /// mappings sharing the frame hold a clone, so the count tells how many
+    /// still do.
+    ///
+    /// The page table maps the frame without `W` while this is set; `perms`
+    /// keeps the permissions to restore once the mapping owns its frame.
+    cow: Option<Arc<()>>,
+}
+
+impl Drop for VmMapping {
+    fn drop(&mut self) {
+        if let Some(token) = self.cow.take() {
+            COW_TOKENS.free_if_unique(token);
+        }
+    }
 }
 
 impl VmMapping {
@@ -13,6 +53,25 @@ impl VmMapping {
             base_vaddr,
             frame,
             perms,
+            cow: None,
+        }
+    }
+
+    /// Creates a mapping sharing `frame` copy-on-write with the other holders
+    /// of `cow_token`.
+    ///
+    /// The caller must map the frame without `W`.
+    pub fn new_cow(
+        base_vaddr: Vaddr,
+        perms: PageFlags,
+        frame: Frame<()>,
+        cow_token: Arc<()>,
+    ) -> Self {
+        Self {
+            base_vaddr,
+            frame,
+            perms,
+            cow: Some(cow_token),
         }
     }
 
@@ -28,6 +87,10 @@ impl VmMapping {
         self.perms
     }
 
+    pub fn set_perms(&mut self, perms: PageFlags) {
+        self.perms = perms;
+    }
+
     pub fn remove_perm(&mut self, flag: PageFlags) {
         self.perms.remove(flag);
     }
@@ -35,4 +98,59 @@ impl VmMapping {
     pub fn frame(&self) -> &Frame<()> {
         &self.frame
     }
+
+    pub fn is_cow(&self) -> bool {
+        self.cow.is_some()
+    }
+
+    /// Returns a mapping sharing this mapping's frame copy-on-write.
+    ///
+    /// The caller must map the frame without `W` in both address spaces.
+    pub fn share_cow(&mut self) -> VmMapping {
+        let token = self
+            .cow
+            .get_or_insert_with(|| COW_TOKENS.alloc(|| Arc::new(())))
+            .clone();
+        VmMapping {
+            base_vaddr: self.base_vaddr,
+            frame: self.frame.clone(),
+            perms: self.perms,
+            cow: Some(token),
+        }
+    }
+
+    /// Gives this mapping a frame of its own and maps it in `vm_space` with
+    /// the full permissions.
+    ///
+    /// The frame is copied only if other mappings still share it.
+    pub fn break_cow(&mut self, vm_space: &VmSpace) {
+        let Some(token) = self.cow.take() else {
+            return;
+        };
+
+        if Arc::strong_count(&token) > 1 {
+            let new_frame = reclaim::alloc_or_reclaim(1, || FrameAllocOptions::new().alloc_frame());
+            new_frame.writer().write(&mut self.frame.reader());
+            self.frame = new_frame;
+        } else {
+            // Pairs with the release in the other sharers' drop of the token,
+            // so that their copies are done before the frame is written.
+            fence(Ordering::Acquire);
+        }
+        // Drop the token only after copying, so that a sharer faulting
+        // concurrently does not take the frame over while it is being read.
+        COW_TOKENS.free_if_unique(token);
+
+        let guard = disable_preempt();
+        let range = self.base_vaddr..self.base_vaddr + PAGE_SIZE;
+        let mut cursor = vm_space.cursor_mut(&guard, &range).unwrap();
+        cursor.map(
+            self.frame.clone().into(),
+            PageProperty::new_user(self.perms, CachePolicy::Writeback),
+        );
+        cursor
+            .flusher()
+            .issue_tlb_flush(TlbFlushOp::Address(self.base_vaddr));
+        cursor.flusher().dispatch_tlb_flush();
+    }
 }
@@ -0,0 +1,57 @@
+//! The memory each subsystem holds, shown in `/proc/meminfo`.
+//!
+//! The counts are of the frames each owner holds now, in kB. Anonymous pages
+//! shared between address spaces count once. The page tables are those of the
+//! user address spaces, estimated from their mappings, see
+//! [`super::MemorySpace::memory_usage`]. The slab caches hold heap memory
+//! rather than frames of their own, so theirs is the size of the objects
+//! cached. The shrinkable lines are what each [`shrinker`] could give back.
+
+use alloc::{collections::btree_set::BTreeSet, format, string::String};
+use core::fmt::Write;
+use ostd::mm::PAGE_SIZE;
+
+use crate::{
+    drivers::utils::dma_pool,
+    fs::{pipe, util::page_cache},
+    mm::{shrinker, slab},
+    process,
+};
+
+/// Returns the memory each subsystem holds, one line per owner.
+pub fn report() -> String {
+    let mut anon = BTreeSet::new();
+    let mut page_tables = 0;
+    for process in process::all_processes() {
+        page_tables += process.memory_space().memory_usage(&mut anon);
+    }
+
+    let kb = |pages: usize| pages * PAGE_SIZE / 1024;
+    let mut report = String::new();
+    for (name, kb) in [
+        ("PageCache", kb(page_cache::cached_pages())),
+        ("Pipes", kb(pipe::frames())),
+        ("Dma", kb(dma_pool::mapped_pages())),
+        ("PageTables", kb(page_tables)),
+        ("Slab", slab::cached_bytes() / 1024),
+        ("AnonPages", kb(anon.len())),
+    ] {
+        writeln!(report, "{:<24} {:>10} kB", format!("{}:", name), kb).unwrap();
+    }
+    for shrinker in shrinker::shrinkers() {
+        let name = format!("Shrinkable({}):", shrinker.name());
+        writeln!(report, "{:<24} {:>10} kB", name, kb(shrinker.count())).unwrap();
+    }
+    writeln!(
+        report,
+        "{:<24} {:>10}",
+        "LowMemory:",
+        if shrinker::is_low_memory() {
+            "on"
+        } else {
+            "off"
+        }
+    )
+    .unwrap();
+    report
+}
@@ -1,20 +1,46 @@
 pub mod area;
 pub mod fault;
+pub mod frame_pool;
 pub mod mapping;
+pub mod meminfo;
+pub mod reaper;
+pub mod reclaim;
+pub mod shrinker;
+pub mod slab;
+pub mod swap;
 
-use alloc::{collections::linked_list::LinkedList, sync::Arc};
+use align_ext::AlignExt;
+use alloc::{
+    collections::{btree_map::BTreeMap, btree_set::BTreeSet},
+    sync::Arc,
+    vec::Vec,
+};
+use core::ops::Range;
 pub use mapping::VmMapping;
 use ostd::{
     arch::cpu::context::CpuExceptionInfo,
+    cpu_local,
     mm::{
-        CachePolicy, FrameAllocOptions, MAX_USERSPACE_VADDR, PAGE_SIZE, PageProperty, Segment,
-        VmSpace, io_util::HasVmReaderWriter,
+        CachePolicy, FrameAllocOptions, MAX_USERSPACE_VADDR, PAGE_SIZE, Paddr, PageFlags,
+        PageProperty, Segment, Vaddr, VmSpace, tlb::TlbFlushOp, vm_space::VmItem,
     },
     sync::SpinLock,
     task::disable_preempt,
 };
 
-use crate::{mm::area::VmArea, process::Process};
+use crate::{
+    error::{Errno, Error, Result},
+    lock_stat::{StatMutex, lock_site},
+    mm::{area::VmArea, fault::MemoryAdvice, swap::SWAP_CLUSTER},
+    process::{Process, USER_STACK_TOP},
+    stats::{self, Stat},
+};
+
+cpu_local! {
+    /// The address space each CPU has loaded. Holding it keeps its page table
+    /// alive, so a new address space cannot be mistaken for it.
+    static ACTIVE_VM_SPACE: SpinLock<Option<Arc<VmSpace>>> = SpinLock::new(None);
+}
 
 pub fn page_fault_handler(
     process: &Arc<Process>,
@@ -23,39 +49,519 @@ pub fn page_fault_handler(
     let memory_space = process.memory_space();
     let page_fault_addr = cpu_exception.page_fault_addr;
 
+    let usage = process.usage();
+    let in_sectors = usage.in_sectors();
+
     let mut areas = memory_space.areas.lock();
-    for area in areas.iter_mut() {
-        if !area.contains_vaddr(page_fault_addr) {
-            continue;
+    if reclaim::is_memory_low() {
+        // Make room for the pages about to be faulted in.
+        swap_out_areas(memory_space.vm_space(), &mut areas, SWAP_CLUSTER);
+    }
+    let area = find_area_mut(&mut areas, page_fault_addr).ok_or(())?;
+    area.handle_page_fault(process, page_fault_addr, cpu_exception.code)
+        .map_err(|_| ())?;
+
+    // A fault that read from the device is a major one.
+    let major = usage.in_sectors() != in_sectors;
+    usage.count_fault(major);
+    stats::inc(if major {
+        Stat::MajorFaults
+    } else {
+        Stat::MinorFaults
+    });
+    usage.record_rss(areas.values().map(|area| area.mappings().len()).sum());
+    Ok(())
+}
+
+/// Returns the areas overlapping `range`, which must not be empty.
+fn overlapping_areas(
+    areas: &mut BTreeMap<Vaddr, VmArea>,
+    range: Range<Vaddr>,
+) -> impl Iterator<Item = &mut VmArea> {
+    let first = areas
+        .range(..=range.start)
+        .next_back()
+        .map_or(range.start, |(&base, _)| base);
+    areas
+        .range_mut(first..range.end)
+        .map(|(_, area)| area)
+        .filter(move |area| area.range().end > range.start)
+}
+
+/// Splits the areas straddling the ends of `range`, so that every area lies
+/// either inside or outside it.
+fn split_areas(areas: &mut BTreeMap<Vaddr, VmArea>, range: &Range<Vaddr>) {
+    for at in [range.start, range.end] {
+        if let Some(area) = find_area_mut(areas, at).filter(|area| area.base_vaddr() != at) {
+            let upper = area.split_off(at);
+            areas.insert(at, upper);
+        }
+    }
+}
+
+/// Merges the areas in and next to `range` that [`VmArea::can_merge`] allows,
+/// undoing the splits of an earlier call.
+fn merge_areas(areas: &mut BTreeMap<Vaddr, VmArea>, range: &Range<Vaddr>) {
+    let first = areas
+        .range(..range.start)
+        .next_back()
+        .map_or(range.start, |(&base, _)| base);
+    let bases: Vec<Vaddr> = areas
+        .range(first..=range.end)
+        .map(|(&base, _)| base)
+        .collect();
+    let mut bases = bases.into_iter();
+    let Some(mut current) = bases.next() else {
+        return;
+    };
+    for base in bases {
+        if areas[&current].can_merge(&areas[&base]) {
+            let next = areas.remove(&base).unwrap();
+            areas.get_mut(&current).unwrap().merge(next);
+        } else {
+            current = base;
+        }
+    }
+}
+
+/// Returns the area containing `vaddr`.
+fn find_area_mut(areas: &mut BTreeMap<Vaddr, VmArea>, vaddr: Vaddr) -> Option<&mut VmArea> {
+    // Areas do not overlap, so only the last one starting at or below `vaddr`
+    // can contain it.
+    let (_, area) = areas.range_mut(..=vaddr).next_back()?;
+    area.contains_vaddr(vaddr).then_some(area)
+}
+
+/// Swaps out up to `max` pages of the swappable areas not accessed since the
+/// last scan, and returns how many were swapped out.
+///
+/// Each scan clears the accessed bits of the pages it passes over, so a page
+/// gets a second chance once accessed. The bits are cleared without a TLB
+/// flush, which at worst makes a page accessed through a stale TLB entry
+/// look cold. Pages shared copy-on-write are left alone, as other address
+/// spaces still map them.
+fn swap_out_areas(vm_space: &VmSpace, areas: &mut BTreeMap<Vaddr, VmArea>, max: usize) -> usize {
+    if max == 0 || !swap::is_enabled() {
+        return 0;
+    }
+    let guard = disable_preempt();
+    let mut cursor = vm_space
+        .cursor_mut(&guard, &(0..MAX_USERSPACE_VADDR))
+        .unwrap();
+    // The base addresses of the victims and of their areas.
+    let mut victims = Vec::new();
+    'scan: for area in areas.values().filter(|area| area.is_swappable()) {
+        for mapping in area.mappings().values().filter(|mapping| !mapping.is_cow()) {
+            let vaddr = mapping.base_vaddr();
+            cursor.jump(vaddr).unwrap();
+            let Ok(VmItem::Mapped { prop, .. }) = cursor.query() else {
+                continue;
+            };
+            if prop.flags.contains(PageFlags::ACCESSED) {
+                cursor.protect_next(PAGE_SIZE, |prop| prop.flags -= PageFlags::ACCESSED);
+                continue;
+            }
+            victims.push((area.base_vaddr(), vaddr));
+            if victims.len() == max {
+                break 'scan;
+            }
+        }
+    }
+
+    let slots = swap::alloc_slots(victims.len());
+    victims.truncate(slots.len());
+    if victims.is_empty() {
+        return 0;
+    }
+    for &(_, vaddr) in &victims {
+        cursor.jump(vaddr).unwrap();
+        cursor.unmap(PAGE_SIZE);
+    }
+    cursor.flusher().dispatch_tlb_flush();
+    drop(cursor);
+    drop(guard);
+
+    let removed: Vec<VmMapping> = victims
+        .iter()
+        .map(|(base, vaddr)| {
+            let area = areas.get_mut(base).unwrap();
+            area.mappings_mut().remove(vaddr).unwrap()
+        })
+        .collect();
+    let frames: Vec<_> = removed
+        .iter()
+        .map(|mapping| mapping.frame().clone())
+        .collect();
+    if swap::write_out(&slots, &frames).is_err() {
+        // Put the pages back as they were.
+        let guard = disable_preempt();
+        let mut cursor = vm_space
+            .cursor_mut(&guard, &(0..MAX_USERSPACE_VADDR))
+            .unwrap();
+        for ((base, _), mapping) in victims.iter().zip(removed) {
+            cursor.jump(mapping.base_vaddr()).unwrap();
+            cursor.map(
+                mapping.frame().clone().into(),
+                PageProperty::new_user(mapping.perms(), CachePolicy::Writeback),
+            );
+            areas.get_mut(base).unwrap().add_mapping(mapping);
         }
+        return 0;
+    }
 
-        return area
-            .handle_page_fault(process, page_fault_addr, cpu_exception.code)
-            .map_err(|_| ());
+    for ((base, vaddr), slot) in victims.iter().zip(slots) {
+        areas.get_mut(base).unwrap().add_swapped(*vaddr, slot);
     }
+    victims.len()
+}
 
-    Err(())
+/// Returns whether pages with `perms` may be in the page table. The pages of
+/// `PROT_NONE` areas are kept out of it, so that any access faults.
+fn is_accessible(perms: PageFlags) -> bool {
+    perms.intersects(PageFlags::RWX)
+}
+
+/// Returns the pages spanning `len` bytes from `start`, as the memory system
+/// calls take them. Fails with `EINVAL` unless `start` is page-aligned and
+/// the pages lie in user space.
+pub fn user_range(start: Vaddr, len: usize) -> Result<Range<Vaddr>> {
+    let end = len
+        .checked_next_multiple_of(PAGE_SIZE)
+        .and_then(|len| start.checked_add(len));
+    match end {
+        Some(end) if start % PAGE_SIZE == 0 && end <= MAX_USERSPACE_VADDR => Ok(start..end),
+        _ => Err(Error::new(Errno::EINVAL)),
+    }
 }
 
 pub struct MemorySpace {
     vm_space: Arc<VmSpace>,
-    areas: SpinLock<LinkedList<VmArea>>,
+    /// The areas, keyed by their base address.
+    ///
+    /// A sleeping lock, as page faults on file mappings wait for I/O while
+    /// holding it. Never take it with preemption disabled.
+    areas: StatMutex<BTreeMap<Vaddr, VmArea>>,
 }
 
 impl MemorySpace {
     pub fn new() -> Self {
         Self {
             vm_space: Arc::new(VmSpace::new()),
-            areas: SpinLock::new(LinkedList::new()),
+            areas: StatMutex::new(BTreeMap::new(), lock_site!("mm.areas")),
         }
     }
 
     /// Add a virtual memory area without initializing the frames.
     pub fn add_area(&self, area: VmArea) {
-        self.areas.lock().push_back(area);
+        self.areas.lock().insert(area.base_vaddr(), area);
+    }
+
+    /// Returns the bytes spanned by all areas, and by the private writable ones
+    /// other than the stack, which count as data.
+    pub fn vm_sizes(&self) -> (usize, usize) {
+        let areas = self.areas.lock();
+        let mut total = 0;
+        let mut data = 0;
+        for area in areas.values() {
+            let size = area.pages() * PAGE_SIZE;
+            total += size;
+            if !area.is_shared()
+                && area.perms().contains(PageFlags::W)
+                && area.range().end != USER_STACK_TOP
+            {
+                data += size;
+            }
+        }
+        (total, data)
+    }
+
+    /// Adds the frames mapped by anonymous areas to `anon`, and returns the
+    /// pages of the page table mapping the areas.
+    ///
+    /// The page table count is an estimate from the pages mapped: the root
+    /// table, and a table per 1 GiB and per 2 MiB block with a page mapped.
+    pub fn memory_usage(&self, anon: &mut BTreeSet<Paddr>) -> usize {
+        let areas = self.areas.lock();
+        let mut gib_blocks = BTreeSet::new();
+        let mut huge_blocks = BTreeSet::new();
+        for area in areas.values() {
+            let is_anonymous = area.page_fault_handler().is_anonymous();
+            for (&vaddr, mapping) in area.mappings() {
+                gib_blocks.insert(vaddr >> 30);
+                huge_blocks.insert(vaddr / fault::HUGE_PAGE_SIZE);
+                if is_anonymous {
+                    anon.insert(mapping.frame().start_paddr());
+                }
+            }
+        }
+        1 + gib_blocks.len() + huge_blocks.len()
+    }
+
+    /// Returns the start of the lowest free range of `len` bytes in `within`.
+    pub fn find_free_range(&self, within: Range<Vaddr>, len: usize) -> Option<Vaddr> {
+        let areas = self.areas.lock();
+        let start = within.start;
+        let mut candidate = start;
+        // Begin with the area that may contain `start`.
+        let first = areas
+            .range(..=start)
+            .next_back()
+            .map_or(start, |(&base, _)| base);
+        for area in areas.range(first..).map(|(_, area)| area) {
+            let area_end = area.base_vaddr() + area.pages() * PAGE_SIZE;
+            if area_end <= candidate {
+                continue;
+            }
+            if area.base_vaddr() >= candidate + len {
+                break;
+            }
+            candidate = area_end;
+        }
+        (candidate + len <= within.end).then_some(candidate)
+    }
+
+    /// Grows or shrinks the area based at `base_vaddr` to `pages` pages,
+    /// removing it if `pages` is 0.
+    ///
+    /// The pages cut off are unmapped and their frames released.
+    pub fn resize_area(&self, base_vaddr: Vaddr, pages: usize) -> Result<()> {
+        let mut areas = self.areas.lock();
+        let new_end = base_vaddr + pages * PAGE_SIZE;
+        if let Some((&next_base, _)) = areas.range(base_vaddr + 1..).next() {
+            if next_base < new_end {
+                return Err(Error::new(Errno::ENOMEM));
+            }
+        }
+
+        let area = areas
+            .get_mut(&base_vaddr)
+            .ok_or(Error::new(Errno::ENOENT))?;
+        let old_end = base_vaddr + area.pages() * PAGE_SIZE;
+        let removed = area.resize(pages);
+        if pages == 0 {
+            areas.remove(&base_vaddr);
+        }
+
+        if !removed.is_empty() {
+            let guard = disable_preempt();
+            let range = new_end..old_end;
+            let mut cursor = self.vm_space.cursor_mut(&guard, &range).unwrap();
+            cursor.unmap(range.len());
+            cursor.flusher().dispatch_tlb_flush();
+        }
+        Ok(())
+    }
+
+    /// Maps all pages in `range` ahead of any access, as for `MAP_POPULATE`.
+    pub fn populate(&self, process: &Arc<Process>, range: Range<Vaddr>) -> Result<()> {
+        if range.is_empty() {
+            return Ok(());
+        }
+        let mut areas = self.areas.lock();
+        for area in overlapping_areas(&mut areas, range.clone()) {
+            area.populate(process, range.clone())?;
+        }
+        Ok(())
+    }
+
+    /// Returns the physical address `vaddr` maps to if it is in a shared
+    /// mapping, or `None` if it is in a private one, faulting its page in
+    /// first.
+    pub fn translate_shared(&self, process: &Arc<Process>, vaddr: Vaddr) -> Result<Option<Paddr>> {
+        let page = vaddr.align_down(PAGE_SIZE);
+        self.populate(process, page..page + PAGE_SIZE)?;
+        let mut areas = self.areas.lock();
+        let area = find_area_mut(&mut areas, vaddr).ok_or(Error::new(Errno::EFAULT))?;
+        if !area.is_shared() {
+            return Ok(None);
+        }
+        area.mappings()
+            .get(&page)
+            .map(|mapping| Some(mapping.frame().start_paddr() + (vaddr - page)))
+            .ok_or(Error::new(Errno::EFAULT))
+    }
+
+    /// Passes an access pattern hint for `range` to the areas it covers.
+    pub fn advise(&self, range: Range<Vaddr>, advice: MemoryAdvice) {
+        if range.is_empty() {
+            return;
+        }
+        let mut areas = self.areas.lock();
+        for area in overlapping_areas(&mut areas, range.clone()) {
+            let area_range = area.range();
+            area.page_fault_handler().advise(
+                advice,
+                range.start.max(area_range.start)..range.end.min(area_range.end),
+            );
+        }
+    }
+
+    /// Unmaps the pages in `range` and releases their frames, as for
+    /// `MADV_DONTNEED`. The areas stay, so the next access faults the pages in
+    /// again.
+    pub fn discard(&self, range: Range<Vaddr>) {
+        if range.is_empty() {
+            return;
+        }
+        let mut areas = self.areas.lock();
+        let mut discarded = false;
+        for area in overlapping_areas(&mut areas, range.clone()) {
+            discarded |= !area.remove_mappings(range.clone()).is_empty();
+        }
+        if !discarded {
+            return;
+        }
+
+        let guard = disable_preempt();
+        let mut cursor = self.vm_space.cursor_mut(&guard, &range).unwrap();
+        cursor.unmap(range.len());
+        cursor.flusher().dispatch_tlb_flush();
+    }
+
+    /// Removes the areas in `range` and releases their frames, as for
+    /// `munmap`. Areas reaching past the ends of `range` are split, and lose
+    /// only the part inside it.
+    ///
+    /// All pages are unmapped in one cursor pass with one TLB shootdown.
+    pub fn unmap(&self, range: Range<Vaddr>) {
+        if range.is_empty() {
+            return;
+        }
+        let mut areas = self.areas.lock();
+        split_areas(&mut areas, &range);
+        let bases: Vec<Vaddr> = areas.range(range.clone()).map(|(&base, _)| base).collect();
+        if bases.is_empty() {
+            return;
+        }
+        let removed: Vec<VmArea> = bases
+            .iter()
+            .map(|base| areas.remove(base).unwrap())
+            .collect();
+
+        let guard = disable_preempt();
+        let mut cursor = self.vm_space.cursor_mut(&guard, &range).unwrap();
+        cursor.unmap(range.len());
+        cursor.flusher().dispatch_tlb_flush();
+        drop(cursor);
+        // Release the frames only once no TLB can reach them.
+        drop(removed);
+    }
+
+    /// Sets the permissions of the pages in `range` to `perms`, as for
+    /// `mprotect`, splitting the areas reaching past its ends and merging
+    /// them back when their permissions match again.
+    ///
+    /// All mapped pages are updated in one cursor pass with one TLB shootdown.
+    /// Pages shared copy-on-write stay without `W` until written. Fails with
+    /// `ENOMEM` if part of `range` is not in an area.
+    pub fn protect(&self, range: Range<Vaddr>, perms: PageFlags) -> Result<()> {
+        if range.is_empty() {
+            return Ok(());
+        }
+        let mut areas = self.areas.lock();
+        let mut covered_end = range.start;
+        for area in overlapping_areas(&mut areas, range.clone()) {
+            if area.base_vaddr() > covered_end {
+                break;
+            }
+            if !area.max_perms().contains(perms) {
+                return Err(Error::new(Errno::EACCES));
+            }
+            covered_end = area.range().end;
+        }
+        if covered_end < range.end {
+            return Err(Error::new(Errno::ENOMEM));
+        }
+
+        split_areas(&mut areas, &range);
+        let guard = disable_preempt();
+        let mut cursor = self.vm_space.cursor_mut(&guard, &range).unwrap();
+        for (_, area) in areas.range_mut(range.clone()) {
+            area.set_perms(perms);
+            if !is_accessible(perms) {
+                continue;
+            }
+            for mapping in area.mappings().values() {
+                let flags = if mapping.is_cow() {
+                    perms - PageFlags::W
+                } else {
+                    perms
+                };
+                cursor.jump(mapping.base_vaddr()).unwrap();
+                cursor.map(
+                    mapping.frame().clone().into(),
+                    PageProperty::new_user(flags, CachePolicy::Writeback),
+                );
+            }
+        }
+        if !is_accessible(perms) {
+            // Keep the frames in the mappings, but out of the page table, so
+            // that any access faults.
+            cursor.jump(range.start).unwrap();
+            cursor.unmap(range.len());
+        }
+        cursor
+            .flusher()
+            .issue_tlb_flush(TlbFlushOp::Range(range.clone()));
+        cursor.flusher().dispatch_tlb_flush();
+        drop(cursor);
+
+        merge_areas(&mut areas, &range);
+        Ok(())
+    }
+
+    /// Unmaps the pages mapping the frames at `paddrs`, so that they are
+    /// faulted in again on the next access. Writable shared areas are left
+    /// alone, as their frames may hold writes not in the file yet.
+    pub fn unmap_frames(&self, paddrs: &BTreeSet<Paddr>) {
+        let mut areas = self.areas.lock();
+        let mut removed = Vec::new();
+        for area in areas.values_mut() {
+            if area.is_shared() && area.perms().contains(PageFlags::W) {
+                continue;
+            }
+            let vaddrs: Vec<Vaddr> = area
+                .mappings()
+                .values()
+                .filter(|mapping| paddrs.contains(&mapping.frame().start_paddr()))
+                .map(VmMapping::base_vaddr)
+                .collect();
+            for vaddr in vaddrs {
+                removed.push(area.mappings_mut().remove(&vaddr).unwrap());
+            }
+        }
+        if removed.is_empty() {
+            return;
+        }
+
+        let guard = disable_preempt();
+        let mut cursor = self
+            .vm_space
+            .cursor_mut(&guard, &(0..MAX_USERSPACE_VADDR))
+            .unwrap();
+        for mapping in removed.iter() {
+            cursor.jump(mapping.base_vaddr()).unwrap();
+            cursor.unmap(PAGE_SIZE);
+        }
+        cursor.flusher().dispatch_tlb_flush();
+        drop(cursor);
+        drop(removed);
+    }
+
+    /// Swaps out up to `max` cold anonymous pages, see [`swap`], and returns
+    /// how many were swapped out.
+    ///
+    /// Skips the address space, returning 0, if its areas are locked, as a
+    /// fault holding them may be waiting for the caller to free memory.
+    pub fn swap_out(&self, max: usize) -> usize {
+        let Some(mut areas) = self.areas.try_lock() else {
+            return 0;
+        };
+        swap_out_areas(&self.vm_space, &mut areas, max)
     }
 
     pub fn map(&self, mut area: VmArea) -> Segment<()> {
+        let mut areas = self.areas.lock();
         let guard = disable_preempt();
 
         let mut cursor_mut = self
@@ -80,68 +586,125 @@ impl MemorySpace {
             area.add_mapping(mapping);
         }
 
-        self.areas.lock().push_back(area);
+        areas.insert(area.base_vaddr(), area);
 
         frames
     }
 
-    /// Duplicate self with new phyiscal frames. Also, this will copy the data inside each frame.
+    /// Duplicate self, sharing the frames copy-on-write.
+    ///
+    /// Both address spaces map the shared frames read-only, and a write to one
+    /// of them copies only the touched page, see [`VmMapping::break_cow`].
     pub fn duplicate(&self) -> Self {
         let new_memory_space = MemorySpace::new();
         let mut new_mappings = new_memory_space.areas.lock();
+        let mut areas = self.areas.lock();
 
         let guard = disable_preempt();
-        let areas = self.areas.lock();
-        for area in areas.iter() {
+        for area in areas.values_mut() {
             let mut new_area = VmArea::new_with_handler(
                 area.base_vaddr(),
                 area.pages(),
                 area.perms(),
                 area.page_fault_handler().clone(),
             );
+            new_area.set_shared(area.is_shared());
+            new_area.set_max_perms(area.max_perms());
+            let range = area.base_vaddr()..(area.base_vaddr() + area.pages() * PAGE_SIZE);
 
-            let old_mappings = area.mappings().iter().map(|mapping| mapping);
-            for old_mapping in old_mappings {
-                let new_frame = FrameAllocOptions::new().alloc_frame().unwrap();
-
-                // Copy data from old frame to new frame
-                new_frame.writer().write(&mut old_mapping.frame().reader());
-
-                let mut cursor_mut = new_memory_space
+            if area.is_shared() {
+                let mut new_cursor = new_memory_space
                     .vm_space
-                    .cursor_mut(
-                        &guard,
-                        &(old_mapping.base_vaddr()..(old_mapping.base_vaddr() + PAGE_SIZE)),
-                    )
+                    .cursor_mut(&guard, &range)
                     .unwrap();
-                // Map new frame
-                cursor_mut.map(
-                    new_frame.clone().into(),
-                    PageProperty::new_user(new_area.perms(), CachePolicy::Writeback),
-                );
+                for mapping in area.mappings().values() {
+                    if is_accessible(area.perms()) {
+                        new_cursor.jump(mapping.base_vaddr()).unwrap();
+                        new_cursor.map(
+                            mapping.frame().clone().into(),
+                            PageProperty::new_user(area.perms(), CachePolicy::Writeback),
+                        );
+                    }
+                    new_area.add_mapping(mapping.clone());
+                }
+                drop(new_cursor);
+                new_mappings.insert(new_area.base_vaddr(), new_area);
+                continue;
+            }
 
-                let mapping = VmMapping::new(old_mapping.base_vaddr(), new_area.perms(), new_frame);
+            // The slots of swapped-out pages are shared like frames, and
+            // freed once neither address space holds them.
+            for (&vaddr, slot) in area.swapped() {
+                new_area.add_swapped(vaddr, slot.clone());
+            }
+            let shared_perms = area.perms() - PageFlags::W;
+            let accessible = is_accessible(area.perms());
+
+            let mut new_cursor = new_memory_space
+                .vm_space
+                .cursor_mut(&guard, &range)
+                .unwrap();
+            for old_mapping in area.mappings_mut().values_mut() {
+                let mapping = old_mapping.share_cow();
+                if accessible {
+                    new_cursor.jump(mapping.base_vaddr()).unwrap();
+                    new_cursor.map(
+                        mapping.frame().clone().into(),
+                        PageProperty::new_user(shared_perms, CachePolicy::Writeback),
+                    );
+                }
                 new_area.add_mapping(mapping);
             }
+            drop(new_cursor);
+
+            // Write-protect the parent's side as well.
+            if area.perms().contains(PageFlags::W) {
+                let mut cursor = self.vm_space.cursor_mut(&guard, &range).unwrap();
+                while cursor
+                    .protect_next(range.end - cursor.virt_addr(), |prop| {
+                        prop.flags -= PageFlags::W
+                    })
+                    .is_some()
+                {}
+                cursor.flusher().issue_tlb_flush(TlbFlushOp::Range(range));
+                cursor.flusher().dispatch_tlb_flush();
+            }
 
-            new_mappings.push_back(new_area);
+            new_mappings.insert(new_area.base_vaddr(), new_area);
         }
         drop(new_mappings);
         new_memory_space
     }
 
+    /// Loads this address space on the current CPU, unless it is loaded
+    /// already, as when switching between tasks sharing it or back to the
+    /// same task.
+    pub fn activate(&self) {
+        let guard = disable_preempt();
+        let mut active = ACTIVE_VM_SPACE.get_with(&guard).lock();
+        if active
+            .as_ref()
+            .is_some_and(|active| Arc::ptr_eq(active, &self.vm_space))
+        {
+            return;
+        }
+        self.vm_space.activate();
+        *active = Some(self.vm_space.clone());
+    }
+
     pub fn vm_space(&self) -> &Arc<VmSpace> {
         &self.vm_space
     }
 
     pub fn clear(&self) {
+        let mut areas = self.areas.lock();
         let guard = disable_preempt();
         let mut cursor = self
             .vm_space
             .cursor_mut(&guard, &(0..MAX_USERSPACE_VADDR))
             .unwrap();
         cursor.unmap(MAX_USERSPACE_VADDR);
-        self.areas.lock().clear();
+        areas.clear();
     }
 }
 
@@ -150,3 +713,21 @@ impl Default for MemorySpace {
         Self::new()
     }
 }
+
+#[cfg(ktest)]
+mod test {
+    use ostd::{mm::PageFlags, prelude::ktest};
+
+    use super::{MemorySpace, area::VmArea};
+    use crate::bench;
+
+    #[ktest]
+    fn bench_memory_space_duplicate() {
+        // The data of a small process, which each copy shares copy-on-write.
+        let memory_space = MemorySpace::new();
+        memory_space.map(VmArea::new(0x1000_0000, 64, PageFlags::RW));
+        bench::run("memory_space_duplicate", 20, || {
+            drop(memory_space.duplicate())
+        });
+    }
+}
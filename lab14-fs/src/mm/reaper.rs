@@ -0,0 +1,55 @@
+//! Tears down the address spaces of dead processes in the background.
+//!
+//! The last reference to a process may drop anywhere, as when its parent
+//! reaps it in `wait4` with the process table and its children locked, and
+//! freeing a large address space there would hold them up. So the process
+//! hands its address space to the reaper task instead, see [`defer`].
+//!
+//! The task frees the address spaces queued since its last round together.
+//! It unmaps the whole user range of each at once, which frees the page
+//! tables and flushes the TLB once, and then drops the areas and their
+//! frames. An address space still shared, as by a vfork parent, is only
+//! dropped.
+
+use alloc::{sync::Arc, vec::Vec};
+use ostd::{
+    sync::{SpinLock, WaitQueue},
+    task::{Task, TaskOptions},
+};
+use spin::Once;
+
+use crate::mm::MemorySpace;
+
+static WAIT_QUEUE: WaitQueue = WaitQueue::new();
+/// The address spaces to tear down.
+static QUEUE: SpinLock<Vec<Arc<MemorySpace>>> = SpinLock::new(Vec::new());
+static TASK: Once<Arc<Task>> = Once::new();
+
+/// Starts the reaper task.
+pub fn init() {
+    TASK.call_once(|| TaskOptions::new(reaper_main).spawn().unwrap());
+}
+
+/// Queues `memory_space`, whose process is gone, to be torn down by the
+/// reaper task, or drops it right away if the task has not started.
+pub fn defer(memory_space: Arc<MemorySpace>) {
+    if !TASK.is_completed() {
+        return;
+    }
+    QUEUE.lock().push(memory_space);
+    WAIT_QUEUE.wake_all();
+}
+
+fn reaper_main() {
+    loop {
+        let batch = WAIT_QUEUE.wait_until(|| {
+            let mut queue = QUEUE.lock();
+            (!queue.is_empty()).then(|| core::mem::take(&mut *queue))
+        });
+        for memory_space in batch {
+            if let Some(memory_space) = Arc::into_inner(memory_space) {
+                memory_space.clear();
+            }
+        }
+    }
+}
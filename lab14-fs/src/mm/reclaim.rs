@@ -0,0 +1,135 @@
+//! Reclaims page cache frames under memory pressure.
+//!
+//! Clean page cache pages are dropped coldest first, see
+//! [`page_cache::shrink`]. A frame allocation on the fault and read paths
+//! that fails evicts the pages user space does not map, and retries. Those
+//! paths may hold their own address space's areas lock, so only the reclaim
+//! task also unmaps cold pages from the address spaces mapping them before
+//! evicting them. It runs when the pre-zeroed frame stock cannot be refilled,
+//! i.e., when free memory runs low, and when the page cache is over its limit
+//! with only mapped pages left to evict.
+//!
+//! When the page cache does not yield enough, the task shrinks the other
+//! caches, see [`shrinker`]. With a swap device, it then also swaps out cold
+//! anonymous pages, and faults swap out some of their own address space's
+//! while memory is low, see [`super::swap`].
+
+use core::sync::atomic::{AtomicBool, Ordering};
+
+use alloc::{collections::btree_set::BTreeSet, sync::Arc, vec::Vec};
+use ostd::{
+    mm::{FrameAllocOptions, Paddr, Segment},
+    sync::WaitQueue,
+    task::{Task, TaskOptions},
+};
+use spin::Once;
+
+use crate::{
+    fs::util::page_cache,
+    mm::{shrinker, swap},
+    process,
+};
+
+/// The pages the reclaim task evicts per round.
+const RECLAIM_BATCH: usize = 512;
+/// The times an allocation waits for the reclaim task to swap pages out
+/// before giving up.
+const SWAP_RETRIES: usize = 64;
+
+static WAIT_QUEUE: WaitQueue = WaitQueue::new();
+/// Set to make the task run a round of reclaim.
+static KICKED: AtomicBool = AtomicBool::new(false);
+static TASK: Once<Arc<Task>> = Once::new();
+/// Set while the pre-zeroed frame stock cannot be refilled.
+static MEMORY_LOW: AtomicBool = AtomicBool::new(false);
+
+/// Starts the reclaim task.
+pub fn init() {
+    TASK.call_once(|| TaskOptions::new(reclaim_main).spawn().unwrap());
+}
+
+/// Makes the reclaim task run a round soon.
+pub fn kick() {
+    if !KICKED.swap(true, Ordering::AcqRel) {
+        WAIT_QUEUE.wake_all();
+    }
+}
+
+/// Records whether free memory runs low, kicking the task if it does.
+pub fn set_memory_low(low: bool) {
+    MEMORY_LOW.store(low, Ordering::Relaxed);
+    if low {
+        kick();
+    }
+}
+
+pub fn is_memory_low() -> bool {
+    MEMORY_LOW.load(Ordering::Relaxed)
+}
+
+/// Returns what `alloc` allocates for `pages` frames, evicting unmapped page
+/// cache pages and retrying while it fails. Once none are left, it waits for
+/// the reclaim task to swap pages out, if there is a swap device.
+///
+/// # Panics
+///
+/// Panics if nothing is left to evict or swap out.
+pub fn alloc_or_reclaim<T>(pages: usize, mut alloc: impl FnMut() -> ostd::Result<T>) -> T {
+    let mut retries = 0;
+    loop {
+        if let Ok(allocated) = alloc() {
+            return allocated;
+        }
+        kick();
+        if page_cache::shrink(pages.max(RECLAIM_BATCH), None) > 0 {
+            continue;
+        }
+        if !swap::is_enabled() || retries == SWAP_RETRIES {
+            panic!("Out of memory allocating {} pages", pages);
+        }
+        retries += 1;
+        Task::yield_now();
+    }
+}
+
+/// Allocates a segment of `pages` zeroed frames, see [`alloc_or_reclaim`].
+pub fn alloc_segment(pages: usize) -> Segment<()> {
+    alloc_or_reclaim(pages, || FrameAllocOptions::new().alloc_segment(pages))
+}
+
+fn reclaim_main() {
+    loop {
+        WAIT_QUEUE.wait_until(|| KICKED.swap(false, Ordering::AcqRel).then_some(()));
+        reclaim(RECLAIM_BATCH);
+    }
+}
+
+/// Frees up to `target` pages, evicting page cache pages and unmapping cold
+/// ones from user space if the unmapped ones do not suffice, then shrinking
+/// the other caches, and then swapping out anonymous pages. Returns the number
+/// freed.
+fn reclaim(target: usize) -> usize {
+    let mut mapped = Vec::new();
+    let mut freed = page_cache::shrink(target, Some(&mut mapped));
+    if freed < target && !mapped.is_empty() {
+        let paddrs: BTreeSet<Paddr> = mapped.iter().map(|frame| frame.start_paddr()).collect();
+        drop(mapped);
+        for process in process::all_processes() {
+            process.memory_space().unmap_frames(&paddrs);
+        }
+        freed += page_cache::shrink(target - freed, None);
+    }
+
+    if freed < target {
+        freed += shrinker::shrink(target - freed);
+    }
+    if freed < target && swap::is_enabled() {
+        for process in process::all_processes() {
+            freed += process.memory_space().swap_out(target - freed);
+            if freed >= target {
+                break;
+            }
+        }
+    }
+    freed
+}
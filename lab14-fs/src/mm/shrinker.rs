@@ -0,0 +1,79 @@
+//! The caches that give memory back on demand, and the low-memory mode.
+//!
+//! A cache that keeps frames it could do without, such as free buffers kept
+//! for reuse, registers a [`Shrinker`]. The reclaim task shrinks them after
+//! the page cache, which stays apart as it also unmaps the pages it evicts,
+//! see [`super::reclaim`].
+//!
+//! With `lowmem=on` on the command line, for guests that should hold as
+//! little memory as they can, the caches default to smaller limits, and the
+//! shrinkers give back all they can once the kernel has booted, as the probes
+//! and mounts leave buffers behind that little else may reuse.
+
+use alloc::vec::Vec;
+use log::warn;
+use ostd::sync::{LocalIrqDisabled, SpinLock};
+use spin::Once;
+
+use crate::kcmd_option;
+
+/// A cache that gives back the memory it holds on demand.
+pub trait Shrinker: Sync {
+    fn name(&self) -> &'static str;
+
+    /// Returns the frames the cache could give back.
+    fn count(&self) -> usize;
+
+    /// Gives back up to `target` frames, and returns the number given back.
+    ///
+    /// This may sleep, but the caller may hold locks that page faults take,
+    /// so it must not wait for a page fault.
+    fn shrink(&self, target: usize) -> usize;
+}
+
+static SHRINKERS: SpinLock<Vec<&'static dyn Shrinker>, LocalIrqDisabled> =
+    SpinLock::new(Vec::new());
+
+/// Adds `shrinker` to those [`shrink`] runs.
+pub fn register(shrinker: &'static dyn Shrinker) {
+    SHRINKERS.lock().push(shrinker);
+}
+
+/// Returns the registered shrinkers, in the order they registered.
+pub fn shrinkers() -> Vec<&'static dyn Shrinker> {
+    SHRINKERS.lock().clone()
+}
+
+/// Shrinks the caches in turn until `target` frames are given back, and
+/// returns the number given back.
+pub fn shrink(target: usize) -> usize {
+    let mut freed = 0;
+    for shrinker in shrinkers() {
+        if freed >= target {
+            break;
+        }
+        freed += shrinker.shrink(target - freed);
+    }
+    freed
+}
+
+/// Returns whether the kernel keeps its caches small, as set with
+/// `lowmem=on|off` on the command line.
+pub fn is_low_memory() -> bool {
+    static LOW_MEMORY: Once<bool> = Once::new();
+    *LOW_MEMORY.call_once(|| match kcmd_option("lowmem=") {
+        None | Some("off") => false,
+        Some("on") => true,
+        Some(other) => {
+            warn!("Unknown low-memory mode {:?}, using off", other);
+            false
+        }
+    })
+}
+
+/// Gives back what the caches hold after booting, in the low-memory mode.
+pub fn trim() {
+    if is_low_memory() {
+        shrink(usize::MAX);
+    }
+}
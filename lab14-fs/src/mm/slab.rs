@@ -0,0 +1,234 @@
+//! Typed caches of recycled kernel objects.
+//!
+//! A [`SlabCache`] keeps freed objects of one type for reuse, so that hot
+//! paths skip the general heap allocator. As in the DMA buffer pool, each CPU
+//! has a magazine of free objects, so allocating and freeing usually takes
+//! only the local CPU's lock, and a shared depot that magazines refill from
+//! and spill into.
+//!
+//! The kernel cannot carve objects out of its own pages without unsafe code,
+//! so a cache recycles whole heap allocations instead: the objects cached are
+//! handles such as an `Arc` whose owner reset it, which the next allocation
+//! fills in again. The counts of each cache are shown in `/proc/slabinfo`.
+//! Under memory pressure, the caches give their objects back to the heap, see
+//! [`shrinker`].
+
+use alloc::{boxed::Box, format, string::String, sync::Arc, vec::Vec};
+use ostd::{
+    cpu::{PinCurrentCpu, all_cpus},
+    sync::{LocalIrqDisabled, SpinLock},
+    task::disable_preempt,
+};
+use spin::Once;
+
+use crate::mm::shrinker::{self, Shrinker};
+
+/// The number of objects a magazine holds before it spills half of them into
+/// the depot.
+const MAGAZINE_SIZE: usize = 64;
+
+/// The number of objects the depot holds. Objects freed beyond it go back to
+/// the heap.
+const DEPOT_CAPACITY: usize = 1024;
+
+/// The caches used so far, for `/proc/slabinfo`.
+static CACHES: SpinLock<Vec<&'static dyn SlabInfo>, LocalIrqDisabled> = SpinLock::new(Vec::new());
+
+pub struct SlabCache<T: 'static> {
+    name: &'static str,
+    /// The size of the objects behind the handles, for the report.
+    object_size: usize,
+    magazines: Once<Box<[SpinLock<Magazine<T>, LocalIrqDisabled>]>>,
+    depot: SpinLock<Vec<T>, LocalIrqDisabled>,
+}
+
+struct Magazine<T> {
+    objects: Vec<T>,
+    stats: SlabStats,
+}
+
+/// The counts of one CPU's magazine, summed over the CPUs on report.
+#[derive(Debug, Default, Clone, Copy)]
+struct SlabStats {
+    allocs: u64,
+    /// The allocations served by a recycled object.
+    hits: u64,
+    frees: u64,
+    /// The frees that went back to the heap as the cache was full.
+    overflows: u64,
+}
+
+impl<T: Send + 'static> SlabCache<T> {
+    pub const fn new(name: &'static str, object_size: usize) -> Self {
+        Self {
+            name,
+            object_size,
+            magazines: Once::new(),
+            depot: SpinLock::new(Vec::new()),
+        }
+    }
+
+    /// Returns a recycled object, or a new one from `new` if there is none.
+    ///
+    /// Recycled objects are as their last owner left them on
+    /// [`Self::free`].
+    pub fn alloc(&'static self, new: impl FnOnce() -> T) -> T {
+        let guard = disable_preempt();
+        let recycled = {
+            let mut magazine = self.magazines()[guard.current_cpu().as_usize()].lock();
+            if magazine.objects.is_empty() {
+                let mut depot = self.depot.lock();
+                let start = depot.len().saturating_sub(MAGAZINE_SIZE / 2);
+                magazine.objects.extend(depot.drain(start..));
+            }
+            let recycled = magazine.objects.pop();
+            magazine.stats.allocs += 1;
+            magazine.stats.hits += recycled.is_some() as u64;
+            recycled
+        };
+        drop(guard);
+        recycled.unwrap_or_else(new)
+    }
+
+    /// Keeps `object` for a later allocation. This can be called in interrupt
+    /// context.
+    pub fn free(&'static self, object: T) {
+        let guard = disable_preempt();
+        let mut magazine = self.magazines()[guard.current_cpu().as_usize()].lock();
+        magazine.stats.frees += 1;
+        magazine.objects.push(object);
+        if magazine.objects.len() <= MAGAZINE_SIZE {
+            return;
+        }
+
+        let start = magazine.objects.len() - MAGAZINE_SIZE / 2;
+        let spilled: Vec<T> = magazine.objects.drain(start..).collect();
+        let mut depot = self.depot.lock();
+        let room = DEPOT_CAPACITY - depot.len().min(DEPOT_CAPACITY);
+        magazine.stats.overflows += spilled.len().saturating_sub(room) as u64;
+        depot.extend(spilled.into_iter().take(room));
+    }
+
+    fn magazines(&'static self) -> &'static [SpinLock<Magazine<T>, LocalIrqDisabled>] {
+        self.magazines.call_once(|| {
+            let is_first = {
+                let mut caches = CACHES.lock();
+                caches.push(self);
+                caches.len() == 1
+            };
+            if is_first {
+                shrinker::register(&SlabShrinker);
+            }
+            all_cpus()
+                .map(|_| {
+                    SpinLock::new(Magazine {
+                        objects: Vec::new(),
+                        stats: SlabStats::default(),
+                    })
+                })
+                .collect()
+        })
+    }
+}
+
+impl<U: Send + Sync + 'static> SlabCache<Arc<U>> {
+    /// Keeps `object` for a later allocation if this is its last reference,
+    /// and drops it otherwise.
+    pub fn free_if_unique(&'static self, mut object: Arc<U>) {
+        if Arc::get_mut(&mut object).is_some() {
+            self.free(object);
+        }
+    }
+}
+
+trait SlabInfo: Sync {
+    fn line(&self) -> String;
+
+    /// Returns the bytes of the objects cached.
+    fn cached_bytes(&self) -> usize;
+
+    /// Drops the objects cached.
+    fn drain(&self);
+}
+
+impl<T: Send + 'static> SlabInfo for SlabCache<T> {
+    fn cached_bytes(&self) -> usize {
+        let mut cached = self.depot.lock().len();
+        for magazine in self.magazines.get().into_iter().flatten() {
+            cached += magazine.lock().objects.len();
+        }
+        cached * self.object_size
+    }
+
+    fn drain(&self) {
+        let mut objects = core::mem::take(&mut *self.depot.lock());
+        for magazine in self.magazines.get().into_iter().flatten() {
+            objects.append(&mut magazine.lock().objects);
+        }
+    }
+
+    fn line(&self) -> String {
+        let mut total = SlabStats::default();
+        let mut cached = self.depot.lock().len();
+        for magazine in self.magazines.get().into_iter().flatten() {
+            let magazine = magazine.lock();
+            total.allocs += magazine.stats.allocs;
+            total.hits += magazine.stats.hits;
+            total.frees += magazine.stats.frees;
+            total.overflows += magazine.stats.overflows;
+            cached += magazine.objects.len();
+        }
+        format!(
+            "{:<16} {:>8} {:>8} {:>12} {:>12} {:>12} {:>10}\n",
+            self.name,
+            self.object_size,
+            cached,
+            total.allocs,
+            total.hits,
+            total.frees,
+            total.overflows
+        )
+    }
+}
+
+/// Returns the counts of the caches used so far, one line per cache.
+pub fn report() -> String {
+    let mut report = format!(
+        "{:<16} {:>8} {:>8} {:>12} {:>12} {:>12} {:>10}\n",
+        "name", "objsize", "cached", "allocs", "hits", "frees", "overflows"
+    );
+    let caches: Vec<&'static dyn SlabInfo> = CACHES.lock().clone();
+    for cache in caches {
+        report.push_str(&cache.line());
+    }
+    report
+}
+
+/// Returns the bytes of the objects the caches hold.
+pub fn cached_bytes() -> usize {
+    let caches: Vec<&'static dyn SlabInfo> = CACHES.lock().clone();
+    caches.iter().map(|cache| cache.cached_bytes()).sum()
+}
+
+/// Gives the cached objects back to the heap. The heap keeps the pages for
+/// its other allocations rather than freeing frames, so it counts none given
+/// back, and the bytes cached are only reported, see [`cached_bytes`].
+struct SlabShrinker;
+
+impl Shrinker for SlabShrinker {
+    fn name(&self) -> &'static str {
+        "slab"
+    }
+
+    fn count(&self) -> usize {
+        0
+    }
+
+    fn shrink(&self, _target: usize) -> usize {
+        let caches: Vec<&'static dyn SlabInfo> = CACHES.lock().clone();
+        for cache in caches {
+            cache.drain();
+        }
+        0
+    }
+}
@@ -0,0 +1,259 @@
+//! Swap: anonymous pages written out to a spare block device.
+//!
+//! The device is the first one made a swap device by `mkswap`, or the one
+//! named by index with `swap=<index>` on the kernel command line, and is
+//! divided into page-sized slots. The first page holds the swap header and is
+//! never used as a slot. Pages swapped out together get consecutive
+//! slots and are written in one request per run of them, and a fault on a
+//! swapped-out page reads back its neighbours swapped out with it in the same
+//! request, see [`super::area::VmArea`].
+//!
+//! A swapped-out page is held by a [`SwapSlot`], which frees the slot when
+//! the last address space holding it, across forks, drops it. Only private
+//! writable anonymous pages not shared copy-on-write are swapped out.
+//!
+//! Without either, or with `swap=off`, swap is off. A device with an ext2
+//! file system on it is never used.
+
+use alloc::{sync::Arc, vec, vec::Vec};
+use log::warn;
+use ostd::{
+    mm::{DmaDirection, DmaStream, Frame, FrameAllocOptions, PAGE_SIZE, Segment},
+    sync::{LocalIrqDisabled, SpinLock},
+};
+use spin::Once;
+
+use crate::{
+    drivers::{
+        BLOCK_DEVICES,
+        blk::{BlockDevice, SECTOR_SIZE, dma_sectors},
+    },
+    error::{Errno, Error, Result},
+    kcmd_option,
+    mm::reclaim,
+    stats::{self, Stat},
+};
+
+/// The pages swapped out per round when memory runs low.
+pub const SWAP_CLUSTER: usize = 32;
+/// The window of pages a fault on a swapped-out page reads back at most.
+pub const SWAP_READAHEAD_PAGES: usize = 8;
+
+const SECTORS_PER_PAGE: usize = PAGE_SIZE / SECTOR_SIZE;
+/// Where the magic number of an ext2 super block is, in sectors and bytes.
+const EXT2_MAGIC_SECTOR: usize = 2;
+const EXT2_MAGIC_OFFSET: usize = 56;
+const EXT2_MAGIC: u16 = 0xef53;
+/// The signature `mkswap` writes at the end of the first page.
+const SWAP_MAGIC: &[u8; 10] = b"SWAPSPACE2";
+const SWAP_MAGIC_SECTOR: usize = (PAGE_SIZE - SWAP_MAGIC.len()) / SECTOR_SIZE;
+const SWAP_MAGIC_OFFSET: usize = (PAGE_SIZE - SWAP_MAGIC.len()) % SECTOR_SIZE;
+
+static SWAP: Once<SwapDevice> = Once::new();
+
+struct SwapDevice {
+    device: Arc<dyn BlockDevice>,
+    slots: SpinLock<SlotMap, LocalIrqDisabled>,
+}
+
+/// Which slots are in use, one bit per slot.
+struct SlotMap {
+    used: Vec<u64>,
+    num_slots: usize,
+    num_free: usize,
+    /// Where the next search for a free run starts, so that consecutive
+    /// allocations get consecutive slots.
+    next: usize,
+}
+
+/// A slot holding a swapped-out page, freed once dropped.
+#[derive(Debug)]
+pub struct SwapSlot(usize);
+
+impl SwapSlot {
+    pub fn index(&self) -> usize {
+        self.0
+    }
+}
+
+impl Drop for SwapSlot {
+    fn drop(&mut self) {
+        SWAP.get().unwrap().slots.lock().free(self.0);
+    }
+}
+
+impl SlotMap {
+    /// Makes a map with slot 0, the swap header, taken.
+    fn new(num_slots: usize) -> Self {
+        let mut used = vec![0; num_slots.div_ceil(64)];
+        used[0] = 1;
+        Self {
+            used,
+            num_slots,
+            num_free: num_slots - 1,
+            next: 1,
+        }
+    }
+
+    fn is_used(&self, slot: usize) -> bool {
+        self.used[slot / 64] & (1 << (slot % 64)) != 0
+    }
+
+    fn free(&mut self, slot: usize) {
+        debug_assert!(self.is_used(slot));
+        self.used[slot / 64] &= !(1 << (slot % 64));
+        self.num_free += 1;
+    }
+
+    /// Takes up to `count` free slots, in as few runs as it finds, and
+    /// returns them in order.
+    fn alloc(&mut self, count: usize) -> Vec<usize> {
+        let count = count.min(self.num_free);
+        let mut slots = Vec::with_capacity(count);
+        let mut slot = self.next;
+        while slots.len() < count {
+            if slot == self.num_slots {
+                slot = 0;
+            }
+            if !self.is_used(slot) {
+                self.used[slot / 64] |= 1 << (slot % 64);
+                slots.push(slot);
+            }
+            slot += 1;
+        }
+        self.num_free -= count;
+        self.next = slot;
+        slots
+    }
+}
+
+/// Picks the swap device, see the module documentation.
+pub fn init() {
+    let devices = BLOCK_DEVICES.get().unwrap().read();
+    let device = match kcmd_option("swap=") {
+        Some("off") => return,
+        Some(index) => {
+            let Some(device) = index.parse::<usize>().ok().and_then(|i| devices.get(i)) else {
+                warn!("No block device {} to swap to, swap is off", index);
+                return;
+            };
+            if has_ext2(device) {
+                warn!(
+                    "Block device {} holds an ext2 file system, swap is off",
+                    index
+                );
+                return;
+            }
+            device
+        }
+        None => {
+            let Some(device) = devices
+                .iter()
+                .find(|device| has_swap_magic(device) && !has_ext2(device))
+            else {
+                return;
+            };
+            device
+        }
+    };
+    // One slot for the header, and at least one for pages.
+    let num_slots = device.num_sectors() / SECTORS_PER_PAGE;
+    if num_slots < 2 {
+        return;
+    }
+    SWAP.call_once(|| SwapDevice {
+        device: device.clone(),
+        slots: SpinLock::new(SlotMap::new(num_slots)),
+    });
+}
+
+fn has_ext2(device: &Arc<dyn BlockDevice>) -> bool {
+    device.num_sectors() > EXT2_MAGIC_SECTOR
+        && device
+            .read_val_offset::<u16>(EXT2_MAGIC_SECTOR, EXT2_MAGIC_OFFSET)
+            .is_ok_and(|magic| magic == EXT2_MAGIC)
+}
+
+fn has_swap_magic(device: &Arc<dyn BlockDevice>) -> bool {
+    device.num_sectors() > SWAP_MAGIC_SECTOR
+        && device
+            .read_val_offset::<[u8; 10]>(SWAP_MAGIC_SECTOR, SWAP_MAGIC_OFFSET)
+            .is_ok_and(|magic| magic == *SWAP_MAGIC)
+}
+
+pub fn is_enabled() -> bool {
+    SWAP.is_completed()
+}
+
+/// Takes slots for up to `count` pages, fewer if the device fills up.
+pub fn alloc_slots(count: usize) -> Vec<Arc<SwapSlot>> {
+    let Some(swap) = SWAP.get() else {
+        return Vec::new();
+    };
+    let slots = swap.slots.lock().alloc(count);
+    slots
+        .into_iter()
+        .map(|slot| Arc::new(SwapSlot(slot)))
+        .collect()
+}
+
+/// Writes each of `frames` to the slot at the same index of `slots`, one
+/// request per run of consecutive slots, and waits for the writes.
+pub fn write_out(slots: &[Arc<SwapSlot>], frames: &[Frame<()>]) -> Result<()> {
+    let swap = SWAP.get().unwrap();
+    let mut start = 0;
+    while start < slots.len() {
+        let first = slots[start].index();
+        let len = slots[start..]
+            .iter()
+            .enumerate()
+            .take_while(|(i, slot)| slot.index() == first + i)
+            .count();
+
+        let mut sectors = Vec::with_capacity(len * SECTORS_PER_PAGE);
+        for frame in &frames[start..start + len] {
+            let dma = DmaStream::map(
+                Segment::from(frame.clone()).into(),
+                DmaDirection::ToDevice,
+                false,
+            )
+            .map_err(|_| Error::new(Errno::ENOMEM))?;
+            dma.sync(0..PAGE_SIZE).unwrap();
+            sectors.extend(dma_sectors(&Arc::new(dma)));
+        }
+        swap.device
+            .write_block_from(first * SECTORS_PER_PAGE, sectors)?;
+        start += len;
+    }
+    stats::add(Stat::SwapOuts, slots.len() as u64);
+    Ok(())
+}
+
+/// Reads the `count` pages in the slots from `first` on into new frames.
+pub fn read_in(first: usize, count: usize) -> Result<Vec<Frame<()>>> {
+    let swap = SWAP.get().unwrap();
+    let frames: Vec<Frame<()>> = (0..count)
+        .map(|_| {
+            reclaim::alloc_or_reclaim(1, || FrameAllocOptions::new().zeroed(false).alloc_frame())
+        })
+        .collect();
+    let mut streams = Vec::with_capacity(count);
+    for frame in &frames {
+        let dma = DmaStream::map(
+            Segment::from(frame.clone()).into(),
+            DmaDirection::FromDevice,
+            false,
+        )
+        .map_err(|_| Error::new(Errno::ENOMEM))?;
+        streams.push(Arc::new(dma));
+    }
+
+    let sectors = streams.iter().flat_map(dma_sectors).collect();
+    swap.device
+        .read_block_into(first * SECTORS_PER_PAGE, sectors)?;
+    for dma in streams {
+        dma.sync(0..PAGE_SIZE).unwrap();
+    }
+    stats::add(Stat::SwapIns, count as u64);
+    Ok(frames)
+}
@@ -1,45 +1,363 @@
+use core::fmt::Debug;
+
 use align_ext::AlignExt;
-use alloc::sync::Arc;
+use alloc::{collections::btree_map::BTreeMap, sync::Arc, vec, vec::Vec};
 use log::debug;
 use ostd::{
     arch::cpu::context::UserContext,
-    mm::{PAGE_SIZE, PageFlags, VmIo},
+    mm::{Frame, PAGE_SIZE, PageFlags, Vaddr, VmWriter, io_util::HasVmReaderWriter},
+    sync::Mutex,
     user::UserContextApi,
 };
 
 use crate::{
-    mm::{MemorySpace, area::VmArea, fault::AllocationPageFaultHandler},
-    process::USER_STACK_SIZE,
+    error::{Errno, Error, Result},
+    fs::{Inode, InodeType, util::page_cache::PageCache},
+    mm::{
+        MemorySpace,
+        area::VmArea,
+        fault::{
+            AllocationPageFaultHandler, DEFAULT_FAULT_AROUND_PAGES, PageFaultContext,
+            PageFaultHandler,
+        },
+        mapping::cache_cow_token,
+        reclaim,
+    },
+    process::{USER_STACK_SIZE, USER_STACK_TOP},
+    progs::BuiltinProgram,
 };
 
-pub fn load_user_space(program: &[u8], memory_space: &MemorySpace) -> UserContext {
+/// The maximum number of cached images of programs in file systems.
+const MAX_CACHED_FILE_IMAGES: usize = 64;
+
+/// A program to load.
+#[derive(Clone)]
+pub enum Program {
+    /// A program built into the kernel.
+    Builtin(&'static BuiltinProgram),
+    /// An ELF file in a file system.
+    File(Arc<dyn Inode>),
+}
+
+impl Program {
+    /// Returns the key of the program's image in [`PROGRAM_IMAGES`].
+    ///
+    /// A cached image holds its program, so the address is not reused while
+    /// it is a key.
+    fn key(&self) -> usize {
+        match self {
+            Program::Builtin(binary) => *binary as *const BuiltinProgram as usize,
+            Program::File(inode) => Arc::as_ptr(inode) as *const () as usize,
+        }
+    }
+
+    fn size(&self) -> usize {
+        match self {
+            Program::Builtin(binary) => binary.len(),
+            Program::File(inode) => inode.size(),
+        }
+    }
+
+    /// Returns the [`Inode::data_version`] of a file, which a built-in
+    /// program never changes.
+    fn version(&self) -> u64 {
+        match self {
+            Program::Builtin(_) => 0,
+            Program::File(inode) => inode.data_version(),
+        }
+    }
+
+    fn is_file(&self) -> bool {
+        matches!(self, Program::File(_))
+    }
+
+    /// Copies the bytes of the program at `offset` into `buf`.
+    fn read_bytes(&self, offset: usize, buf: &mut [u8]) -> Result<()> {
+        match self {
+            Program::Builtin(binary) => binary.read_bytes(offset, buf),
+            Program::File(inode) => {
+                inode.read_at(offset, VmWriter::from(buf).to_fallible())?;
+                Ok(())
+            }
+        }
+    }
+
+    /// Copies `len` bytes at `offset` in the program to `frame` at
+    /// `frame_offset`.
+    fn read_into(
+        &self,
+        offset: usize,
+        frame: &Frame<()>,
+        frame_offset: usize,
+        len: usize,
+    ) -> Result<()> {
+        match self {
+            Program::Builtin(binary) => {
+                let src = binary.frame(offset / PAGE_SIZE).unwrap();
+                let first_len = len.min(PAGE_SIZE - offset % PAGE_SIZE);
+                let mut writer = frame.writer();
+                writer.skip(frame_offset).limit(len);
+                writer.write(src.reader().skip(offset % PAGE_SIZE).limit(first_len));
+                if first_len < len {
+                    let next = binary.frame(offset / PAGE_SIZE + 1).unwrap();
+                    writer.write(next.reader().limit(len - first_len));
+                }
+            }
+            Program::File(inode) => {
+                let mut writer = frame.writer();
+                writer.skip(frame_offset).limit(len);
+                inode.read_at(offset, writer.to_fallible())?;
+            }
+        }
+        Ok(())
+    }
+}
+
+/// The images of the programs loaded so far, keyed by [`Program::key`].
+static PROGRAM_IMAGES: Mutex<BTreeMap<usize, Arc<ProgramImage>>> = Mutex::new(BTreeMap::new());
+
+/// The loadable segments of a program, shared by all processes running it.
+///
+/// Pages are filled on first touch and kept in frames that processes map
+/// copy-on-write, so a program costs only the pages it touches, and running it
+/// again copies only the pages written to.
+pub struct ProgramImage {
+    program: Program,
+    /// The program size and version when it was parsed, to notice that a
+    /// file changed.
+    size: usize,
+    version: u64,
+    segments: Vec<ImageSegment>,
+    entry_point: Vaddr,
+}
+
+struct ImageSegment {
+    base_vaddr: Vaddr,
+    pages: usize,
+    perms: PageFlags,
+    /// Where the file data starts, relative to `base_vaddr`.
+    data_offset: usize,
+    /// Where the file data is in the program.
+    file_offset: usize,
+    /// The length of the file data. The rest of the segment is zero-filled,
+    /// as for bss.
+    data_len: usize,
+    /// The pages holding file data filled so far.
+    page_cache: PageCache,
+}
+
+impl ImageSegment {
+    /// Returns where the pages holding file data end.
+    fn data_pages_end(&self) -> Vaddr {
+        self.base_vaddr + (self.data_offset + self.data_len).align_up(PAGE_SIZE)
+    }
+
+    /// Returns the frame of the page at `vaddr`, which must hold file data.
+    ///
+    /// A page wholly of file data that starts at a page of a built-in program
+    /// is the program's own frame, so that no process copies it until it
+    /// writes to it.
+    fn page(&self, program: &Program, vaddr: Vaddr) -> Result<Frame<()>> {
+        let page_start = vaddr - self.base_vaddr;
+        if let Program::Builtin(binary) = program {
+            let file_pos = (self.file_offset + page_start).checked_sub(self.data_offset);
+            if let Some(file_pos) = file_pos.filter(|&pos| {
+                page_start >= self.data_offset
+                    && page_start + PAGE_SIZE <= self.data_offset + self.data_len
+                    && pos % PAGE_SIZE == 0
+            }) {
+                return Ok(binary.frame(file_pos / PAGE_SIZE).unwrap().clone());
+            }
+        }
+        self.page_cache.get(page_start / PAGE_SIZE, |frame| {
+            // Copy the part of the file data in this page.
+            let start = page_start.max(self.data_offset);
+            let end = (page_start + PAGE_SIZE).min(self.data_offset + self.data_len);
+            if start < end {
+                program.read_into(
+                    self.file_offset + (start - self.data_offset),
+                    frame,
+                    start - page_start,
+                    end - start,
+                )?;
+            }
+            Ok(())
+        })
+    }
+}
+
+/// Fills the pages of an ELF segment on first touch.
+struct ElfSegmentFaultHandler {
+    image: Arc<ProgramImage>,
+    segment_index: usize,
+}
+
+impl Debug for ElfSegmentFaultHandler {
+    fn fmt(&self, f: &mut core::fmt::Formatter<'_>) -> core::fmt::Result {
+        f.debug_struct("ElfSegmentFaultHandler")
+            .field("segment_index", &self.segment_index)
+            .finish()
+    }
+}
+
+impl PageFaultHandler for ElfSegmentFaultHandler {
+    fn handle_page_fault<'a>(&self, mut context: PageFaultContext<'a>) -> Result<()> {
+        let segment = &self.image.segments[self.segment_index];
+        let range = context.fault_around_range(DEFAULT_FAULT_AROUND_PAGES);
+        if range.is_empty() {
+            return Err(Error::new(Errno::EACCES));
+        }
+
+        // Pages holding file data come from the image, and the pure bss pages
+        // after them are fresh zeroed frames.
+        let split = segment.data_pages_end().clamp(range.start, range.end);
+        if range.start < split {
+            let frames = (range.start..split)
+                .step_by(PAGE_SIZE)
+                .map(|vaddr| segment.page(&self.image.program, vaddr))
+                .collect::<Result<Vec<_>>>()?;
+            context.map_frames(range.start..split, frames, Some(cache_cow_token()));
+        }
+        if split < range.end {
+            let frames = reclaim::alloc_segment((range.end - split) / PAGE_SIZE);
+            context.map_frames(split..range.end, frames, None);
+        }
+
+        Ok(())
+    }
+}
+
+pub fn load_user_space(image: &Arc<ProgramImage>, memory_space: &MemorySpace) -> UserContext {
     let mut user_context = UserContext::default();
-    parse_elf(program, &memory_space, &mut user_context);
+    map_program(image, memory_space, &mut user_context);
     user_context
 }
 
-pub fn create_user_space(program: &[u8]) -> (MemorySpace, UserContext) {
+pub fn create_user_space(program: &Program) -> Result<(MemorySpace, UserContext)> {
+    let image = program_image(program)?;
     let memory_space = MemorySpace::new();
     let mut user_context = UserContext::default();
 
-    parse_elf(program, &memory_space, &mut user_context);
-    (memory_space, user_context)
+    map_program(&image, &memory_space, &mut user_context);
+    Ok((memory_space, user_context))
 }
 
-fn parse_elf(input: &[u8], memory_space: &MemorySpace, user_cpu_state: &mut UserContext) {
-    let header = xmas_elf::header::parse_header(input).unwrap();
+/// Returns the image of `program`, parsing it unless a cached image is still
+/// up to date.
+pub fn program_image(program: &Program) -> Result<Arc<ProgramImage>> {
+    let key = program.key();
+    if let Some(image) = PROGRAM_IMAGES.lock().get(&key) {
+        if image.size == program.size() && image.version == program.version() {
+            return Ok(image.clone());
+        }
+    }
+
+    // Parse without the lock held, as reading a file sleeps on I/O.
+    let image = Arc::new(parse_elf(program)?);
+
+    let mut images = PROGRAM_IMAGES.lock();
+    if program.is_file() && !images.contains_key(&key) {
+        let num_file_images = images
+            .values()
+            .filter(|image| image.program.is_file())
+            .count();
+        if num_file_images >= MAX_CACHED_FILE_IMAGES {
+            // Running processes keep their images alive.
+            let victim = images
+                .iter()
+                .find(|(_, image)| image.program.is_file())
+                .map(|(&key, _)| key)
+                .unwrap();
+            images.remove(&victim);
+        }
+    }
+    images.insert(key, image.clone());
+    Ok(image)
+}
+
+fn map_program(
+    image: &Arc<ProgramImage>,
+    memory_space: &MemorySpace,
+    user_cpu_state: &mut UserContext,
+) {
+    // First, add an area for each segment, filled on demand
+    for (segment_index, segment) in image.segments.iter().enumerate() {
+        memory_space.add_area(VmArea::new_with_handler(
+            segment.base_vaddr,
+            segment.pages,
+            segment.perms,
+            Arc::new(ElfSegmentFaultHandler {
+                image: image.clone(),
+                segment_index,
+            }),
+        ));
+    }
+
+    // Second, init the user stack, ending at `USER_STACK_TOP`.
+    let stack_low = USER_STACK_TOP - USER_STACK_SIZE;
+    memory_space.add_area(VmArea::new_with_handler(
+        stack_low,
+        USER_STACK_SIZE / PAGE_SIZE,
+        PageFlags::RW,
+        Arc::new(AllocationPageFaultHandler::default()),
+    ));
+    user_cpu_state.set_stack_pointer(USER_STACK_TOP - 32);
+    user_cpu_state.set_instruction_pointer(image.entry_point);
+
+    memory_space.add_area(crate::clock::clock_page_area());
+
+    // Third, map the 0 address
+    memory_space.map(VmArea::new(0, 1, PageFlags::RW));
+}
+
+/// Reads the ELF header and the program header table of an ELF program.
+fn read_headers(program: &Program) -> Result<Vec<u8>> {
+    if let Program::File(inode) = program
+        && inode.typ() != InodeType::File
+    {
+        return Err(Error::new(Errno::EACCES));
+    }
+
+    let size = program.size();
+    let mut headers = vec![0u8; PAGE_SIZE.min(size)];
+    program.read_bytes(0, &mut headers)?;
+    let header =
+        xmas_elf::header::parse_header(&headers).map_err(|_| Error::new(Errno::ENOEXEC))?;
+
+    // The program header table is usually right after the ELF header.
+    let table_end = header.pt2.ph_offset() as usize
+        + header.pt2.ph_count() as usize * header.pt2.ph_entry_size() as usize;
+    if table_end > headers.len() {
+        if table_end > size {
+            return Err(Error::new(Errno::ENOEXEC));
+        }
+        headers.resize(table_end, 0);
+        program.read_bytes(0, &mut headers)?;
+    }
+    Ok(headers)
+}
+
+fn parse_elf(program: &Program) -> Result<ProgramImage> {
+    // Taken before anything is read, so that a write meanwhile makes the
+    // image stale.
+    let version = program.version();
+    let headers = read_headers(program)?;
+    let input = headers.as_slice();
+    let size = program.size();
+    let header = xmas_elf::header::parse_header(input).map_err(|_| Error::new(Errno::ENOEXEC))?;
 
     let pt2 = header.pt2;
     let ph_count = pt2.ph_count();
 
-    // First, map each ph
+    // Load each ph
+    let mut segments = Vec::new();
     for index in 0..ph_count {
-        let program_header = xmas_elf::program::parse_program_header(input, header, index).unwrap();
+        let program_header = xmas_elf::program::parse_program_header(input, header, index)
+            .map_err(|_| Error::new(Errno::ENOEXEC))?;
         let ph64 = match program_header {
             xmas_elf::program::ProgramHeader::Ph64(ph64) => *ph64,
-            xmas_elf::program::ProgramHeader::Ph32(_) => {
-                todo!("Not 64 byte executable")
-            }
+            // Not 64 byte executable
+            xmas_elf::program::ProgramHeader::Ph32(_) => return Err(Error::new(Errno::ENOEXEC)),
         };
         if let Ok(typ) = ph64.get_type() {
             if typ == xmas_elf::program::Type::Load {
@@ -66,29 +384,30 @@ fn parse_elf(input: &[u8], memory_space: &MemorySpace, user_cpu_state: &mut User
                 }
                 // __stack_chk_fail
                 let nframes = (end_addr - start_addr) / PAGE_SIZE;
-                let frames = memory_space.map(VmArea::new(start_addr, nframes, perms));
-
-                let copy_bytes =
-                    &input[ph64.offset as usize..(ph64.offset + ph64.file_size) as usize];
+                if ph64.offset.saturating_add(ph64.file_size) > size as u64
+                    || ph64.file_size > ph64.mem_size
+                {
+                    return Err(Error::new(Errno::ENOEXEC));
+                }
 
-                frames
-                    .write_bytes(raw_start_addr as usize - start_addr, copy_bytes)
-                    .unwrap();
+                segments.push(ImageSegment {
+                    base_vaddr: start_addr,
+                    pages: nframes,
+                    perms,
+                    data_offset: raw_start_addr as usize - start_addr,
+                    file_offset: ph64.offset as usize,
+                    data_len: ph64.file_size as usize,
+                    page_cache: PageCache::new(),
+                });
             }
         }
     }
 
-    // Second, init the user stack with addr: 0x40_0000_0000 - 10 * PAGE_SIZE.
-    let stack_low = 0x40_0000_0000 - 10 * PAGE_SIZE - USER_STACK_SIZE;
-    memory_space.add_area(VmArea::new_with_handler(
-        stack_low,
-        USER_STACK_SIZE / PAGE_SIZE,
-        PageFlags::RW,
-        Arc::new(AllocationPageFaultHandler),
-    ));
-    user_cpu_state.set_stack_pointer(0x40_0000_0000 - 10 * PAGE_SIZE - 32);
-    user_cpu_state.set_instruction_pointer(header.pt2.entry_point() as usize);
-
-    // Third, map the 0 address
-    memory_space.map(VmArea::new(0, 1, PageFlags::RW));
+    Ok(ProgramImage {
+        program: program.clone(),
+        size,
+        version,
+        segments,
+        entry_point: header.pt2.entry_point() as usize,
+    })
 }
@@ -0,0 +1,282 @@
+//! Futexes, the wait queues user space blocks on when a lock or condition
+//! variable word is contended.
+//!
+//! Waiters are kept in a table of buckets hashed by futex key. A futex in a
+//! shared mapping is keyed by its physical address, so that processes mapping
+//! the same page meet on it, and any other by its address in the memory space
+//! of the threads sharing it. A futex used as private, as for
+//! `FUTEX_PRIVATE_FLAG`, is taken to be in a private mapping, so that both
+//! kinds of operation on a word of a private mapping meet.
+//!
+//! The waiters of a process ending with `exit_group` are woken, see
+//! [`wake_exiting`].
+
+use core::{
+    sync::atomic::{AtomicUsize, Ordering},
+    time::Duration,
+};
+
+use alloc::{collections::VecDeque, sync::Arc};
+use ostd::{
+    mm::{Paddr, Vaddr},
+    sync::{SpinLock, Waiter, Waker},
+};
+
+use crate::{
+    error::{Errno, Error, Result},
+    hrtimer,
+    process::{Pid, Process},
+};
+
+/// Matches every waiter, for the operations without a bitset.
+pub const FUTEX_BITSET_MATCH_ANY: u32 = u32::MAX;
+
+const BUCKETS: usize = 64;
+
+static FUTEX_BUCKETS: [SpinLock<VecDeque<FutexWaiter>>; BUCKETS] =
+    [const { SpinLock::new(VecDeque::new()) }; BUCKETS];
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+enum FutexKey {
+    /// The address of the memory space, and the address of the futex in it.
+    Private(usize, Vaddr),
+    Shared(Paddr),
+}
+
+impl FutexKey {
+    fn new(process: &Arc<Process>, addr: Vaddr, private: bool) -> Result<Self> {
+        if addr % align_of::<u32>() != 0 {
+            return Err(Error::new(Errno::EINVAL));
+        }
+        let memory_space = process.memory_space();
+        // Fault the page in, as the word is read under a bucket lock.
+        let shared = if private {
+            memory_space.populate(process, addr..addr + size_of::<u32>())?;
+            None
+        } else {
+            memory_space.translate_shared(process, addr)?
+        };
+        Ok(match shared {
+            Some(paddr) => Self::Shared(paddr),
+            None => Self::Private(Arc::as_ptr(&memory_space) as usize, addr),
+        })
+    }
+
+    fn bucket_index(&self) -> usize {
+        let hash = match *self {
+            Self::Private(memory_space, vaddr) => memory_space ^ vaddr,
+            Self::Shared(paddr) => paddr,
+        };
+        // Fibonacci hashing, taking the top bits.
+        ((hash as u64).wrapping_mul(0x9e37_79b9_7f4a_7c15) >> (64 - BUCKETS.ilog2())) as usize
+    }
+
+    fn bucket(&self) -> &'static SpinLock<VecDeque<FutexWaiter>> {
+        &FUTEX_BUCKETS[self.bucket_index()]
+    }
+}
+
+struct FutexWaiter {
+    key: FutexKey,
+    bitset: u32,
+    waker: Arc<Waker>,
+    /// The process of the waiting thread.
+    pid: Pid,
+    /// The index of the bucket the waiter is in, changed by requeues with
+    /// the locks of both buckets held.
+    bucket: Arc<AtomicUsize>,
+}
+
+fn read_word(process: &Process, addr: Vaddr) -> Result<u32> {
+    process
+        .memory_space()
+        .vm_space()
+        .reader(addr, size_of::<u32>())
+        .and_then(|mut reader| reader.read_val())
+        .map_err(|_| Error::new(Errno::EFAULT))
+}
+
+/// Blocks until woken if the word at `addr` holds `expected`, or fails with
+/// `EAGAIN` if it does not.
+///
+/// Fails with `ETIMEDOUT` if not woken by the time the monotonic time reaches
+/// `deadline`, and with `EINTR` if the process is ending.
+pub fn futex_wait(
+    process: &Arc<Process>,
+    addr: Vaddr,
+    expected: u32,
+    bitset: u32,
+    deadline: Option<Duration>,
+    private: bool,
+) -> Result<()> {
+    if bitset == 0 {
+        return Err(Error::new(Errno::EINVAL));
+    }
+    let key = FutexKey::new(process, addr, private)?;
+    let (waiter, waker) = Waiter::new_pair();
+    let bucket = Arc::new(AtomicUsize::new(key.bucket_index()));
+    {
+        // Checked under the bucket lock, so that a waker changing the word
+        // first and then waking cannot be missed, nor can `wake_exiting`.
+        let mut waiters = key.bucket().lock();
+        if process.exit_code().is_some() {
+            return Err(Error::new(Errno::EINTR));
+        }
+        if read_word(process, addr)? != expected {
+            return Err(Error::new(Errno::EAGAIN));
+        }
+        waiters.push_back(FutexWaiter {
+            key,
+            bitset,
+            waker: waker.clone(),
+            pid: process.pid(),
+            bucket: bucket.clone(),
+        });
+    }
+    let timer = deadline.map(|deadline| {
+        let waker = waker.clone();
+        hrtimer::arm(deadline, move || {
+            waker.wake_up();
+        })
+    });
+    waiter.wait();
+    if let Some(timer) = timer {
+        hrtimer::cancel(timer);
+        // Woken by the timer if still queued, as wakers dequeue the waiters
+        // they wake.
+        if dequeue(&bucket, &waker) {
+            return Err(Error::new(Errno::ETIMEDOUT));
+        }
+    }
+    Ok(())
+}
+
+/// Takes the waiter woken by `waker` out of its bucket, and returns whether
+/// it was still there.
+fn dequeue(bucket: &AtomicUsize, waker: &Arc<Waker>) -> bool {
+    loop {
+        let index = bucket.load(Ordering::Acquire);
+        let mut waiters = FUTEX_BUCKETS[index].lock();
+        // Requeued meanwhile.
+        if bucket.load(Ordering::Acquire) != index {
+            continue;
+        }
+        let len = waiters.len();
+        waiters.retain(|waiter| !Arc::ptr_eq(&waiter.waker, waker));
+        return waiters.len() != len;
+    }
+}
+
+/// Wakes every waiter of the process with `pid`, which is ending, so that its
+/// threads return and stop.
+///
+/// Waiters that come later see the process ending, see [`futex_wait`].
+pub fn wake_exiting(pid: Pid) {
+    for bucket in &FUTEX_BUCKETS {
+        bucket.lock().retain(|waiter| {
+            if waiter.pid != pid {
+                return true;
+            }
+            waiter.waker.wake_up();
+            false
+        });
+    }
+}
+
+/// Wakes up to `max` waiters on `addr` whose bitsets intersect `bitset`, and
+/// returns how many were woken.
+pub fn futex_wake(
+    process: &Arc<Process>,
+    addr: Vaddr,
+    max: usize,
+    bitset: u32,
+    private: bool,
+) -> Result<usize> {
+    if bitset == 0 {
+        return Err(Error::new(Errno::EINVAL));
+    }
+    let key = FutexKey::new(process, addr, private)?;
+    let mut bucket = key.bucket().lock();
+    let mut woken = 0;
+    bucket.retain(|waiter| {
+        if woken == max || waiter.key != key || waiter.bitset & bitset == 0 {
+            return true;
+        }
+        waiter.waker.wake_up();
+        woken += 1;
+        false
+    });
+    Ok(woken)
+}
+
+/// Wakes up to `max_wake` waiters on `addr` and moves up to `max_requeue` of
+/// the rest to wait on `addr2`, and returns how many were woken or moved.
+///
+/// With `expected`, fails with `EAGAIN` unless the word at `addr` holds it,
+/// as for `FUTEX_CMP_REQUEUE`.
+pub fn futex_requeue(
+    process: &Arc<Process>,
+    addr: Vaddr,
+    max_wake: usize,
+    addr2: Vaddr,
+    max_requeue: usize,
+    expected: Option<u32>,
+    private: bool,
+) -> Result<usize> {
+    let key = FutexKey::new(process, addr, private)?;
+    let key2 = FutexKey::new(process, addr2, private)?;
+    let bucket = key.bucket();
+    let bucket2 = key2.bucket();
+
+    // Lock the buckets in a fixed order.
+    let (mut waiters, mut waiters2) = if core::ptr::eq(bucket, bucket2) {
+        (bucket.lock(), None)
+    } else if (bucket as *const _) < (bucket2 as *const _) {
+        let waiters = bucket.lock();
+        (waiters, Some(bucket2.lock()))
+    } else {
+        let waiters2 = bucket2.lock();
+        (bucket.lock(), Some(waiters2))
+    };
+
+    if let Some(expected) = expected {
+        if read_word(process, addr)? != expected {
+            return Err(Error::new(Errno::EAGAIN));
+        }
+    }
+
+    let (mut woken, mut requeued) = (0, 0);
+    let mut moved = VecDeque::new();
+    waiters.retain_mut(|waiter| {
+        if waiter.key != key {
+            return true;
+        }
+        if woken < max_wake {
+            waiter.waker.wake_up();
+            woken += 1;
+            return false;
+        }
+        if requeued < max_requeue {
+            requeued += 1;
+            if waiters2.is_none() {
+                // Same bucket, so it stays where it is.
+                waiter.key = key2;
+                return true;
+            }
+            waiter.bucket.store(key2.bucket_index(), Ordering::Release);
+            moved.push_back(FutexWaiter {
+                key: key2,
+                bitset: waiter.bitset,
+                waker: waiter.waker.clone(),
+                pid: waiter.pid,
+                bucket: waiter.bucket.clone(),
+            });
+            return false;
+        }
+        true
+    });
+    if let Some(waiters2) = waiters2.as_mut() {
+        waiters2.append(&mut moved);
+    }
+    Ok(woken + requeued)
+}
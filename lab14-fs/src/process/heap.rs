@@ -1,9 +1,10 @@
 use core::sync::atomic::{AtomicUsize, Ordering};
 
 use align_ext::AlignExt;
+use alloc::sync::Arc;
 use ostd::mm::{PAGE_SIZE, PageFlags, Vaddr};
 
-use crate::mm::area::VmArea;
+use crate::mm::{area::VmArea, fault::AllocationPageFaultHandler};
 
 use super::current_process;
 
@@ -31,28 +32,55 @@ impl UserHeap {
         self.base
     }
 
+    /// Moves the program break to `new_end`, or returns it if `new_end` is `None`.
+    ///
+    /// The heap is a single lazily faulted area that grows and shrinks with
+    /// the break. A break outside the heap limit, or one that would exceed
+    /// `RLIMIT_AS` or `RLIMIT_DATA`, is refused by returning the current one.
     pub fn brk(&self, new_end: Option<Vaddr>) -> Option<Vaddr> {
-        match new_end {
-            Some(new_end) => {
-                let process = current_process();
-                let current_end = self.current_end.load(Ordering::Acquire);
-                if new_end <= current_end {
-                    return Some(current_end);
-                }
-                let old_vaddr = current_end.align_up(PAGE_SIZE);
-                let new_vaddr = new_end.align_up(PAGE_SIZE);
+        let current_end = self.current_end.load(Ordering::Acquire);
+        let Some(new_end) = new_end else {
+            return Some(current_end);
+        };
+        if new_end < self.base || new_end > self.base + self.limit {
+            return Some(current_end);
+        }
 
-                if new_vaddr > old_vaddr {
-                    let pages = (new_vaddr - old_vaddr) / PAGE_SIZE;
-                    process
-                        .memory_space()
-                        .map(VmArea::new(old_vaddr, pages, PageFlags::RW));
-                }
-                self.current_end.store(new_end, Ordering::Release);
-                Some(new_end)
+        let old_pages = (current_end.align_up(PAGE_SIZE) - self.base) / PAGE_SIZE;
+        let new_pages = (new_end.align_up(PAGE_SIZE) - self.base) / PAGE_SIZE;
+        if new_pages != old_pages {
+            let process = current_process();
+            if new_pages > old_pages
+                && process
+                    .check_vm_limits((new_pages - old_pages) * PAGE_SIZE, true)
+                    .is_err()
+            {
+                return Some(current_end);
+            }
+            let memory_space = process.memory_space();
+            let result = if old_pages == 0 {
+                memory_space.add_area(VmArea::new_with_handler(
+                    self.base,
+                    new_pages,
+                    PageFlags::RW,
+                    Arc::new(AllocationPageFaultHandler::default()),
+                ));
+                Ok(())
+            } else {
+                memory_space.resize_area(self.base, new_pages)
+            };
+            if result.is_err() {
+                return Some(current_end);
             }
-            None => Some(self.current_end.load(Ordering::Relaxed)),
         }
+
+        self.current_end.store(new_end, Ordering::Release);
+        Some(new_end)
+    }
+
+    /// Resets the break to the heap base, as for a new program.
+    pub fn reset(&self) {
+        self.current_end.store(self.base, Ordering::Release);
     }
 }
 
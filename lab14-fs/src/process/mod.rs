@@ -1,41 +1,66 @@
 mod elf;
+pub mod futex;
 mod heap;
+pub mod rlimit;
+pub mod rusage;
 mod status;
+mod table;
+mod thread;
 
-use core::sync::atomic::{AtomicUsize, Ordering};
+use core::sync::atomic::{AtomicBool, AtomicI8, Ordering};
 
 use alloc::boxed::Box;
-use alloc::collections::btree_map::BTreeMap;
+use alloc::collections::{VecDeque, btree_map::BTreeMap};
 use alloc::sync::{Arc, Weak};
+use alloc::vec::Vec;
+use id_alloc::IdAlloc;
 use log::{debug, info};
 use ostd::arch::cpu::context::UserContext;
 use ostd::arch::qemu::{QemuExitCode, exit_qemu};
 use ostd::early_println;
-use ostd::sync::{Mutex, MutexGuard, WaitQueue};
+use ostd::sync::{Mutex, RwLock, SpinLock, WaitQueue};
 use ostd::task::{Task, TaskOptions};
 use ostd::user::{ReturnReason, UserContextApi, UserMode};
 use riscv::register::scause::Exception;
-use spin::Once;
 
 use crate::error::{Errno, Error, Result};
-use crate::fs::file_table::FileTable;
-use crate::mm::MemorySpace;
+use crate::fs::FileLike;
+use crate::fs::file_table::{FileDescriptor, FileTable};
+use crate::lock_stat::{
+    StatMutex, StatRwMutex, StatRwMutexReadGuard, StatRwMutexWriteGuard, lock_site,
+};
+use crate::mm::{MemorySpace, reaper};
 use crate::process::heap::UserHeap;
+use crate::process::rlimit::{RLIMIT_AS, RLIMIT_DATA, ResourceLimits};
+use crate::process::rusage::{ResourceUsage, UsageSnapshot};
 use crate::process::status::ProcessStatus;
+use crate::process::table::ProcessTable;
+use crate::progs::BuiltinProgram;
+use crate::sched;
+pub use elf::Program;
+pub use thread::{Thread, Tid, current_thread};
 pub const USER_STACK_SIZE: usize = 8192 * 1024; // 8MB
+/// The end of the user stack area.
+pub const USER_STACK_TOP: usize = 0x40_0000_0000 - 10 * ostd::mm::PAGE_SIZE;
 
-static PROCESS_TABLE: Mutex<BTreeMap<Pid, Arc<Process>>> = Mutex::new(BTreeMap::new());
+/// The range of nice values, from the highest priority to the lowest.
+pub const NICE_RANGE: core::ops::RangeInclusive<i8> = -20..=19;
+
+static PROCESS_TABLE: ProcessTable = ProcessTable::new();
 
 #[inline]
 pub fn current_process() -> Arc<Process> {
-    let current = Task::current().unwrap();
-    current
-        .data()
-        .downcast_ref::<Weak<Process>>()
-        .unwrap()
-        .upgrade()
-        .unwrap()
-        .clone()
+    current_thread().process().unwrap()
+}
+
+/// Returns the live process with `pid`.
+pub fn find_process(pid: Pid) -> Option<Arc<Process>> {
+    PROCESS_TABLE.get(pid)
+}
+
+/// Returns the live processes.
+pub fn all_processes() -> Vec<Arc<Process>> {
+    PROCESS_TABLE.all()
 }
 
 pub struct Process {
@@ -44,13 +69,32 @@ pub struct Process {
     pid: Pid,
     /// Process state
     status: ProcessStatus,
-    /// The thread of this process
-    task: Once<Arc<Task>>,
+    /// The tasks of the live threads, by tid. The main thread's tid is the
+    /// pid.
+    threads: Mutex<BTreeMap<Tid, Arc<Task>>>,
     /// File table
-    file_table: Mutex<FileTable>,
+    file_table: StatRwMutex<FileTable>,
+    /// The nice value, weighting the process's share of CPU time under the
+    /// fair scheduler.
+    nice: AtomicI8,
+    /// The resources used by the threads, which hold it as well.
+    usage: Arc<ResourceUsage>,
+    /// The resources used by the reaped children and their reaped children.
+    children_usage: ResourceUsage,
+    limits: SpinLock<ResourceLimits>,
 
     // ======================== Memory management ===============================
-    memory_space: MemorySpace,
+    /// Shared with the parent while this is a vfork child that has not called
+    /// `execve` or exited yet. Only taken when the process drops.
+    memory_space: RwLock<Option<Arc<MemorySpace>>>,
+    /// Whether this is a vfork child still borrowing its parent's memory space.
+    borrows_memory_space: AtomicBool,
+    /// Whether the parent waits, as for `CLONE_VFORK`, until this child calls
+    /// `execve` or exits, whether or not it borrows the memory space.
+    vfork_parent_waits: AtomicBool,
+    /// The WaitQueue for a vfork parent to wait for the child to call `execve`
+    /// or exit.
+    vfork_done_queue: WaitQueue,
     // Heap
     heap: UserHeap,
 
@@ -58,38 +102,74 @@ pub struct Process {
     /// Parent process.
     parent_process: Mutex<Weak<Process>>,
     /// Children process.
-    children: Mutex<BTreeMap<Pid, Arc<Process>>>,
+    children: StatMutex<Children>,
     /// The WaitQueue for a child process to become a zombie.
     wait_children_queue: WaitQueue,
 }
 
 impl Process {
-    pub fn new(user_prog_bin: &[u8]) -> Arc<Self> {
-        let (memory_space, user_context) = elf::create_user_space(user_prog_bin);
+    pub fn new(user_prog_bin: &'static BuiltinProgram) -> Arc<Self> {
+        let (memory_space, user_context) =
+            elf::create_user_space(&Program::Builtin(user_prog_bin)).unwrap();
 
         let process = Arc::new(Process {
-            pid: alloc_pid(),
+            pid: alloc_pid().unwrap(),
             status: ProcessStatus::new(),
-            task: Once::new(),
-            memory_space,
+            threads: Mutex::new(BTreeMap::new()),
+            memory_space: RwLock::new(Some(Arc::new(memory_space))),
+            borrows_memory_space: AtomicBool::new(false),
+            vfork_parent_waits: AtomicBool::new(false),
+            vfork_done_queue: WaitQueue::new(),
             heap: UserHeap::new(),
             parent_process: Mutex::new(Weak::new()),
-            children: Mutex::new(BTreeMap::new()),
+            children: StatMutex::new(Children::default(), lock_site!("process.children")),
             wait_children_queue: WaitQueue::new(),
-            file_table: Mutex::new(FileTable::new_with_standard_io()),
+            file_table: StatRwMutex::new(
+                FileTable::new_with_standard_io(),
+                lock_site!("process.file_table"),
+            ),
+            nice: AtomicI8::new(0),
+            usage: Arc::new(ResourceUsage::default()),
+            children_usage: ResourceUsage::default(),
+            limits: SpinLock::new(ResourceLimits::new()),
         });
 
-        let task = create_user_task(&process, Box::new(user_context));
-        process.task.call_once(|| task);
+        process.add_thread(Thread::new_main(&process), user_context);
         process.status.set_runnable();
-        PROCESS_TABLE.lock().insert(process.pid(), process.clone());
+        PROCESS_TABLE.insert(process.clone());
 
         process
     }
 
-    pub fn fork(self: &Arc<Self>, user_context: &UserContext) -> Arc<Process> {
-        let memory_space = self.memory_space.duplicate();
+    /// Creates a child with a copy of this process's memory space. With
+    /// `vfork`, the caller then waits with [`Self::wait_vfork_done`] on the
+    /// child.
+    pub fn fork(self: &Arc<Self>, user_context: &UserContext, vfork: bool) -> Result<Arc<Process>> {
+        let memory_space = Arc::new(self.memory_space().duplicate());
+        self.spawn_child(user_context, memory_space, false, vfork)
+    }
+
+    /// Creates a child that runs in this process's memory space until it calls
+    /// `execve` or exits. The caller must not return to user space before
+    /// [`Self::wait_vfork_done`] on the child returns.
+    pub fn vfork(self: &Arc<Self>, user_context: &UserContext) -> Result<Arc<Process>> {
+        self.spawn_child(user_context, self.memory_space(), true, true)
+    }
+
+    /// Waits until this vfork child calls `execve` or exits.
+    pub fn wait_vfork_done(&self) {
+        self.vfork_done_queue
+            .wait_until(|| (!self.vfork_parent_waits.load(Ordering::Acquire)).then_some(()));
+    }
 
+    fn spawn_child(
+        self: &Arc<Self>,
+        user_context: &UserContext,
+        memory_space: Arc<MemorySpace>,
+        borrows_memory_space: bool,
+        vfork: bool,
+    ) -> Result<Arc<Process>> {
+        let pid = alloc_pid()?;
         let user_context = {
             let mut ctx = user_context.clone();
             ctx.set_a0(0);
@@ -97,37 +177,121 @@ impl Process {
         };
 
         let child_process = Arc::new(Process {
-            pid: alloc_pid(),
+            pid,
             status: ProcessStatus::new(),
-            task: Once::new(),
-            memory_space,
-            heap: UserHeap::new(),
+            threads: Mutex::new(BTreeMap::new()),
+            memory_space: RwLock::new(Some(memory_space)),
+            borrows_memory_space: AtomicBool::new(borrows_memory_space),
+            vfork_parent_waits: AtomicBool::new(vfork),
+            vfork_done_queue: WaitQueue::new(),
+            heap: self.heap.clone(),
             parent_process: Mutex::new(Arc::downgrade(self)),
-            children: Mutex::new(BTreeMap::new()),
+            children: StatMutex::new(Children::default(), lock_site!("process.children")),
             wait_children_queue: WaitQueue::new(),
-            file_table: Mutex::new(self.file_table().duplicate()),
+            file_table: StatRwMutex::new(
+                self.file_table().duplicate(),
+                lock_site!("process.file_table"),
+            ),
+            nice: AtomicI8::new(self.nice()),
+            usage: Arc::new(ResourceUsage::default()),
+            children_usage: ResourceUsage::default(),
+            limits: SpinLock::new(self.limits.lock().clone()),
         });
 
-        let task = create_user_task(&child_process, Box::new(user_context));
-        child_process.task.call_once(|| task);
+        child_process.add_thread(Thread::new_main(&child_process), user_context);
         child_process.status.set_runnable();
 
         self.children
             .lock()
+            .all
             .insert(child_process.pid(), child_process.clone());
-        PROCESS_TABLE
-            .lock()
-            .insert(child_process.pid(), child_process.clone());
+        PROCESS_TABLE.insert(child_process.clone());
+
+        Ok(child_process)
+    }
 
-        child_process
+    /// Creates a thread in this process, which runs from `user_context` once
+    /// [`Self::run_thread`] is called with its tid.
+    pub fn spawn_thread(self: &Arc<Self>, user_context: &UserContext) -> Result<Arc<Thread>> {
+        let tid = alloc_pid()?;
+        let mut user_context = user_context.clone();
+        user_context.set_a0(0);
+        Ok(self.add_thread(Thread::new(tid, self, true), user_context))
     }
 
-    pub fn exec(&self, binary: &[u8]) -> UserContext {
-        self.memory_space.clear();
-        elf::load_user_space(binary, &self.memory_space)
+    fn add_thread(self: &Arc<Self>, thread: Thread, user_context: UserContext) -> Arc<Thread> {
+        let thread = Arc::new(thread);
+        let task = create_user_task(thread.clone(), Box::new(user_context));
+        self.threads.lock().insert(thread.tid(), task);
+        thread
+    }
+
+    /// Returns the thread with `tid`, if it has not exited.
+    pub fn thread(&self, tid: Tid) -> Option<Arc<Thread>> {
+        let task = self.threads.lock().get(&tid).cloned()?;
+        task.data().downcast_ref::<Arc<Thread>>().cloned()
+    }
+
+    /// Runs the thread with `tid`, if it has not exited.
+    pub fn run_thread(&self, tid: Tid) {
+        let task = self.threads.lock().get(&tid).cloned();
+        if let Some(task) = task {
+            task.run();
+        }
     }
 
-    pub fn wait(&self, wait_pid: i32) -> Result<(Pid, u32)> {
+    /// Ends `thread`, and the process with `exit_code` if it is the last
+    /// thread, as for `exit`.
+    pub fn exit_thread(self: &Arc<Self>, thread: &Thread, exit_code: u32) {
+        thread.exit(self);
+        let is_last = {
+            let mut threads = self.threads.lock();
+            threads.remove(&thread.tid());
+            threads.is_empty()
+        };
+        if is_last {
+            self.exit(exit_code);
+        }
+    }
+
+    /// Ends the process with `exit_code`, as for `exit_group`. The other
+    /// threads stop the next time they enter the kernel, and those waiting on
+    /// futexes are woken to do so.
+    pub fn exit_group(self: &Arc<Self>, thread: &Thread, exit_code: u32) {
+        thread.exit(self);
+        self.threads.lock().remove(&thread.tid());
+        self.exit(exit_code);
+        futex::wake_exiting(self.pid);
+    }
+
+    /// Replaces the program this process runs.
+    ///
+    /// The program is parsed before anything is torn down, so that on an
+    /// error the process keeps running the old one.
+    pub fn exec(&self, program: &Program) -> Result<UserContext> {
+        let image = elf::program_image(program)?;
+
+        self.heap.reset();
+        if !self.borrows_memory_space.load(Ordering::Acquire) {
+            let memory_space = self.memory_space();
+            memory_space.clear();
+            let user_context = elf::load_user_space(&image, &memory_space);
+            self.release_vfork_parent();
+            return Ok(user_context);
+        }
+
+        // Leave the parent's memory space alone and start over in a new one.
+        let memory_space = Arc::new(MemorySpace::new());
+        let user_context = elf::load_user_space(&image, &memory_space);
+        *self.memory_space.write() = Some(memory_space);
+        self.borrows_memory_space.store(false, Ordering::Release);
+        self.release_vfork_parent();
+        Ok(user_context)
+    }
+
+    /// Reaps a child, and returns its pid, exit code and resource usage,
+    /// which includes that of its reaped children.
+    pub fn wait(&self, wait_pid: i32) -> Result<(Pid, u32, UsageSnapshot)> {
         let wait_pid = if wait_pid == -1 {
             None
         } else {
@@ -137,7 +301,7 @@ impl Process {
         let res = self.try_wait(wait_pid);
 
         match res {
-            Ok((pid, exit_code)) => return Ok((pid as Pid, exit_code)),
+            Ok(reaped) => return Ok(reaped),
             Err(err) if err.code == Errno::EAGAIN => {}
             Err(err) => return Err(err),
         }
@@ -149,21 +313,27 @@ impl Process {
 
     pub fn reparent_children_to_init(&self) {
         const INIT_PROCESS_ID: Pid = 1;
-        if self.pid == INIT_PROCESS_ID || self.children.lock().is_empty() {
+        if self.pid == INIT_PROCESS_ID || self.children.lock().all.is_empty() {
             return;
         }
 
         // Do re-parenting
-        let init_process = {
-            let process_table = PROCESS_TABLE.lock();
-            process_table.get(&INIT_PROCESS_ID).unwrap().clone()
-        };
+        let init_process = PROCESS_TABLE.get(INIT_PROCESS_ID).unwrap();
 
         let mut init_children = init_process.children.lock();
         let mut self_children = self.children.lock();
-        while let Some((pid, child)) = self_children.pop_first() {
+        // A child exiting meanwhile finds it has moved, see
+        // `Self::notify_parent`.
+        while let Some((pid, child)) = self_children.all.pop_first() {
             *child.parent_process.lock() = Arc::downgrade(&init_process);
-            init_children.insert(pid, child);
+            init_children.all.insert(pid, child);
+        }
+        let has_zombies = !self_children.zombies.is_empty();
+        init_children.zombies.append(&mut self_children.zombies);
+        drop(self_children);
+        drop(init_children);
+        if has_zombies {
+            init_process.wait_children_queue.wake_all();
         }
     }
 
@@ -171,17 +341,58 @@ impl Process {
         self.parent_process.lock().upgrade()
     }
 
-    pub fn exit(&self, exit_code: u32) {
-        self.status.exit(exit_code);
+    fn exit(&self, exit_code: u32) {
+        // Another thread may have ended the process already.
+        if !self.status.exit(exit_code) {
+            return;
+        }
+        // Close the files now rather than when the zombie is reaped, so that
+        // the other ends of pipes see them closed.
+        let files = core::mem::replace(&mut *self.file_table.write(), FileTable::new());
+        drop(files);
         self.reparent_children_to_init();
-        // Wakeup the parent process if it is waiting.
-        if let Some(parent) = self.parent_process() {
-            parent.wait_children_queue.wake_all();
+        self.release_vfork_parent();
+        self.notify_parent();
+    }
+
+    /// Queues this zombie to be reaped by its parent, and wakes the parent if
+    /// it is waiting.
+    fn notify_parent(&self) {
+        // The parent may be reparenting its children to init meanwhile, which
+        // moves this process to init's children under the parent's lock.
+        loop {
+            let Some(parent) = self.parent_process() else {
+                return;
+            };
+            let mut children = parent.children.lock();
+            if !children.all.contains_key(&self.pid) {
+                continue;
+            }
+            children.zombies.push_back(self.pid);
+            drop(children);
+            // This process is exiting, so the parent may as well run here.
+            sched::wake_affine(|| parent.wait_children_queue.wake_all());
+            return;
         }
     }
 
-    pub fn file_table(&self) -> MutexGuard<FileTable> {
-        self.file_table.lock()
+    /// Returns the file open at `fd`. The file table is only read-locked for
+    /// the lookup, so the caller may block on the file without holding up the
+    /// other threads' fd operations.
+    pub fn file(&self, fd: FileDescriptor) -> Result<Arc<dyn FileLike>> {
+        self.file_table
+            .read()
+            .get(fd)
+            .map(|entry| entry.file().clone())
+            .ok_or(Error::new(Errno::EBADF))
+    }
+
+    pub fn file_table(&self) -> StatRwMutexReadGuard<FileTable> {
+        self.file_table.read()
+    }
+
+    pub fn file_table_mut(&self) -> StatRwMutexWriteGuard<FileTable> {
+        self.file_table.write()
     }
 
     pub fn is_zombie(&self) -> bool {
@@ -196,69 +407,122 @@ impl Process {
         self.pid
     }
 
+    pub fn nice(&self) -> i8 {
+        self.nice.load(Ordering::Relaxed)
+    }
+
+    /// Sets the nice value, clamped to [`NICE_RANGE`]. It takes effect the
+    /// next time the process is queued to run.
+    pub fn set_nice(&self, nice: i32) {
+        let nice = nice.clamp(*NICE_RANGE.start() as i32, *NICE_RANGE.end() as i32);
+        self.nice.store(nice as i8, Ordering::Relaxed);
+    }
+
+    /// Runs the main thread.
     pub fn run(&self) {
-        self.task.get().unwrap().run();
+        self.run_thread(self.pid);
     }
 
-    pub fn memory_space(&self) -> &MemorySpace {
-        &self.memory_space
+    pub fn memory_space(&self) -> Arc<MemorySpace> {
+        self.memory_space.read().clone().unwrap()
     }
 
     pub fn heap(&self) -> &UserHeap {
         &self.heap
     }
 
-    fn try_wait(&self, pid: Option<Pid>) -> Result<(Pid, u32)> {
+    pub fn usage(&self) -> &Arc<ResourceUsage> {
+        &self.usage
+    }
+
+    pub fn children_usage(&self) -> &ResourceUsage {
+        &self.children_usage
+    }
+
+    pub fn limits(&self) -> &SpinLock<ResourceLimits> {
+        &self.limits
+    }
+
+    /// Fails with `ENOMEM` if mapping `len` more bytes, which count as data if
+    /// `data`, would exceed `RLIMIT_AS` or `RLIMIT_DATA`.
+    pub fn check_vm_limits(&self, len: usize, data: bool) -> Result<()> {
+        let (as_limit, data_limit) = {
+            let limits = self.limits.lock();
+            (limits.soft(RLIMIT_AS), limits.soft(RLIMIT_DATA))
+        };
+        if as_limit == rlimit::RLIM_INFINITY && (!data || data_limit == rlimit::RLIM_INFINITY) {
+            return Ok(());
+        }
+        let (total, data_size) = self.memory_space().vm_sizes();
+        if (total + len) as u64 > as_limit || (data && (data_size + len) as u64 > data_limit) {
+            return Err(Error::new(Errno::ENOMEM));
+        }
+        Ok(())
+    }
+
+    fn release_vfork_parent(&self) {
+        if self.vfork_parent_waits.swap(false, Ordering::AcqRel) {
+            self.vfork_done_queue.wake_all();
+        }
+    }
+
+    fn try_wait(&self, pid: Option<Pid>) -> Result<(Pid, u32, UsageSnapshot)> {
         let mut children = self.children.lock();
-        if children.is_empty() {
+        if children.all.is_empty() {
             return Err(Error::new(Errno::ECHILD));
         }
 
-        let mut wait_pid = None;
-        if let Some(pid) = pid {
-            if let Some(child) = children.get(&pid) {
-                if child.status.is_zombie() {
-                    wait_pid = Some(pid);
-                }
-            } else {
-                return Err(Error::new(Errno::ECHILD));
-            }
-        } else {
-            for (child_pid, child) in children.iter() {
-                debug!(
-                    "try_wait: check child pid = {}, is zombie = {:?}",
-                    child_pid,
-                    child.status.is_zombie()
-                );
-                if child.status.is_zombie() {
-                    wait_pid = Some(*child_pid);
-                    break;
+        let wait_pid = match pid {
+            Some(pid) => {
+                if !children.all.contains_key(&pid) {
+                    return Err(Error::new(Errno::ECHILD));
                 }
+                let index = children.zombies.iter().position(|&zombie| zombie == pid);
+                index.and_then(|index| children.zombies.remove(index))
             }
-        }
+            None => children.zombies.pop_front(),
+        };
 
         debug!("try_wait: wait_pid = {:?}", wait_pid);
 
         if let Some(pid) = wait_pid {
-            let child = children.remove(&pid).unwrap();
-            PROCESS_TABLE.lock().remove(&pid);
-            return Ok((pid, child.status.exit_code().unwrap()));
+            let child = children.all.remove(&pid).unwrap();
+            PROCESS_TABLE.remove(pid);
+            let usage = ResourceUsage::default();
+            usage.add(&child.usage.snapshot());
+            usage.add(&child.children_usage.snapshot());
+            let usage = usage.snapshot();
+            self.children_usage.add(&usage);
+            return Ok((pid, child.status.exit_code().unwrap(), usage));
         }
 
         Err(Error::new(crate::error::Errno::EAGAIN))
     }
 }
 
-fn create_user_task(process: &Arc<Process>, user_context: Box<UserContext>) -> Arc<Task> {
+/// The children of a process.
+#[derive(Default)]
+struct Children {
+    all: BTreeMap<Pid, Arc<Process>>,
+    /// The children that exited and are not reaped yet, in the order they
+    /// exited, so that waiting for any child does not scan them all.
+    zombies: VecDeque<Pid>,
+}
+
+fn create_user_task(thread: Arc<Thread>, user_context: Box<UserContext>) -> Arc<Task> {
     let entry = move |user_ctx| {
-        let process = current_process();
+        let thread = current_thread();
+        let process = thread.process().unwrap();
 
         let mut user_mode = UserMode::new(user_ctx);
-        let vm_space = process.memory_space().vm_space();
 
         loop {
-            vm_space.activate();
+            crate::sched::leave_disallowed_cpu(&thread);
+            // A vfork child gets a memory space of its own on `execve`.
+            process.memory_space().activate();
+            thread.set_in_user(true);
             let return_reason = user_mode.execute(|| true);
+            thread.set_in_user(false);
             let user_context = user_mode.context_mut();
             match return_reason {
                 ReturnReason::UserException => {
@@ -295,6 +559,8 @@ fn create_user_task(process: &Arc<Process>, user_context: Box<UserContext>) -> A
                     crate::syscall::handle_syscall(user_context, &process);
                 }
                 ReturnReason::KernelEvent => {
+                    #[cfg(feature = "profiler")]
+                    crate::profiler::sample_user(&process, user_context);
                     ostd::task::halt_cpu();
                 }
             }
@@ -302,6 +568,9 @@ fn create_user_task(process: &Arc<Process>, user_context: Box<UserContext>) -> A
                 info!("Process {} exited with code {}", process.pid(), exit_code);
                 break;
             }
+            if thread.has_exited() {
+                break;
+            }
         }
     };
 
@@ -309,15 +578,54 @@ fn create_user_task(process: &Arc<Process>, user_context: Box<UserContext>) -> A
 
     Arc::new(
         TaskOptions::new(user_task_func)
-            .data(Arc::downgrade(process))
+            .data(thread)
             .build()
             .unwrap(),
     )
 }
 
+impl Drop for Process {
+    fn drop(&mut self) {
+        // The last reference may drop with locks held, as in `try_wait`.
+        if let Some(memory_space) = self.memory_space.get_mut().take() {
+            reaper::defer(memory_space);
+        }
+        // Only now, so that no reference to this process outlives its pid.
+        free_pid(self.pid);
+    }
+}
+
 type Pid = usize;
 
-fn alloc_pid() -> Pid {
-    static NEXT_PID: AtomicUsize = AtomicUsize::new(1);
-    NEXT_PID.fetch_add(1, Ordering::Relaxed)
+/// The number of pids allocated for at first. The pid space doubles as needed
+/// up to [`PID_MAX`].
+const INITIAL_PIDS: usize = 1024;
+/// One more than the largest pid, as Linux's default `pid_max`.
+const PID_MAX: usize = 32768;
+
+/// Hands out the lowest free pid, or tid, so that pids stay dense and are reused once
+/// their processes are gone.
+static PID_ALLOCATOR: SpinLock<Option<IdAlloc>> = SpinLock::new(None);
+
+fn alloc_pid() -> Result<Pid> {
+    let mut allocator = PID_ALLOCATOR.lock();
+    let allocator = allocator.get_or_insert_with(|| {
+        let mut allocator = IdAlloc::with_capacity(INITIAL_PIDS);
+        // Pid 0 is not a process, and the first one is init.
+        allocator.alloc_specific(0);
+        allocator
+    });
+    if let Some(pid) = allocator.alloc() {
+        return Ok(pid);
+    }
+    let capacity = allocator.capacity();
+    if capacity >= PID_MAX {
+        return Err(Error::new(Errno::EAGAIN));
+    }
+    allocator.resize((capacity * 2).min(PID_MAX));
+    allocator.alloc().ok_or(Error::new(Errno::EAGAIN))
+}
+
+fn free_pid(pid: Pid) {
+    PID_ALLOCATOR.lock().as_mut().unwrap().free(pid);
 }
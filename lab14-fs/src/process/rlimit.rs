@@ -0,0 +1,75 @@
+//! The resource limits of a process, as for `prlimit64`.
+//!
+//! Every limit is kept and inherited by children, but only the address space
+//! and data limits are enforced, when `mmap` and `brk` grow the memory space.
+
+use ostd::Pod;
+
+use crate::error::{Errno, Error, Result};
+
+use super::USER_STACK_SIZE;
+
+pub const RLIMIT_DATA: usize = 2;
+pub const RLIMIT_STACK: usize = 3;
+pub const RLIMIT_AS: usize = 9;
+/// The number of resources, as for Linux.
+const RLIM_NLIMITS: usize = 16;
+
+pub const RLIM_INFINITY: u64 = u64::MAX;
+
+#[derive(Debug, Clone, Copy, Pod)]
+#[repr(C)]
+pub struct RLimit64 {
+    pub cur: u64,
+    pub max: u64,
+}
+
+#[derive(Debug, Clone)]
+pub struct ResourceLimits {
+    limits: [RLimit64; RLIM_NLIMITS],
+}
+
+impl ResourceLimits {
+    /// Returns the limits of the first process: unlimited, except the stack,
+    /// which is as large as the one every program gets.
+    pub fn new() -> Self {
+        let mut limits = [RLimit64 {
+            cur: RLIM_INFINITY,
+            max: RLIM_INFINITY,
+        }; RLIM_NLIMITS];
+        limits[RLIMIT_STACK].cur = USER_STACK_SIZE as u64;
+        Self { limits }
+    }
+
+    pub fn get(&self, resource: usize) -> Result<RLimit64> {
+        self.limits
+            .get(resource)
+            .copied()
+            .ok_or(Error::new(Errno::EINVAL))
+    }
+
+    /// Sets the limit of `resource`. Its soft limit may not exceed the hard
+    /// one.
+    pub fn set(&mut self, resource: usize, limit: RLimit64) -> Result<()> {
+        if limit.cur > limit.max {
+            return Err(Error::new(Errno::EINVAL));
+        }
+        let entry = self
+            .limits
+            .get_mut(resource)
+            .ok_or(Error::new(Errno::EINVAL))?;
+        *entry = limit;
+        Ok(())
+    }
+
+    /// Returns the soft limit of `resource`, which must be valid.
+    pub fn soft(&self, resource: usize) -> u64 {
+        self.limits[resource].cur
+    }
+}
+
+impl Default for ResourceLimits {
+    fn default() -> Self {
+        Self::new()
+    }
+}
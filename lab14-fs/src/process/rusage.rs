@@ -0,0 +1,173 @@
+//! The resource usage of processes, as reported by `getrusage` and `wait4`.
+//!
+//! Each thread holds its process's counters, so that they are updated where
+//! the events happen without looking the process up: page faults in
+//! [`crate::mm::page_fault_handler`], CPU time and context switches by the
+//! scheduler, block I/O by the block layer, and bytes by the read and write
+//! syscalls. CPU time is sampled on timer ticks, each one charged to user or
+//! system time by whether it interrupted user mode.
+
+use core::sync::atomic::{AtomicU64, Ordering};
+
+use alloc::sync::Arc;
+use ostd::task::{Task, scheduler::UpdateFlags};
+
+use super::Thread;
+
+#[derive(Debug, Default)]
+pub struct ResourceUsage {
+    user_ticks: AtomicU64,
+    system_ticks: AtomicU64,
+    minor_faults: AtomicU64,
+    major_faults: AtomicU64,
+    voluntary_switches: AtomicU64,
+    involuntary_switches: AtomicU64,
+    in_sectors: AtomicU64,
+    out_sectors: AtomicU64,
+    read_bytes: AtomicU64,
+    write_bytes: AtomicU64,
+    /// The most pages mapped at once, as seen after page faults.
+    max_rss_pages: AtomicU64,
+}
+
+/// The counts of a [`ResourceUsage`] at one point.
+#[derive(Debug, Default, Clone, Copy)]
+pub struct UsageSnapshot {
+    pub user_ticks: u64,
+    pub system_ticks: u64,
+    pub minor_faults: u64,
+    pub major_faults: u64,
+    pub voluntary_switches: u64,
+    pub involuntary_switches: u64,
+    pub in_sectors: u64,
+    pub out_sectors: u64,
+    pub read_bytes: u64,
+    pub write_bytes: u64,
+    pub max_rss_pages: u64,
+}
+
+impl ResourceUsage {
+    pub fn count_tick(&self, in_user: bool) {
+        let ticks = if in_user {
+            &self.user_ticks
+        } else {
+            &self.system_ticks
+        };
+        ticks.fetch_add(1, Ordering::Relaxed);
+    }
+
+    /// Counts a page fault, which is major if it waited for the device.
+    pub fn count_fault(&self, major: bool) {
+        let faults = if major {
+            &self.major_faults
+        } else {
+            &self.minor_faults
+        };
+        faults.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub fn count_switch(&self, voluntary: bool) {
+        let switches = if voluntary {
+            &self.voluntary_switches
+        } else {
+            &self.involuntary_switches
+        };
+        switches.fetch_add(1, Ordering::Relaxed);
+    }
+
+    pub fn count_sectors(&self, write: bool, sectors: usize) {
+        let counter = if write {
+            &self.out_sectors
+        } else {
+            &self.in_sectors
+        };
+        counter.fetch_add(sectors as u64, Ordering::Relaxed);
+    }
+
+    pub fn count_bytes(&self, write: bool, bytes: usize) {
+        let counter = if write {
+            &self.write_bytes
+        } else {
+            &self.read_bytes
+        };
+        counter.fetch_add(bytes as u64, Ordering::Relaxed);
+    }
+
+    /// Records that `pages` pages are mapped, raising the maximum if needed.
+    pub fn record_rss(&self, pages: usize) {
+        self.max_rss_pages
+            .fetch_max(pages as u64, Ordering::Relaxed);
+    }
+
+    /// Returns the sectors read from the device so far.
+    pub fn in_sectors(&self) -> u64 {
+        self.in_sectors.load(Ordering::Relaxed)
+    }
+
+    pub fn snapshot(&self) -> UsageSnapshot {
+        UsageSnapshot {
+            user_ticks: self.user_ticks.load(Ordering::Relaxed),
+            system_ticks: self.system_ticks.load(Ordering::Relaxed),
+            minor_faults: self.minor_faults.load(Ordering::Relaxed),
+            major_faults: self.major_faults.load(Ordering::Relaxed),
+            voluntary_switches: self.voluntary_switches.load(Ordering::Relaxed),
+            involuntary_switches: self.involuntary_switches.load(Ordering::Relaxed),
+            in_sectors: self.in_sectors.load(Ordering::Relaxed),
+            out_sectors: self.out_sectors.load(Ordering::Relaxed),
+            read_bytes: self.read_bytes.load(Ordering::Relaxed),
+            write_bytes: self.write_bytes.load(Ordering::Relaxed),
+            max_rss_pages: self.max_rss_pages.load(Ordering::Relaxed),
+        }
+    }
+
+    /// Adds the counts of `usage`, as of a reaped child. The maximum resident
+    /// size becomes the larger of the two, as for Linux.
+    pub fn add(&self, usage: &UsageSnapshot) {
+        let add = |counter: &AtomicU64, value: u64| {
+            counter.fetch_add(value, Ordering::Relaxed);
+        };
+        add(&self.user_ticks, usage.user_ticks);
+        add(&self.system_ticks, usage.system_ticks);
+        add(&self.minor_faults, usage.minor_faults);
+        add(&self.major_faults, usage.major_faults);
+        add(&self.voluntary_switches, usage.voluntary_switches);
+        add(&self.involuntary_switches, usage.involuntary_switches);
+        add(&self.in_sectors, usage.in_sectors);
+        add(&self.out_sectors, usage.out_sectors);
+        add(&self.read_bytes, usage.read_bytes);
+        add(&self.write_bytes, usage.write_bytes);
+        self.max_rss_pages
+            .fetch_max(usage.max_rss_pages, Ordering::Relaxed);
+    }
+}
+
+/// Returns the usage counters of the user thread the current task runs, if
+/// it runs one.
+pub fn current_usage() -> Option<Arc<ResourceUsage>> {
+    let task = Task::current()?;
+    thread_of(&task).map(|thread| thread.usage().clone())
+}
+
+/// Accounts the scheduler's update of `task`, the current task of a run
+/// queue. A tick charges CPU time, blocking is a voluntary switch, and a tick
+/// or yield that makes the scheduler pick another task an involuntary one.
+pub fn account_update(task: &Task, flags: UpdateFlags, should_pick_next: bool) {
+    let Some(thread) = thread_of(task) else {
+        return;
+    };
+    let usage = thread.usage();
+    match flags {
+        UpdateFlags::Tick => {
+            usage.count_tick(thread.is_in_user());
+            if should_pick_next {
+                usage.count_switch(false);
+            }
+        }
+        UpdateFlags::Wait => usage.count_switch(true),
+        UpdateFlags::Yield => usage.count_switch(false),
+    }
+}
+
+fn thread_of(task: &Task) -> Option<&Arc<Thread>> {
+    task.data().downcast_ref::<Arc<Thread>>()
+}
@@ -21,11 +21,21 @@ impl ProcessStatus {
         ProcessStatus(AtomicU64::new(Status::Uninit as u64))
     }
 
-    pub fn exit(&self, exit_code: u32) {
-        let status = self.get_status();
-        assert!(status == Status::Runnable);
+    /// Makes the process a zombie with `exit_code`, and returns whether it was
+    /// runnable rather than a zombie already.
+    pub fn exit(&self, exit_code: u32) -> bool {
         let value = (Status::Zombie as u64) | ((exit_code as u64) << 32);
-        self.0.store(value, Ordering::SeqCst);
+        let exited = self
+            .0
+            .compare_exchange(
+                Status::Runnable as u64,
+                value,
+                Ordering::SeqCst,
+                Ordering::SeqCst,
+            )
+            .is_ok();
+        debug_assert!(exited || self.get_status() == Status::Zombie);
+        exited
     }
 
     pub fn exit_code(&self) -> Option<u32> {
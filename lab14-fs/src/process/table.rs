@@ -0,0 +1,49 @@
+//! The table of live processes, by pid.
+//!
+//! The table is split into shards by pid, so that forks and reaps on different
+//! CPUs rarely take the same lock, and lookups only take it for reading.
+
+use alloc::{collections::btree_map::BTreeMap, sync::Arc, vec::Vec};
+use ostd::sync::RwLock;
+
+use super::{Pid, Process};
+
+const SHARDS: usize = 16;
+
+pub(super) struct ProcessTable {
+    shards: [RwLock<BTreeMap<Pid, Arc<Process>>>; SHARDS],
+}
+
+impl ProcessTable {
+    pub const fn new() -> Self {
+        Self {
+            shards: [const { RwLock::new(BTreeMap::new()) }; SHARDS],
+        }
+    }
+
+    pub fn insert(&self, process: Arc<Process>) {
+        self.shard(process.pid())
+            .write()
+            .insert(process.pid(), process);
+    }
+
+    pub fn remove(&self, pid: Pid) -> Option<Arc<Process>> {
+        self.shard(pid).write().remove(&pid)
+    }
+
+    pub fn get(&self, pid: Pid) -> Option<Arc<Process>> {
+        self.shard(pid).read().get(&pid).cloned()
+    }
+
+    pub fn all(&self) -> Vec<Arc<Process>> {
+        self.shards
+            .iter()
+            .flat_map(|shard| shard.read().values().cloned().collect::<Vec<_>>())
+            .collect()
+    }
+
+    fn shard(&self, pid: Pid) -> &RwLock<BTreeMap<Pid, Arc<Process>>> {
+        // Pids are dense, so the live ones spread evenly.
+        &self.shards[pid % SHARDS]
+    }
+}
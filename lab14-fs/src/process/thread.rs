@@ -0,0 +1,159 @@
+//! The threads of a process.
+//!
+//! Each thread is a task whose data is its [`Thread`]. The threads of a
+//! process share its memory space and file table, and the first one's tid is
+//! the pid.
+
+use core::sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering};
+
+use alloc::{
+    boxed::Box,
+    sync::{Arc, Weak},
+};
+use ostd::{cpu::CpuId, mm::Vaddr, sync::SpinLock, task::Task};
+
+use crate::sched::CpuMask;
+
+use super::{
+    Pid, Process, free_pid,
+    futex::{FUTEX_BITSET_MATCH_ANY, futex_wake},
+    rusage::ResourceUsage,
+};
+
+pub type Tid = Pid;
+
+pub struct Thread {
+    tid: Tid,
+    process: Weak<Process>,
+    /// Whether the tid was allocated for this thread, rather than being the
+    /// pid, which the process owns.
+    owns_tid: bool,
+    /// Where to write 0 when the thread exits, as for `CLONE_CHILD_CLEARTID`
+    /// and `set_tid_address`, or 0 for nowhere.
+    clear_child_tid: AtomicUsize,
+    exited: AtomicBool,
+    /// The process's resource usage, reachable without the process.
+    usage: Arc<ResourceUsage>,
+    /// Whether the thread runs in user mode, for ticks to charge user time.
+    in_user: AtomicBool,
+    /// The buffer paths are copied from user space into, while no syscall of
+    /// the thread holds it, see [`crate::syscall::user::read_user_path`].
+    path_buf: SpinLock<Option<Box<[u8]>>>,
+    /// The CPUs the thread may run on, see [`crate::sched::CpuMask`].
+    cpu_mask: AtomicU64,
+}
+
+impl Thread {
+    /// Creates the main thread of `process`.
+    pub(super) fn new_main(process: &Arc<Process>) -> Self {
+        Self::new(process.pid(), process, false)
+    }
+
+    /// Creates a thread of `process`, allowed on the CPUs the creating thread
+    /// is allowed on, if any.
+    pub(super) fn new(tid: Tid, process: &Arc<Process>, owns_tid: bool) -> Self {
+        let cpu_mask = Task::current()
+            .and_then(|task| {
+                task.data()
+                    .downcast_ref::<Arc<Thread>>()
+                    .map(|thread| thread.cpu_mask())
+            })
+            .unwrap_or(CpuMask::ALL);
+        Self {
+            tid,
+            process: Arc::downgrade(process),
+            owns_tid,
+            clear_child_tid: AtomicUsize::new(0),
+            exited: AtomicBool::new(false),
+            usage: process.usage().clone(),
+            in_user: AtomicBool::new(false),
+            path_buf: SpinLock::new(None),
+            cpu_mask: AtomicU64::new(cpu_mask.bits()),
+        }
+    }
+
+    pub fn tid(&self) -> Tid {
+        self.tid
+    }
+
+    pub fn process(&self) -> Option<Arc<Process>> {
+        self.process.upgrade()
+    }
+
+    pub fn set_clear_child_tid(&self, addr: Vaddr) {
+        self.clear_child_tid.store(addr, Ordering::Relaxed);
+    }
+
+    pub fn usage(&self) -> &Arc<ResourceUsage> {
+        &self.usage
+    }
+
+    pub fn is_in_user(&self) -> bool {
+        self.in_user.load(Ordering::Relaxed)
+    }
+
+    pub(super) fn set_in_user(&self, in_user: bool) {
+        self.in_user.store(in_user, Ordering::Relaxed);
+    }
+
+    pub fn cpu_mask(&self) -> CpuMask {
+        CpuMask::from_bits(self.cpu_mask.load(Ordering::Relaxed))
+    }
+
+    /// Sets the CPUs the thread may run on. It leaves any other CPU the next
+    /// time it enters the kernel, see [`crate::sched::leave_disallowed_cpu`].
+    pub fn set_cpu_mask(&self, mask: CpuMask) {
+        self.cpu_mask.store(mask.bits(), Ordering::Relaxed);
+    }
+
+    pub fn may_run_on(&self, cpu: CpuId) -> bool {
+        self.cpu_mask().contains(cpu)
+    }
+
+    pub fn take_path_buf(&self) -> Option<Box<[u8]>> {
+        self.path_buf.lock().take()
+    }
+
+    pub fn put_path_buf(&self, buf: Box<[u8]>) {
+        *self.path_buf.lock() = Some(buf);
+    }
+
+    pub fn has_exited(&self) -> bool {
+        self.exited.load(Ordering::Acquire)
+    }
+
+    /// Marks the thread exited and clears the tid word it was given, waking a
+    /// thread joining it.
+    pub(super) fn exit(&self, process: &Arc<Process>) {
+        self.exited.store(true, Ordering::Release);
+        let addr = self.clear_child_tid.swap(0, Ordering::Relaxed);
+        if addr != 0 {
+            // Nothing to report to if the word is gone.
+            let memory_space = process.memory_space();
+            let _ = memory_space
+                .vm_space()
+                .writer(addr, size_of::<u32>())
+                .and_then(|mut writer| writer.write_val(&0u32));
+            // Joiners wait on it as a shared futex.
+            let _ = futex_wake(process, addr, 1, FUTEX_BITSET_MATCH_ANY, false);
+        }
+    }
+}
+
+impl Drop for Thread {
+    fn drop(&mut self) {
+        if self.owns_tid {
+            free_pid(self.tid);
+        }
+    }
+}
+
+/// Returns the thread running on the current task.
+pub fn current_thread() -> Arc<Thread> {
+    Task::current()
+        .unwrap()
+        .data()
+        .downcast_ref::<Arc<Thread>>()
+        .unwrap()
+        .clone()
+}
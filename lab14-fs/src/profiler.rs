@@ -0,0 +1,232 @@
+//! A sampling profiler, built with the `profiler` feature.
+//!
+//! Every `profile.period=<ticks>` timer ticks (1 by default), each CPU takes a
+//! sample of what it was running:
+//!
+//! - in the kernel, the interrupted PC, as walking a kernel stack would need
+//!   unsafe reads of it;
+//! - in user space, the PC and a frame-pointer walk of the user stack, taken
+//!   when the task returns to the kernel for the tick. Programs must be built
+//!   with `-fno-omit-frame-pointer` for more than the PC.
+//!
+//! Identical stacks are counted together in a table per CPU, and
+//! `/proc/profile` folds them all into the format FlameGraph reads, with
+//! addresses in place of symbols. The report is also printed on reboot, for
+//! `profile_fold.py` to pick from the QEMU log and symbolize.
+
+use core::{
+    fmt::Write,
+    sync::atomic::{AtomicBool, AtomicU64, AtomicUsize, Ordering},
+};
+
+use alloc::{boxed::Box, collections::btree_map::BTreeMap, string::String, vec, vec::Vec};
+use log::warn;
+use ostd::{
+    arch::cpu::context::UserContext,
+    cpu::{PinCurrentCpu, all_cpus},
+    mm::MAX_USERSPACE_VADDR,
+    sync::SpinLock,
+    task::disable_preempt,
+    user::UserContextApi,
+};
+use riscv::register::{sepc, sstatus};
+use spin::Once;
+
+use crate::{kcmd_option, process::Process};
+
+/// The deepest stack recorded, in frames.
+const MAX_DEPTH: usize = 32;
+
+/// The number of distinct stacks each CPU tells apart. Samples of stacks
+/// beyond it are only counted as dropped.
+const TABLE_SLOTS: usize = 1024;
+
+#[derive(Clone, Copy)]
+struct StackSlot {
+    /// The pid for a user stack, or 0 for a kernel one.
+    pid: usize,
+    depth: usize,
+    /// From the sampled PC outwards.
+    frames: [usize; MAX_DEPTH],
+    count: u64,
+}
+
+impl StackSlot {
+    const EMPTY: Self = Self {
+        pid: 0,
+        depth: 0,
+        frames: [0; MAX_DEPTH],
+        count: 0,
+    };
+
+    fn matches(&self, pid: usize, frames: &[usize]) -> bool {
+        self.pid == pid && &self.frames[..self.depth] == frames
+    }
+}
+
+struct CpuProfile {
+    /// An open-addressing hash table of stacks. Filled from the timer
+    /// interrupt, so always locked with IRQs disabled.
+    slots: SpinLock<Box<[StackSlot]>>,
+    dropped: AtomicU64,
+    /// Ticks since the last sample.
+    ticks: AtomicUsize,
+    /// Set when a tick interrupted user space, for the task to take the
+    /// sample once it is back in the kernel.
+    user_sample_pending: AtomicBool,
+}
+
+static PROFILES: Once<Box<[CpuProfile]>> = Once::new();
+static PERIOD_TICKS: Once<usize> = Once::new();
+
+pub fn init() {
+    let period = match kcmd_option("profile.period=").map(str::parse::<usize>) {
+        None => 1,
+        Some(Ok(ticks)) if ticks > 0 => ticks,
+        Some(_) => {
+            warn!("Invalid profiling period, sampling every tick");
+            1
+        }
+    };
+    PERIOD_TICKS.call_once(|| period);
+    PROFILES.call_once(|| {
+        all_cpus()
+            .map(|_| CpuProfile {
+                slots: SpinLock::new(vec![StackSlot::EMPTY; TABLE_SLOTS].into_boxed_slice()),
+                dropped: AtomicU64::new(0),
+                ticks: AtomicUsize::new(0),
+                user_sample_pending: AtomicBool::new(false),
+            })
+            .collect()
+    });
+    ostd::timer::register_callback(on_tick);
+}
+
+fn on_tick() {
+    let Some(profiles) = PROFILES.get() else {
+        return;
+    };
+    let guard = disable_preempt();
+    let profile = &profiles[guard.current_cpu().as_usize()];
+
+    let ticks = profile.ticks.load(Ordering::Relaxed) + 1;
+    if ticks < *PERIOD_TICKS.get().unwrap() {
+        profile.ticks.store(ticks, Ordering::Relaxed);
+        return;
+    }
+    profile.ticks.store(0, Ordering::Relaxed);
+
+    if sstatus::read().spp() == sstatus::SPP::User {
+        profile.user_sample_pending.store(true, Ordering::Relaxed);
+    } else {
+        record(profile, 0, &[sepc::read()]);
+    }
+}
+
+/// Takes the sample of the user stack asked for by the last tick, if any.
+/// Called when user space returns to the kernel for an interrupt.
+pub fn sample_user(process: &Process, user_context: &UserContext) {
+    let Some(profiles) = PROFILES.get() else {
+        return;
+    };
+    let guard = disable_preempt();
+    let profile = &profiles[guard.current_cpu().as_usize()];
+    if !profile.user_sample_pending.swap(false, Ordering::Relaxed) {
+        return;
+    }
+
+    let mut frames = [0; MAX_DEPTH];
+    frames[0] = user_context.instruction_pointer();
+    let mut depth = 1;
+
+    // Below the frame pointer are the return address and the caller's frame
+    // pointer.
+    let memory_space = process.memory_space();
+    let mut fp = user_context.fp();
+    while depth < MAX_DEPTH && fp % 8 == 0 && (16..=MAX_USERSPACE_VADDR).contains(&fp) {
+        let Ok(mut reader) = memory_space.vm_space().reader(fp - 16, 16) else {
+            break;
+        };
+        let (Ok(prev_fp), Ok(ra)) = (reader.read_val::<usize>(), reader.read_val::<usize>()) else {
+            break;
+        };
+        if ra == 0 {
+            break;
+        }
+        frames[depth] = ra;
+        depth += 1;
+        // Stacks grow down, so callers' frames are higher.
+        if prev_fp <= fp {
+            break;
+        }
+        fp = prev_fp;
+    }
+
+    record(profile, process.pid(), &frames[..depth]);
+}
+
+fn record(profile: &CpuProfile, pid: usize, frames: &[usize]) {
+    let hash = frames
+        .iter()
+        .fold(pid as u64 ^ 0xcbf2_9ce4_8422_2325, |hash, &frame| {
+            (hash ^ frame as u64).wrapping_mul(0x0000_0100_0000_01b3)
+        });
+
+    let mut slots = profile.slots.disable_irq().lock();
+    for probe in 0..TABLE_SLOTS {
+        let slot = &mut slots[(hash as usize + probe) % TABLE_SLOTS];
+        if slot.count == 0 {
+            slot.pid = pid;
+            slot.depth = frames.len();
+            slot.frames[..frames.len()].copy_from_slice(frames);
+        } else if !slot.matches(pid, frames) {
+            continue;
+        }
+        slot.count += 1;
+        return;
+    }
+    profile.dropped.fetch_add(1, Ordering::Relaxed);
+}
+
+/// Renders the samples of all CPUs as folded stacks, from the outermost frame
+/// to the sampled PC, one stack per line followed by its count.
+pub fn report() -> String {
+    let Some(profiles) = PROFILES.get() else {
+        return String::new();
+    };
+
+    let mut folded: BTreeMap<String, u64> = BTreeMap::new();
+    let mut dropped = 0;
+    for profile in profiles.iter() {
+        dropped += profile.dropped.load(Ordering::Relaxed);
+        // Copy the stacks out, so the lock is not held while formatting.
+        let stacks: Vec<StackSlot> = profile
+            .slots
+            .disable_irq()
+            .lock()
+            .iter()
+            .filter(|slot| slot.count > 0)
+            .copied()
+            .collect();
+        for slot in stacks {
+            let mut key = if slot.pid == 0 {
+                String::from("kernel")
+            } else {
+                alloc::format!("pid {}", slot.pid)
+            };
+            for frame in slot.frames[..slot.depth].iter().rev() {
+                let _ = write!(key, ";{:#x}", frame);
+            }
+            *folded.entry(key).or_default() += slot.count;
+        }
+    }
+
+    let mut out = String::new();
+    for (stack, count) in folded {
+        let _ = writeln!(out, "{} {}", stack, count);
+    }
+    if dropped > 0 {
+        let _ = writeln!(out, "[dropped] {}", dropped);
+    }
+    out
+}
@@ -0,0 +1,74 @@
+//! A decoder of the LZ4 block format, which `pack_progs.py` compresses the
+//! built-in programs with.
+//!
+//! A block is a run of sequences, each a token, literals to copy, and a match
+//! to copy from the output so far: a 16-bit offset back and a length of at
+//! least 4. The token holds both lengths in its nibbles, and a nibble of 15
+//! continues in the bytes that follow, up to the first one that is not 255.
+//! The last sequence has literals only.
+
+use alloc::vec::Vec;
+
+use crate::error::{Errno, Error, Result};
+
+const MIN_MATCH: usize = 4;
+
+/// Decompresses `input` into the `len` bytes that it must hold.
+pub fn decompress(input: &[u8], len: usize) -> Result<Vec<u8>> {
+    let corrupt = || Error::new(Errno::ENOEXEC);
+    let mut output = Vec::with_capacity(len);
+    let mut pos = 0;
+    loop {
+        let token = *input.get(pos).ok_or_else(corrupt)?;
+        pos += 1;
+
+        let literals_len = read_len(input, &mut pos, (token >> 4) as usize)?;
+        let literals = input.get(pos..pos + literals_len).ok_or_else(corrupt)?;
+        if output.len() + literals_len > len {
+            return Err(corrupt());
+        }
+        output.extend_from_slice(literals);
+        pos += literals_len;
+        if pos == input.len() {
+            break;
+        }
+
+        let offset = input.get(pos..pos + 2).ok_or_else(corrupt)?;
+        let offset = u16::from_le_bytes([offset[0], offset[1]]) as usize;
+        pos += 2;
+        let match_len = read_len(input, &mut pos, (token & 0xf) as usize)? + MIN_MATCH;
+        if offset == 0 || offset > output.len() || output.len() + match_len > len {
+            return Err(corrupt());
+        }
+        let start = output.len() - offset;
+        if offset >= match_len {
+            output.extend_from_within(start..start + match_len);
+        } else {
+            // The match overlaps what it appends, as for a repeated byte.
+            for i in start..start + match_len {
+                output.push(output[i]);
+            }
+        }
+    }
+
+    if output.len() != len {
+        return Err(corrupt());
+    }
+    Ok(output)
+}
+
+/// Reads a length whose nibble in the token is `nibble`.
+fn read_len(input: &[u8], pos: &mut usize, nibble: usize) -> Result<usize> {
+    let mut len = nibble;
+    if nibble == 15 {
+        loop {
+            let byte = *input.get(*pos).ok_or(Error::new(Errno::ENOEXEC))?;
+            *pos += 1;
+            len += byte as usize;
+            if byte != 255 {
+                break;
+            }
+        }
+    }
+    Ok(len)
+}
@@ -1,20 +1,166 @@
-use crate::error::{Errno, Error, Result};
-use alloc::collections::btree_map::BTreeMap;
+//! The user programs built into the kernel.
+//!
+//! `pack_progs.py` packs the programs of `user/` into one archive, which the
+//! kernel embeds. The archive starts with a header, then the index of the
+//! programs by name, then the table of the stored programs, and then their
+//! data. Programs with the same content are stored once, and a stored program
+//! is compressed with LZ4 unless that makes it no smaller, see [`lz4`].
+//!
+//! [`init`] only reads the index. A stored program is decompressed on its
+//! first lookup into frames that stay cached, which the ELF loader maps into
+//! processes as they are, see [`crate::process::Program`].
+
+use alloc::{collections::btree_map::BTreeMap, vec::Vec};
+use ostd::mm::{Frame, PAGE_SIZE, VmIo};
 use spin::Once;
 
-mod progs;
+use crate::{
+    error::{Errno, Error, Result},
+    mm::reclaim,
+};
+
+mod lz4;
+
+static ARCHIVE: &[u8] =
+    include_bytes_aligned::include_bytes_aligned!(32, "../../target/user_prog/progs.pack");
+
+const MAGIC: &[u8; 4] = b"TPAK";
+const VERSION: u32 = 1;
+const HEADER_SIZE: usize = 16;
+const NAME_LEN: usize = 32;
+const PROGRAM_ENTRY_SIZE: usize = NAME_LEN + 8;
+const BLOB_ENTRY_SIZE: usize = 16;
+
+static USER_PROGS: Once<UserProgs> = Once::new();
+
+struct UserProgs {
+    /// The index of each program's stored program in `blobs`, by name.
+    names: BTreeMap<&'static str, usize>,
+    blobs: Vec<BuiltinProgram>,
+}
+
+/// A program stored in the archive, under one or more names.
+pub struct BuiltinProgram {
+    /// The stored data, which is compressed unless its length is `len`.
+    packed: &'static [u8],
+    len: usize,
+    /// The program, decompressed once, or `None` if it is corrupt.
+    frames: Once<Option<Vec<Frame<()>>>>,
+}
+
+impl BuiltinProgram {
+    pub fn len(&self) -> usize {
+        self.len
+    }
+
+    /// Returns the frame holding the `index`-th page of the program. The
+    /// bytes past the end of the program in the last frame are zero.
+    pub fn frame(&self, index: usize) -> Option<&Frame<()>> {
+        self.frames().get(index)
+    }
+
+    /// Copies the bytes of the program at `offset` into `buf`.
+    pub fn read_bytes(&self, offset: usize, buf: &mut [u8]) -> Result<()> {
+        if offset
+            .checked_add(buf.len())
+            .is_none_or(|end| end > self.len)
+        {
+            return Err(Error::new(Errno::EINVAL));
+        }
+        let mut done = 0;
+        while done < buf.len() {
+            let pos = offset + done;
+            let len = (PAGE_SIZE - pos % PAGE_SIZE).min(buf.len() - done);
+            self.frames()[pos / PAGE_SIZE]
+                .read_bytes(pos % PAGE_SIZE, &mut buf[done..done + len])
+                .unwrap();
+            done += len;
+        }
+        Ok(())
+    }
 
-pub static USER_PROGS: Once<BTreeMap<&str, &'static [u8]>> = Once::new();
+    fn frames(&self) -> &[Frame<()>] {
+        self.frames
+            .call_once(|| self.decompress().ok())
+            .as_deref()
+            .unwrap_or(&[])
+    }
+
+    fn decompress(&self) -> Result<Vec<Frame<()>>> {
+        let data = if self.packed.len() == self.len {
+            None
+        } else {
+            Some(lz4::decompress(self.packed, self.len)?)
+        };
+        let data = data.as_deref().unwrap_or(self.packed);
+        Ok(reclaim::alloc_segment(self.len.div_ceil(PAGE_SIZE))
+            .zip(data.chunks(PAGE_SIZE))
+            .map(|(frame, chunk)| {
+                frame.write_bytes(0, chunk).unwrap();
+                frame
+            })
+            .collect())
+    }
+}
 
+/// Reads the index of the archive.
 pub fn init() {
-    progs::init();
+    USER_PROGS.call_once(|| parse_archive(ARCHIVE).expect("corrupt program archive"));
 }
 
-pub fn lookup_progs(prog_name: &str) -> Result<&'static [u8]> {
-    USER_PROGS
-        .get()
-        .unwrap()
+/// Returns the built-in program named `prog_name`, decompressing it on its
+/// first lookup.
+pub fn lookup_progs(prog_name: &str) -> Result<&'static BuiltinProgram> {
+    let user_progs = USER_PROGS.get().unwrap();
+    let blob = *user_progs
+        .names
         .get(prog_name)
-        .ok_or(Error::new(Errno::ENOENT))
-        .copied()
+        .ok_or(Error::new(Errno::ENOENT))?;
+    let program = &user_progs.blobs[blob];
+    if program.len > 0 && program.frames().is_empty() {
+        return Err(Error::new(Errno::ENOEXEC));
+    }
+    Ok(program)
+}
+
+fn parse_archive(archive: &'static [u8]) -> Result<UserProgs> {
+    let corrupt = || Error::new(Errno::ENOEXEC);
+    let read_u32 = |offset: usize| -> Result<usize> {
+        let bytes = archive.get(offset..offset + 4).ok_or_else(corrupt)?;
+        Ok(u32::from_le_bytes(bytes.try_into().unwrap()) as usize)
+    };
+    if archive.get(..MAGIC.len()) != Some(MAGIC) || read_u32(4)? != VERSION as usize {
+        return Err(corrupt());
+    }
+    let num_programs = read_u32(8)?;
+    let num_blobs = read_u32(12)?;
+    let blobs_start = HEADER_SIZE + num_programs * PROGRAM_ENTRY_SIZE;
+
+    let blobs = (0..num_blobs)
+        .map(|index| {
+            let entry = blobs_start + index * BLOB_ENTRY_SIZE;
+            let (offset, packed_len) = (read_u32(entry)?, read_u32(entry + 4)?);
+            Ok(BuiltinProgram {
+                packed: archive
+                    .get(offset..offset + packed_len)
+                    .ok_or_else(corrupt)?,
+                len: read_u32(entry + 8)?,
+                frames: Once::new(),
+            })
+        })
+        .collect::<Result<Vec<_>>>()?;
+
+    let mut names = BTreeMap::new();
+    for index in 0..num_programs {
+        let entry = HEADER_SIZE + index * PROGRAM_ENTRY_SIZE;
+        let name = archive.get(entry..entry + NAME_LEN).ok_or_else(corrupt)?;
+        let name_len = name.iter().position(|&byte| byte == 0).unwrap_or(NAME_LEN);
+        let name = core::str::from_utf8(&name[..name_len]).map_err(|_| corrupt())?;
+        let blob = read_u32(entry + NAME_LEN)?;
+        if blob >= blobs.len() {
+            return Err(corrupt());
+        }
+        names.insert(name, blob);
+    }
+    Ok(UserProgs { names, blobs })
 }
@@ -0,0 +1,204 @@
+//! A weighted fair scheduler, in the style of CFS and EEVDF.
+//!
+//! Each task accumulates virtual runtime at a rate inversely proportional to
+//! the weight of its nice value, and the task with the least virtual runtime
+//! runs next. Tasks that slept come back near the front instead of being
+//! charged for the time they did not use, so interactive tasks stay
+//! responsive next to CPU-bound ones.
+
+use alloc::{collections::btree_map::BTreeMap, sync::Arc};
+use ostd::{
+    cpu::CpuId,
+    task::{
+        Task,
+        scheduler::{EnqueueFlags, LocalRunQueue, Scheduler, UpdateFlags},
+    },
+};
+
+use crate::{
+    process::{NICE_RANGE, Thread},
+    sched::{
+        is_allowed,
+        per_cpu::{PerCpuRunQueues, RunQueue},
+    },
+};
+
+/// The weight of nice 0.
+const NICE_0_WEIGHT: u64 = 1024;
+
+/// The weights of nice -20 to 19. Each step is about 1.25 times the next, so
+/// one nice level is about 10% of CPU time between two competing tasks.
+const NICE_TO_WEIGHT: [u64; 40] = [
+    88761, 71755, 56483, 46273, 36291, 29154, 23254, 18705, 14949, 11916, 9548, 7620, 6100, 4904,
+    3906, 3121, 2501, 1991, 1586, 1277, 1024, 820, 655, 526, 423, 335, 272, 215, 172, 137, 110, 87,
+    70, 56, 45, 36, 29, 23, 18, 15,
+];
+
+/// The virtual runtime a nice 0 task accumulates per tick.
+const TICK_VRUNTIME: u64 = 1024;
+
+pub struct FairScheduler {
+    run_queues: PerCpuRunQueues<FairRunQueue>,
+}
+
+impl FairScheduler {
+    /// The default number of ticks a task runs before a task with less
+    /// virtual runtime preempts it.
+    pub const DEFAULT_SLICE_TICKS: usize = 3;
+
+    pub fn new(slice_ticks: usize) -> Self {
+        Self {
+            run_queues: PerCpuRunQueues::new(|| FairRunQueue {
+                current: None,
+                entities: BTreeMap::new(),
+                min_vruntime: 0,
+                next_seq: 0,
+                slice_ticks: slice_ticks as u64,
+            }),
+        }
+    }
+}
+
+impl Scheduler for FairScheduler {
+    fn enqueue(&self, runnable: Arc<Task>, flags: EnqueueFlags) -> Option<CpuId> {
+        self.run_queues.enqueue(runnable, flags)
+    }
+
+    fn local_rq_with(&self, f: &mut dyn FnMut(&dyn LocalRunQueue<Task>)) {
+        self.run_queues.local_rq_with(f);
+    }
+
+    fn mut_local_rq_with(&self, f: &mut dyn FnMut(&mut dyn LocalRunQueue<Task>)) {
+        self.run_queues.mut_local_rq_with(f);
+    }
+}
+
+struct FairRunQueue {
+    current: Option<Entity>,
+    /// The waiting tasks, ordered by virtual runtime and then by arrival.
+    entities: BTreeMap<(u64, u64), Entity>,
+    /// Never decreases, and trails the least virtual runtime on this queue.
+    min_vruntime: u64,
+    /// Breaks ties between equal virtual runtimes in arrival order.
+    next_seq: u64,
+    slice_ticks: u64,
+}
+
+impl FairRunQueue {
+    fn insert(&mut self, entity: Entity) {
+        let seq = self.next_seq;
+        self.next_seq += 1;
+        self.entities.insert((entity.vruntime, seq), entity);
+    }
+
+    /// Returns how far behind the queue's minimum a woken task is placed, in
+    /// virtual runtime, so that it runs soon but cannot bank the time it slept.
+    fn wakeup_credit(&self) -> u64 {
+        self.slice_ticks * TICK_VRUNTIME / 2
+    }
+
+    fn update_min_vruntime(&mut self) {
+        let leftmost = self.entities.first_key_value().map(|(key, _)| key.0);
+        let current = self.current.as_ref().map(|entity| entity.vruntime);
+        let least = match (leftmost, current) {
+            (Some(leftmost), Some(current)) => leftmost.min(current),
+            (Some(vruntime), None) | (None, Some(vruntime)) => vruntime,
+            (None, None) => return,
+        };
+        self.min_vruntime = self.min_vruntime.max(least);
+    }
+}
+
+impl RunQueue for FairRunQueue {
+    fn len(&self) -> usize {
+        self.entities.len() + self.current.is_some() as usize
+    }
+
+    fn push(&mut self, task: Arc<Task>) {
+        // Virtual runtimes are only comparable within one queue, so a woken or
+        // stolen task starts from this queue's minimum.
+        let entity = Entity {
+            weight: task_weight(&task),
+            task,
+            vruntime: self.min_vruntime.saturating_sub(self.wakeup_credit()),
+            slice_ticks: 0,
+        };
+        self.insert(entity);
+    }
+
+    fn steal(&mut self, cpu: CpuId) -> Option<Arc<Task>> {
+        // The task that would run last here, of those that may run there.
+        let key = *self
+            .entities
+            .iter()
+            .rev()
+            .find(|(_, entity)| is_allowed(&entity.task, cpu))?
+            .0;
+        self.entities.remove(&key).map(|entity| entity.task)
+    }
+}
+
+impl LocalRunQueue for FairRunQueue {
+    fn current(&self) -> Option<&Arc<Task>> {
+        self.current.as_ref().map(|entity| &entity.task)
+    }
+
+    fn update_current(&mut self, flags: UpdateFlags) -> bool {
+        match flags {
+            UpdateFlags::Tick => {
+                let Some(entity) = self.current.as_mut() else {
+                    return false;
+                };
+                entity.vruntime += TICK_VRUNTIME * NICE_0_WEIGHT / entity.weight;
+                entity.slice_ticks += 1;
+                let (vruntime, slice_ticks) = (entity.vruntime, entity.slice_ticks);
+                self.update_min_vruntime();
+
+                slice_ticks >= self.slice_ticks
+                    && self
+                        .entities
+                        .first_key_value()
+                        .is_some_and(|(key, _)| key.0 < vruntime)
+            }
+            _ => true,
+        }
+    }
+
+    fn dequeue_current(&mut self) -> Option<Arc<Task>> {
+        let task = self.current.take()?.task;
+        task.schedule_info().cpu.set_to_none();
+        Some(task)
+    }
+
+    fn try_pick_next(&mut self) -> Option<&Arc<Task>> {
+        let (_, mut next) = self.entities.pop_first()?;
+        next.slice_ticks = 0;
+        if let Some(current) = self.current.replace(next) {
+            self.insert(current);
+        }
+        self.update_min_vruntime();
+
+        self.current.as_ref().map(|entity| &entity.task)
+    }
+}
+
+struct Entity {
+    task: Arc<Task>,
+    weight: u64,
+    vruntime: u64,
+    /// The ticks run since the task was last picked.
+    slice_ticks: u64,
+}
+
+/// Returns the weight of the nice value of the process `task` runs, or of nice
+/// 0 for kernel tasks.
+fn task_weight(task: &Task) -> u64 {
+    let Some(process) = task
+        .data()
+        .downcast_ref::<Arc<Thread>>()
+        .and_then(|thread| thread.process())
+    else {
+        return NICE_0_WEIGHT;
+    };
+    NICE_TO_WEIGHT[(process.nice() - NICE_RANGE.start()) as usize]
+}
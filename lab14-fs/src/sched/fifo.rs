@@ -1,44 +1,33 @@
 use alloc::{collections::VecDeque, sync::Arc};
 use ostd::{
     cpu::CpuId,
-    sync::SpinLock,
     task::{
-        Task, disable_preempt,
+        Task,
         scheduler::{EnqueueFlags, LocalRunQueue, Scheduler, UpdateFlags},
     },
 };
 
-use crate::process::Process;
+use crate::sched::{
+    is_allowed,
+    per_cpu::{PerCpuRunQueues, RunQueue},
+};
 
+#[derive(Default)]
 pub struct FifoScheduler {
-    run_queue: SpinLock<FifoRunQueue>,
+    run_queues: PerCpuRunQueues<FifoRunQueue>,
 }
 
 impl Scheduler for FifoScheduler {
-    fn enqueue(&self, runnable: Arc<Task>, _flags: EnqueueFlags) -> Option<CpuId> {
-        let mut run_queue = self.run_queue.disable_irq().lock();
-        run_queue.queue.push_back(runnable);
-        None
+    fn enqueue(&self, runnable: Arc<Task>, flags: EnqueueFlags) -> Option<CpuId> {
+        self.run_queues.enqueue(runnable, flags)
     }
 
     fn local_rq_with(&self, f: &mut dyn FnMut(&dyn LocalRunQueue<Task>)) {
-        let _guard = disable_preempt();
-        let local_rq: &FifoRunQueue = &self.run_queue.disable_irq().lock();
-        f(local_rq);
+        self.run_queues.local_rq_with(f);
     }
 
     fn mut_local_rq_with(&self, f: &mut dyn FnMut(&mut dyn LocalRunQueue<Task>)) {
-        let _guard = disable_preempt();
-        let local_rq: &mut FifoRunQueue = &mut self.run_queue.disable_irq().lock();
-        f(local_rq);
-    }
-}
-
-impl Default for FifoScheduler {
-    fn default() -> Self {
-        Self {
-            run_queue: SpinLock::new(FifoRunQueue::new()),
-        }
+        self.run_queues.mut_local_rq_with(f);
     }
 }
 
@@ -56,6 +45,27 @@ impl FifoRunQueue {
     }
 }
 
+impl Default for FifoRunQueue {
+    fn default() -> Self {
+        Self::new()
+    }
+}
+
+impl RunQueue for FifoRunQueue {
+    fn len(&self) -> usize {
+        self.queue.len() + self.current.is_some() as usize
+    }
+
+    fn push(&mut self, task: Arc<Task>) {
+        self.queue.push_back(task);
+    }
+
+    fn steal(&mut self, cpu: CpuId) -> Option<Arc<Task>> {
+        let index = self.queue.iter().rposition(|task| is_allowed(task, cpu))?;
+        self.queue.remove(index)
+    }
+}
+
 impl LocalRunQueue for FifoRunQueue {
     fn current(&self) -> Option<&Arc<Task>> {
         self.current.as_ref()
@@ -71,7 +81,9 @@ impl LocalRunQueue for FifoRunQueue {
     }
 
     fn dequeue_current(&mut self) -> Option<Arc<Task>> {
-        self.current.take()
+        self.current
+            .take()
+            .inspect(|task| task.schedule_info().cpu.set_to_none())
     }
 
     fn try_pick_next(&mut self) -> Option<&Arc<Task>> {
@@ -79,13 +91,6 @@ impl LocalRunQueue for FifoRunQueue {
             self.queue.push_back(current_task);
         }
 
-        // Activate the memory space of the current task
-        if let Some(ref current_task) = self.current {
-            if let Some(process) = current_task.data().downcast_ref::<Arc<Process>>() {
-                process.memory_space().vm_space().activate();
-            }
-        }
-
         self.current.as_ref()
     }
 }
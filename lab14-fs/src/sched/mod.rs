@@ -1,20 +1,172 @@
+mod fair;
 mod fifo;
+mod per_cpu;
 mod rr;
 
 use alloc::boxed::Box;
+use core::ops::BitAnd;
+use fair::FairScheduler;
 use fifo::FifoScheduler;
-use ostd::task::scheduler::inject_scheduler;
+use log::warn;
+use ostd::cpu::{CpuId, PinCurrentCpu, all_cpus};
+use ostd::task::{
+    Task, disable_preempt,
+    scheduler::{Scheduler, inject_scheduler},
+};
 use rr::RrScheduler;
+use spin::Once;
 
-const USE_RR_SCHEDULER: bool = false;
+use crate::{hrtimer, kcmd_option, process::Thread};
+
+pub use per_cpu::wake_affine;
+
+/// The scheduling setup chosen at boot from the kernel command line:
+///
+/// - `sched=fifo|rr|fair` picks the scheduler, fifo by default;
+/// - `sched.slice=<ticks>` sets the time slice of rr and fair;
+/// - `sched.preempt=on|off` turns preemption on timer ticks on or off.
+pub struct SchedConfig {
+    pub policy: SchedPolicy,
+    /// The time slice in ticks, or `None` for fifo, which has none.
+    pub slice_ticks: Option<usize>,
+    pub preempt: bool,
+}
+
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum SchedPolicy {
+    Fifo,
+    Rr,
+    Fair,
+}
+
+impl SchedPolicy {
+    pub fn name(self) -> &'static str {
+        match self {
+            SchedPolicy::Fifo => "fifo",
+            SchedPolicy::Rr => "rr",
+            SchedPolicy::Fair => "fair",
+        }
+    }
+}
+
+static CONFIG: Once<SchedConfig> = Once::new();
 
 pub fn init() {
-    if USE_RR_SCHEDULER {
-        let rr_scheduler = Box::new(RrScheduler::default());
-        inject_scheduler(Box::leak(rr_scheduler));
-    } else {
-        let fifo_scheduler = Box::new(FifoScheduler::default());
-        inject_scheduler(Box::leak(fifo_scheduler));
-    }
-    ostd::task::scheduler::enable_preemption_on_cpu();
+    let config = CONFIG.call_once(parse_config);
+    let scheduler: Box<dyn Scheduler> = match config.policy {
+        SchedPolicy::Fifo => Box::new(FifoScheduler::default()),
+        SchedPolicy::Rr => Box::new(RrScheduler::new(config.slice_ticks.unwrap())),
+        SchedPolicy::Fair => Box::new(FairScheduler::new(config.slice_ticks.unwrap())),
+    };
+    inject_scheduler(Box::leak(scheduler));
+    if config.preempt {
+        ostd::task::scheduler::enable_preemption_on_cpu();
+    }
+}
+
+/// Returns the scheduling setup, once [`init`] has run.
+pub fn config() -> &'static SchedConfig {
+    CONFIG.get().unwrap()
+}
+
+fn parse_config() -> SchedConfig {
+    let policy = match kcmd_option("sched=") {
+        None | Some("fifo") => SchedPolicy::Fifo,
+        Some("rr") => SchedPolicy::Rr,
+        Some("fair") => SchedPolicy::Fair,
+        Some(other) => {
+            warn!("Unknown scheduler {:?}, using fifo", other);
+            SchedPolicy::Fifo
+        }
+    };
+
+    let default_slice = match policy {
+        SchedPolicy::Fifo => None,
+        SchedPolicy::Rr => Some(RrScheduler::DEFAULT_SLICE_TICKS),
+        SchedPolicy::Fair => Some(FairScheduler::DEFAULT_SLICE_TICKS),
+    };
+    let slice_ticks =
+        default_slice.map(
+            |default| match kcmd_option("sched.slice=").map(str::parse::<usize>) {
+                None => default,
+                Some(Ok(ticks)) if ticks > 0 => ticks,
+                Some(_) => {
+                    warn!("Invalid time slice, using {} ticks", default);
+                    default
+                }
+            },
+        );
+
+    let preempt = match kcmd_option("sched.preempt=") {
+        None | Some("on") => true,
+        Some("off") => false,
+        Some(other) => {
+            warn!("Unknown preemption policy {:?}, preempting", other);
+            true
+        }
+    };
+
+    SchedConfig {
+        policy,
+        slice_ticks,
+        preempt,
+    }
+}
+
+/// The CPUs a thread may run on, as for `sched_setaffinity`: bit `i` stands
+/// for CPU `i`. Masks tell only the first 64 CPUs apart, and allow the rest.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub struct CpuMask(u64);
+
+impl CpuMask {
+    pub const ALL: Self = Self(u64::MAX);
+
+    pub const fn from_bits(bits: u64) -> Self {
+        Self(bits)
+    }
+
+    pub const fn bits(self) -> u64 {
+        self.0
+    }
+
+    /// Returns the mask of the CPUs of the machine.
+    pub fn online() -> Self {
+        Self(all_cpus().fold(0, |bits, cpu| bits | Self::bit(cpu)))
+    }
+
+    pub fn contains(self, cpu: CpuId) -> bool {
+        cpu.as_usize() >= u64::BITS as usize || self.0 & Self::bit(cpu) != 0
+    }
+
+    pub fn is_empty(self) -> bool {
+        self.0 == 0
+    }
+
+    fn bit(cpu: CpuId) -> u64 {
+        1u64.checked_shl(cpu.as_usize() as u32).unwrap_or(0)
+    }
+}
+
+impl BitAnd for CpuMask {
+    type Output = Self;
+
+    fn bitand(self, other: Self) -> Self {
+        Self(self.0 & other.0)
+    }
+}
+
+/// Returns whether `task` may run on `cpu`. Kernel tasks may run anywhere.
+pub fn is_allowed(task: &Task, cpu: CpuId) -> bool {
+    task.data()
+        .downcast_ref::<alloc::sync::Arc<Thread>>()
+        .is_none_or(|thread| thread.may_run_on(cpu))
+}
+
+/// Moves the current thread, `thread`, off this CPU if its mask no longer
+/// allows it. The thread sleeps until the next tick, and the wakeup queues it
+/// on a CPU it may run on.
+pub fn leave_disallowed_cpu(thread: &Thread) {
+    if !thread.may_run_on(disable_preempt().current_cpu()) {
+        hrtimer::sleep_tick();
+    }
 }
@@ -0,0 +1,255 @@
+//! Per-CPU run queues, shared by the schedulers.
+//!
+//! Each CPU schedules from a queue of its own, so CPUs only contend when a
+//! task is enqueued on another CPU or an idle CPU steals from a busy one.
+//!
+//! The scheduler's updates of the current task go through here too, which
+//! counts the context switches and accounts them and the ticks to the
+//! resource usage of user threads, see [`rusage`].
+//!
+//! A waker about to wait for the task it wakes, as a pipe writer for the
+//! reader's reply, can wake it with [`wake_affine`], which queues it on the
+//! waker's CPU rather than on the least loaded one. The pair then hands the
+//! CPU back and forth with warm caches. The task still queues as any woken
+//! task, as letting it run next would let such a pair starve the other tasks
+//! of the CPU for as long as it keeps waking each other.
+//!
+//! Tasks are only queued on, and stolen by, the CPUs their thread's mask
+//! allows, see [`super::CpuMask`].
+
+use core::sync::atomic::{AtomicBool, AtomicUsize, Ordering};
+
+use alloc::{boxed::Box, sync::Arc};
+use ostd::{
+    cpu::{CpuId, PinCurrentCpu, all_cpus},
+    cpu_local,
+    irq::disable_local,
+    sync::SpinLock,
+    task::{
+        Task, disable_preempt,
+        scheduler::{EnqueueFlags, LocalRunQueue, UpdateFlags},
+    },
+};
+
+use crate::{
+    process::rusage,
+    sched::is_allowed,
+    stats::{self, Stat},
+};
+
+/// A run queue of one CPU.
+pub trait RunQueue: LocalRunQueue<Task> + Send {
+    /// Returns the number of tasks on this queue, including the current one.
+    fn len(&self) -> usize;
+
+    /// Adds a runnable task.
+    fn push(&mut self, task: Arc<Task>);
+
+    /// Takes a task waiting to run that may run on `cpu`, for `cpu` to run
+    /// it.
+    fn steal(&mut self, cpu: CpuId) -> Option<Arc<Task>>;
+}
+
+cpu_local! {
+    /// Set while the tasks woken on this CPU are to be queued on it.
+    static WAKE_AFFINE: AtomicBool = AtomicBool::new(false);
+}
+
+/// Calls `wake`, and queues the first task it wakes on the current CPU, as the
+/// current task is about to wait for it.
+pub fn wake_affine<T>(wake: impl FnOnce() -> T) -> T {
+    // Keep interrupt handlers from waking a task in the meantime.
+    let guard = disable_local();
+    let hint = WAKE_AFFINE.get_with(&guard);
+    hint.store(true, Ordering::Relaxed);
+    let ret = wake();
+    hint.store(false, Ordering::Relaxed);
+    ret
+}
+
+/// Returns the current CPU if a task woken now is to be queued on it, only
+/// once per [`wake_affine`].
+fn take_wake_affine() -> Option<CpuId> {
+    let guard = disable_local();
+    WAKE_AFFINE
+        .get_with(&guard)
+        .swap(false, Ordering::Relaxed)
+        .then(|| guard.current_cpu())
+}
+
+pub struct PerCpuRunQueues<R> {
+    queues: Box<[CpuRunQueue<R>]>,
+}
+
+struct CpuRunQueue<R> {
+    queue: SpinLock<R>,
+    /// The length of `queue` when it was last unlocked, to pick CPUs without
+    /// locking every queue.
+    load: AtomicUsize,
+}
+
+impl<R: RunQueue> PerCpuRunQueues<R> {
+    pub fn new(new_queue: impl Fn() -> R) -> Self {
+        Self {
+            queues: all_cpus()
+                .map(|_| CpuRunQueue {
+                    queue: SpinLock::new(new_queue()),
+                    load: AtomicUsize::new(0),
+                })
+                .collect(),
+        }
+    }
+
+    /// Puts `task` on the run queue of a CPU, and returns the CPU to kick.
+    ///
+    /// The CPU recorded in the task's schedule info is the one whose queue
+    /// holds it, and is only cleared when the task stops being runnable. A
+    /// task woken before it was dequeued stays where it is.
+    pub fn enqueue(&self, task: Arc<Task>, flags: EnqueueFlags) -> Option<CpuId> {
+        let affine_cpu = (flags == EnqueueFlags::Wake)
+            .then(take_wake_affine)
+            .flatten()
+            .filter(|&cpu| is_allowed(&task, cpu));
+        let mut still_queued = false;
+        let target_cpu = {
+            let mut cpu = affine_cpu.unwrap_or_else(|| self.select_cpu(&task));
+            if let Err(task_cpu) = task.schedule_info().cpu.set_if_is_none(cpu) {
+                debug_assert_ne!(flags, EnqueueFlags::Spawn);
+                still_queued = true;
+                cpu = task_cpu;
+            }
+            cpu
+        };
+
+        let cpu_rq = &self.queues[target_cpu.as_usize()];
+        let mut queue = cpu_rq.queue.disable_irq().lock();
+        // The task may have left the queue before the lock was taken.
+        if still_queued && task.schedule_info().cpu.set_if_is_none(target_cpu).is_err() {
+            return None;
+        }
+        queue.push(task);
+        cpu_rq.load.store(queue.len(), Ordering::Relaxed);
+
+        Some(target_cpu)
+    }
+
+    pub fn local_rq_with(&self, f: &mut dyn FnMut(&dyn LocalRunQueue<Task>)) {
+        let guard = disable_preempt();
+        let queue = self.queues[guard.current_cpu().as_usize()]
+            .queue
+            .disable_irq()
+            .lock();
+        f(&*queue);
+    }
+
+    pub fn mut_local_rq_with(&self, f: &mut dyn FnMut(&mut dyn LocalRunQueue<Task>)) {
+        let guard = disable_preempt();
+        let cpu = guard.current_cpu();
+        let cpu_rq = &self.queues[cpu.as_usize()];
+
+        if cpu_rq.load.load(Ordering::Relaxed) == 0 {
+            self.steal_for(cpu);
+        }
+
+        let mut queue = cpu_rq.queue.disable_irq().lock();
+        f(&mut AccountingRunQueue(&mut *queue));
+        cpu_rq.load.store(queue.len(), Ordering::Relaxed);
+    }
+
+    /// Returns the least loaded CPU `task` may run on, preferring the current
+    /// one, whose caches are warm with what the waker just touched.
+    ///
+    /// Falls back to the current CPU if the mask allows none, which a mask
+    /// made of online CPUs only never does.
+    fn select_cpu(&self, task: &Task) -> CpuId {
+        let current_cpu = disable_preempt().current_cpu();
+        let mut selected = current_cpu;
+        let mut min_load = if is_allowed(task, current_cpu) {
+            self.queues[current_cpu.as_usize()]
+                .load
+                .load(Ordering::Relaxed)
+        } else {
+            usize::MAX
+        };
+        for cpu in all_cpus().filter(|&cpu| is_allowed(task, cpu)) {
+            let load = self.queues[cpu.as_usize()].load.load(Ordering::Relaxed);
+            if load < min_load {
+                selected = cpu;
+                min_load = load;
+            }
+        }
+        selected
+    }
+
+    /// Moves a waiting task from the busiest CPU to the idle `cpu`.
+    fn steal_for(&self, cpu: CpuId) {
+        let Some((victim, load)) = all_cpus()
+            .filter(|&other| other != cpu)
+            .map(|other| {
+                (
+                    other,
+                    self.queues[other.as_usize()].load.load(Ordering::Relaxed),
+                )
+            })
+            .max_by_key(|&(_, load)| load)
+        else {
+            return;
+        };
+        // Leave a CPU its only task.
+        if load < 2 {
+            return;
+        }
+
+        let victim_rq = &self.queues[victim.as_usize()];
+        let task = {
+            let mut queue = victim_rq.queue.disable_irq().lock();
+            let Some(task) = queue.steal(cpu) else {
+                return;
+            };
+            // Set before the victim's queue is unlocked, so a racing enqueue
+            // of the task goes to its new queue.
+            task.schedule_info().cpu.set_anyway(cpu);
+            victim_rq.load.store(queue.len(), Ordering::Relaxed);
+            task
+        };
+
+        let cpu_rq = &self.queues[cpu.as_usize()];
+        let mut queue = cpu_rq.queue.disable_irq().lock();
+        queue.push(task);
+        cpu_rq.load.store(queue.len(), Ordering::Relaxed);
+    }
+}
+
+/// Forwards to a run queue, accounting the updates of its current task.
+struct AccountingRunQueue<'a, R>(&'a mut R);
+
+impl<R: RunQueue> LocalRunQueue<Task> for AccountingRunQueue<'_, R> {
+    fn current(&self) -> Option<&Arc<Task>> {
+        self.0.current()
+    }
+
+    fn update_current(&mut self, flags: UpdateFlags) -> bool {
+        let should_pick_next = self.0.update_current(flags);
+        if should_pick_next || matches!(flags, UpdateFlags::Wait) {
+            stats::inc(Stat::ContextSwitches);
+        }
+        if let Some(current) = self.0.current() {
+            rusage::account_update(current, flags, should_pick_next);
+        }
+        should_pick_next
+    }
+
+    fn try_pick_next(&mut self) -> Option<&Arc<Task>> {
+        self.0.try_pick_next()
+    }
+
+    fn dequeue_current(&mut self) -> Option<Arc<Task>> {
+        self.0.dequeue_current()
+    }
+}
+
+impl<R: RunQueue + Default> Default for PerCpuRunQueues<R> {
+    fn default() -> Self {
+        Self::new(R::default)
+    }
+}
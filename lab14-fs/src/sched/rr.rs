@@ -1,54 +1,75 @@
 use alloc::{collections::vec_deque::VecDeque, sync::Arc};
 use ostd::{
     cpu::CpuId,
-    sync::SpinLock,
     task::{
-        Task, disable_preempt,
+        Task,
         scheduler::{EnqueueFlags, LocalRunQueue, Scheduler},
     },
 };
 
-use crate::process::Process;
+use crate::sched::{
+    is_allowed,
+    per_cpu::{PerCpuRunQueues, RunQueue},
+};
 
 pub struct RrScheduler {
-    run_queue: SpinLock<RrRunQueue>,
+    run_queues: PerCpuRunQueues<RrRunQueue>,
+}
+
+impl RrScheduler {
+    /// The default time slice, in ticks.
+    pub const DEFAULT_SLICE_TICKS: usize = 100;
+
+    pub fn new(slice_ticks: usize) -> Self {
+        Self {
+            run_queues: PerCpuRunQueues::new(|| RrRunQueue {
+                current: None,
+                entities: VecDeque::new(),
+                slice_ticks,
+            }),
+        }
+    }
 }
 
 impl Scheduler for RrScheduler {
-    fn enqueue(&self, runnable: Arc<Task>, _flags: EnqueueFlags) -> Option<CpuId> {
-        let mut run_queue = self.run_queue.disable_irq().lock();
-        run_queue.entities.push_back(Entity {
-            task: runnable,
-            time_slice: TimeSlice::default(),
-        });
-        None
+    fn enqueue(&self, runnable: Arc<Task>, flags: EnqueueFlags) -> Option<CpuId> {
+        self.run_queues.enqueue(runnable, flags)
     }
 
     fn local_rq_with(&self, f: &mut dyn FnMut(&dyn LocalRunQueue<Task>)) {
-        let _guard = disable_preempt();
-        let rq = self.run_queue.disable_irq().lock();
-        f(&*rq)
+        self.run_queues.local_rq_with(f);
     }
 
     fn mut_local_rq_with(&self, f: &mut dyn FnMut(&mut dyn LocalRunQueue<Task>)) {
-        let _guard = disable_preempt();
-        let mut rq = self.run_queue.disable_irq().lock();
-        f(&mut *rq)
-    }
-}
-
-impl Default for RrScheduler {
-    fn default() -> Self {
-        Self {
-            run_queue: SpinLock::new(RrRunQueue::default()),
-        }
+        self.run_queues.mut_local_rq_with(f);
     }
 }
 
-#[derive(Default)]
 struct RrRunQueue {
     current: Option<Entity>,
     entities: VecDeque<Entity>,
+    slice_ticks: usize,
+}
+
+impl RunQueue for RrRunQueue {
+    fn len(&self) -> usize {
+        self.entities.len() + self.current.is_some() as usize
+    }
+
+    fn push(&mut self, task: Arc<Task>) {
+        self.entities.push_back(Entity {
+            task,
+            time_slice: TimeSlice::default(),
+        });
+    }
+
+    fn steal(&mut self, cpu: CpuId) -> Option<Arc<Task>> {
+        let index = self
+            .entities
+            .iter()
+            .rposition(|entity| is_allowed(&entity.task, cpu))?;
+        self.entities.remove(index).map(|entity| entity.task)
+    }
 }
 
 impl LocalRunQueue for RrRunQueue {
@@ -62,14 +83,16 @@ impl LocalRunQueue for RrRunQueue {
                 let Some(entity) = self.current.as_mut() else {
                     return false;
                 };
-                entity.time_slice.elapse() & !self.entities.is_empty()
+                entity.time_slice.elapse(self.slice_ticks) & !self.entities.is_empty()
             }
             _ => true,
         }
     }
 
     fn dequeue_current(&mut self) -> Option<Arc<Task>> {
-        self.current.take().map(|entity| entity.task)
+        let task = self.current.take()?.task;
+        task.schedule_info().cpu.set_to_none();
+        Some(task)
     }
 
     fn try_pick_next(&mut self) -> Option<&Arc<Task>> {
@@ -77,13 +100,6 @@ impl LocalRunQueue for RrRunQueue {
             self.entities.push_back(current_task);
         }
 
-        // Activate the memory space of the current task
-        if let Some(ref current_task) = self.current {
-            if let Some(process) = current_task.task.data().downcast_ref::<Arc<Process>>() {
-                process.memory_space().vm_space().activate();
-            }
-        }
-
         self.current.as_ref().map(|entity| &entity.task)
     }
 }
@@ -99,10 +115,9 @@ struct TimeSlice {
 }
 
 impl TimeSlice {
-    const PROCESS_TIME_SLICE: usize = 100;
-
-    fn elapse(&mut self) -> bool {
-        self.tick = (self.tick + 1) % Self::PROCESS_TIME_SLICE;
+    /// Counts a tick, and returns whether a slice of `slice_ticks` is used up.
+    fn elapse(&mut self, slice_ticks: usize) -> bool {
+        self.tick = (self.tick + 1) % slice_ticks;
 
         self.tick == 0
     }
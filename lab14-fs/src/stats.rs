@@ -0,0 +1,110 @@
+//! Kernel-wide event counters, kept per CPU and summed when read.
+//!
+//! Each CPU counts in its own CPU-local block, so counting is an uncontended
+//! atomic add on a cache line no other CPU writes. Reads sum the blocks of
+//! all CPUs, and may miss the adds racing with them.
+//!
+//! `/proc/stat` shows the totals and each CPU's share of them.
+
+use core::{
+    fmt::Write,
+    sync::atomic::{AtomicU64, Ordering},
+};
+
+use alloc::string::String;
+use ostd::{cpu::all_cpus, cpu_local, task::disable_preempt};
+
+/// A counted event.
+#[derive(Debug, Clone, Copy, PartialEq, Eq)]
+pub enum Stat {
+    ContextSwitches,
+    MinorFaults,
+    MajorFaults,
+    Syscalls,
+    BlockRequests,
+    BlockBytes,
+    PageCacheHits,
+    PageCacheMisses,
+    BlockCacheHits,
+    BlockCacheMisses,
+    PipeBytes,
+    SwapIns,
+    SwapOuts,
+}
+
+const NR_STATS: usize = Stat::SwapOuts as usize + 1;
+
+/// The names of the stats in `/proc/stat`, indexed by [`Stat`].
+const NAMES: [&str; NR_STATS] = [
+    "ctxt",
+    "pgfault",
+    "pgmajfault",
+    "syscalls",
+    "blk_requests",
+    "blk_bytes",
+    "pagecache_hits",
+    "pagecache_misses",
+    "blockcache_hits",
+    "blockcache_misses",
+    "pipe_bytes",
+    "pswpin",
+    "pswpout",
+];
+
+/// The counters of one CPU, on a cache line of their own.
+#[repr(align(64))]
+struct CpuStats([AtomicU64; NR_STATS]);
+
+cpu_local! {
+    static CPU_STATS: CpuStats = CpuStats([const { AtomicU64::new(0) }; NR_STATS]);
+}
+
+/// Adds `count` to `stat` on the current CPU.
+pub fn add(stat: Stat, count: u64) {
+    let guard = disable_preempt();
+    CPU_STATS.get_with(&guard).0[stat as usize].fetch_add(count, Ordering::Relaxed);
+}
+
+/// Counts one `stat` event on the current CPU.
+pub fn inc(stat: Stat) {
+    add(stat, 1);
+}
+
+/// The totals of all CPUs at one point, indexed by [`Stat`].
+pub struct Snapshot([u64; NR_STATS]);
+
+impl Snapshot {
+    pub fn get(&self, stat: Stat) -> u64 {
+        self.0[stat as usize]
+    }
+}
+
+/// Returns the totals of all CPUs.
+pub fn snapshot() -> Snapshot {
+    let mut totals = [0; NR_STATS];
+    for cpu in all_cpus() {
+        let stats = CPU_STATS.get_on_cpu(cpu);
+        for (total, counter) in totals.iter_mut().zip(&stats.0) {
+            *total += counter.load(Ordering::Relaxed);
+        }
+    }
+    Snapshot(totals)
+}
+
+/// Returns the counters in the format of `/proc/stat`: a `name total` line
+/// per stat, then a `cpuN` line per CPU with its counts in the same order.
+pub fn report() -> String {
+    let mut out = String::new();
+    let totals = snapshot();
+    for (name, total) in NAMES.iter().zip(totals.0) {
+        writeln!(out, "{} {}", name, total).unwrap();
+    }
+    for cpu in all_cpus() {
+        write!(out, "cpu{}", cpu.as_usize()).unwrap();
+        for counter in &CPU_STATS.get_on_cpu(cpu).0 {
+            write!(out, " {}", counter.load(Ordering::Relaxed)).unwrap();
+        }
+        out.push('\n');
+    }
+    out
+}
@@ -0,0 +1,98 @@
+use alloc::sync::Arc;
+use log::debug;
+use ostd::{cpu::PinCurrentCpu, mm::Vaddr, task::disable_preempt};
+
+use crate::error::{Errno, Error, Result};
+use crate::process::{Process, Thread, Tid, current_thread, find_process};
+use crate::sched::CpuMask;
+use crate::syscall::SyscallReturn;
+use crate::syscall::user::{user_reader, write_val_to_user};
+
+/// The size of the masks, for the first 64 CPUs, see [`CpuMask`].
+const MASK_SIZE: usize = size_of::<u64>();
+
+pub fn sys_sched_setaffinity(
+    tid: Tid,
+    len: usize,
+    mask_addr: Vaddr,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!(
+        "[SYS_SCHED_SETAFFINITY] tid: {}, len: {}, mask_addr: {:#x}",
+        tid, len, mask_addr
+    );
+
+    // Bits past the 64th are for CPUs that are always allowed.
+    let mut bytes = [0u8; MASK_SIZE];
+    let len = len.min(MASK_SIZE);
+    let memory_space = current_process.memory_space();
+    let mut reader = user_reader(memory_space.vm_space(), mask_addr, len)?;
+    for byte in &mut bytes[..len] {
+        *byte = reader.read_val().map_err(|_| Error::new(Errno::EFAULT))?;
+    }
+    let mask = CpuMask::from_bits(u64::from_le_bytes(bytes)) & CpuMask::online();
+    if mask.is_empty() {
+        return Err(Error::new(Errno::EINVAL));
+    }
+
+    target_thread(tid, current_process)?.set_cpu_mask(mask);
+    Ok(SyscallReturn(0))
+}
+
+pub fn sys_sched_getaffinity(
+    tid: Tid,
+    len: usize,
+    mask_addr: Vaddr,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!(
+        "[SYS_SCHED_GETAFFINITY] tid: {}, len: {}, mask_addr: {:#x}",
+        tid, len, mask_addr
+    );
+
+    if len < MASK_SIZE || len % MASK_SIZE != 0 {
+        return Err(Error::new(Errno::EINVAL));
+    }
+    let mask = target_thread(tid, current_process)?.cpu_mask() & CpuMask::online();
+    write_val_to_user(
+        current_process.memory_space().vm_space(),
+        mask_addr,
+        &mask.bits().to_le(),
+    )?;
+    // The raw syscall returns the size of the mask it wrote.
+    Ok(SyscallReturn(MASK_SIZE as isize))
+}
+
+/// `getcpu`, which `sched_getcpu` wraps. There is one NUMA node.
+pub fn sys_getcpu(
+    cpu_addr: Vaddr,
+    node_addr: Vaddr,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!(
+        "[SYS_GETCPU] cpu_addr: {:#x}, node_addr: {:#x}",
+        cpu_addr, node_addr
+    );
+
+    let cpu = disable_preempt().current_cpu().as_usize() as u32;
+    let memory_space = current_process.memory_space();
+    if cpu_addr != 0 {
+        write_val_to_user(memory_space.vm_space(), cpu_addr, &cpu)?;
+    }
+    if node_addr != 0 {
+        write_val_to_user(memory_space.vm_space(), node_addr, &0u32)?;
+    }
+    Ok(SyscallReturn(0))
+}
+
+/// Returns the thread with `tid`, the calling one for 0, looking in the
+/// calling process first.
+fn target_thread(tid: Tid, current_process: &Arc<Process>) -> Result<Arc<Thread>> {
+    if tid == 0 {
+        return Ok(current_thread());
+    }
+    current_process
+        .thread(tid)
+        .or_else(|| find_process(tid)?.thread(tid))
+        .ok_or(Error::new(Errno::ESRCH))
+}
@@ -2,11 +2,23 @@ use alloc::sync::Arc;
 use log::debug;
 use ostd::arch::cpu::context::UserContext;
 use ostd::mm::Vaddr;
+use ostd::user::UserContextApi;
 
-use crate::error::Result;
+use crate::error::{Errno, Error, Result};
 use crate::process::Process;
 use crate::syscall::SyscallReturn;
 
+const CLONE_VM: u64 = 0x100;
+const CLONE_FS: u64 = 0x200;
+const CLONE_FILES: u64 = 0x400;
+const CLONE_SIGHAND: u64 = 0x800;
+const CLONE_VFORK: u64 = 0x4000;
+const CLONE_THREAD: u64 = 0x10000;
+const CLONE_SETTLS: u64 = 0x80000;
+const CLONE_PARENT_SETTID: u64 = 0x100000;
+const CLONE_CHILD_CLEARTID: u64 = 0x200000;
+const CLONE_CHILD_SETTID: u64 = 0x1000000;
+
 pub fn sys_clone(
     clone_flags: u64,
     child_stack: u64,
@@ -21,9 +33,82 @@ pub fn sys_clone(
         clone_flags, child_stack, parent_tidptr, tls, child_tidptr
     );
 
-    let child_process = current_process.fork(&user_context);
+    let mut child_context = user_context.clone();
+    if child_stack != 0 {
+        child_context.set_stack_pointer(child_stack as _);
+    }
+    if clone_flags & CLONE_SETTLS != 0 {
+        child_context.set_tls_pointer(tls as _);
+    }
+
+    if clone_flags & CLONE_THREAD != 0 {
+        return clone_thread(
+            clone_flags,
+            parent_tidptr,
+            child_tidptr,
+            current_process,
+            &child_context,
+        );
+    }
+
+    // The threads of a process share its file table, but separate processes
+    // cannot share one.
+    if clone_flags & CLONE_FILES != 0 {
+        return Err(Error::new(Errno::EINVAL));
+    }
+
+    let child_process = if clone_flags & CLONE_VM != 0 && clone_flags & CLONE_VFORK != 0 {
+        current_process.vfork(&child_context)?
+    } else {
+        current_process.fork(&child_context, clone_flags & CLONE_VFORK != 0)?
+    };
 
     child_process.run();
 
+    if clone_flags & CLONE_VFORK != 0 {
+        child_process.wait_vfork_done();
+    }
+
     Ok(SyscallReturn(child_process.pid() as _))
 }
+
+/// Creates a thread sharing the memory space and files of this process, as
+/// `pthread_create` does.
+fn clone_thread(
+    clone_flags: u64,
+    parent_tidptr: Vaddr,
+    child_tidptr: Vaddr,
+    current_process: &Arc<Process>,
+    child_context: &UserContext,
+) -> Result<SyscallReturn> {
+    // Threads share everything a process has, so these must come together.
+    const SHARED: u64 = CLONE_VM | CLONE_FS | CLONE_FILES | CLONE_SIGHAND;
+    if clone_flags & SHARED != SHARED {
+        return Err(Error::new(Errno::EINVAL));
+    }
+
+    let thread = current_process.spawn_thread(child_context)?;
+    let tid = thread.tid() as u32;
+
+    // As on Linux, the tid words are written on a best-effort basis.
+    let memory_space = current_process.memory_space();
+    let write_tid = |addr: Vaddr| {
+        let _ = memory_space
+            .vm_space()
+            .writer(addr, size_of::<u32>())
+            .and_then(|mut writer| writer.write_val(&tid));
+    };
+    if clone_flags & CLONE_PARENT_SETTID != 0 {
+        write_tid(parent_tidptr);
+    }
+    // The child shares the memory space, so its tid word is written here too.
+    if clone_flags & CLONE_CHILD_SETTID != 0 {
+        write_tid(child_tidptr);
+    }
+    if clone_flags & CLONE_CHILD_CLEARTID != 0 {
+        thread.set_clear_child_tid(child_tidptr);
+    }
+
+    current_process.run_thread(thread.tid());
+    Ok(SyscallReturn(tid as _))
+}
@@ -0,0 +1,19 @@
+use alloc::sync::Arc;
+use log::debug;
+
+use crate::error::{Errno, Error, Result};
+use crate::fs::file_table::FileDescriptor;
+use crate::process::Process;
+use crate::syscall::SyscallReturn;
+
+pub fn sys_close(fd: FileDescriptor, current_process: &Arc<Process>) -> Result<SyscallReturn> {
+    debug!("[SYS_CLOSE] fd: {}", fd);
+
+    // The file is released once no other descriptor refers to it, which is
+    // how the last close of a pipe end is noticed by the other end.
+    current_process
+        .file_table_mut()
+        .close(fd)
+        .ok_or(Error::new(Errno::EBADF))?;
+    Ok(SyscallReturn(0))
+}
@@ -0,0 +1,108 @@
+use core::time::Duration;
+
+use alloc::sync::Arc;
+use log::debug;
+use ostd::mm::Vaddr;
+
+use super::SyscallReturn;
+use crate::clock::monotonic_time;
+use crate::error::{Errno, Error, Result};
+use crate::fs::epoll::{EpollEvent, EpollFile};
+use crate::fs::file_table::FileEntry;
+use crate::process::Process;
+
+const EPOLL_CLOEXEC: u32 = 0x80000;
+
+const EPOLL_CTL_ADD: i32 = 1;
+const EPOLL_CTL_DEL: i32 = 2;
+const EPOLL_CTL_MOD: i32 = 3;
+
+/// Creates an epoll instance. Nothing is ever exec'd with fds open, so
+/// `EPOLL_CLOEXEC` changes nothing.
+pub fn sys_epoll_create1(flags: u32, current_process: &Arc<Process>) -> Result<SyscallReturn> {
+    debug!("[SYS_EPOLL_CREATE1] flags: {:#x}", flags);
+
+    if flags & !EPOLL_CLOEXEC != 0 {
+        return Err(Error::new(Errno::EINVAL));
+    }
+    let fd = current_process
+        .file_table_mut()
+        .insert(FileEntry::new(Arc::new(EpollFile::new())));
+    Ok(SyscallReturn(fd as _))
+}
+
+pub fn sys_epoll_ctl(
+    epfd: i32,
+    op: i32,
+    fd: i32,
+    event_addr: Vaddr,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!(
+        "[SYS_EPOLL_CTL] epfd: {}, op: {}, fd: {}, event_addr: {:#x}",
+        epfd, op, fd, event_addr
+    );
+
+    let epoll_file = current_process.file(epfd)?;
+    let file = current_process.file(fd)?;
+    let epoll = epoll_file.as_epoll().ok_or(Error::new(Errno::EINVAL))?;
+    if fd == epfd {
+        return Err(Error::new(Errno::EINVAL));
+    }
+
+    match op {
+        EPOLL_CTL_ADD => epoll.add(fd, &file, read_event(current_process, event_addr)?)?,
+        EPOLL_CTL_MOD => epoll.modify(fd, &file, read_event(current_process, event_addr)?)?,
+        EPOLL_CTL_DEL => epoll.remove(fd)?,
+        _ => return Err(Error::new(Errno::EINVAL)),
+    }
+    Ok(SyscallReturn(0))
+}
+
+/// Waits for the files watched by `epfd`, for up to `timeout` milliseconds, or
+/// without a limit if it is negative.
+///
+/// There are no signals to block, so `sigmask` is ignored.
+pub fn sys_epoll_pwait(
+    epfd: i32,
+    events_addr: Vaddr,
+    max_events: i32,
+    timeout: i32,
+    _sigmask_addr: Vaddr,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!(
+        "[SYS_EPOLL_PWAIT] epfd: {}, events_addr: {:#x}, max_events: {}, timeout: {}",
+        epfd, events_addr, max_events, timeout
+    );
+
+    if max_events <= 0 {
+        return Err(Error::new(Errno::EINVAL));
+    }
+    let epoll_file = current_process.file(epfd)?;
+    let epoll = epoll_file.as_epoll().ok_or(Error::new(Errno::EINVAL))?;
+    let deadline = (timeout >= 0).then(|| monotonic_time() + Duration::from_millis(timeout as u64));
+
+    let events = epoll.wait(max_events as usize, deadline);
+
+    let memory_space = current_process.memory_space();
+    let mut writer = memory_space
+        .vm_space()
+        .writer(events_addr, events.len() * size_of::<EpollEvent>())
+        .map_err(|_| Error::new(Errno::EFAULT))?;
+    for event in &events {
+        writer
+            .write_val(event)
+            .map_err(|_| Error::new(Errno::EFAULT))?;
+    }
+    Ok(SyscallReturn(events.len() as _))
+}
+
+fn read_event(process: &Process, addr: Vaddr) -> Result<EpollEvent> {
+    process
+        .memory_space()
+        .vm_space()
+        .reader(addr, size_of::<EpollEvent>())
+        .and_then(|mut reader| reader.read_val())
+        .map_err(|_| Error::new(Errno::EFAULT))
+}
@@ -1,14 +1,14 @@
-use core::ffi::CStr;
-
 use alloc::sync::Arc;
-use alloc::vec;
 use log::{debug, info};
 use ostd::arch::cpu::context::UserContext;
-use ostd::mm::{FallibleVmRead, Vaddr, VmWriter};
+use ostd::mm::Vaddr;
 
-use crate::error::Result;
-use crate::process::Process;
+use crate::error::{Errno, Result};
+use crate::fs::InodeType;
+use crate::fs::util::PathString;
+use crate::process::{Process, Program};
 use crate::syscall::SyscallReturn;
+use crate::syscall::user::read_user_path;
 
 pub fn sys_execve(
     path: Vaddr, /* &[u8] */
@@ -23,32 +23,32 @@ pub fn sys_execve(
     );
 
     // We ignore the argv and envp for now.
-    // The max file name: 255 bytes + 1(\0)
-    const MAX_FILENAME_LENGTH: usize = 256;
-    let mut buffer = vec![0u8; MAX_FILENAME_LENGTH];
-    current_process
-        .memory_space()
-        .vm_space()
-        .reader(path, MAX_FILENAME_LENGTH)
-        .unwrap()
-        .read_fallible(&mut VmWriter::from(&mut buffer as &mut [u8]))
-        .unwrap();
-
-    let exec_name = CStr::from_bytes_until_nul(&buffer)
-        .unwrap()
-        .to_str()
-        .unwrap();
-
-    info!("[SYS_EXECVE] Execute program path: {}", exec_name);
-
-    let binary = crate::progs::lookup_progs(exec_name)?;
+    let exec_name = read_user_path(current_process.memory_space().vm_space(), path)?;
+
+    info!("[SYS_EXECVE] Execute program path: {}", &*exec_name);
+
+    let program = lookup_program(&exec_name)?;
 
     // Do exec:
-    // 1. Cleanup all the memory space, including heap
-    // 2. Change the user context to zero
-    // 3. Parse ELF and load program
+    // 1. Parse ELF, or find its cached image
+    // 2. Cleanup all the memory space, including heap
+    // 3. Change the user context to zero and load program
 
-    *user_context = current_process.exec(binary);
+    *user_context = current_process.exec(&program)?;
 
     Ok(SyscallReturn(0 as _))
 }
+
+/// Looks up `path` in the root file system, falling back to the programs built
+/// into the kernel.
+fn lookup_program(path: &str) -> Result<Program> {
+    if let Some(fs) = crate::fs::ROOT.get() {
+        match PathString::new(path).lookup(&fs.root_inode()) {
+            Ok(inode) if inode.typ() == InodeType::File => return Ok(Program::File(inode)),
+            Ok(_) => {}
+            Err(err) if err.code == Errno::ENOENT || err.code == Errno::ENOTDIR => {}
+            Err(err) => return Err(err),
+        }
+    }
+    Ok(Program::Builtin(crate::progs::lookup_progs(path)?))
+}
@@ -2,7 +2,7 @@ use alloc::sync::Arc;
 use log::debug;
 
 use crate::error::Result;
-use crate::process::Process;
+use crate::process::{Process, current_thread};
 use crate::syscall::SyscallReturn;
 
 pub fn sys_exit(exit_code: u32, current_process: &Arc<Process>) -> Result<SyscallReturn> {
@@ -14,7 +14,17 @@ pub fn sys_exit(exit_code: u32, current_process: &Arc<Process>) -> Result<Syscal
     if current_process.is_zombie() {
         debug!("[pid: {}] has already exited", current_process.pid());
     } else {
-        current_process.exit(exit_code);
+        current_process.exit_thread(&current_thread(), exit_code);
     }
     Ok(SyscallReturn(0))
 }
+
+pub fn sys_exit_group(exit_code: u32, current_process: &Arc<Process>) -> Result<SyscallReturn> {
+    debug!(
+        "[pid: {}] exit_group with code: {}",
+        current_process.pid(),
+        exit_code
+    );
+    current_process.exit_group(&current_thread(), exit_code);
+    Ok(SyscallReturn(0))
+}
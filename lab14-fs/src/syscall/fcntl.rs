@@ -0,0 +1,38 @@
+use alloc::sync::Arc;
+use log::debug;
+
+use crate::error::{Errno, Error, Result};
+use crate::fs::file_table::FileDescriptor;
+use crate::process::Process;
+use crate::syscall::SyscallReturn;
+
+const F_SETPIPE_SZ: u32 = 1031;
+const F_GETPIPE_SZ: u32 = 1032;
+
+pub fn sys_fcntl(
+    fd: FileDescriptor,
+    cmd: u32,
+    arg: usize,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!("[SYS_FCNTL] fd: {}, cmd: {}, arg: {:#x}", fd, cmd, arg);
+
+    let file = current_process.file(fd)?;
+
+    match cmd {
+        F_SETPIPE_SZ | F_GETPIPE_SZ => {
+            let pipe = file
+                .as_pipe_reader()
+                .map(|reader| reader.pipe())
+                .or_else(|| file.as_pipe_writer().map(|writer| writer.pipe()))
+                .ok_or(Error::new(Errno::EBADF))?;
+            let size = if cmd == F_SETPIPE_SZ {
+                pipe.set_capacity(arg)?
+            } else {
+                pipe.capacity()
+            };
+            Ok(SyscallReturn(size as _))
+        }
+        _ => Err(Error::new(Errno::EINVAL)),
+    }
+}
@@ -0,0 +1,93 @@
+use core::time::Duration;
+
+use alloc::sync::Arc;
+use log::debug;
+use ostd::mm::Vaddr;
+
+use crate::clock::monotonic_time;
+use crate::error::{Errno, Error, Result};
+use crate::process::Process;
+use crate::process::futex::{FUTEX_BITSET_MATCH_ANY, futex_requeue, futex_wait, futex_wake};
+use crate::syscall::SyscallReturn;
+use crate::syscall::nanosleep::read_timespec;
+
+const FUTEX_WAIT: u32 = 0;
+const FUTEX_WAKE: u32 = 1;
+const FUTEX_REQUEUE: u32 = 3;
+const FUTEX_CMP_REQUEUE: u32 = 4;
+const FUTEX_WAIT_BITSET: u32 = 9;
+const FUTEX_WAKE_BITSET: u32 = 10;
+
+const FUTEX_PRIVATE_FLAG: u32 = 128;
+const FUTEX_CLOCK_REALTIME: u32 = 256;
+
+pub fn sys_futex(
+    addr: Vaddr,
+    futex_op: u32,
+    val: u32,
+    timeout_or_val2: usize,
+    addr2: Vaddr,
+    val3: u32,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!(
+        "[SYS_FUTEX] addr: {:#x}, futex_op: {:#x}, val: {}, timeout_or_val2: {:#x}, addr2: {:#x}, val3: {:#x}",
+        addr, futex_op, val, timeout_or_val2, addr2, val3
+    );
+
+    let private = futex_op & FUTEX_PRIVATE_FLAG != 0;
+    let count = |val: u32| val.min(i32::MAX as u32) as usize;
+    let op = futex_op & !(FUTEX_PRIVATE_FLAG | FUTEX_CLOCK_REALTIME);
+    // The timeout of `FUTEX_WAIT` is relative, and that of `FUTEX_WAIT_BITSET`
+    // a deadline. With no wall clock, `CLOCK_REALTIME` counts from boot too.
+    let deadline = |relative: bool| -> Result<Option<Duration>> {
+        if timeout_or_val2 == 0 {
+            return Ok(None);
+        }
+        let timeout = read_timespec(current_process, timeout_or_val2)?;
+        Ok(Some(if relative {
+            monotonic_time() + timeout
+        } else {
+            timeout
+        }))
+    };
+    match op {
+        FUTEX_WAIT => futex_wait(
+            current_process,
+            addr,
+            val,
+            FUTEX_BITSET_MATCH_ANY,
+            deadline(true)?,
+            private,
+        )
+        .map(|_| SyscallReturn(0)),
+        FUTEX_WAIT_BITSET => {
+            futex_wait(current_process, addr, val, val3, deadline(false)?, private)
+                .map(|_| SyscallReturn(0))
+        }
+        FUTEX_WAKE => futex_wake(
+            current_process,
+            addr,
+            count(val),
+            FUTEX_BITSET_MATCH_ANY,
+            private,
+        )
+        .map(|woken| SyscallReturn(woken as _)),
+        FUTEX_WAKE_BITSET => futex_wake(current_process, addr, count(val), val3, private)
+            .map(|woken| SyscallReturn(woken as _)),
+        FUTEX_REQUEUE | FUTEX_CMP_REQUEUE => {
+            let expected = (op == FUTEX_CMP_REQUEUE).then_some(val3);
+            futex_requeue(
+                current_process,
+                addr,
+                count(val),
+                addr2,
+                count(timeout_or_val2 as u32),
+                expected,
+                private,
+            )
+            .map(|count| SyscallReturn(count as _))
+        }
+        _ => Err(Error::new(Errno::ENOSYS)),
+    }
+}
@@ -0,0 +1,85 @@
+use core::cell::{Cell, RefCell};
+
+use alloc::{sync::Arc, vec::Vec};
+use log::debug;
+use ostd::mm::{FallibleVmWrite, Vaddr, VmReader};
+
+use crate::error::{Errno, Error, Result};
+use crate::fs::{DirEntry, InodeType, file_table::FileDescriptor};
+use crate::process::Process;
+use crate::syscall::SyscallReturn;
+
+/// The length of a `struct linux_dirent64` before its name.
+const DIRENT64_HEADER_LEN: usize = 19;
+
+const DT_UNKNOWN: u8 = 0;
+const DT_DIR: u8 = 4;
+const DT_REG: u8 = 8;
+const DT_LNK: u8 = 10;
+
+/// Lists the entries of the directory `fd` from its file offset on, as many as
+/// fit in the buffer.
+///
+/// The records are built in one kernel buffer while the directory is walked,
+/// and copied out with one write, before the file offset moves past them.
+pub fn sys_getdents64(
+    fd: FileDescriptor,
+    user_buf_addr: Vaddr,
+    buf_len: usize,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!(
+        "[SYS_GETDENTS64] fd: {}, user_buf_addr: 0x{:x}, buf_len: {}",
+        fd, user_buf_addr, buf_len
+    );
+
+    let file = current_process.file(fd)?;
+    let records = RefCell::new(Vec::new());
+    let too_small = Cell::new(false);
+    let visit = &mut |entry: DirEntry| {
+        let mut records = records.borrow_mut();
+        let record_len = (DIRENT64_HEADER_LEN + entry.name.len() + 1).next_multiple_of(8);
+        if records.len() + record_len > buf_len {
+            too_small.set(records.is_empty());
+            return false;
+        }
+
+        let start = records.len();
+        records.extend_from_slice(&entry.ino.to_ne_bytes());
+        records.extend_from_slice(&(entry.next_offset as i64).to_ne_bytes());
+        records.extend_from_slice(&(record_len as u16).to_ne_bytes());
+        records.push(dirent_type(entry.type_));
+        records.extend_from_slice(entry.name);
+        records.resize(start + record_len, 0);
+        true
+    };
+    let finish = &mut || {
+        let records = records.borrow();
+        if records.is_empty() {
+            return Ok(());
+        }
+        current_process
+            .memory_space()
+            .vm_space()
+            .writer(user_buf_addr, records.len())
+            .map_err(|_| Error::new(Errno::EFAULT))?
+            .write_fallible(&mut VmReader::from(records.as_slice()))
+            .map_err(|_| Error::new(Errno::EFAULT))?;
+        Ok(())
+    };
+    file.read_dir(visit, finish)?;
+    if too_small.get() {
+        return Err(Error::new(Errno::EINVAL));
+    }
+    let len = records.into_inner().len();
+    Ok(SyscallReturn(len as _))
+}
+
+fn dirent_type(type_: Option<InodeType>) -> u8 {
+    match type_ {
+        Some(InodeType::File) => DT_REG,
+        Some(InodeType::Directory) => DT_DIR,
+        Some(InodeType::SymbolLink) => DT_LNK,
+        None => DT_UNKNOWN,
+    }
+}
@@ -0,0 +1,103 @@
+use alloc::sync::Arc;
+use log::debug;
+use ostd::{Pod, mm::PAGE_SIZE, mm::Vaddr, timer::TIMER_FREQ};
+
+use crate::error::{Errno, Error, Result};
+use crate::process::Process;
+use crate::process::rusage::UsageSnapshot;
+use crate::syscall::SyscallReturn;
+
+const RUSAGE_SELF: i32 = 0;
+const RUSAGE_CHILDREN: i32 = -1;
+const RUSAGE_THREAD: i32 = 1;
+
+#[derive(Debug, Default, Clone, Copy, Pod)]
+#[repr(C)]
+pub struct timeval_t {
+    pub sec: i64,
+    pub usec: i64,
+}
+
+impl timeval_t {
+    fn from_ticks(ticks: u64) -> Self {
+        Self {
+            sec: (ticks / TIMER_FREQ) as i64,
+            usec: (ticks % TIMER_FREQ * 1_000_000 / TIMER_FREQ) as i64,
+        }
+    }
+}
+
+/// The `struct rusage` of Linux. The fields it no longer fills stay 0.
+#[derive(Debug, Default, Clone, Copy, Pod)]
+#[repr(C)]
+pub struct rusage_t {
+    pub utime: timeval_t,
+    pub stime: timeval_t,
+    /// The maximum resident set size, in KiB.
+    pub maxrss: i64,
+    pub ixrss: i64,
+    pub idrss: i64,
+    pub isrss: i64,
+    pub minflt: i64,
+    pub majflt: i64,
+    pub nswap: i64,
+    pub inblock: i64,
+    pub oublock: i64,
+    pub msgsnd: i64,
+    pub msgrcv: i64,
+    pub nsignals: i64,
+    pub nvcsw: i64,
+    pub nivcsw: i64,
+}
+
+impl From<&UsageSnapshot> for rusage_t {
+    fn from(usage: &UsageSnapshot) -> Self {
+        Self {
+            utime: timeval_t::from_ticks(usage.user_ticks),
+            stime: timeval_t::from_ticks(usage.system_ticks),
+            maxrss: (usage.max_rss_pages * PAGE_SIZE as u64 / 1024) as i64,
+            minflt: usage.minor_faults as i64,
+            majflt: usage.major_faults as i64,
+            // Counted in 512-byte blocks, so in sectors.
+            inblock: usage.in_sectors as i64,
+            oublock: usage.out_sectors as i64,
+            nvcsw: usage.voluntary_switches as i64,
+            nivcsw: usage.involuntary_switches as i64,
+            ..Default::default()
+        }
+    }
+}
+
+/// Reports the resources used by the process or its reaped children.
+///
+/// Threads share their process's counters, so `RUSAGE_THREAD` reports the
+/// whole process.
+pub fn sys_getrusage(
+    who: i32,
+    usage_addr: Vaddr,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!(
+        "[SYS_GETRUSAGE] who: {}, usage_addr: {:#x}",
+        who, usage_addr
+    );
+
+    let usage = match who {
+        RUSAGE_SELF | RUSAGE_THREAD => current_process.usage().snapshot(),
+        RUSAGE_CHILDREN => current_process.children_usage().snapshot(),
+        _ => return Err(Error::new(Errno::EINVAL)),
+    };
+
+    write_rusage(current_process, usage_addr, &usage)?;
+    Ok(SyscallReturn(0))
+}
+
+/// Writes `usage` to user space as a `struct rusage` at `addr`.
+pub fn write_rusage(process: &Process, addr: Vaddr, usage: &UsageSnapshot) -> Result<()> {
+    process
+        .memory_space()
+        .vm_space()
+        .writer(addr, size_of::<rusage_t>())
+        .and_then(|mut writer| writer.write_val(&rusage_t::from(usage)))
+        .map_err(|_| Error::new(Errno::EFAULT))
+}
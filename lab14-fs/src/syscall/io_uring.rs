@@ -0,0 +1,179 @@
+use alloc::sync::Arc;
+use log::debug;
+use ostd::{Pod, mm::Vaddr};
+
+use super::SyscallReturn;
+use super::close::sys_close;
+use super::open::sys_openat;
+use super::read::{sys_pread64, sys_preadv, sys_read, sys_readv};
+use super::sync::sys_fsync;
+use super::write::{sys_pwrite64, sys_pwritev, sys_write, sys_writev};
+use crate::error::{Errno, Error, Result};
+use crate::fs::file_table::FileEntry;
+use crate::fs::io_uring::{CqRingOffsets, IoUring, SqRingOffsets, Sqe};
+use crate::process::Process;
+
+const IORING_SETUP_CQSIZE: u32 = 1 << 3;
+
+/// The rings and the CQEs are in one mapping.
+const IORING_FEAT_SINGLE_MMAP: u32 = 1 << 0;
+/// SQEs are copied when submitted, so they may be reused right after.
+const IORING_FEAT_SUBMIT_STABLE: u32 = 1 << 2;
+/// An offset of -1 reads or writes at the file offset.
+const IORING_FEAT_RW_CUR_POS: u32 = 1 << 3;
+
+const IORING_ENTER_GETEVENTS: u32 = 1 << 0;
+
+const IORING_OP_NOP: u8 = 0;
+const IORING_OP_READV: u8 = 1;
+const IORING_OP_WRITEV: u8 = 2;
+const IORING_OP_FSYNC: u8 = 3;
+const IORING_OP_OPENAT: u8 = 18;
+const IORING_OP_CLOSE: u8 = 19;
+const IORING_OP_READ: u8 = 22;
+const IORING_OP_WRITE: u8 = 23;
+
+/// The `struct io_uring_params` of Linux.
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy, Pod)]
+struct IoUringParams {
+    sq_entries: u32,
+    cq_entries: u32,
+    flags: u32,
+    sq_thread_cpu: u32,
+    sq_thread_idle: u32,
+    features: u32,
+    wq_fd: u32,
+    resv: [u32; 3],
+    sq_off: SqRingOffsets,
+    cq_off: CqRingOffsets,
+}
+
+/// Makes rings of at least `entries` SQEs, and fills in the params at
+/// `params_addr` with their sizes and layout.
+///
+/// Only `IORING_SETUP_CQSIZE` is supported. The kernel has no task of its
+/// own to poll the SQ with, as it can only reach the buffers of a process
+/// from the process, so `IORING_SETUP_SQPOLL` is not.
+pub fn sys_io_uring_setup(
+    entries: u32,
+    params_addr: Vaddr,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    let memory_space = current_process.memory_space();
+    let vm_space = memory_space.vm_space();
+    let mut params: IoUringParams = vm_space
+        .reader(params_addr, size_of::<IoUringParams>())
+        .and_then(|mut reader| reader.read_val())
+        .map_err(|_| Error::new(Errno::EFAULT))?;
+    debug!(
+        "[SYS_IO_URING_SETUP] entries: {}, flags: {:#x}",
+        entries, params.flags
+    );
+
+    if params.flags & !IORING_SETUP_CQSIZE != 0 {
+        return Err(Error::new(Errno::EINVAL));
+    }
+    let cq_entries = (params.flags & IORING_SETUP_CQSIZE != 0).then_some(params.cq_entries);
+    let ring = IoUring::new(entries, cq_entries)?;
+
+    params.sq_entries = ring.sq_entries();
+    params.cq_entries = ring.cq_entries();
+    params.features = IORING_FEAT_SINGLE_MMAP | IORING_FEAT_SUBMIT_STABLE | IORING_FEAT_RW_CUR_POS;
+    params.sq_off = ring.sq_offsets();
+    params.cq_off = ring.cq_offsets();
+    vm_space
+        .writer(params_addr, size_of::<IoUringParams>())
+        .and_then(|mut writer| writer.write_val(&params))
+        .map_err(|_| Error::new(Errno::EFAULT))?;
+
+    let fd = current_process
+        .file_table_mut()
+        .insert(FileEntry::new(Arc::new(ring)));
+    Ok(SyscallReturn(fd as _))
+}
+
+/// Submits up to `to_submit` SQEs and returns how many were taken.
+///
+/// Each SQE runs to completion before the next, so they complete in order,
+/// and its completion is posted by the time this returns; waiting for
+/// `min_complete` with `IORING_ENTER_GETEVENTS` never blocks. There are no
+/// signals to block, so the sigmask is ignored.
+pub fn sys_io_uring_enter(
+    fd: i32,
+    to_submit: u32,
+    min_complete: u32,
+    flags: u32,
+    _sig_addr: Vaddr,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!(
+        "[SYS_IO_URING_ENTER] fd: {}, to_submit: {}, min_complete: {}, flags: {:#x}",
+        fd, to_submit, min_complete, flags
+    );
+
+    if flags & !IORING_ENTER_GETEVENTS != 0 {
+        return Err(Error::new(Errno::EINVAL));
+    }
+    let file = current_process.file(fd)?;
+    let ring = file.as_io_uring().ok_or(Error::new(Errno::EOPNOTSUPP))?;
+
+    let submitted = ring.submit(to_submit, |sqes| {
+        start_read_ahead(sqes, current_process);
+        sqes.iter().map(|sqe| run(sqe, current_process)).collect()
+    })?;
+    Ok(SyscallReturn(submitted as _))
+}
+
+/// Starts fetching what the positioned reads of a batch read, so that the
+/// device takes the whole batch's requests together rather than one at a
+/// time as each read runs.
+fn start_read_ahead(sqes: &[Sqe], process: &Process) {
+    for sqe in sqes {
+        if sqe.opcode != IORING_OP_READ || sqe.off == u64::MAX {
+            continue;
+        }
+        let Some(inode) = process.file(sqe.fd).ok().and_then(|file| file.as_inode()) else {
+            continue;
+        };
+        let start = sqe.off as usize;
+        inode.read_ahead(start..start.saturating_add(sqe.len as usize));
+    }
+}
+
+/// Runs an SQE with the syscall it stands for, and returns its result as
+/// the CQE reports it.
+fn run(sqe: &Sqe, process: &Arc<Process>) -> i32 {
+    let fd = sqe.fd;
+    let addr = sqe.addr as Vaddr;
+    let len = sqe.len as usize;
+    // -1 is the file offset, see `IORING_FEAT_RW_CUR_POS`.
+    let at = (sqe.off != u64::MAX).then_some(sqe.off as isize);
+    let ret = match sqe.opcode {
+        IORING_OP_NOP => Ok(SyscallReturn(0)),
+        IORING_OP_READ => match at {
+            Some(offset) => sys_pread64(fd, addr, len, offset, process),
+            None => sys_read(fd, addr, len, process),
+        },
+        IORING_OP_WRITE => match at {
+            Some(offset) => sys_pwrite64(fd, addr, len, offset, process),
+            None => sys_write(fd, addr, len, process),
+        },
+        IORING_OP_READV => match at {
+            Some(offset) => sys_preadv(fd, addr, len, offset, process),
+            None => sys_readv(fd, addr, len, process),
+        },
+        IORING_OP_WRITEV => match at {
+            Some(offset) => sys_pwritev(fd, addr, len, offset, process),
+            None => sys_writev(fd, addr, len, process),
+        },
+        IORING_OP_FSYNC => sys_fsync(fd, process),
+        IORING_OP_OPENAT => sys_openat(fd as _, addr, sqe.op_flags as _, len, process),
+        IORING_OP_CLOSE => sys_close(fd, process),
+        _ => Err(Error::new(Errno::EINVAL)),
+    };
+    match ret {
+        Ok(value) => value.0 as i32,
+        Err(e) => -e.code(),
+    }
+}
@@ -0,0 +1,79 @@
+use alloc::vec::Vec;
+use ostd::{
+    Pod,
+    mm::{Vaddr, VmReader, VmSpace, VmWriter},
+};
+
+use crate::error::{Errno, Error, Result};
+
+/// The most segments one vectored read or write may take.
+const IOV_MAX: usize = 1024;
+
+#[repr(C)]
+#[derive(Debug, Clone, Copy, Pod)]
+pub struct IoVec {
+    base: Vaddr,
+    len: usize,
+}
+
+/// Reads the `count` segments at `io_vec_ptr`, leaving out the empty ones.
+fn read_io_vecs(vm_space: &VmSpace, io_vec_ptr: Vaddr, count: usize) -> Result<Vec<IoVec>> {
+    if count > IOV_MAX {
+        return Err(Error::new(Errno::EINVAL));
+    }
+    if count == 0 {
+        return Ok(Vec::new());
+    }
+    let mut reader = vm_space
+        .reader(io_vec_ptr, count * size_of::<IoVec>())
+        .map_err(|_| Error::new(Errno::EFAULT))?;
+
+    let mut io_vecs = Vec::with_capacity(count);
+    let mut total_len: usize = 0;
+    for _ in 0..count {
+        let io_vec: IoVec = reader.read_val().map_err(|_| Error::new(Errno::EFAULT))?;
+        // The total must fit the return value.
+        total_len = total_len
+            .checked_add(io_vec.len)
+            .filter(|&len| len <= isize::MAX as usize)
+            .ok_or(Error::new(Errno::EINVAL))?;
+        if io_vec.len > 0 {
+            io_vecs.push(io_vec);
+        }
+    }
+    Ok(io_vecs)
+}
+
+/// Returns writers to the user buffers of the `count` segments at
+/// `io_vec_ptr`, for a vectored read.
+pub fn io_vec_writers(
+    vm_space: &VmSpace,
+    io_vec_ptr: Vaddr,
+    count: usize,
+) -> Result<Vec<VmWriter<'_>>> {
+    read_io_vecs(vm_space, io_vec_ptr, count)?
+        .into_iter()
+        .map(|io_vec| {
+            vm_space
+                .writer(io_vec.base, io_vec.len)
+                .map_err(|_| Error::new(Errno::EFAULT))
+        })
+        .collect()
+}
+
+/// Returns readers of the user buffers of the `count` segments at
+/// `io_vec_ptr`, for a vectored write.
+pub fn io_vec_readers(
+    vm_space: &VmSpace,
+    io_vec_ptr: Vaddr,
+    count: usize,
+) -> Result<Vec<VmReader<'_>>> {
+    read_io_vecs(vm_space, io_vec_ptr, count)?
+        .into_iter()
+        .map(|io_vec| {
+            vm_space
+                .reader(io_vec.base, io_vec.len)
+                .map_err(|_| Error::new(Errno::EFAULT))
+        })
+        .collect()
+}
@@ -0,0 +1,38 @@
+use alloc::sync::Arc;
+use log::debug;
+
+use crate::error::{Errno, Error, Result};
+use crate::fs::SeekFrom;
+use crate::fs::file_table::FileDescriptor;
+use crate::process::Process;
+use crate::syscall::SyscallReturn;
+
+const SEEK_SET: u32 = 0;
+const SEEK_CUR: u32 = 1;
+const SEEK_END: u32 = 2;
+
+pub fn sys_lseek(
+    fd: FileDescriptor,
+    offset: isize,
+    whence: u32,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!(
+        "[SYS_LSEEK] fd: {}, offset: {}, whence: {}",
+        fd, offset, whence
+    );
+
+    let pos = match whence {
+        SEEK_SET => {
+            SeekFrom::Start(usize::try_from(offset).map_err(|_| Error::new(Errno::EINVAL))?)
+        }
+        SEEK_CUR => SeekFrom::Current(offset),
+        SEEK_END => SeekFrom::End(offset),
+        _ => return Err(Error::new(Errno::EINVAL)),
+    };
+
+    let file = current_process.file(fd)?;
+    let new_offset = file.seek(pos)?;
+
+    Ok(SyscallReturn(new_offset as _))
+}
@@ -0,0 +1,44 @@
+use alloc::sync::Arc;
+use log::debug;
+use ostd::mm::Vaddr;
+
+use crate::error::{Errno, Error, Result};
+use crate::mm::{self, fault::MemoryAdvice};
+use crate::process::Process;
+use crate::syscall::SyscallReturn;
+
+const MADV_NORMAL: i32 = 0;
+const MADV_RANDOM: i32 = 1;
+const MADV_SEQUENTIAL: i32 = 2;
+const MADV_WILLNEED: i32 = 3;
+const MADV_DONTNEED: i32 = 4;
+
+pub fn sys_madvise(
+    start: Vaddr,
+    len: usize,
+    advice: i32,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!(
+        "[SYS_MADVISE] start: {:#x}, len: {:#x}, advice: {}",
+        start, len, advice
+    );
+
+    let range = mm::user_range(start, len)?;
+
+    let memory_space = current_process.memory_space();
+    let advice = match advice {
+        MADV_NORMAL => MemoryAdvice::Normal,
+        MADV_RANDOM => MemoryAdvice::Random,
+        MADV_SEQUENTIAL => MemoryAdvice::Sequential,
+        MADV_WILLNEED => MemoryAdvice::WillNeed,
+        MADV_DONTNEED => {
+            memory_space.discard(range);
+            return Ok(SyscallReturn(0));
+        }
+        _ => return Err(Error::new(Errno::EINVAL)),
+    };
+    memory_space.advise(range, advice);
+
+    Ok(SyscallReturn(0))
+}
@@ -1,16 +1,24 @@
-use core::fmt::Debug;
+use core::{
+    fmt::Debug,
+    ops::Range,
+    sync::atomic::{AtomicBool, AtomicUsize, Ordering},
+};
 
 use align_ext::AlignExt;
 use alloc::sync::Arc;
-use ostd::irq::disable_local;
 use ostd::mm::io_util::HasVmReaderWriter;
-use ostd::mm::{CachePolicy, FrameAllocOptions, PAGE_SIZE, PageFlags, PageProperty, Vaddr};
+use ostd::mm::{PAGE_SIZE, PageFlags, Vaddr};
 
 use crate::error::{Errno, Error, Result};
-use crate::fs::Inode;
-use crate::mm::VmMapping;
+use crate::fs::util::readahead::ReadAhead;
+use crate::fs::{FileLike, Inode};
 use crate::mm::area::VmArea;
-use crate::mm::fault::{PageFaultContext, PageFaultHandler};
+use crate::mm::fault::{
+    AllocationPageFaultHandler, DEFAULT_FAULT_AROUND_PAGES, HUGE_PAGE_SIZE, MemoryAdvice,
+    PageFaultContext, PageFaultHandler,
+};
+use crate::mm::mapping::cache_cow_token;
+use crate::mm::{reclaim, user_range};
 use crate::process::Process;
 use crate::syscall::SyscallReturn;
 
@@ -33,6 +41,17 @@ bitflags::bitflags! {
     }
 }
 
+/// The fault-around window of file mappings advised `MADV_SEQUENTIAL`.
+const SEQUENTIAL_FAULT_AROUND_PAGES: usize = 64;
+
+/// Where mappings without `MAP_FIXED` are placed.
+const MMAP_AREA: Range<Vaddr> = 0x10_0000_0000..0x30_0000_0000;
+
+/// Maps a file or, with `MAP_ANONYMOUS`, zeroed memory.
+///
+/// Anonymous pages are allocated on first access. Without `MAP_FIXED`, the
+/// kernel picks the lowest free range, aligned to a huge page for mappings
+/// of at least one so that their blocks can be mapped whole.
 pub fn sys_mmap(
     vaddr: u64,
     length: u64,
@@ -42,82 +61,218 @@ pub fn sys_mmap(
     offset: u64,
     current_process: &Arc<Process>,
 ) -> Result<SyscallReturn> {
-    // Current, we only support mmap with file
-    // MAP_PRIVATE, MAP_FIXED, no MAP_ANONYMOUS
-    assert!(vaddr != 0);
-    assert!(vaddr.align_down(PAGE_SIZE as _) == vaddr);
-    assert!(offset == 0);
-    assert!(flags & 0xf == 0x2);
+    let vaddr = vaddr as Vaddr;
+    let offset = offset as usize;
     let mmap_flags = MMapFlags::from_bits_truncate(flags as u32);
-    assert!(mmap_flags == MMapFlags::MAP_FIXED);
+    let shared = match flags & 0xf {
+        0x1 => true,
+        0x2 => false,
+        _ => return Err(Error::new(Errno::EINVAL)),
+    };
+    if length == 0 || offset % PAGE_SIZE != 0 {
+        return Err(Error::new(Errno::EINVAL));
+    }
+    let len = (length as usize)
+        .checked_next_multiple_of(PAGE_SIZE)
+        .ok_or(Error::new(Errno::ENOMEM))?;
+    let anonymous = mmap_flags.contains(MMapFlags::MAP_ANONYMOUS);
 
-    // Now, we can map the file
     let page_flags = PageFlags::from_bits_truncate(perms as _);
-    let inode = current_process
-        .file_table()
-        .get(fd as _)
-        .unwrap()
-        .file()
-        .as_inode()
-        .ok_or(Error::new(Errno::EBADF))?;
-
-    let handler = Arc::new(MMapInodeFaultHandler {
-        base_vaddr: vaddr as _,
-        inode,
-    });
+    let file = if anonymous {
+        None
+    } else {
+        let file = current_process.file(fd as _)?;
+        if let Some(inode) = file.as_inode()
+            && shared
+            && page_flags.contains(PageFlags::W)
+            && !inode.keeps_mapped_writes()
+        {
+            // The writes would stay in cached pages that may be dropped.
+            return Err(Error::new(Errno::ENODEV));
+        }
+        if file.as_inode().is_none() {
+            // Fail now, rather than on faults, if the file cannot be mapped
+            // for the whole length.
+            file.mmap_frames(offset, len / PAGE_SIZE)?;
+        }
+        Some(file)
+    };
+
+    // Private writable mappings count as data, as for Linux.
+    current_process.check_vm_limits(len, !shared && page_flags.contains(PageFlags::W))?;
 
     let memory_space = current_process.memory_space();
-    memory_space.add_area(VmArea::new_with_handler(
-        vaddr as _,
-        length.align_up(PAGE_SIZE as _) as usize / PAGE_SIZE,
-        page_flags,
-        handler,
-    ));
+    let vaddr = if mmap_flags.intersects(MMapFlags::MAP_FIXED | MMapFlags::MAP_FIXED_NOREPLACE) {
+        let end = user_range(vaddr, len)?.end;
+        if memory_space.find_free_range(vaddr..end, len) != Some(vaddr) {
+            if !mmap_flags.contains(MMapFlags::MAP_FIXED) {
+                return Err(Error::new(Errno::EEXIST));
+            }
+            // Replace whatever is mapped there.
+            memory_space.unmap(vaddr..end);
+        }
+        vaddr
+    } else {
+        let align = if anonymous && len >= HUGE_PAGE_SIZE {
+            HUGE_PAGE_SIZE
+        } else {
+            PAGE_SIZE
+        };
+        // Take the hint if it is free.
+        let hint = vaddr.align_down(PAGE_SIZE);
+        (hint != 0)
+            .then(|| memory_space.find_free_range(hint..hint.saturating_add(len), len))
+            .flatten()
+            .or_else(|| {
+                // Leave room to move the start up to the alignment.
+                let start = memory_space.find_free_range(MMAP_AREA, len + align - PAGE_SIZE)?;
+                Some(start.align_up(align))
+            })
+            .ok_or(Error::new(Errno::ENOMEM))?
+    };
+
+    let handler: Arc<dyn PageFaultHandler> = match file {
+        None => Arc::new(AllocationPageFaultHandler::default()),
+        Some(file) => match file.as_inode() {
+            Some(inode) => Arc::new(MMapInodeFaultHandler {
+                base_vaddr: vaddr,
+                offset,
+                shared,
+                inode,
+                read_ahead: ReadAhead::default(),
+                fault_around_pages: AtomicUsize::new(DEFAULT_FAULT_AROUND_PAGES),
+                random: AtomicBool::new(false),
+            }),
+            None => Arc::new(MMapFileFaultHandler {
+                base_vaddr: vaddr,
+                offset,
+                shared,
+                file,
+            }),
+        },
+    };
+
+    let mut area = VmArea::new_with_handler(vaddr, len / PAGE_SIZE, page_flags, handler);
+    area.set_shared(shared);
+    if shared && !anonymous && !page_flags.contains(PageFlags::W) {
+        // Writes would reach the file, which was mapped only to be read.
+        area.set_max_perms(PageFlags::RX);
+    }
+    memory_space.add_area(area);
+
+    // Children share the frames mapped at fork, and fault in frames of their
+    // own after it, so shared anonymous pages must all exist up front.
+    if mmap_flags.contains(MMapFlags::MAP_POPULATE) || (anonymous && shared) {
+        memory_space.populate(current_process, vaddr..vaddr + len)?;
+    }
 
     Ok(SyscallReturn(vaddr as _))
 }
 
+/// Maps the pages of a file.
+///
+/// Files with a page cache are mapped with the cached frames, which private
+/// mappings copy on write. Other files are copied into private frames, even
+/// for `MAP_SHARED`.
 pub struct MMapInodeFaultHandler {
     base_vaddr: Vaddr,
+    /// The file offset mapped at `base_vaddr`.
+    offset: usize,
+    shared: bool,
     inode: Arc<dyn Inode>,
+    read_ahead: ReadAhead,
+    fault_around_pages: AtomicUsize,
+    /// Set by `MADV_RANDOM` to stop read-ahead.
+    random: AtomicBool,
 }
 
 impl Debug for MMapInodeFaultHandler {
     fn fmt(&self, f: &mut core::fmt::Formatter<'_>) -> core::fmt::Result {
         f.debug_struct("MMapInodeFaultHandler")
             .field("base_vaddr", &self.base_vaddr)
+            .field("offset", &self.offset)
+            .field("shared", &self.shared)
             .finish()
     }
 }
 
 impl PageFaultHandler for MMapInodeFaultHandler {
-    fn handle_page_fault<'a>(&self, context: PageFaultContext<'a>) -> Result<()> {
-        let memory_space = context.process.memory_space();
-        let vm_space = memory_space.vm_space();
-        let frame = FrameAllocOptions::new().alloc_frame().unwrap();
-        let align_down_vaddr = context.vaddr.align_down(PAGE_SIZE);
-
-        // Read data from Inode
-        self.inode
-            .read_at(
-                align_down_vaddr - self.base_vaddr,
-                frame.writer().to_fallible(),
-            )
-            .unwrap();
-
-        let guard = disable_local();
-        let mut cursor_mut = vm_space
-            .cursor_mut(&guard, &(align_down_vaddr..align_down_vaddr + PAGE_SIZE))
-            .unwrap();
-        cursor_mut.map(
-            frame.clone().into(),
-            PageProperty::new_user(context.perms, CachePolicy::Writeback),
-        );
-
-        // Add mapping
-        let mapping = VmMapping::new(align_down_vaddr, context.perms, frame);
-        context.mappings.push_back(mapping);
+    fn handle_page_fault<'a>(&self, mut context: PageFaultContext<'a>) -> Result<()> {
+        let range = context.fault_around_range(self.fault_around_pages.load(Ordering::Relaxed));
+        if range.is_empty() {
+            return Err(Error::new(Errno::EACCES));
+        }
+        let offset = self.offset + (range.start - self.base_vaddr);
+        let first_page = offset / PAGE_SIZE;
+        let num_pages = range.len() / PAGE_SIZE;
+
+        if let Some(frames) = self.inode.page_frames(first_page..first_page + num_pages) {
+            let frames = frames?;
+            let cow_token = (!self.shared).then(cache_cow_token);
+            context.map_frames(range.clone(), frames, cow_token);
+        } else {
+            let frames = reclaim::alloc_segment(num_pages);
+            self.inode.read_at(offset, frames.writer().to_fallible())?;
+            context.map_frames(range.clone(), frames, None);
+        }
+
+        if !self.random.load(Ordering::Relaxed) {
+            if let Some(range) = self.read_ahead.on_read(offset, range.len()) {
+                self.inode.read_ahead(range);
+            }
+        }
+
+        Ok(())
+    }
+
+    fn advise(&self, advice: MemoryAdvice, range: Range<Vaddr>) {
+        let fault_around_pages = match advice {
+            MemoryAdvice::Normal => DEFAULT_FAULT_AROUND_PAGES,
+            MemoryAdvice::Random => 1,
+            MemoryAdvice::Sequential => SEQUENTIAL_FAULT_AROUND_PAGES,
+            MemoryAdvice::WillNeed => {
+                let start = self.offset + (range.start - self.base_vaddr);
+                self.inode.read_ahead(start..start + range.len());
+                return;
+            }
+        };
+        self.fault_around_pages
+            .store(fault_around_pages, Ordering::Relaxed);
+        self.random
+            .store(advice == MemoryAdvice::Random, Ordering::Relaxed);
+    }
+}
+
+/// Maps the frames of a file that shares its memory, see
+/// [`FileLike::mmap_frames`]. Private mappings copy them on write.
+pub struct MMapFileFaultHandler {
+    base_vaddr: Vaddr,
+    /// The file offset mapped at `base_vaddr`.
+    offset: usize,
+    shared: bool,
+    file: Arc<dyn FileLike>,
+}
+
+impl Debug for MMapFileFaultHandler {
+    fn fmt(&self, f: &mut core::fmt::Formatter<'_>) -> core::fmt::Result {
+        f.debug_struct("MMapFileFaultHandler")
+            .field("base_vaddr", &self.base_vaddr)
+            .field("offset", &self.offset)
+            .field("shared", &self.shared)
+            .finish()
+    }
+}
 
+impl PageFaultHandler for MMapFileFaultHandler {
+    fn handle_page_fault<'a>(&self, mut context: PageFaultContext<'a>) -> Result<()> {
+        let range = context.fault_around_range(DEFAULT_FAULT_AROUND_PAGES);
+        if range.is_empty() {
+            return Err(Error::new(Errno::EACCES));
+        }
+        let offset = self.offset + (range.start - self.base_vaddr);
+        let frames = self.file.mmap_frames(offset, range.len() / PAGE_SIZE)?;
+        let cow_token = (!self.shared).then(cache_cow_token);
+        context.map_frames(range, frames, cow_token);
         Ok(())
     }
 }
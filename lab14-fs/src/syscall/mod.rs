@@ -1,162 +1,387 @@
+mod affinity;
 mod brk;
 mod clone;
+mod close;
+mod epoll;
 mod exec;
 mod exit;
+mod fcntl;
+mod futex;
+mod getdents;
+mod getrusage;
+mod io_uring;
+mod iovec;
+mod lseek;
+mod madvise;
 mod mmap;
+mod mprotect;
+mod munmap;
+mod nanosleep;
 mod open;
 mod pipe;
+mod poll;
+mod priority;
 mod prlimit;
 mod read;
+mod splice;
+mod stat;
+mod sync;
+mod syslog;
 mod time;
+#[cfg(feature = "syscall-trace")]
+mod trace;
 mod uname;
+mod user;
 mod wait4;
 mod write;
 
 use alloc::sync::Arc;
-use log::{debug, info};
+use log::debug;
 use ostd::arch::cpu::context::UserContext;
 use ostd::arch::qemu::exit_qemu;
 use ostd::task::Task;
 
 use crate::error::{Errno, Error, Result};
-use crate::process::Process;
+use crate::process::{Process, current_thread};
+use crate::stats::{self, Stat};
+use crate::syscall::affinity::{sys_getcpu, sys_sched_getaffinity, sys_sched_setaffinity};
 use crate::syscall::brk::sys_brk;
 use crate::syscall::clone::sys_clone;
+use crate::syscall::close::sys_close;
+use crate::syscall::epoll::{sys_epoll_create1, sys_epoll_ctl, sys_epoll_pwait};
 use crate::syscall::exec::sys_execve;
-use crate::syscall::exit::sys_exit;
+use crate::syscall::exit::{sys_exit, sys_exit_group};
+use crate::syscall::fcntl::sys_fcntl;
+use crate::syscall::futex::sys_futex;
+use crate::syscall::getdents::sys_getdents64;
+use crate::syscall::getrusage::sys_getrusage;
+use crate::syscall::io_uring::{sys_io_uring_enter, sys_io_uring_setup};
+use crate::syscall::lseek::sys_lseek;
+use crate::syscall::madvise::sys_madvise;
 use crate::syscall::mmap::sys_mmap;
+use crate::syscall::mprotect::sys_mprotect;
+use crate::syscall::munmap::sys_munmap;
+use crate::syscall::nanosleep::{sys_clock_nanosleep, sys_nanosleep};
 use crate::syscall::pipe::sys_pipe2;
+use crate::syscall::poll::sys_ppoll;
+use crate::syscall::priority::{sys_getpriority, sys_setpriority};
 use crate::syscall::prlimit::sys_prlimit64;
-use crate::syscall::read::sys_read;
+use crate::syscall::read::{sys_pread64, sys_preadv, sys_read, sys_readv};
+use crate::syscall::splice::sys_splice;
+use crate::syscall::stat::{sys_fstat, sys_newfstatat, sys_statx};
+use crate::syscall::sync::{sys_fsync, sys_sync};
+use crate::syscall::syslog::sys_syslog;
 use crate::syscall::time::sys_clock_gettime;
 use crate::syscall::uname::sys_uname;
 use crate::syscall::wait4::sys_wait4;
-use crate::syscall::write::{sys_write, sys_writev};
+use crate::syscall::write::{sys_pwrite64, sys_pwritev, sys_write, sys_writev};
 
 pub struct SyscallReturn(pub isize);
 
-pub fn handle_syscall(user_context: &mut UserContext, current_process: &Arc<Process>) {
-    const SYS_OPENAT: usize = 56;
-    const SYS_PIPE2: usize = 59;
+type SyscallArgs = [usize; 6];
 
-    const SYS_READ: usize = 63;
-    const SYS_WRITE: usize = 64;
-    const SYS_WRITEV: usize = 66;
-    const SYS_EXIT: usize = 93;
-    const SYS_EXIT_GROUP: usize = 94;
+type SyscallHandler = fn(&SyscallArgs, &Arc<Process>, &mut UserContext) -> Result<SyscallReturn>;
 
-    const SYS_CLOCK_GETTIME: usize = 113;
-    const SYS_SCHED_YIELD: usize = 124;
-    const SYS_REBOOT: usize = 142;
-    const SYS_NEWUNAME: usize = 160;
-    const SYS_GETPID: usize = 172;
-    const SYS_GETPPID: usize = 173;
-    const SYS_BRK: usize = 214;
-    const SYS_CLONE: usize = 220;
-    const SYS_EXECVE: usize = 221;
-    const SYS_MMAP: usize = 222;
-    const SYS_MPROTECT: usize = 226;
-    const SYS_WAIT4: usize = 260;
-    const SYS_PRLIMIT64: usize = 261;
+const SYS_EPOLL_CREATE1: usize = 20;
+const SYS_EPOLL_CTL: usize = 21;
+const SYS_EPOLL_PWAIT: usize = 22;
+const SYS_FCNTL: usize = 25;
+const SYS_OPENAT: usize = 56;
+const SYS_CLOSE: usize = 57;
+const SYS_PIPE2: usize = 59;
+const SYS_GETDENTS64: usize = 61;
+const SYS_LSEEK: usize = 62;
+const SYS_READ: usize = 63;
+const SYS_WRITE: usize = 64;
+const SYS_READV: usize = 65;
+const SYS_WRITEV: usize = 66;
+const SYS_PREAD64: usize = 67;
+const SYS_PWRITE64: usize = 68;
+const SYS_PREADV: usize = 69;
+const SYS_PWRITEV: usize = 70;
+const SYS_PPOLL: usize = 73;
+const SYS_SPLICE: usize = 76;
+const SYS_NEWFSTATAT: usize = 79;
+const SYS_FSTAT: usize = 80;
+const SYS_SYNC: usize = 81;
+const SYS_FSYNC: usize = 82;
+const SYS_FDATASYNC: usize = 83;
+const SYS_EXIT: usize = 93;
+const SYS_EXIT_GROUP: usize = 94;
+const SYS_SET_TID_ADDRESS: usize = 96;
+const SYS_FUTEX: usize = 98;
+const SYS_NANOSLEEP: usize = 101;
 
-    let args = [
-        user_context.a0(),
-        user_context.a1(),
-        user_context.a2(),
-        user_context.a3(),
-        user_context.a4(),
-        user_context.a5(),
-    ];
+const SYS_CLOCK_GETTIME: usize = 113;
+const SYS_CLOCK_NANOSLEEP: usize = 115;
+const SYS_SYSLOG: usize = 116;
+const SYS_SCHED_SETAFFINITY: usize = 122;
+const SYS_SCHED_GETAFFINITY: usize = 123;
+const SYS_SCHED_YIELD: usize = 124;
+const SYS_SETPRIORITY: usize = 140;
+const SYS_GETPRIORITY: usize = 141;
+const SYS_REBOOT: usize = 142;
+const SYS_NEWUNAME: usize = 160;
+const SYS_GETRUSAGE: usize = 165;
+const SYS_GETCPU: usize = 168;
+const SYS_GETPID: usize = 172;
+const SYS_GETPPID: usize = 173;
+const SYS_GETTID: usize = 178;
+const SYS_BRK: usize = 214;
+const SYS_MUNMAP: usize = 215;
+const SYS_CLONE: usize = 220;
+const SYS_EXECVE: usize = 221;
+const SYS_MMAP: usize = 222;
+const SYS_MPROTECT: usize = 226;
+const SYS_MADVISE: usize = 233;
+const SYS_WAIT4: usize = 260;
+const SYS_PRLIMIT64: usize = 261;
+const SYS_STATX: usize = 291;
+const SYS_IO_URING_SETUP: usize = 425;
+const SYS_IO_URING_ENTER: usize = 426;
 
-    info!(
-        "[pid: {}] syscall num: {}, args: {:x?}",
-        current_process.pid(),
-        user_context.a7(),
-        &args
-    );
+/// One more than the highest syscall number handled.
+const NR_SYSCALLS: usize = 427;
 
-    let ret: Result<SyscallReturn> = match user_context.a7() {
-        SYS_PIPE2 => sys_pipe2(args[0] as _, args[1] as _, current_process),
+/// Builds the dispatch table from `number => |args, process, context| body`
+/// entries. Each body decodes the raw arguments into the handler's types.
+macro_rules! syscall_table {
+    ($($nr:ident => |$args:pat_param, $process:pat_param, $context:pat_param| $body:expr),* $(,)?) => {{
+        let mut table: [Option<SyscallHandler>; NR_SYSCALLS] = [None; NR_SYSCALLS];
+        $(
+            table[$nr] = Some(
+                |$args: &SyscallArgs,
+                 $process: &Arc<Process>,
+                 $context: &mut UserContext|
+                 -> Result<SyscallReturn> { $body },
+            );
+        )*
+        table
+    }};
+}
 
-        SYS_WRITEV => sys_writev(args[0] as _, args[1] as _, args[2] as _, current_process),
-        SYS_NEWUNAME => sys_uname(args[0] as _, current_process),
-        SYS_BRK => sys_brk(args[0] as _, current_process),
-        SYS_MPROTECT => Ok(SyscallReturn(0)),
-        SYS_GETPID => Ok(SyscallReturn(current_process.pid() as _)),
-        SYS_GETPPID => {
-            let ppid = current_process
-                .parent_process()
-                .and_then(|p| Some(p.pid()))
-                .unwrap_or(0);
-            Ok(SyscallReturn(ppid as _))
-        }
-        SYS_PRLIMIT64 => sys_prlimit64(
+static SYSCALL_TABLE: [Option<SyscallHandler>; NR_SYSCALLS] = syscall_table! {
+    SYS_EPOLL_CREATE1 => |args, process, _| sys_epoll_create1(args[0] as _, process),
+    SYS_EPOLL_CTL => |args, process, _| {
+        sys_epoll_ctl(args[0] as _, args[1] as _, args[2] as _, args[3] as _, process)
+    },
+    SYS_EPOLL_PWAIT => |args, process, _| {
+        sys_epoll_pwait(
             args[0] as _,
             args[1] as _,
             args[2] as _,
             args[3] as _,
-            current_process,
-        ),
-        SYS_CLONE => sys_clone(
+            args[4] as _,
+            process,
+        )
+    },
+    SYS_FCNTL => |args, process, _| sys_fcntl(args[0] as _, args[1] as _, args[2] as _, process),
+    SYS_OPENAT => |args, process, _| {
+        open::sys_openat(args[0] as _, args[1] as _, args[2] as _, args[3] as _, process)
+    },
+    SYS_CLOSE => |args, process, _| sys_close(args[0] as _, process),
+    SYS_PIPE2 => |args, process, _| sys_pipe2(args[0] as _, args[1] as _, process),
+    SYS_GETDENTS64 => |args, process, _| {
+        sys_getdents64(args[0] as _, args[1] as _, args[2] as _, process)
+    },
+    SYS_LSEEK => |args, process, _| sys_lseek(args[0] as _, args[1] as _, args[2] as _, process),
+    SYS_READ => |args, process, _| sys_read(args[0] as _, args[1] as _, args[2] as _, process),
+    SYS_WRITE => |args, process, _| sys_write(args[0] as _, args[1] as _, args[2] as _, process),
+    SYS_READV => |args, process, _| sys_readv(args[0] as _, args[1] as _, args[2] as _, process),
+    SYS_WRITEV => |args, process, _| sys_writev(args[0] as _, args[1] as _, args[2] as _, process),
+    SYS_PREAD64 => |args, process, _| {
+        sys_pread64(args[0] as _, args[1] as _, args[2] as _, args[3] as _, process)
+    },
+    SYS_PWRITE64 => |args, process, _| {
+        sys_pwrite64(args[0] as _, args[1] as _, args[2] as _, args[3] as _, process)
+    },
+    SYS_PREADV => |args, process, _| {
+        sys_preadv(args[0] as _, args[1] as _, args[2] as _, args[3] as _, process)
+    },
+    SYS_PWRITEV => |args, process, _| {
+        sys_pwritev(args[0] as _, args[1] as _, args[2] as _, args[3] as _, process)
+    },
+    SYS_PPOLL => |args, process, _| {
+        sys_ppoll(args[0] as _, args[1] as _, args[2] as _, args[3] as _, process)
+    },
+    SYS_SPLICE => |args, process, _| {
+        sys_splice(
             args[0] as _,
             args[1] as _,
             args[2] as _,
             args[3] as _,
             args[4] as _,
-            current_process,
-            user_context,
-        ),
-
-        SYS_EXECVE => sys_execve(
+            args[5] as _,
+            process,
+        )
+    },
+    SYS_NEWFSTATAT => |args, process, _| {
+        sys_newfstatat(args[0] as _, args[1] as _, args[2] as _, args[3] as _, process)
+    },
+    SYS_FSTAT => |args, process, _| sys_fstat(args[0] as _, args[1] as _, process),
+    SYS_SYNC => |_, _, _| sys_sync(),
+    SYS_FSYNC => |args, process, _| sys_fsync(args[0] as _, process),
+    SYS_FDATASYNC => |args, process, _| sys_fsync(args[0] as _, process),
+    SYS_EXIT => |args, process, _| sys_exit(args[0] as _, process),
+    SYS_EXIT_GROUP => |args, process, _| sys_exit_group(args[0] as _, process),
+    SYS_SET_TID_ADDRESS => |args, _, _| {
+        let thread = current_thread();
+        thread.set_clear_child_tid(args[0]);
+        Ok(SyscallReturn(thread.tid() as _))
+    },
+    SYS_FUTEX => |args, process, _| {
+        sys_futex(
             args[0] as _,
             args[1] as _,
             args[2] as _,
-            current_process,
-            user_context,
-        ),
-        SYS_WAIT4 => sys_wait4(
+            args[3] as _,
+            args[4] as _,
+            args[5] as _,
+            process,
+        )
+    },
+    SYS_NANOSLEEP => |args, process, _| sys_nanosleep(args[0] as _, args[1] as _, process),
+    SYS_CLOCK_GETTIME => |args, process, _| sys_clock_gettime(args[0] as _, args[1] as _, process),
+    SYS_CLOCK_NANOSLEEP => |args, process, _| {
+        sys_clock_nanosleep(args[0] as _, args[1] as _, args[2] as _, args[3] as _, process)
+    },
+    SYS_SYSLOG => |args, process, _| sys_syslog(args[0] as _, args[1] as _, args[2] as _, process),
+    SYS_SCHED_SETAFFINITY => |args, process, _| {
+        sys_sched_setaffinity(args[0] as _, args[1] as _, args[2] as _, process)
+    },
+    SYS_SCHED_GETAFFINITY => |args, process, _| {
+        sys_sched_getaffinity(args[0] as _, args[1] as _, args[2] as _, process)
+    },
+    SYS_SCHED_YIELD => |_, _, _| {
+        Task::yield_now();
+        Ok(SyscallReturn(0))
+    },
+    SYS_SETPRIORITY => |args, process, _| {
+        sys_setpriority(args[0] as _, args[1] as _, args[2] as _, process)
+    },
+    SYS_GETPRIORITY => |args, process, _| sys_getpriority(args[0] as _, args[1] as _, process),
+    SYS_REBOOT => |_, _, _| {
+        #[cfg(feature = "profiler")]
+        ostd::early_println!(
+            "==== profile begin ====\n{}==== profile end ====",
+            crate::profiler::report()
+        );
+        exit_qemu(ostd::arch::qemu::QemuExitCode::Success)
+    },
+    SYS_NEWUNAME => |args, process, _| sys_uname(args[0] as _, process),
+    SYS_GETRUSAGE => |args, process, _| sys_getrusage(args[0] as _, args[1] as _, process),
+    SYS_GETCPU => |args, process, _| sys_getcpu(args[0] as _, args[1] as _, process),
+    SYS_GETPID => |_, process, _| Ok(SyscallReturn(process.pid() as _)),
+    SYS_GETPPID => |_, process, _| {
+        let ppid = process
+            .parent_process()
+            .and_then(|p| Some(p.pid()))
+            .unwrap_or(0);
+        Ok(SyscallReturn(ppid as _))
+    },
+    SYS_GETTID => |_, _, _| Ok(SyscallReturn(current_thread().tid() as _)),
+    SYS_BRK => |args, process, _| sys_brk(args[0] as _, process),
+    SYS_MUNMAP => |args, process, _| sys_munmap(args[0] as _, args[1] as _, process),
+    SYS_CLONE => |args, process, context| {
+        sys_clone(
             args[0] as _,
             args[1] as _,
             args[2] as _,
             args[3] as _,
-            current_process,
-        ),
-        SYS_CLOCK_GETTIME => sys_clock_gettime(args[0] as _, args[1] as _, current_process),
-        SYS_REBOOT => exit_qemu(ostd::arch::qemu::QemuExitCode::Success),
-        SYS_READ => sys_read(args[0] as _, args[1] as _, args[2] as _, current_process),
-        SYS_SCHED_YIELD => {
-            Task::yield_now();
-            Ok(SyscallReturn(0))
-        }
-
-        SYS_WRITE => sys_write(args[0] as _, args[1] as _, args[2] as _, current_process),
-        SYS_EXIT | SYS_EXIT_GROUP => sys_exit(args[0] as _, current_process),
-        SYS_OPENAT => open::sys_openat(
+            args[4] as _,
+            process,
+            context,
+        )
+    },
+    SYS_EXECVE => |args, process, context| {
+        sys_execve(args[0] as _, args[1] as _, args[2] as _, process, context)
+    },
+    SYS_MMAP => |args, process, _| {
+        sys_mmap(
             args[0] as _,
             args[1] as _,
             args[2] as _,
             args[3] as _,
-            current_process,
-        ),
-        SYS_MMAP => sys_mmap(
+            args[4] as _,
+            args[5] as _,
+            process,
+        )
+    },
+    SYS_MPROTECT => |args, process, _| sys_mprotect(args[0] as _, args[1] as _, args[2] as _, process),
+    SYS_MADVISE => |args, process, _| sys_madvise(args[0] as _, args[1] as _, args[2] as _, process),
+    SYS_WAIT4 => |args, process, _| {
+        sys_wait4(args[0] as _, args[1] as _, args[2] as _, args[3] as _, process)
+    },
+    SYS_PRLIMIT64 => |args, process, _| {
+        sys_prlimit64(args[0] as _, args[1] as _, args[2] as _, args[3] as _, process)
+    },
+    SYS_STATX => |args, process, _| {
+        sys_statx(args[0] as _, args[1] as _, args[2] as _, args[3] as _, args[4] as _, process)
+    },
+    SYS_IO_URING_SETUP => |args, process, _| {
+        sys_io_uring_setup(args[0] as _, args[1] as _, process)
+    },
+    SYS_IO_URING_ENTER => |args, process, _| {
+        sys_io_uring_enter(
             args[0] as _,
             args[1] as _,
             args[2] as _,
             args[3] as _,
             args[4] as _,
-            args[5] as _,
-            current_process,
-        ),
-        _ => Err(Error::new(Errno::ENOSYS)),
+            process,
+        )
+    },
+};
+
+pub fn handle_syscall(user_context: &mut UserContext, current_process: &Arc<Process>) {
+    let nr = user_context.a7();
+    let args = [
+        user_context.a0(),
+        user_context.a1(),
+        user_context.a2(),
+        user_context.a3(),
+        user_context.a4(),
+        user_context.a5(),
+    ];
+
+    #[cfg(feature = "syscall-trace")]
+    let entry = trace::now();
+    stats::inc(Stat::Syscalls);
+
+    // The hottest syscalls skip the table lookup.
+    let ret = match nr {
+        SYS_READ => sys_read(args[0] as _, args[1] as _, args[2] as _, current_process),
+        SYS_WRITE => sys_write(args[0] as _, args[1] as _, args[2] as _, current_process),
+        SYS_GETPID => Ok(SyscallReturn(current_process.pid() as _)),
+        SYS_SCHED_YIELD => {
+            Task::yield_now();
+            Ok(SyscallReturn(0))
+        }
+        _ => match SYSCALL_TABLE.get(nr).copied().flatten() {
+            Some(handler) => handler(&args, current_process, user_context),
+            None => Err(Error::new(Errno::ENOSYS)),
+        },
     };
 
+    #[cfg(feature = "syscall-trace")]
+    trace::record(
+        nr,
+        current_process.pid(),
+        entry,
+        match &ret {
+            Ok(value) => value.0,
+            Err(e) => -(e.code() as isize),
+        },
+    );
+
     match ret {
         Ok(value) => user_context.set_a0(value.0 as usize),
         Err(e) => {
             debug!(
-                "[pid: {}] Syscall num: {}, return error: {:?}",
+                "[pid: {}] Syscall num: {}, args: {:x?}, return error: {:?}",
                 current_process.pid(),
-                user_context.a7(),
+                nr,
+                &args,
                 e
             );
             user_context.set_a0(-(e.code()) as usize);
@@ -0,0 +1,27 @@
+use alloc::sync::Arc;
+use log::debug;
+use ostd::mm::{PageFlags, Vaddr};
+
+use crate::error::{Errno, Error, Result};
+use crate::mm;
+use crate::process::Process;
+use crate::syscall::SyscallReturn;
+
+pub fn sys_mprotect(
+    start: Vaddr,
+    len: usize,
+    prot: u64,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!(
+        "[SYS_MPROTECT] start: {:#x}, len: {:#x}, prot: {:#x}",
+        start, len, prot
+    );
+
+    let range = mm::user_range(start, len)?;
+    // PROT_READ, PROT_WRITE and PROT_EXEC have the bits of R, W and X.
+    let perms = PageFlags::from_bits(prot as _).ok_or(Error::new(Errno::EINVAL))?;
+
+    current_process.memory_space().protect(range, perms)?;
+    Ok(SyscallReturn(0))
+}
@@ -0,0 +1,24 @@
+use alloc::sync::Arc;
+use log::debug;
+use ostd::mm::Vaddr;
+
+use crate::error::{Errno, Error, Result};
+use crate::mm;
+use crate::process::Process;
+use crate::syscall::SyscallReturn;
+
+pub fn sys_munmap(
+    start: Vaddr,
+    len: usize,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!("[SYS_MUNMAP] start: {:#x}, len: {:#x}", start, len);
+
+    if len == 0 {
+        return Err(Error::new(Errno::EINVAL));
+    }
+    let range = mm::user_range(start, len)?;
+
+    current_process.memory_space().unmap(range);
+    Ok(SyscallReturn(0))
+}
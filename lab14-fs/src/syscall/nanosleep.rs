@@ -0,0 +1,68 @@
+use core::time::Duration;
+
+use alloc::sync::Arc;
+use log::debug;
+use ostd::mm::Vaddr;
+
+use super::SyscallReturn;
+use super::time::{ClockId, timespec_t};
+use super::user::read_val_from_user;
+use crate::error::{Errno, Error, Result};
+use crate::hrtimer;
+use crate::process::Process;
+
+/// Makes `request` an absolute deadline rather than an interval.
+const TIMER_ABSTIME: u32 = 1;
+
+pub fn sys_nanosleep(
+    request_addr: Vaddr,
+    _remain_addr: Vaddr,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    let duration = read_timespec(current_process, request_addr)?;
+    debug!("[SYS_NANOSLEEP] duration: {:?}", duration);
+
+    hrtimer::sleep(duration);
+    Ok(SyscallReturn(0))
+}
+
+/// Sleeps for `request`, or until it with `TIMER_ABSTIME`, on `clockid`.
+///
+/// With no wall clock, `CLOCK_REALTIME` counts from boot like the monotonic
+/// clocks. Sleeps are never interrupted, so the remaining time is never
+/// written.
+pub fn sys_clock_nanosleep(
+    clockid: i32,
+    flags: u32,
+    request_addr: Vaddr,
+    _remain_addr: Vaddr,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    let clock = ClockId::try_from(clockid).map_err(|_| Error::new(Errno::EINVAL))?;
+    if !matches!(
+        clock,
+        ClockId::CLOCK_REALTIME | ClockId::CLOCK_MONOTONIC | ClockId::CLOCK_BOOTTIME
+    ) {
+        return Err(Error::new(Errno::EINVAL));
+    }
+    let request = read_timespec(current_process, request_addr)?;
+    debug!(
+        "[SYS_CLOCK_NANOSLEEP] clock: {:?}, flags: {:#x}, request: {:?}",
+        clock, flags, request
+    );
+
+    if flags & TIMER_ABSTIME != 0 {
+        hrtimer::sleep_until(request);
+    } else {
+        hrtimer::sleep(request);
+    }
+    Ok(SyscallReturn(0))
+}
+
+pub(super) fn read_timespec(process: &Process, addr: Vaddr) -> Result<Duration> {
+    let timespec: timespec_t = read_val_from_user(process.memory_space().vm_space(), addr)?;
+    if timespec.sec < 0 || !(0..1_000_000_000).contains(&timespec.nsec) {
+        return Err(Error::new(Errno::EINVAL));
+    }
+    Ok(Duration::new(timespec.sec as u64, timespec.nsec as u32))
+}
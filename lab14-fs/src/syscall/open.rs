@@ -1,10 +1,7 @@
-use core::ffi::CStr;
-
-use alloc::string::ToString;
+use alloc::string::String;
 use alloc::sync::Arc;
-use alloc::vec;
 use log::debug;
-use ostd::mm::{FallibleVmRead, Vaddr, VmWriter};
+use ostd::mm::Vaddr;
 
 use crate::error::{Errno, Error, Result};
 use crate::fs::InodeType;
@@ -12,6 +9,7 @@ use crate::fs::file_table::FileEntry;
 use crate::fs::util::PathString;
 use crate::process::Process;
 use crate::syscall::SyscallReturn;
+use crate::syscall::user::read_user_path;
 
 bitflags::bitflags! {
     pub struct OpenFlags: u32 {
@@ -31,39 +29,53 @@ pub fn sys_openat(
         dfd, file_name, flags, mode
     );
 
-    // The max file name: 255 bytes + 1(\0)
-    const MAX_FILENAME_LENGTH: usize = 256;
-    let mut buffer = vec![0u8; MAX_FILENAME_LENGTH];
-    current_process
-        .memory_space()
-        .vm_space()
-        .reader(file_name, MAX_FILENAME_LENGTH)
-        .unwrap()
-        .read_fallible(&mut VmWriter::from(&mut buffer as &mut [u8]))
-        .unwrap();
+    let file_name = read_user_path(current_process.memory_space().vm_space(), file_name)?;
+    let file_name: &str = &file_name;
 
-    let file_name = CStr::from_bytes_until_nul(&buffer)
-        .unwrap()
-        .to_str()
-        .unwrap();
+    if let Some(content) = pseudo_file_content(file_name) {
+        let file = crate::fs::util::snapshot_file::SnapshotFile::new(content);
+        let fd = current_process
+            .file_table_mut()
+            .insert(FileEntry::new(Arc::new(file)));
+        return Ok(SyscallReturn(fd as _));
+    }
 
     let create = OpenFlags::from_bits_truncate(flags as u32).contains(OpenFlags::O_CREAT);
-    let mut path_string = PathString::new(file_name.to_string());
+    let mut path_string = PathString::new(file_name);
     let current_inode = crate::fs::ROOT.get().unwrap().root_inode();
     if path_string.is_empty() {
         return Err(Error::new(Errno::EINVAL));
     }
 
     let open_inode = if create {
-        path_string.create(current_inode.as_ref(), InodeType::File)?
+        path_string.create(&current_inode, InodeType::File)?
     } else {
-        path_string.lookup(current_inode.as_ref())?
+        path_string.lookup(&current_inode)?
     };
 
     let file = crate::fs::util::FileInode::new(open_inode);
     let fd = current_process
-        .file_table()
+        .file_table_mut()
         .insert(FileEntry::new(Arc::new(file)));
 
     Ok(SyscallReturn(fd as _))
 }
+
+/// Returns the content of the pseudo file at `path`, generated now, if there
+/// is one.
+fn pseudo_file_content(path: &str) -> Option<String> {
+    match path {
+        #[cfg(feature = "syscall-trace")]
+        "/proc/syscalls" => Some(super::trace::report()),
+        #[cfg(feature = "profiler")]
+        "/proc/profile" => Some(crate::profiler::report()),
+        #[cfg(feature = "lock-stat")]
+        "/proc/locks" => Some(crate::lock_stat::report()),
+        "/proc/meminfo" => Some(crate::mm::meminfo::report()),
+        "/proc/slabinfo" => Some(crate::mm::slab::report()),
+        "/proc/vmstat" => Some(crate::fs::util::page_cache::report()),
+        "/proc/stat" => Some(crate::stats::report()),
+        "/proc/boot" => Some(crate::boot::report()),
+        _ => None,
+    }
+}
@@ -28,11 +28,12 @@ pub fn sys_pipe2(
 
     let (reader, writer) = Pipe::new_pair();
 
-    let mut file_table = current_process.file_table();
+    let mut file_table = current_process.file_table_mut();
     let read_fd = file_table.insert(FileEntry::new(reader));
     let write_fd = file_table.insert(FileEntry::new(writer));
 
-    let vm_space = current_process.memory_space().vm_space();
+    let memory_space = current_process.memory_space();
+    let vm_space = memory_space.vm_space();
     let mut writer = vm_space.writer(pipe_address, size_of::<PipeFds>()).unwrap();
 
     writer.write_val(&PipeFds { read_fd, write_fd }).unwrap();
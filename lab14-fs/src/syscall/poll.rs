@@ -0,0 +1,86 @@
+use alloc::{sync::Arc, vec::Vec};
+use log::debug;
+use ostd::{Pod, mm::Vaddr};
+
+use super::SyscallReturn;
+use super::nanosleep::read_timespec;
+use super::user::{user_reader, user_writer};
+use crate::clock::monotonic_time;
+use crate::error::{Errno, Error, Result};
+use crate::fs::poll::{IoEvents, wait_for};
+use crate::process::Process;
+
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy, Pod)]
+struct PollFd {
+    fd: i32,
+    events: i16,
+    revents: i16,
+}
+
+/// Waits for any of the `nfds` fds at `fds_addr` to be ready, for up to the
+/// timespec at `timeout_addr`, or without a limit if it is null.
+///
+/// Negative fds are skipped, and fds not open report `POLLNVAL`. There are no
+/// signals to block, so `sigmask` is ignored.
+pub fn sys_ppoll(
+    fds_addr: Vaddr,
+    nfds: usize,
+    timeout_addr: Vaddr,
+    _sigmask_addr: Vaddr,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!(
+        "[SYS_PPOLL] fds_addr: {:#x}, nfds: {}, timeout_addr: {:#x}",
+        fds_addr, nfds, timeout_addr
+    );
+
+    let deadline = if timeout_addr == 0 {
+        None
+    } else {
+        Some(monotonic_time() + read_timespec(current_process, timeout_addr)?)
+    };
+
+    let memory_space = current_process.memory_space();
+    let vm_space = memory_space.vm_space();
+    let len = nfds
+        .checked_mul(size_of::<PollFd>())
+        .ok_or(Error::new(Errno::EINVAL))?;
+    let mut reader = user_reader(vm_space, fds_addr, len)?;
+    let mut poll_fds = (0..nfds)
+        .map(|_| reader.read_val::<PollFd>())
+        .collect::<core::result::Result<Vec<_>, _>>()
+        .map_err(|_| Error::new(Errno::EFAULT))?;
+    let files = poll_fds
+        .iter()
+        .map(|poll_fd| (poll_fd.fd >= 0).then(|| current_process.file(poll_fd.fd)))
+        .collect::<Vec<_>>();
+
+    let ready = wait_for(deadline, |poller| {
+        let mut ready = 0;
+        for (poll_fd, file) in poll_fds.iter_mut().zip(&files) {
+            let revents = match file {
+                None => IoEvents::empty(),
+                Some(Err(_)) => IoEvents::NVAL,
+                Some(Ok(file)) => {
+                    let mask = IoEvents::from_bits_truncate(poll_fd.events as u16 as u32)
+                        | IoEvents::ALWAYS;
+                    // Once one fd is ready, the others need not register.
+                    file.poll(mask, (ready == 0).then_some(poller))
+                }
+            };
+            poll_fd.revents = revents.bits() as i16;
+            ready += !revents.is_empty() as usize;
+        }
+        (ready > 0).then_some(ready)
+    })
+    .unwrap_or(0);
+
+    let mut writer = user_writer(vm_space, fds_addr, len)?;
+    for poll_fd in &poll_fds {
+        writer
+            .write_val(poll_fd)
+            .map_err(|_| Error::new(Errno::EFAULT))?;
+    }
+    Ok(SyscallReturn(ready as _))
+}
@@ -0,0 +1,46 @@
+use alloc::sync::Arc;
+use log::debug;
+
+use crate::error::{Errno, Error, Result};
+use crate::process::{Process, find_process};
+use crate::syscall::SyscallReturn;
+
+const PRIO_PROCESS: i32 = 0;
+
+pub fn sys_setpriority(
+    which: i32,
+    who: i32,
+    prio: i32,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!(
+        "[SYS_SETPRIORITY] which: {}, who: {}, prio: {}",
+        which, who, prio
+    );
+
+    target_process(which, who, current_process)?.set_nice(prio);
+    Ok(SyscallReturn(0))
+}
+
+pub fn sys_getpriority(
+    which: i32,
+    who: i32,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!("[SYS_GETPRIORITY] which: {}, who: {}", which, who);
+
+    // The raw syscall returns 20 - nice, so that it is never negative.
+    let nice = target_process(which, who, current_process)?.nice();
+    Ok(SyscallReturn(20 - nice as isize))
+}
+
+fn target_process(which: i32, who: i32, current_process: &Arc<Process>) -> Result<Arc<Process>> {
+    // Process groups and users are not supported.
+    if which != PRIO_PROCESS || who < 0 {
+        return Err(Error::new(Errno::EINVAL));
+    }
+    if who == 0 {
+        return Ok(current_process.clone());
+    }
+    find_process(who as usize).ok_or(Error::new(Errno::ESRCH))
+}
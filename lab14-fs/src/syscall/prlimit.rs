@@ -1,50 +1,61 @@
 use alloc::sync::Arc;
 use log::debug;
-use ostd::{Pod, mm::Vaddr};
+use ostd::mm::Vaddr;
 
 use crate::error::{Errno, Error, Result};
-use crate::process::{Process, USER_STACK_SIZE};
+use crate::process::rlimit::RLimit64;
+use crate::process::{Process, find_process};
 use crate::syscall::SyscallReturn;
 
-const RLIM_INFINITY: u64 = u64::MAX;
-
-#[derive(Debug, Clone, Copy, Pod)]
-#[repr(C)]
-pub struct RLimit64 {
-    cur: u64,
-    max: u64,
-}
-
+/// Reads and, with a `new_limit`, sets a resource limit of the process with
+/// `pid`, or of the calling one if it is 0.
+///
+/// The old limit is read before the new one is set, so both can be given.
 pub fn sys_prlimit64(
     pid: i32,
-    resource: i32,
-    _new_limit: Vaddr,
+    resource: u32,
+    new_limit: Vaddr,
     old_limit: Vaddr,
     current_process: &Arc<Process>,
 ) -> Result<SyscallReturn> {
-    if pid != 0 {
-        return Err(Error::new(Errno::EINVAL));
-    }
-
     debug!(
         "[SYS_PRLIMIT64] pid: {}, resource: {}, new_limit: {:#x}, old_limit: {:#x}",
-        pid, resource, _new_limit, old_limit
+        pid, resource, new_limit, old_limit
     );
 
-    let value: usize = USER_STACK_SIZE;
-    let rlim = RLimit64 {
-        cur: value as u64,
-        max: RLIM_INFINITY,
+    let process = match pid {
+        0 => current_process.clone(),
+        pid if pid > 0 => find_process(pid as _).ok_or(Error::new(Errno::ESRCH))?,
+        _ => return Err(Error::new(Errno::EINVAL)),
+    };
+    let memory_space = current_process.memory_space();
+    let new_limit = if new_limit != 0 {
+        let limit: RLimit64 = memory_space
+            .vm_space()
+            .reader(new_limit, size_of::<RLimit64>())
+            .and_then(|mut reader| reader.read_val())
+            .map_err(|_| Error::new(Errno::EFAULT))?;
+        Some(limit)
+    } else {
+        None
+    };
+
+    let resource = resource as usize;
+    let old = {
+        let mut limits = process.limits().lock();
+        let old = limits.get(resource)?;
+        if let Some(new_limit) = new_limit {
+            limits.set(resource, new_limit)?;
+        }
+        old
     };
 
     if old_limit != 0 {
-        current_process
-            .memory_space()
+        memory_space
             .vm_space()
-            .writer(old_limit, core::mem::size_of::<RLimit64>())
-            .unwrap()
-            .write_val(&rlim)
-            .unwrap();
+            .writer(old_limit, size_of::<RLimit64>())
+            .and_then(|mut writer| writer.write_val(&old))
+            .map_err(|_| Error::new(Errno::EFAULT))?;
     }
 
     Ok(SyscallReturn(0))
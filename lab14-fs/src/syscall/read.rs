@@ -3,6 +3,8 @@ use log::debug;
 use ostd::mm::Vaddr;
 
 use super::SyscallReturn;
+use super::iovec::io_vec_writers;
+use super::user::user_writer;
 use crate::error::Result;
 use crate::{
     error::{Errno, Error},
@@ -20,15 +22,81 @@ pub fn sys_read(
         fd, user_buf_addr, buf_len
     );
 
-    let writer = current_process
-        .memory_space()
-        .vm_space()
-        .writer(user_buf_addr, buf_len)
-        .unwrap();
+    let memory_space = current_process.memory_space();
+    let writer = user_writer(memory_space.vm_space(), user_buf_addr, buf_len)?;
 
-    let file_table = current_process.file_table();
-    let file = file_table.get(fd).ok_or(Error::new(Errno::EBADF))?;
-    let read_len = file.file().read(writer)?;
+    let file = current_process.file(fd)?;
+    let read_len = file.read(writer)?;
+    current_process.usage().count_bytes(false, read_len);
+
+    Ok(SyscallReturn(read_len as _))
+}
+
+pub fn sys_readv(
+    fd: i32,
+    io_vec_ptr: Vaddr,
+    io_vec_count: usize,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!(
+        "fd: {:?}, io_vec_ptr: 0x{:x?}, io_vec_count: {:?}",
+        fd, io_vec_ptr, io_vec_count
+    );
+
+    let memory_space = current_process.memory_space();
+    let writers = io_vec_writers(memory_space.vm_space(), io_vec_ptr, io_vec_count)?;
+
+    let file = current_process.file(fd)?;
+    let read_len = file.read_vectored(writers)?;
+    current_process.usage().count_bytes(false, read_len);
+
+    Ok(SyscallReturn(read_len as _))
+}
+
+/// Reads into the segments at `offset` without moving the file offset.
+pub fn sys_preadv(
+    fd: i32,
+    io_vec_ptr: Vaddr,
+    io_vec_count: usize,
+    offset: isize,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!(
+        "fd: {:?}, io_vec_ptr: 0x{:x?}, io_vec_count: {:?}, offset: {:?}",
+        fd, io_vec_ptr, io_vec_count, offset
+    );
+
+    let offset = usize::try_from(offset).map_err(|_| Error::new(Errno::EINVAL))?;
+    let memory_space = current_process.memory_space();
+    let writers = io_vec_writers(memory_space.vm_space(), io_vec_ptr, io_vec_count)?;
+
+    let file = current_process.file(fd)?;
+    let read_len = file.read_vectored_at(offset, writers)?;
+    current_process.usage().count_bytes(false, read_len);
+
+    Ok(SyscallReturn(read_len as _))
+}
+
+/// Reads at `offset` without moving the file offset.
+pub fn sys_pread64(
+    fd: i32,
+    user_buf_addr: Vaddr,
+    buf_len: usize,
+    offset: isize,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!(
+        "fd: {:?}, user_buf_addr: 0x{:x?}, buf_len: {:?}, offset: {:?}",
+        fd, user_buf_addr, buf_len, offset
+    );
+
+    let offset = usize::try_from(offset).map_err(|_| Error::new(Errno::EINVAL))?;
+    let memory_space = current_process.memory_space();
+    let writer = user_writer(memory_space.vm_space(), user_buf_addr, buf_len)?;
+
+    let file = current_process.file(fd)?;
+    let read_len = file.read_at(offset, writer)?;
+    current_process.usage().count_bytes(false, read_len);
 
     Ok(SyscallReturn(read_len as _))
 }
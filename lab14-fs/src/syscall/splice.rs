@@ -0,0 +1,87 @@
+use alloc::sync::Arc;
+use log::debug;
+use ostd::mm::Vaddr;
+
+use crate::error::{Errno, Error, Result};
+use crate::fs::SeekFrom;
+use crate::fs::file_table::FileDescriptor;
+use crate::process::Process;
+use crate::syscall::SyscallReturn;
+
+/// Moves data between a pipe and a file inside the kernel, one side of which
+/// must be a pipe.
+///
+/// Pipe-to-pipe splices are not supported. The file side starts at the offset
+/// passed, or at the file offset if none is, and whichever was used is
+/// advanced past the data moved.
+pub fn sys_splice(
+    fd_in: FileDescriptor,
+    off_in: Vaddr,
+    fd_out: FileDescriptor,
+    off_out: Vaddr,
+    len: usize,
+    flags: u32,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!(
+        "[SYS_SPLICE] fd_in: {}, off_in: {:#x}, fd_out: {}, off_out: {:#x}, len: {}, flags: {:#x}",
+        fd_in, off_in, fd_out, off_out, len, flags
+    );
+
+    let (file_in, file_out) = (current_process.file(fd_in)?, current_process.file(fd_out)?);
+    if len == 0 {
+        return Ok(SyscallReturn(0));
+    }
+
+    let memory_space = current_process.memory_space();
+    let vm_space = memory_space.vm_space();
+    let read_offset = |addr: Vaddr| -> Result<usize> {
+        let offset: i64 = vm_space
+            .reader(addr, size_of::<i64>())
+            .and_then(|mut reader| reader.read_val())
+            .map_err(|_| Error::new(Errno::EFAULT))?;
+        usize::try_from(offset).map_err(|_| Error::new(Errno::EINVAL))
+    };
+    let write_offset = |addr: Vaddr, offset: usize| -> Result<()> {
+        vm_space
+            .writer(addr, size_of::<i64>())
+            .and_then(|mut writer| writer.write_val(&(offset as i64)))
+            .map_err(|_| Error::new(Errno::EFAULT))
+    };
+
+    if let Some(pipe_reader) = file_in.as_pipe_reader() {
+        if off_in != 0 {
+            return Err(Error::new(Errno::ESPIPE));
+        }
+        let inode = file_out.as_inode().ok_or(Error::new(Errno::EINVAL))?;
+        if off_out == 0 {
+            let offset = file_out.seek(SeekFrom::Current(0))?;
+            let spliced = pipe_reader.splice_to(&inode, offset, len)?;
+            file_out.seek(SeekFrom::Start(offset + spliced))?;
+            return Ok(SyscallReturn(spliced as _));
+        }
+        let offset = read_offset(off_out)?;
+        let spliced = pipe_reader.splice_to(&inode, offset, len)?;
+        write_offset(off_out, offset + spliced)?;
+        return Ok(SyscallReturn(spliced as _));
+    }
+
+    if let Some(pipe_writer) = file_out.as_pipe_writer() {
+        if off_out != 0 {
+            return Err(Error::new(Errno::ESPIPE));
+        }
+        let inode = file_in.as_inode().ok_or(Error::new(Errno::EINVAL))?;
+        if off_in == 0 {
+            let offset = file_in.seek(SeekFrom::Current(0))?;
+            let spliced = pipe_writer.splice_from(&inode, offset, len)?;
+            file_in.seek(SeekFrom::Start(offset + spliced))?;
+            return Ok(SyscallReturn(spliced as _));
+        }
+        let offset = read_offset(off_in)?;
+        let spliced = pipe_writer.splice_from(&inode, offset, len)?;
+        write_offset(off_in, offset + spliced)?;
+        return Ok(SyscallReturn(spliced as _));
+    }
+
+    Err(Error::new(Errno::EINVAL))
+}
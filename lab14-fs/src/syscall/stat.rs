@@ -0,0 +1,241 @@
+use core::time::Duration;
+
+use alloc::sync::Arc;
+use log::debug;
+use ostd::{Pod, mm::Vaddr};
+
+use crate::error::{Errno, Error, Result};
+use crate::fs::{InodeStat, InodeType, file_table::FileDescriptor, util::PathString};
+use crate::process::Process;
+use crate::syscall::SyscallReturn;
+use crate::syscall::user::{read_user_path, write_val_to_user};
+
+const AT_EMPTY_PATH: u32 = 0x1000;
+
+const S_IFIFO: u32 = 0o010000;
+const S_IFCHR: u32 = 0o020000;
+const S_IFDIR: u32 = 0o040000;
+const S_IFREG: u32 = 0o100000;
+const S_IFLNK: u32 = 0o120000;
+
+/// The fields `statx` fills in: type, mode, link count, owner, times, inode
+/// number, size and blocks.
+const STATX_BASIC_STATS: u32 = 0x7ff;
+
+/// `struct stat` of riscv64.
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy, Pod)]
+struct Stat {
+    dev: u64,
+    ino: u64,
+    mode: u32,
+    nlink: u32,
+    uid: u32,
+    gid: u32,
+    rdev: u64,
+    pad1: u64,
+    size: i64,
+    blksize: i32,
+    pad2: i32,
+    blocks: i64,
+    atime: i64,
+    atime_nsec: u64,
+    mtime: i64,
+    mtime_nsec: u64,
+    ctime: i64,
+    ctime_nsec: u64,
+    unused: [u32; 2],
+}
+
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy, Pod)]
+struct StatxTimestamp {
+    sec: i64,
+    nsec: u32,
+    reserved: i32,
+}
+
+#[repr(C)]
+#[derive(Debug, Default, Clone, Copy, Pod)]
+struct Statx {
+    mask: u32,
+    blksize: u32,
+    attributes: u64,
+    nlink: u32,
+    uid: u32,
+    gid: u32,
+    mode: u16,
+    spare0: u16,
+    ino: u64,
+    size: u64,
+    blocks: u64,
+    attributes_mask: u64,
+    atime: StatxTimestamp,
+    btime: StatxTimestamp,
+    ctime: StatxTimestamp,
+    mtime: StatxTimestamp,
+    rdev_major: u32,
+    rdev_minor: u32,
+    dev_major: u32,
+    dev_minor: u32,
+    spare: [u64; 14],
+}
+
+pub fn sys_fstat(
+    fd: FileDescriptor,
+    stat_addr: Vaddr,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!("[SYS_FSTAT] fd: {}, stat_addr: {:#x}", fd, stat_addr);
+
+    let stat = fd_stat(fd, current_process)?;
+    write_user(current_process, stat_addr, &to_stat(&stat))
+}
+
+pub fn sys_newfstatat(
+    dirfd: FileDescriptor,
+    path_addr: Vaddr,
+    stat_addr: Vaddr,
+    flags: u32,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!(
+        "[SYS_NEWFSTATAT] dirfd: {}, path_addr: {:#x}, stat_addr: {:#x}, flags: {:#x}",
+        dirfd, path_addr, stat_addr, flags
+    );
+
+    let stat = path_stat(dirfd, path_addr, flags, current_process)?;
+    write_user(current_process, stat_addr, &to_stat(&stat))
+}
+
+/// Fills in the basic fields whatever `mask` asks for, as they are all in
+/// memory anyway.
+pub fn sys_statx(
+    dirfd: FileDescriptor,
+    path_addr: Vaddr,
+    flags: u32,
+    mask: u32,
+    statx_addr: Vaddr,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!(
+        "[SYS_STATX] dirfd: {}, path_addr: {:#x}, flags: {:#x}, mask: {:#x}, statx_addr: {:#x}",
+        dirfd, path_addr, flags, mask, statx_addr
+    );
+
+    let (stat, mode) = path_stat(dirfd, path_addr, flags, current_process)?;
+    let statx = Statx {
+        mask: STATX_BASIC_STATS,
+        blksize: stat.block_size,
+        nlink: stat.nlink,
+        uid: stat.uid,
+        gid: stat.gid,
+        mode: mode as u16,
+        ino: stat.ino,
+        size: stat.size,
+        blocks: stat.blocks,
+        atime: to_statx_timestamp(stat.atime),
+        ctime: to_statx_timestamp(stat.ctime),
+        mtime: to_statx_timestamp(stat.mtime),
+        ..Default::default()
+    };
+    write_user(current_process, statx_addr, &statx)
+}
+
+/// Returns the attributes of the file at `path_addr` and its mode, or those of
+/// `dirfd` itself for an empty path with `AT_EMPTY_PATH`.
+///
+/// Paths are looked up from the root, as for `openat`.
+fn path_stat(
+    dirfd: FileDescriptor,
+    path_addr: Vaddr,
+    flags: u32,
+    current_process: &Arc<Process>,
+) -> Result<(InodeStat, u32)> {
+    let path = read_user_path(current_process.memory_space().vm_space(), path_addr)?;
+    if path.is_empty() {
+        if flags & AT_EMPTY_PATH == 0 {
+            return Err(Error::new(Errno::ENOENT));
+        }
+        return fd_stat(dirfd, current_process);
+    }
+
+    let root = crate::fs::ROOT
+        .get()
+        .ok_or(Error::new(Errno::ENOENT))?
+        .root_inode();
+    Ok(with_mode(PathString::new(&path).lookup(&root)?.stat()))
+}
+
+/// Returns the attributes of the file `fd` and its mode. Files that are not
+/// inodes report only their type.
+fn fd_stat(fd: FileDescriptor, current_process: &Arc<Process>) -> Result<(InodeStat, u32)> {
+    let file = current_process.file(fd)?;
+    if let Some(inode) = file.as_inode() {
+        return Ok(with_mode(inode.stat()));
+    }
+
+    let is_pipe = file.as_pipe_reader().is_some() || file.as_pipe_writer().is_some();
+    let stat = InodeStat {
+        ino: 0,
+        type_: InodeType::File,
+        perm: 0o600,
+        nlink: 1,
+        uid: 0,
+        gid: 0,
+        size: 0,
+        blocks: 0,
+        block_size: 4096,
+        atime: Duration::ZERO,
+        mtime: Duration::ZERO,
+        ctime: Duration::ZERO,
+    };
+    let type_bits = if is_pipe { S_IFIFO } else { S_IFCHR };
+    Ok((stat, type_bits | stat.perm as u32))
+}
+
+fn with_mode(stat: InodeStat) -> (InodeStat, u32) {
+    let type_bits = match stat.type_ {
+        InodeType::File => S_IFREG,
+        InodeType::Directory => S_IFDIR,
+        InodeType::SymbolLink => S_IFLNK,
+    };
+    (stat, type_bits | stat.perm as u32)
+}
+
+fn to_stat((stat, mode): &(InodeStat, u32)) -> Stat {
+    Stat {
+        ino: stat.ino,
+        mode: *mode,
+        nlink: stat.nlink,
+        uid: stat.uid,
+        gid: stat.gid,
+        size: stat.size as i64,
+        blksize: stat.block_size as i32,
+        blocks: stat.blocks as i64,
+        atime: stat.atime.as_secs() as i64,
+        atime_nsec: stat.atime.subsec_nanos() as u64,
+        mtime: stat.mtime.as_secs() as i64,
+        mtime_nsec: stat.mtime.subsec_nanos() as u64,
+        ctime: stat.ctime.as_secs() as i64,
+        ctime_nsec: stat.ctime.subsec_nanos() as u64,
+        ..Default::default()
+    }
+}
+
+fn to_statx_timestamp(time: Duration) -> StatxTimestamp {
+    StatxTimestamp {
+        sec: time.as_secs() as i64,
+        nsec: time.subsec_nanos(),
+        reserved: 0,
+    }
+}
+
+fn write_user<T: Pod>(
+    current_process: &Arc<Process>,
+    addr: Vaddr,
+    val: &T,
+) -> Result<SyscallReturn> {
+    write_val_to_user(current_process.memory_space().vm_space(), addr, val)?;
+    Ok(SyscallReturn(0))
+}
@@ -0,0 +1,27 @@
+use alloc::sync::Arc;
+use log::debug;
+
+use crate::error::{Errno, Error, Result};
+use crate::fs::file_table::FileDescriptor;
+use crate::process::Process;
+use crate::syscall::SyscallReturn;
+
+pub fn sys_sync() -> Result<SyscallReturn> {
+    debug!("[SYS_SYNC]");
+
+    crate::fs::sync();
+    Ok(SyscallReturn(0))
+}
+
+/// Serves both `fsync` and `fdatasync`, as metadata is committed with the data
+/// anyway.
+pub fn sys_fsync(fd: FileDescriptor, current_process: &Arc<Process>) -> Result<SyscallReturn> {
+    debug!("[SYS_FSYNC] fd: {}", fd);
+
+    let inode = current_process
+        .file(fd)?
+        .as_inode()
+        .ok_or(Error::new(Errno::EINVAL))?;
+    inode.sync()?;
+    Ok(SyscallReturn(0))
+}
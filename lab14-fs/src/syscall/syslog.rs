@@ -0,0 +1,60 @@
+use alloc::{sync::Arc, vec};
+use log::debug;
+use ostd::mm::{FallibleVmWrite, Vaddr, VmReader};
+
+use crate::error::{Errno, Error, Result};
+use crate::logger;
+use crate::process::Process;
+use crate::syscall::SyscallReturn;
+
+const SYSLOG_ACTION_CLOSE: i32 = 0;
+const SYSLOG_ACTION_OPEN: i32 = 1;
+const SYSLOG_ACTION_READ_ALL: i32 = 3;
+const SYSLOG_ACTION_READ_CLEAR: i32 = 4;
+const SYSLOG_ACTION_CLEAR: i32 = 5;
+const SYSLOG_ACTION_SIZE_UNREAD: i32 = 9;
+const SYSLOG_ACTION_SIZE_BUFFER: i32 = 10;
+
+/// Reads or clears the kernel log, as `dmesg` does.
+///
+/// Nothing is read destructively, so every record kept counts as unread, and
+/// `SYSLOG_ACTION_READ` and the console level actions are not supported.
+pub fn sys_syslog(
+    action: i32,
+    buf_addr: Vaddr,
+    len: i32,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!(
+        "[SYS_SYSLOG] action: {}, buf_addr: {:#x}, len: {}",
+        action, buf_addr, len
+    );
+
+    let ret = match action {
+        SYSLOG_ACTION_CLOSE | SYSLOG_ACTION_OPEN => 0,
+        SYSLOG_ACTION_READ_ALL | SYSLOG_ACTION_READ_CLEAR => {
+            let len = usize::try_from(len).map_err(|_| Error::new(Errno::EINVAL))?;
+            let mut buf = vec![0; len.min(logger::HISTORY_CAPACITY)];
+            let read = logger::read_history(&mut buf, action == SYSLOG_ACTION_READ_CLEAR);
+            current_process
+                .memory_space()
+                .vm_space()
+                .writer(buf_addr, read)
+                .and_then(|mut writer| {
+                    writer
+                        .write_fallible(&mut VmReader::from(&buf[..read]))
+                        .map_err(|(err, _)| err)
+                })
+                .map_err(|_| Error::new(Errno::EFAULT))?;
+            read
+        }
+        SYSLOG_ACTION_CLEAR => {
+            logger::clear_history();
+            0
+        }
+        SYSLOG_ACTION_SIZE_UNREAD => logger::history_len(),
+        SYSLOG_ACTION_SIZE_BUFFER => logger::HISTORY_CAPACITY,
+        _ => return Err(Error::new(Errno::EINVAL)),
+    };
+    Ok(SyscallReturn(ret as _))
+}
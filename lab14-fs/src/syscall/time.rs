@@ -18,15 +18,20 @@ pub fn sys_clock_gettime(
 
     let clock = ClockId::try_from(clockid).unwrap();
 
-    let vm_space = current_process.memory_space().vm_space();
+    let memory_space = current_process.memory_space();
+    let vm_space = memory_space.vm_space();
     let mut writer = vm_space
         .writer(timespec_addr, size_of::<timespec_t>())
         .unwrap();
 
     match clock {
         ClockId::CLOCK_REALTIME => todo!(),
-        ClockId::CLOCK_MONOTONIC => {
-            // Just use the Jiffies
+        ClockId::CLOCK_MONOTONIC | ClockId::CLOCK_MONOTONIC_RAW | ClockId::CLOCK_BOOTTIME => {
+            writer
+                .write_val(&timespec_t::from(crate::clock::monotonic_time()))
+                .unwrap();
+        }
+        ClockId::CLOCK_MONOTONIC_COARSE => {
             let duration = Jiffies::elapsed().as_duration();
             writer.write_val(&timespec_t::from(duration)).unwrap();
         }
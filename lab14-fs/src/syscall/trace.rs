@@ -0,0 +1,186 @@
+//! Syscall tracing, built with the `syscall-trace` feature.
+//!
+//! Each CPU records the syscalls it handles in a ring of recent calls and in
+//! per-syscall counts and latency histograms. Only the CPU a record belongs to
+//! writes it, with preemption disabled, so recording takes no lock; a reader
+//! on another CPU may see a record being overwritten, which is fine for
+//! statistics.
+//!
+//! `/proc/syscalls` shows the totals of all CPUs and the most recent calls.
+//! Times are in ticks of the `time` counter.
+
+use core::{
+    fmt::Write,
+    sync::atomic::{AtomicU64, AtomicUsize, Ordering},
+};
+
+use alloc::{boxed::Box, string::String, vec::Vec};
+use ostd::{
+    arch::read_tsc,
+    cpu::{PinCurrentCpu, all_cpus},
+    task::disable_preempt,
+};
+use spin::Once;
+
+/// Syscalls numbered from here on are not counted.
+const MAX_TRACED_SYSCALLS: usize = 430;
+
+/// Latencies of up to `2^HISTOGRAM_BUCKETS - 1` ticks are told apart; longer
+/// ones share the last bucket.
+const HISTOGRAM_BUCKETS: usize = 24;
+
+/// The number of recent syscalls each CPU remembers.
+const TRACE_RING_LEN: usize = 256;
+
+struct SyscallStats {
+    count: AtomicU64,
+    total_ticks: AtomicU64,
+    /// Bucket `i` counts the calls that took `2^(i-1)` to `2^i - 1` ticks.
+    histogram: [AtomicU64; HISTOGRAM_BUCKETS],
+}
+
+struct TraceRecord {
+    /// The syscall number in the low half, and the pid in the high half.
+    nr_pid: AtomicU64,
+    entry: AtomicU64,
+    exit: AtomicU64,
+    ret: AtomicU64,
+}
+
+struct CpuTrace {
+    stats: Box<[SyscallStats]>,
+    ring: Box<[TraceRecord]>,
+    /// The number of records ever written to `ring`.
+    next: AtomicUsize,
+}
+
+static TRACES: Once<Box<[CpuTrace]>> = Once::new();
+
+fn traces() -> &'static [CpuTrace] {
+    TRACES.call_once(|| {
+        all_cpus()
+            .map(|_| CpuTrace {
+                stats: (0..MAX_TRACED_SYSCALLS)
+                    .map(|_| SyscallStats {
+                        count: AtomicU64::new(0),
+                        total_ticks: AtomicU64::new(0),
+                        histogram: core::array::from_fn(|_| AtomicU64::new(0)),
+                    })
+                    .collect(),
+                ring: (0..TRACE_RING_LEN)
+                    .map(|_| TraceRecord {
+                        nr_pid: AtomicU64::new(0),
+                        entry: AtomicU64::new(0),
+                        exit: AtomicU64::new(0),
+                        ret: AtomicU64::new(0),
+                    })
+                    .collect(),
+                next: AtomicUsize::new(0),
+            })
+            .collect()
+    })
+}
+
+/// Returns the time a syscall is entered at, to pass to [`record`].
+pub fn now() -> u64 {
+    read_tsc()
+}
+
+/// Records a syscall that was entered at `entry` and has just returned `ret`.
+pub fn record(nr: usize, pid: usize, entry: u64, ret: isize) {
+    let exit = read_tsc();
+    let guard = disable_preempt();
+    let trace = &traces()[guard.current_cpu().as_usize()];
+
+    // This CPU is the only writer, so plain loads and stores are enough.
+    let next = trace.next.load(Ordering::Relaxed);
+    let slot = &trace.ring[next % TRACE_RING_LEN];
+    slot.nr_pid.store(
+        (nr as u64 & 0xFFFF_FFFF) | ((pid as u64) << 32),
+        Ordering::Relaxed,
+    );
+    slot.entry.store(entry, Ordering::Relaxed);
+    slot.exit.store(exit, Ordering::Relaxed);
+    slot.ret.store(ret as u64, Ordering::Relaxed);
+    trace.next.store(next + 1, Ordering::Release);
+
+    let Some(stats) = trace.stats.get(nr) else {
+        return;
+    };
+    let ticks = exit.saturating_sub(entry);
+    let bucket = ((u64::BITS - ticks.leading_zeros()) as usize).min(HISTOGRAM_BUCKETS - 1);
+    let add = |counter: &AtomicU64, value: u64| {
+        counter.store(counter.load(Ordering::Relaxed) + value, Ordering::Relaxed);
+    };
+    add(&stats.count, 1);
+    add(&stats.total_ticks, ticks);
+    add(&stats.histogram[bucket], 1);
+}
+
+/// Renders the contents of `/proc/syscalls`.
+pub fn report() -> String {
+    let traces = traces();
+    let mut out = String::new();
+
+    let _ = writeln!(
+        out,
+        "{:>4} {:>10} {:>12}  histogram (bucket i: 2^(i-1) to 2^i-1 ticks)",
+        "nr", "count", "avg ticks"
+    );
+    for nr in 0..MAX_TRACED_SYSCALLS {
+        let sum = |counter: fn(&SyscallStats) -> &AtomicU64| -> u64 {
+            traces
+                .iter()
+                .map(|trace| counter(&trace.stats[nr]).load(Ordering::Relaxed))
+                .sum()
+        };
+        let count = sum(|stats| &stats.count);
+        if count == 0 {
+            continue;
+        }
+        let total_ticks = sum(|stats| &stats.total_ticks);
+        let _ = write!(out, "{:>4} {:>10} {:>12} ", nr, count, total_ticks / count);
+        for bucket in 0..HISTOGRAM_BUCKETS {
+            let calls: u64 = traces
+                .iter()
+                .map(|trace| trace.stats[nr].histogram[bucket].load(Ordering::Relaxed))
+                .sum();
+            if calls > 0 {
+                let _ = write!(out, " {}:{}", bucket, calls);
+            }
+        }
+        out.push('\n');
+    }
+
+    let _ = writeln!(
+        out,
+        "\n{:>3} {:>4} {:>6} {:>16} {:>10} {:>8}",
+        "cpu", "nr", "pid", "entry", "ticks", "ret"
+    );
+    let mut recent = Vec::new();
+    for (cpu, trace) in traces.iter().enumerate() {
+        let next = trace.next.load(Ordering::Acquire);
+        for index in next.saturating_sub(TRACE_RING_LEN)..next {
+            let slot = &trace.ring[index % TRACE_RING_LEN];
+            let nr_pid = slot.nr_pid.load(Ordering::Relaxed);
+            let entry = slot.entry.load(Ordering::Relaxed);
+            let exit = slot.exit.load(Ordering::Relaxed);
+            let ret = slot.ret.load(Ordering::Relaxed) as i64;
+            recent.push((entry, cpu, nr_pid, exit.saturating_sub(entry), ret));
+        }
+    }
+    recent.sort_unstable_by_key(|&(entry, ..)| entry);
+    for (entry, cpu, nr_pid, ticks, ret) in recent {
+        let _ = writeln!(
+            out,
+            "{:>3} {:>4} {:>6} {:>16} {:>10} {:>8}",
+            cpu,
+            nr_pid & 0xFFFF_FFFF,
+            nr_pid >> 32,
+            entry,
+            ticks,
+            ret
+        );
+    }
+    out
+}
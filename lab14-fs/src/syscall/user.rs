@@ -0,0 +1,150 @@
+//! Access to the memory of the calling process.
+//!
+//! Each helper validates its whole range once, when making the reader or
+//! writer, and then copies through it with fallible accesses that need no
+//! further checks, so a syscall touching a range many times should make one
+//! reader or writer for it and keep it. Faults surface as `EFAULT`.
+//!
+//! Strings are copied a word at a time up to their NUL, see
+//! [`strncpy_from_user`]. Paths go into a buffer each thread keeps for them,
+//! so that path syscalls allocate nothing after a thread's first one.
+
+use core::ops::Deref;
+
+use alloc::{boxed::Box, sync::Arc, vec};
+use ostd::{
+    Pod,
+    mm::{MAX_USERSPACE_VADDR, Vaddr, VmReader, VmSpace, VmWriter},
+};
+
+use crate::{
+    error::{Errno, Error, Result},
+    process::{Thread, current_thread},
+};
+
+/// The longest path, with its NUL.
+pub const PATH_MAX: usize = 4096;
+
+const WORD_SIZE: usize = size_of::<u64>();
+/// A byte of 1, and one of 0x80, in each byte of a word.
+const LOW_BITS: u64 = u64::from_ne_bytes([0x01; WORD_SIZE]);
+const HIGH_BITS: u64 = u64::from_ne_bytes([0x80; WORD_SIZE]);
+
+pub fn user_reader(vm_space: &VmSpace, addr: Vaddr, len: usize) -> Result<VmReader<'_>> {
+    vm_space
+        .reader(addr, len)
+        .map_err(|_| Error::new(Errno::EFAULT))
+}
+
+pub fn user_writer(vm_space: &VmSpace, addr: Vaddr, len: usize) -> Result<VmWriter<'_>> {
+    vm_space
+        .writer(addr, len)
+        .map_err(|_| Error::new(Errno::EFAULT))
+}
+
+pub fn read_val_from_user<T: Pod>(vm_space: &VmSpace, addr: Vaddr) -> Result<T> {
+    user_reader(vm_space, addr, size_of::<T>())?
+        .read_val()
+        .map_err(|_| Error::new(Errno::EFAULT))
+}
+
+pub fn write_val_to_user<T: Pod>(vm_space: &VmSpace, addr: Vaddr, val: &T) -> Result<()> {
+    user_writer(vm_space, addr, size_of::<T>())?
+        .write_val(val)
+        .map_err(|_| Error::new(Errno::EFAULT))
+}
+
+/// Copies the NUL-terminated string at `addr` into `buf`, NUL included, and
+/// returns its length without the NUL.
+///
+/// Copies a word at a time from the first word boundary on, and stops at the
+/// word holding the NUL. An aligned word never straddles a page, so a string
+/// ending right before an unmapped page is copied whole.
+/// Fails with `ENAMETOOLONG` if `buf` cannot hold the string and its NUL.
+pub fn strncpy_from_user(vm_space: &VmSpace, addr: Vaddr, buf: &mut [u8]) -> Result<usize> {
+    if addr >= MAX_USERSPACE_VADDR {
+        return Err(Error::new(Errno::EFAULT));
+    }
+    let limit = buf.len().min(MAX_USERSPACE_VADDR - addr);
+    let mut reader = user_reader(vm_space, addr, limit)?;
+    let efault = |_| Error::new(Errno::EFAULT);
+
+    let mut len = 0;
+    while len < limit && (addr + len) % WORD_SIZE != 0 {
+        let byte: u8 = reader.read_val().map_err(efault)?;
+        buf[len] = byte;
+        if byte == 0 {
+            return Ok(len);
+        }
+        len += 1;
+    }
+    while len + WORD_SIZE <= limit {
+        let word: u64 = reader.read_val().map_err(efault)?;
+        buf[len..len + WORD_SIZE].copy_from_slice(&word.to_ne_bytes());
+        // The lowest byte flagged is the first zero byte; only bytes above
+        // a zero one may be flagged wrongly.
+        let zeros = word.wrapping_sub(LOW_BITS) & !word & HIGH_BITS;
+        if zeros != 0 {
+            return Ok(len + zeros.trailing_zeros() as usize / 8);
+        }
+        len += WORD_SIZE;
+    }
+    while len < limit {
+        let byte: u8 = reader.read_val().map_err(efault)?;
+        buf[len] = byte;
+        if byte == 0 {
+            return Ok(len);
+        }
+        len += 1;
+    }
+    Err(Error::new(if limit < buf.len() {
+        Errno::EFAULT
+    } else {
+        Errno::ENAMETOOLONG
+    }))
+}
+
+/// A path copied from user space, in the path buffer of the thread, which
+/// gets the buffer back once this is dropped.
+pub struct UserPath {
+    thread: Arc<Thread>,
+    buf: Option<Box<[u8]>>,
+    len: usize,
+}
+
+/// Copies the path at `addr` from user space, see [`strncpy_from_user`].
+pub fn read_user_path(vm_space: &VmSpace, addr: Vaddr) -> Result<UserPath> {
+    let thread = current_thread();
+    let mut buf = thread
+        .take_path_buf()
+        .unwrap_or_else(|| vec![0; PATH_MAX].into_boxed_slice());
+    let copied = strncpy_from_user(vm_space, addr, &mut buf);
+    // Give the buffer back even if the copy fails.
+    let mut path = UserPath {
+        thread,
+        buf: Some(buf),
+        len: 0,
+    };
+    let len = copied?;
+    core::str::from_utf8(&path.buf.as_ref().unwrap()[..len])
+        .map_err(|_| Error::new(Errno::EINVAL))?;
+    path.len = len;
+    Ok(path)
+}
+
+impl Deref for UserPath {
+    type Target = str;
+
+    fn deref(&self) -> &str {
+        // Checked to be UTF-8 when copied.
+        core::str::from_utf8(&self.buf.as_ref().unwrap()[..self.len]).unwrap()
+    }
+}
+
+impl Drop for UserPath {
+    fn drop(&mut self) {
+        if let Some(buf) = self.buf.take() {
+            self.thread.put_path_buf(buf);
+        }
+    }
+}
@@ -5,6 +5,7 @@ use ostd::mm::Vaddr;
 use crate::error::Result;
 use crate::process::Process;
 use crate::syscall::SyscallReturn;
+use crate::syscall::getrusage::write_rusage;
 
 pub fn sys_wait4(
     wait_pid: i32,
@@ -18,11 +19,11 @@ pub fn sys_wait4(
         wait_pid, exit_status_ptr, wait_options, rusage_addr
     );
 
-    let (pid, exit_code) = current_process.wait(wait_pid)?;
+    let (pid, exit_code, usage) = current_process.wait(wait_pid)?;
 
     // Write the exit code to the user space
     if exit_status_ptr != 0 {
-        current_process.memory_space().vm_space().activate();
+        current_process.memory_space().activate();
         current_process
             .memory_space()
             .vm_space()
@@ -32,5 +33,9 @@ pub fn sys_wait4(
             .unwrap();
     }
 
+    if rusage_addr != 0 {
+        write_rusage(current_process, rusage_addr, &usage)?;
+    }
+
     Ok(SyscallReturn(pid as _))
 }
@@ -1,25 +1,13 @@
-use core::str;
-
-use alloc::{sync::Arc, vec};
+use alloc::sync::Arc;
 use log::debug;
-use ostd::{
-    Pod, early_print,
-    mm::{FallibleVmRead, Vaddr, VmWriter},
-};
+use ostd::mm::Vaddr;
 
 use crate::{
     error::{Errno, Error, Result},
     process::Process,
-    syscall::SyscallReturn,
+    syscall::{SyscallReturn, iovec::io_vec_readers, user::user_reader},
 };
 
-#[repr(C)]
-#[derive(Debug, Clone, Copy, Pod)]
-pub struct IoVec {
-    base: Vaddr,
-    len: usize,
-}
-
 pub fn sys_writev(
     fd: i32,
     io_vec_ptr: Vaddr,
@@ -31,34 +19,38 @@ pub fn sys_writev(
         fd, io_vec_ptr, io_vec_count
     );
 
-    let mut total_len = 0;
+    let memory_space = current_process.memory_space();
+    let readers = io_vec_readers(memory_space.vm_space(), io_vec_ptr, io_vec_count)?;
+
+    let file = current_process.file(fd)?;
+    let write_len = file.write_vectored(readers)?;
+    current_process.usage().count_bytes(true, write_len);
+
+    Ok(SyscallReturn(write_len as _))
+}
+
+/// Writes the segments at `offset` without moving the file offset.
+pub fn sys_pwritev(
+    fd: i32,
+    io_vec_ptr: Vaddr,
+    io_vec_count: usize,
+    offset: isize,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!(
+        "[SYS_PWRITEV] Fd: {:?}, vec ptr: {:x?}, vec count: {:?}, offset: {:?}",
+        fd, io_vec_ptr, io_vec_count, offset
+    );
 
-    let mut current_addr = io_vec_ptr;
+    let offset = usize::try_from(offset).map_err(|_| Error::new(Errno::EINVAL))?;
     let memory_space = current_process.memory_space();
+    let readers = io_vec_readers(memory_space.vm_space(), io_vec_ptr, io_vec_count)?;
 
-    for _ in 0..io_vec_count {
-        let mut reader = memory_space
-            .vm_space()
-            .reader(current_addr, size_of::<IoVec>())
-            .unwrap();
-        let io_vec: IoVec = reader.read_val().unwrap();
-
-        let mut buf = vec![0u8; io_vec.len];
-
-        let mut buffer = memory_space
-            .vm_space()
-            .reader(io_vec.base, io_vec.len)
-            .unwrap();
-        buffer
-            .read_fallible(&mut VmWriter::from(&mut buf as &mut [u8]))
-            .unwrap();
-
-        total_len += io_vec.len;
-        early_print!("{}", str::from_utf8(&buf).unwrap());
-        current_addr += size_of::<IoVec>();
-    }
-
-    Ok(SyscallReturn(total_len as _))
+    let file = current_process.file(fd)?;
+    let write_len = file.write_vectored_at(offset, readers)?;
+    current_process.usage().count_bytes(true, write_len);
+
+    Ok(SyscallReturn(write_len as _))
 }
 
 pub fn sys_write(
@@ -72,15 +64,36 @@ pub fn sys_write(
         fd, buf, count
     );
 
-    let reader = current_process
-        .memory_space()
-        .vm_space()
-        .reader(buf, count)
-        .unwrap();
+    let memory_space = current_process.memory_space();
+    let reader = user_reader(memory_space.vm_space(), buf, count)?;
+
+    let file = current_process.file(fd)?;
+    let write_len = file.write(reader)?;
+    current_process.usage().count_bytes(true, write_len);
+
+    Ok(SyscallReturn(write_len as _))
+}
+
+/// Writes at `offset` without moving the file offset.
+pub fn sys_pwrite64(
+    fd: i32,
+    buf: Vaddr,
+    count: usize,
+    offset: isize,
+    current_process: &Arc<Process>,
+) -> Result<SyscallReturn> {
+    debug!(
+        "[SYS_PWRITE64] Fd: {:?}, buf: {:x?}, count: {:?}, offset: {:?}",
+        fd, buf, count, offset
+    );
+
+    let offset = usize::try_from(offset).map_err(|_| Error::new(Errno::EINVAL))?;
+    let memory_space = current_process.memory_space();
+    let reader = user_reader(memory_space.vm_space(), buf, count)?;
 
-    let file_table = current_process.file_table();
-    let file = file_table.get(fd).ok_or(Error::new(Errno::EBADF))?;
-    let write_len = file.file().write(reader)?;
+    let file = current_process.file(fd)?;
+    let write_len = file.write_at(offset, reader)?;
+    current_process.usage().count_bytes(true, write_len);
 
     Ok(SyscallReturn(write_len as _))
 }
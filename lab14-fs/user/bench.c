@@ -0,0 +1,308 @@
+// Microbenchmarks of the kernel, one JSON object per line:
+//
+//   {"bench":"pipe_latency","param":64,"unit":"ns","reps":200,
+//    "min":..,"p50":..,"p90":..,"p99":..,"max":..,"mean":..}
+//
+// Each benchmark runs its warmup iterations first, then times each of its
+// repetitions. "param" is the benchmark's size parameter, or 0 if it has none.
+// The ext2 benchmarks read /bench.dat, which `make blk_img` creates. Times come
+// from the clock page, so reading the clock adds no syscall to what is timed.
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "clock_page.h"
+
+#define MAX_REPS 1000
+#define PAGE_SIZE 4096
+
+static long long now_ns(void) {
+    return clock_monotonic_ns();
+}
+
+static int compare(const void *a, const void *b) {
+    long long x = *(const long long *)a, y = *(const long long *)b;
+    return (x > y) - (x < y);
+}
+
+static long long samples[MAX_REPS];
+
+// Sorts the samples and prints their distribution.
+static void report(const char *name, long param, const char *unit, int reps) {
+    long long sum = 0;
+    for (int i = 0; i < reps; i++) {
+        sum += samples[i];
+    }
+    qsort(samples, reps, sizeof(samples[0]), compare);
+    printf("{\"bench\":\"%s\",\"param\":%ld,\"unit\":\"%s\",\"reps\":%d,"
+           "\"min\":%lld,\"p50\":%lld,\"p90\":%lld,\"p99\":%lld,\"max\":%lld,"
+           "\"mean\":%lld}\n",
+           name, param, unit, reps, samples[0], samples[reps / 2],
+           samples[reps * 90 / 100], samples[reps * 99 / 100], samples[reps - 1],
+           sum / reps);
+}
+
+// A benchmark step, timed once per repetition. Returns its result in the
+// benchmark's unit, or a negative value on failure.
+typedef long long (*step_fn)(long param);
+
+struct bench {
+    const char *name;
+    step_fn step;
+    long param;
+    const char *unit;
+    int warmup;
+    int reps;
+};
+
+static long long fork_wait(long param) {
+    long long start = now_ns();
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        _exit(0);
+    }
+    waitpid(pid, NULL, 0);
+    return now_ns() - start;
+}
+
+static long long vfork_exec(long param) {
+    long long start = now_ns();
+    pid_t pid = vfork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        char *argv[] = {"nop", NULL};
+        execve("nop", argv, NULL);
+        _exit(1);
+    }
+    waitpid(pid, NULL, 0);
+    return now_ns() - start;
+}
+
+static int ping[2], pong[2];
+static pid_t echo_pid = -1;
+
+// Starts a child that echoes every message of `param` bytes back.
+static int start_echo(long param) {
+    if (pipe(ping) < 0 || pipe(pong) < 0) {
+        return -1;
+    }
+    echo_pid = fork();
+    if (echo_pid < 0) {
+        return -1;
+    }
+    if (echo_pid == 0) {
+        static char buf[65536];
+        close(ping[1]);
+        close(pong[0]);
+        for (;;) {
+            long done = 0;
+            while (done < param) {
+                long len = read(ping[0], buf + done, param - done);
+                if (len <= 0) {
+                    _exit(0);
+                }
+                done += len;
+            }
+            write(pong[1], buf, param);
+        }
+    }
+    close(ping[0]);
+    close(pong[1]);
+    return 0;
+}
+
+static void stop_echo(void) {
+    close(ping[1]);
+    close(pong[0]);
+    waitpid(echo_pid, NULL, 0);
+    echo_pid = -1;
+}
+
+// A round trip of `param` bytes through the echo child.
+static long long pipe_latency(long param) {
+    static char buf[65536];
+    long long start = now_ns();
+    if (write(ping[1], buf, param) != param) {
+        return -1;
+    }
+    long done = 0;
+    while (done < param) {
+        long len = read(pong[0], buf + done, param - done);
+        if (len <= 0) {
+            return -1;
+        }
+        done += len;
+    }
+    return now_ns() - start;
+}
+
+// Moves 1 MiB through a pipe to a child in writes of `param` bytes, in MiB/s.
+static long long pipe_throughput(long param) {
+    static char buf[65536];
+    const long total = 1 << 20;
+    int fds[2];
+    if (pipe(fds) < 0) {
+        return -1;
+    }
+    long long start = now_ns();
+    pid_t pid = fork();
+    if (pid < 0) {
+        return -1;
+    }
+    if (pid == 0) {
+        close(fds[1]);
+        while (read(fds[0], buf, sizeof(buf)) > 0) {
+        }
+        _exit(0);
+    }
+    close(fds[0]);
+    for (long done = 0; done < total; done += param) {
+        if (write(fds[1], buf, param) != param) {
+            return -1;
+        }
+    }
+    close(fds[1]);
+    waitpid(pid, NULL, 0);
+    long long elapsed = now_ns() - start;
+    return total * 1000000000LL / (elapsed > 0 ? elapsed : 1) >> 20;
+}
+
+static char *fault_area;
+
+// Touches `param` fresh anonymous pages, in ns per fault. The pages are
+// discarded again afterwards, so the next repetition faults them in anew.
+static long long page_faults(long param) {
+    if (fault_area == NULL) {
+        fault_area = mmap(NULL, param * PAGE_SIZE, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (fault_area == MAP_FAILED) {
+            fault_area = NULL;
+            return -1;
+        }
+    }
+    long long start = now_ns();
+    for (long i = 0; i < param; i++) {
+        fault_area[i * PAGE_SIZE] = 1;
+    }
+    long long elapsed = now_ns() - start;
+    madvise(fault_area, param * PAGE_SIZE, MADV_DONTNEED);
+    return elapsed / param;
+}
+
+// Reads /bench.dat from start to end in reads of `param` bytes, in MiB/s.
+static long long ext2_seq_read(long param) {
+    static char buf[65536];
+    int fd = open("/bench.dat", O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    long total = 0;
+    long long start = now_ns();
+    for (;;) {
+        long len = read(fd, buf, param);
+        if (len <= 0) {
+            break;
+        }
+        total += len;
+    }
+    long long elapsed = now_ns() - start;
+    close(fd);
+    return total * 1000000000LL / (elapsed > 0 ? elapsed : 1) >> 20;
+}
+
+// One read of `param` bytes at a random aligned offset in /bench.dat.
+static long long ext2_random_read(long param) {
+    static char buf[65536];
+    static int fd = -1;
+    static long size;
+    if (fd < 0) {
+        fd = open("/bench.dat", O_RDONLY);
+        if (fd < 0) {
+            return -1;
+        }
+        size = lseek(fd, 0, SEEK_END);
+        if (size < param) {
+            return -1;
+        }
+    }
+    long offset = (long)(rand() % (size / param)) * param;
+    long long start = now_ns();
+    if (pread(fd, buf, param, offset) != param) {
+        return -1;
+    }
+    return now_ns() - start;
+}
+
+static long long openat_lookup(long param) {
+    long long start = now_ns();
+    int fd = open("/hello.txt", O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    long long elapsed = now_ns() - start;
+    close(fd);
+    return elapsed;
+}
+
+static const struct bench benches[] = {
+    {"fork_wait", fork_wait, 0, "ns", 5, 100},
+    {"vfork_exec", vfork_exec, 0, "ns", 5, 100},
+    {"pipe_latency", pipe_latency, 64, "ns", 20, 500},
+    {"pipe_latency", pipe_latency, 4096, "ns", 20, 500},
+    {"pipe_throughput", pipe_throughput, 4096, "MiB/s", 1, 20},
+    {"pipe_throughput", pipe_throughput, 65536, "MiB/s", 1, 20},
+    {"page_fault", page_faults, 256, "ns", 2, 50},
+    {"ext2_seq_read", ext2_seq_read, 4096, "MiB/s", 1, 10},
+    {"ext2_seq_read", ext2_seq_read, 65536, "MiB/s", 1, 10},
+    {"ext2_random_read", ext2_random_read, 4096, "ns", 10, 500},
+    {"openat_lookup", openat_lookup, 0, "ns", 10, 500},
+};
+
+static int run(const struct bench *bench) {
+    int echo = bench->step == pipe_latency;
+    if (echo && start_echo(bench->param) < 0) {
+        return -1;
+    }
+    for (int i = 0; i < bench->warmup; i++) {
+        if (bench->step(bench->param) < 0) {
+            return -1;
+        }
+    }
+    for (int i = 0; i < bench->reps; i++) {
+        samples[i] = bench->step(bench->param);
+        if (samples[i] < 0) {
+            return -1;
+        }
+    }
+    if (echo) {
+        stop_echo();
+    }
+    report(bench->name, bench->param, bench->unit, bench->reps);
+    return 0;
+}
+
+int main() {
+    // Disable buffer in STDOUT
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    int failed = 0;
+    for (unsigned i = 0; i < sizeof(benches) / sizeof(benches[0]); i++) {
+        if (run(&benches[i]) < 0) {
+            printf("{\"bench\":\"%s\",\"param\":%ld,\"error\":\"failed\"}\n",
+                   benches[i].name, benches[i].param);
+            failed = 1;
+        }
+    }
+    return failed;
+}
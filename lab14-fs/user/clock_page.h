@@ -0,0 +1,40 @@
+// Reads the monotonic clock from the clock page the kernel maps into every
+// process, without making a syscall. Falls back to clock_gettime if the page
+// is missing or the kernel does not know the timebase frequency.
+//
+// Keep the layout in sync with `ClockPageLayout` in src/clock.rs.
+
+#ifndef CLOCK_PAGE_H
+#define CLOCK_PAGE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#define CLOCK_PAGE_ADDR (0x4000000000UL - 2 * 4096)
+#define CLOCK_PAGE_MAGIC 0x4b4c434f504d4554ULL // "TEMPOCLK"
+
+struct clock_page {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t timebase_frequency;
+    uint64_t time_offset;
+};
+
+static inline long long clock_monotonic_ns(void) {
+    const volatile struct clock_page *page = (const volatile struct clock_page *)CLOCK_PAGE_ADDR;
+    if (page->magic == CLOCK_PAGE_MAGIC && page->timebase_frequency != 0) {
+        uint64_t ticks;
+        __asm__ volatile("rdtime %0" : "=r"(ticks));
+        ticks -= page->time_offset;
+        uint64_t frequency = page->timebase_frequency;
+        return (long long)(ticks / frequency * 1000000000ULL +
+                           ticks % frequency * 1000000000ULL / frequency);
+    }
+
+    struct timespec ts = {0, 0};
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (long long)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+#endif
@@ -5,12 +5,12 @@
 #include <sys/wait.h>
 #include <time.h>
 
+#include "clock_page.h"
+
 #define NUM_FORKS 100000
 
 long long get_current_time_us() {
-    struct timespec ts = {0, 0};
-    clock_gettime(CLOCK_MONOTONIC, &ts);
-    return (long long)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+    return clock_monotonic_ns() / 1000;
 }
 
 int main() {
@@ -0,0 +1,5 @@
+// Exits at once. The program the exec benchmarks run.
+
+int main() {
+    return 0;
+}
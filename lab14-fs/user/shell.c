@@ -14,16 +14,17 @@ int execute(char *command)
         exit(0);
     }
 
-    pid_t pid = fork();
+    // The child only calls execl, so let it borrow our address space.
+    pid_t pid = vfork();
     if (pid < 0)
     {
-        perror("Fork failed");
+        perror("Vfork failed");
         return -1;
     }
     else if (pid == 0)
     {
         execl(command, NULL);
-        exit(EXIT_FAILURE);
+        _exit(EXIT_FAILURE);
     }
     else
     {
@@ -0,0 +1,57 @@
+// Threads sharing a counter under a mutex, and a condition variable that
+// releases them together. Contended locks and joins block in futex.
+
+#include <pthread.h>
+#include <stdio.h>
+#include <unistd.h>
+
+#define NUM_THREADS 4
+#define INCREMENTS 10000
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start_cond = PTHREAD_COND_INITIALIZER;
+static int started = 0;
+static long counter = 0;
+
+static void *worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&lock);
+    while (!started) {
+        pthread_cond_wait(&start_cond, &lock);
+    }
+    pthread_mutex_unlock(&lock);
+
+    for (int i = 0; i < INCREMENTS; i++) {
+        pthread_mutex_lock(&lock);
+        counter++;
+        pthread_mutex_unlock(&lock);
+    }
+    return NULL;
+}
+
+int main() {
+    // Disable buffer in STDOUT
+    setvbuf(stdout, NULL, _IONBF, 0);
+
+    pthread_t threads[NUM_THREADS];
+    for (int i = 0; i < NUM_THREADS; i++) {
+        if (pthread_create(&threads[i], NULL, worker, NULL) != 0) {
+            printf("thread_test: pthread_create failed\n");
+            return 1;
+        }
+    }
+
+    pthread_mutex_lock(&lock);
+    started = 1;
+    pthread_cond_broadcast(&start_cond);
+    pthread_mutex_unlock(&lock);
+
+    for (int i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+    }
+
+    long expected = (long)NUM_THREADS * INCREMENTS;
+    printf("thread_test: pid %d, counter %ld, expected %ld: %s\n", getpid(), counter, expected,
+           counter == expected ? "PASS" : "FAIL");
+    return counter == expected ? 0 : 1;
+}
@@ -1,10 +1,15 @@
-use alloc::sync::Arc;
-use ostd::sync::{LocalIrqDisabled, SpinLock, WaitQueue};
+use core::sync::atomic::{AtomicUsize, Ordering};
+
+use ostd::sync::WaitQueue;
 
 /// 信号量同步原语
 pub struct Semaphore {
-    /// 计数值，使用自旋锁保护，并禁用中断以防止死锁
-    count: SpinLock<usize, LocalIrqDisabled>,
+    /// 计数值，使用原子操作，无竞争时获取和释放都不需要加锁
+    count: AtomicUsize,
+    /// 正在（或即将）睡眠的等待者数量，为 0 时释放操作跳过唤醒
+    waiters: AtomicUsize,
+    /// 其中一次需要多个资源的等待者数量
+    batch_waiters: AtomicUsize,
     /// 等待队列，用于阻塞和唤醒线程
     queue: WaitQueue,
 }
@@ -13,65 +18,108 @@ impl Semaphore {
     /// 创建一个新的信号量，设置初始计数值
     pub fn new(count: usize) -> Self {
         Self {
-            count: SpinLock::new(count),
+            count: AtomicUsize::new(count),
+            waiters: AtomicUsize::new(0),
+            batch_waiters: AtomicUsize::new(0),
             queue: WaitQueue::new(),
         }
     }
 
     /// 阻塞式获取资源 (P 操作)
     pub fn acquire(&self) -> SemaphoreGuard {
-        // wait_until 会在闭包返回 true 之前阻塞当前线程
-        self.queue.wait_until(|| {
-            let mut count = self.count.lock();
-            if *count > 0 {
-                *count -= 1;
-                true
-            } else {
-                false
-            }
-        });
-
-        SemaphoreGuard {
-            sem: self,
-            released: false,
+        self.acquire_many(1)
+    }
+
+    /// 阻塞式一次获取 `n` 个资源，供批量消费者使用
+    pub fn acquire_many(&self, n: usize) -> SemaphoreGuard {
+        // 快速路径：资源充足时只需一次 CAS
+        if self.try_take(n) {
+            return SemaphoreGuard::new(self, n);
         }
+
+        // 先登记为等待者再检查计数，与 release_many 先加计数再读等待者
+        // 数量的顺序相配合，保证唤醒不会丢失
+        self.waiters.fetch_add(1, Ordering::SeqCst);
+        if n > 1 {
+            self.batch_waiters.fetch_add(1, Ordering::SeqCst);
+        }
+        // wait_until 会在闭包返回 Some 之前阻塞当前线程
+        self.queue.wait_until(|| self.try_take(n).then_some(()));
+        if n > 1 {
+            self.batch_waiters.fetch_sub(1, Ordering::SeqCst);
+        }
+        self.waiters.fetch_sub(1, Ordering::SeqCst);
+
+        SemaphoreGuard::new(self, n)
     }
 
     /// 非阻塞式获取资源
     pub fn try_acquire(&self) -> Option<SemaphoreGuard> {
-        let mut count = self.count.lock();
-        if *count > 0 {
-            *count -= 1;
-            Some(SemaphoreGuard {
-                sem: self,
-                released: false,
-            })
-        } else {
-            None
-        }
+        self.try_acquire_many(1)
+    }
+
+    /// 非阻塞式一次获取 `n` 个资源
+    pub fn try_acquire_many(&self, n: usize) -> Option<SemaphoreGuard> {
+        self.try_take(n).then(|| SemaphoreGuard::new(self, n))
     }
 
     /// 释放资源 (V 操作)
     pub fn release(&self) {
-        {
-            let mut count = self.count.lock();
-            *count += 1;
+        self.release_many(1);
+    }
+
+    /// 一次释放 `n` 个资源，供批量生产者使用
+    pub fn release_many(&self, n: usize) {
+        if n == 0 {
+            return;
+        }
+        self.count.fetch_add(n, Ordering::SeqCst);
+        // 无人等待时不碰等待队列
+        if self.waiters.load(Ordering::SeqCst) == 0 {
+            return;
+        }
+        // 被唤醒的批量等待者可能资源仍不够而继续睡眠，此时唤醒一个会让
+        // 其他能满足的等待者一直睡下去，所以唤醒全部
+        if n > 1 || self.batch_waiters.load(Ordering::SeqCst) > 0 {
+            self.queue.wake_all();
+        } else {
+            // 唤醒等待队列中的一个线程
+            self.queue.wake_one();
         }
-        // 唤醒等待队列中的一个线程
-        self.queue.wake_one();
+    }
+
+    /// 计数不小于 `n` 时减去 `n` 并返回 true
+    fn try_take(&self, n: usize) -> bool {
+        self.count
+            .fetch_update(Ordering::Acquire, Ordering::Relaxed, |count| {
+                count.checked_sub(n)
+            })
+            .is_ok()
     }
 }
 
 /// 信号量资源卫兵，实现 RAII 模式
 pub struct SemaphoreGuard<'a> {
     sem: &'a Semaphore,
+    /// 持有的资源数量
+    permits: usize,
     released: bool,
 }
 
+impl<'a> SemaphoreGuard<'a> {
+    fn new(sem: &'a Semaphore, permits: usize) -> Self {
+        Self {
+            sem,
+            permits,
+            released: false,
+        }
+    }
+}
+
 impl<'a> Drop for SemaphoreGuard<'a> {
     fn drop(&mut self) {
         if !self.released {
-            self.sem.release();
+            self.sem.release_many(self.permits);
             self.released = true;
         }
     }
@@ -103,6 +151,26 @@ mod test {
         let g4 = sem.try_acquire();
         assert!(g4.is_some());
     }
-}
 
+    #[ktest]
+    fn test_semaphore_batch() {
+        let sem = Semaphore::new(3);
+
+        // 一次获取三个资源后，单个也获取不到
+        let g1 = sem.try_acquire_many(3);
+        assert!(g1.is_some());
+        assert!(sem.try_acquire().is_none());
+
+        // 卫兵释放全部三个资源
+        drop(g1);
+        assert!(sem.try_acquire_many(4).is_none());
+        let g2 = sem.acquire_many(3);
 
+        // 批量释放后可以满足批量获取
+        sem.release_many(2);
+        let g3 = sem.try_acquire_many(2);
+        assert!(g3.is_some());
+        drop(g2);
+        drop(g3);
+    }
+}